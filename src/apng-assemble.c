@@ -0,0 +1,883 @@
+/* GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ *   Animated Portable Network Graphics (APNG) plug-in
+ *
+ *   Building an animation from a directory of PNG frames.  Frames are
+ *   read one at a time and written as soon as they are compressed, so
+ *   only the current and the previous frame are ever in memory.  With
+ *   "optimize" each frame only covers the area that changed since the
+ *   previous one.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include <png.h>
+
+#include "apng-assemble.h"
+#include "apng-chunk.h"
+#include "apng-encode.h"
+#include "apng-output.h"
+#include "plugin-intl.h"
+
+
+typedef struct
+{
+  gchar    *filename;
+  gint      delay;                      /* ms */
+}
+AssembleFrame;
+
+typedef struct
+{
+  guint32   x, y;
+  guint32   width, height;
+  gboolean  over;                       /* Unchanged pixels are left out
+                                         * and the frame is blended */
+}
+AssembleRegion;
+
+struct _ApngAssembler
+{
+  gchar      *filename;
+  ApngOutput *output;
+  ApngFormat  format;
+  guint32     width;
+  guint32     height;
+  guint32     num_frames;               /* As written in acTL */
+  guint32     num_plays;
+  guint32     frame;                    /* Frames written */
+  guint32     sequence;
+  guchar     *prev;                     /* Previous frame, if optimizing */
+  guchar     *cur;                      /* Frame being written */
+  gboolean    ok;                       /* No write has failed */
+};
+
+
+static void
+frames_free (GArray *frames)
+{
+  guint i;
+
+  for (i = 0; i < frames->len; i++)
+    g_free (g_array_index (frames, AssembleFrame, i).filename);
+
+  g_array_free (frames, TRUE);
+}
+
+/*
+ * 'list_manifest ()' - Read the frames and delays of a manifest.
+ */
+
+static GArray *
+list_manifest (const gchar  *dirname,
+               const gchar  *manifest,
+               gint          delay,
+               GError      **error)
+{
+  GArray  *frames;
+  gchar   *contents;
+  gchar  **lines;
+  gint     i;
+
+  if (! g_file_get_contents (manifest, &contents, NULL, error))
+    return NULL;
+
+  frames = g_array_new (FALSE, FALSE, sizeof (AssembleFrame));
+  lines  = g_strsplit (contents, "\n", -1);
+  g_free (contents);
+
+  for (i = 0; lines[i]; i++)
+    {
+      AssembleFrame  frame;
+      gchar         *line = g_strstrip (lines[i]);
+      gchar         *last;
+
+      if (*line == '\0' || *line == '#')
+        continue;
+
+      frame.delay = delay;
+
+      /* A trailing number is the delay */
+      last = strrchr (line, ' ');
+      if (! last)
+        last = strrchr (line, '\t');
+
+      if (last)
+        {
+          gchar *end;
+          glong  value = strtol (last + 1, &end, 10);
+
+          if (*end == '\0' && end != last + 1 && value >= 0)
+            {
+              frame.delay = value;
+              *last = '\0';
+              g_strchomp (line);
+            }
+        }
+
+      if (g_path_is_absolute (line))
+        frame.filename = g_strdup (line);
+      else
+        frame.filename = g_build_filename (dirname, line, NULL);
+
+      g_array_append_val (frames, frame);
+    }
+
+  g_strfreev (lines);
+
+  return frames;
+}
+
+static gint
+frame_compare (gconstpointer a,
+               gconstpointer b)
+{
+  const gchar * const *ka = a;
+  const gchar * const *kb = b;
+
+  return strcmp (*ka, *kb);
+}
+
+/*
+ * 'list_directory ()' - List the PNG files of a directory.
+ *
+ * Files are sorted the way file managers do, so "frame10.png" comes
+ * after "frame9.png".  The output file is skipped if it's in there.
+ */
+
+static GArray *
+list_directory (const gchar  *dirname,
+                const gchar  *output,
+                gint          delay,
+                GError      **error)
+{
+  GArray      *frames;
+  GPtrArray   *names;
+  GDir        *dir;
+  const gchar *name;
+  guint        i;
+
+  dir = g_dir_open (dirname, 0, error);
+
+  if (! dir)
+    return NULL;
+
+  /* Pairs of sort key and file name */
+  names = g_ptr_array_new ();
+
+  while ((name = g_dir_read_name (dir)))
+    {
+      gchar *display;
+      gsize  len = strlen (name);
+
+      if (len < 4 || g_ascii_strcasecmp (name + len - 4, ".png"))
+        continue;
+
+      display = g_filename_display_name (name);
+      g_ptr_array_add (names, g_utf8_collate_key_for_filename (display, -1));
+      g_ptr_array_add (names, g_strdup (name));
+      g_free (display);
+    }
+
+  g_dir_close (dir);
+
+  qsort (names->pdata, names->len / 2, 2 * sizeof (gpointer), frame_compare);
+
+  frames = g_array_new (FALSE, FALSE, sizeof (AssembleFrame));
+
+  for (i = 0; i < names->len; i += 2)
+    {
+      AssembleFrame frame;
+
+      frame.filename = g_build_filename (dirname, names->pdata[i + 1], NULL);
+      frame.delay    = delay;
+
+      if (output && ! strcmp (frame.filename, output))
+        g_free (frame.filename);
+      else
+        g_array_append_val (frames, frame);
+
+      g_free (names->pdata[i]);
+      g_free (names->pdata[i + 1]);
+    }
+
+  g_ptr_array_free (names, TRUE);
+
+  return frames;
+}
+
+/*
+ * 'read_frame ()' - Read a PNG file as 8-bit RGBA.
+ *
+ * The first frame allocates "pixels" and sets the size, the others must
+ * have the same size and are read into the same kind of buffer.
+ */
+
+static gboolean
+read_frame (const gchar  *filename,
+            guchar      **pixels,
+            guint32      *width,
+            guint32      *height,
+            GError      **error)
+{
+  png_structp           pp;
+  png_infop             info;
+  FILE                 *fp;
+  png_bytep * volatile  rows = NULL;
+  guint32               w, h, y;
+
+  fp = g_fopen (filename, "rb");
+
+  if (! fp)
+    {
+      gint   errsv = errno;
+      gchar *name  = g_filename_display_name (filename);
+
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errsv),
+                   _("Could not open '%s' for reading: %s"),
+                   name, g_strerror (errsv));
+      g_free (name);
+
+      return FALSE;
+    }
+
+  pp   = png_create_read_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  info = png_create_info_struct (pp);
+
+  if (setjmp (png_jmpbuf (pp)))
+    {
+      gchar *name = g_filename_display_name (filename);
+
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                   _("Error while reading '%s'. File corrupted?"), name);
+      g_free (name);
+
+      png_destroy_read_struct (&pp, &info, NULL);
+      g_free (rows);
+      fclose (fp);
+
+      return FALSE;
+    }
+
+  png_init_io (pp, fp);
+  png_read_info (pp, info);
+
+  w = png_get_image_width (pp, info);
+  h = png_get_image_height (pp, info);
+
+  if (*pixels && (w != *width || h != *height))
+    {
+      gchar *name = g_filename_display_name (filename);
+
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                   _("'%s' is %d x %d pixels, but the first frame is "
+                     "%d x %d pixels."),
+                   name, (gint) w, (gint) h, (gint) *width, (gint) *height);
+      g_free (name);
+
+      png_destroy_read_struct (&pp, &info, NULL);
+      fclose (fp);
+
+      return FALSE;
+    }
+
+  /*
+   * Whatever the file has, read it as 8-bit RGBA
+   */
+
+  png_set_expand (pp);
+  png_set_strip_16 (pp);
+  png_set_gray_to_rgb (pp);
+  png_set_filler (pp, 0xff, PNG_FILLER_AFTER);
+  png_set_interlace_handling (pp);
+
+  png_read_update_info (pp, info);
+
+  if (! *pixels)
+    {
+      *pixels = g_new (guchar, (gsize) w * h * 4);
+      *width  = w;
+      *height = h;
+    }
+
+  rows = g_new (png_bytep, h);
+
+  for (y = 0; y < h; y++)
+    rows[y] = *pixels + (gsize) y * w * 4;
+
+  png_read_image (pp, rows);
+  png_read_end (pp, NULL);
+
+  png_destroy_read_struct (&pp, &info, NULL);
+  g_free (rows);
+  fclose (fp);
+
+  return TRUE;
+}
+
+/*
+ * 'probe_frame ()' - Find out whether a PNG file has color and alpha.
+ *
+ * Only the chunks before the image data are read.  Palettes count as
+ * color, tRNS as alpha.  Files that can't be read count as both, they
+ * fail later with a proper error.
+ */
+
+static void
+probe_frame (const gchar *filename,
+             gboolean    *color,
+             gboolean    *alpha)
+{
+  png_structp  pp;
+  png_infop    info;
+  FILE        *fp;
+  gint         color_type;
+
+  *color = TRUE;
+  *alpha = TRUE;
+
+  fp = g_fopen (filename, "rb");
+
+  if (! fp)
+    return;
+
+  pp   = png_create_read_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  info = png_create_info_struct (pp);
+
+  if (setjmp (png_jmpbuf (pp)))
+    {
+      png_destroy_read_struct (&pp, &info, NULL);
+      fclose (fp);
+
+      return;
+    }
+
+  png_init_io (pp, fp);
+  png_read_info (pp, info);
+
+  color_type = png_get_color_type (pp, info);
+
+  *color = (color_type & PNG_COLOR_MASK_COLOR) != 0;
+  *alpha = ((color_type & PNG_COLOR_MASK_ALPHA) ||
+            png_get_valid (pp, info, PNG_INFO_tRNS));
+
+  png_destroy_read_struct (&pp, &info, NULL);
+  fclose (fp);
+}
+
+/*
+ * 'diff_frames ()' - Find the area where two frames differ.
+ *
+ * Returns FALSE if they're the same.  "opaque" tells whether all the
+ * pixels that changed are opaque, in which case the frame can leave the
+ * others out and be blended over the previous one.
+ */
+
+static gboolean
+diff_frames (const guchar   *prev,
+             const guchar   *cur,
+             guint32         width,
+             guint32         height,
+             AssembleRegion *region)
+{
+  gsize    stride = (gsize) width * 4;
+  guint32  x0 = width, x1 = 0;
+  guint32  y0 = height, y1 = 0;
+  gboolean opaque = TRUE;
+  guint32  x, y;
+
+  for (y = 0; y < height; y++)
+    {
+      const guchar *p = prev + y * stride;
+      const guchar *c = cur  + y * stride;
+
+      if (! memcmp (p, c, stride))
+        continue;
+
+      y0 = MIN (y0, y);
+      y1 = y + 1;
+
+      for (x = 0; x < width; x++, p += 4, c += 4)
+        {
+          if (! memcmp (p, c, 4))
+            continue;
+
+          x0 = MIN (x0, x);
+          x1 = MAX (x1, x + 1);
+
+          if (c[3] != 255)
+            opaque = FALSE;
+        }
+    }
+
+  if (y0 >= y1)
+    return FALSE;
+
+  region->x      = x0;
+  region->y      = y0;
+  region->width  = x1 - x0;
+  region->height = y1 - y0;
+  region->over   = opaque;
+
+  return TRUE;
+}
+
+/*
+ * 'pack_row ()' - Drop the channels of an RGBA row that aren't written.
+ */
+
+static void
+pack_row (guchar  *row,
+          guint32  width,
+          gint     color_type)
+{
+  guchar  *dst = row;
+  guint32  x;
+
+  switch (color_type)
+    {
+    case PNG_COLOR_TYPE_RGB:
+      for (x = 0; x < width; x++, dst += 3)
+        memmove (dst, row + x * 4, 3);
+      break;
+
+    case PNG_COLOR_TYPE_GRAY:
+      for (x = 0; x < width; x++)
+        row[x] = row[x * 4];
+      break;
+
+    case PNG_COLOR_TYPE_GRAY_ALPHA:
+      for (x = 0; x < width; x++)
+        {
+          row[x * 2]     = row[x * 4];
+          row[x * 2 + 1] = row[x * 4 + 3];
+        }
+      break;
+
+    default:
+      break;
+    }
+}
+
+/*
+ * 'encode_region ()' - Compress a region of a frame.
+ *
+ * Returns the encoder holding the image data, or NULL on errors.
+ */
+
+static ApngFrameEncoder *
+encode_region (const ApngFormat     *format,
+               const guchar         *prev,
+               const guchar         *cur,
+               guint32               width,
+               const AssembleRegion *region)
+{
+  ApngFrameEncoder *encoder = apng_frame_encoder_new ();
+  guchar           *row     = g_new (guchar, (gsize) region->width * 4);
+  gsize             stride  = (gsize) width * 4;
+  guint32           x, y;
+
+  if (setjmp (png_jmpbuf (encoder->pp)))
+    {
+      apng_frame_encoder_free (encoder);
+      g_free (row);
+
+      return NULL;
+    }
+
+  apng_frame_encoder_start (encoder, format, region->width, region->height);
+
+  for (y = 0; y < region->height; y++)
+    {
+      gsize         offset = (region->y + y) * stride + region->x * 4;
+      const guchar *c      = cur + offset;
+
+      if (region->over)
+        {
+          const guchar *p = prev + offset;
+
+          /* Unchanged pixels become transparent */
+          for (x = 0; x < region->width; x++)
+            {
+              if (memcmp (p + x * 4, c + x * 4, 4))
+                memcpy (row + x * 4, c + x * 4, 4);
+              else
+                memset (row + x * 4, 0, 4);
+            }
+        }
+      else
+        {
+          memcpy (row, c, (gsize) region->width * 4);
+        }
+
+      pack_row (row, region->width, format->color_type);
+      png_write_row (encoder->pp, row);
+    }
+
+  apng_frame_encoder_finish (encoder);
+  g_free (row);
+
+  return encoder;
+}
+
+/*
+ * 'apng_assembler_new ()' - Start an animation of @width x @height.
+ */
+
+ApngAssembler *
+apng_assembler_new (const gchar               *filename,
+                    guint32                    width,
+                    guint32                    height,
+                    guint32                    num_frames,
+                    gint                       color_type,
+                    const ApngAssembleOptions *options,
+                    GError                   **error)
+{
+  ApngAssembler *assembler;
+  ApngOutput    *output;
+  ApngHeader     header;
+  guchar         data[APNG_IHDR_SIZE];
+
+  output = apng_output_open (filename, error);
+
+  if (! output)
+    return NULL;
+
+  assembler = g_new0 (ApngAssembler, 1);
+
+  assembler->filename   = g_strdup (filename);
+  assembler->output     = output;
+  assembler->width      = width;
+  assembler->height     = height;
+  assembler->num_frames = num_frames;
+  assembler->num_plays  = options->num_plays;
+  assembler->cur        = g_new (guchar, (gsize) width * height * 4);
+
+  if (options->optimize)
+    assembler->prev = g_new (guchar, (gsize) width * height * 4);
+
+  assembler->format.bit_depth         = 8;
+  assembler->format.color_type        = color_type;
+  assembler->format.interlace         = PNG_INTERLACE_NONE;
+  assembler->format.compression_level = options->compression_level;
+
+  header.width       = width;
+  header.height      = height;
+  header.bit_depth   = assembler->format.bit_depth;
+  header.color_type  = assembler->format.color_type;
+  header.compression = 0;
+  header.filter      = 0;
+  header.interlace   = assembler->format.interlace;
+
+  apng_pack_header (data, &header);
+
+  /* A frame count that isn't known yet is patched in on finish */
+  assembler->ok = (apng_write_signature (output) &&
+                   apng_write_chunk (output, "IHDR", data, sizeof (data)) &&
+                   apng_write_actl (output, MAX (num_frames, 1),
+                                    options->num_plays));
+
+  return assembler;
+}
+
+guchar *
+apng_assembler_get_buffer (ApngAssembler *assembler)
+{
+  return assembler->cur;
+}
+
+static void
+assembler_set_write_error (ApngAssembler  *assembler,
+                           GError        **error)
+{
+  gchar *name = g_filename_display_name (assembler->filename);
+
+  g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+               _("Error writing '%s'."), name);
+  g_free (name);
+}
+
+/*
+ * 'apng_assembler_add_frame ()' - Write the frame in the buffer.
+ *
+ * With optimizing on, only what changed since the previous frame is
+ * stored.  The buffer is then swapped with the one of the previous
+ * frame, so its contents are gone afterwards.
+ */
+
+gboolean
+apng_assembler_add_frame (ApngAssembler  *assembler,
+                          guint16         delay_num,
+                          guint16         delay_den,
+                          GError        **error)
+{
+  ApngFrameControl  fc;
+  AssembleRegion    region;
+  ApngFrameEncoder *encoder;
+  guchar           *prev = assembler->prev;
+  guchar           *cur  = assembler->cur;
+
+  region.x      = 0;
+  region.y      = 0;
+  region.width  = assembler->width;
+  region.height = assembler->height;
+  region.over   = FALSE;
+
+  /* A frame that changes nothing is a transparent pixel */
+  if (assembler->frame > 0 && prev &&
+      ! diff_frames (prev, cur, assembler->width, assembler->height, &region))
+    {
+      region.width  = 1;
+      region.height = 1;
+      region.over   = TRUE;
+    }
+
+  /* Without alpha, changed areas are written whole; a pixel that is
+   * written again as it was changes nothing either */
+  if (! (assembler->format.color_type & PNG_COLOR_MASK_ALPHA))
+    region.over = FALSE;
+
+  encoder = encode_region (&assembler->format, prev, cur, assembler->width,
+                           &region);
+
+  if (! encoder)
+    {
+      gchar *name = g_filename_display_name (assembler->filename);
+
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                   _("Could not compress frame %d of '%s'."),
+                   (gint) assembler->frame + 1, name);
+      g_free (name);
+
+      return FALSE;
+    }
+
+  fc.sequence   = assembler->sequence++;
+  fc.width      = region.width;
+  fc.height     = region.height;
+  fc.x_offset   = region.x;
+  fc.y_offset   = region.y;
+  fc.delay_num  = delay_num;
+  fc.delay_den  = delay_den;
+  fc.dispose_op = 0;            /* APNG_DISPOSE_OP_NONE */
+  fc.blend_op   = region.over ? 1 : 0;
+
+  assembler->ok = (assembler->ok &&
+                   apng_write_fctl (assembler->output, &fc) &&
+                   apng_write_image_data (assembler->output,
+                                          assembler->frame > 0 ?
+                                          &assembler->sequence : NULL,
+                                          encoder->payload->data,
+                                          encoder->payload->len));
+
+  apng_frame_encoder_free (encoder);
+
+  if (! assembler->ok)
+    {
+      assembler_set_write_error (assembler, error);
+      return FALSE;
+    }
+
+  if (prev)
+    {
+      assembler->prev = cur;
+      assembler->cur  = prev;
+    }
+
+  assembler->frame++;
+
+  return TRUE;
+}
+
+static void
+assembler_free (ApngAssembler *assembler)
+{
+  g_free (assembler->filename);
+  g_free (assembler->prev);
+  g_free (assembler->cur);
+  g_free (assembler);
+}
+
+/*
+ * 'apng_assembler_finish ()' - End the animation and close the file.
+ */
+
+gboolean
+apng_assembler_finish (ApngAssembler  *assembler,
+                       GError        **error)
+{
+  ApngOutput *output = assembler->output;
+
+  g_return_val_if_fail (assembler->frame > 0, FALSE);
+
+  if (assembler->frame != assembler->num_frames)
+    {
+      guchar data[APNG_acTL_SIZE];
+      guchar chunk[12 + APNG_acTL_SIZE];
+
+      apng_put_uint32 (data,     assembler->frame);
+      apng_put_uint32 (data + 4, assembler->num_plays);
+      apng_chunk_pack (chunk, "acTL", data, sizeof (data));
+
+      /* acTL follows the signature and IHDR */
+      apng_output_patch (output, APNG_SIGNATURE_SIZE + 12 + APNG_IHDR_SIZE,
+                         chunk, sizeof (chunk));
+    }
+
+  if (! assembler->ok ||
+      ! apng_write_chunk (output, "IEND", NULL, 0))
+    {
+      apng_output_abort (output);
+      assembler_set_write_error (assembler, error);
+      assembler_free (assembler);
+
+      return FALSE;
+    }
+
+  assembler_free (assembler);
+
+  return apng_output_close (output, error);
+}
+
+void
+apng_assembler_abort (ApngAssembler *assembler)
+{
+  apng_output_abort (assembler->output);
+  assembler_free (assembler);
+}
+
+/*
+ * 'apng_assemble ()' - Write the frames of a directory as an animation.
+ */
+
+gboolean
+apng_assemble (const gchar               *dirname,
+               const gchar               *filename,
+               const ApngAssembleOptions *options,
+               ApngProgressFunc           progress,
+               gpointer                   progress_data,
+               GError                   **error)
+{
+  GArray        *frames;
+  ApngAssembler *assembler;
+  guchar        *first = NULL;
+  guint32        width = 0, height = 0;
+  gboolean       color = FALSE;
+  gboolean       alpha = FALSE;
+  gint           color_type;
+  guint          i;
+
+  if (options->manifest)
+    frames = list_manifest (dirname, options->manifest, options->delay,
+                            error);
+  else
+    frames = list_directory (dirname, filename, options->delay, error);
+
+  if (! frames)
+    return FALSE;
+
+  if (frames->len == 0)
+    {
+      gchar *name = g_filename_display_name (dirname);
+
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_NOENT,
+                   _("No PNG frames found in '%s'."), name);
+      g_free (name);
+      frames_free (frames);
+
+      return FALSE;
+    }
+
+  /*
+   * The size of the animation is the size of the first frame
+   */
+
+  if (! read_frame (g_array_index (frames, AssembleFrame, 0).filename,
+                    &first, &width, &height, error))
+    {
+      frames_free (frames);
+      return FALSE;
+    }
+
+  /*
+   * Frames are written with alpha only if one of them has it, and in
+   * color only if one of them is
+   */
+
+  for (i = 0; i < frames->len && ! (color && alpha); i++)
+    {
+      gboolean frame_color, frame_alpha;
+
+      probe_frame (g_array_index (frames, AssembleFrame, i).filename,
+                   &frame_color, &frame_alpha);
+
+      color |= frame_color;
+      alpha |= frame_alpha;
+    }
+
+  if (color)
+    color_type = alpha ? PNG_COLOR_TYPE_RGB_ALPHA : PNG_COLOR_TYPE_RGB;
+  else
+    color_type = alpha ? PNG_COLOR_TYPE_GRAY_ALPHA : PNG_COLOR_TYPE_GRAY;
+
+  assembler = apng_assembler_new (filename, width, height, frames->len,
+                                  color_type, options, error);
+
+  if (! assembler)
+    {
+      g_free (first);
+      frames_free (frames);
+
+      return FALSE;
+    }
+
+  memcpy (apng_assembler_get_buffer (assembler), first,
+          (gsize) width * height * 4);
+  g_free (first);
+
+  for (i = 0; i < frames->len; i++)
+    {
+      AssembleFrame *frame  = &g_array_index (frames, AssembleFrame, i);
+      guchar        *pixels = apng_assembler_get_buffer (assembler);
+
+      if ((i > 0 &&
+           ! read_frame (frame->filename, &pixels, &width, &height, error)) ||
+          ! apng_assembler_add_frame (assembler,
+                                      CLAMP (frame->delay, 0, G_MAXUINT16),
+                                      1000, error))
+        {
+          apng_assembler_abort (assembler);
+          frames_free (frames);
+
+          return FALSE;
+        }
+
+      if (progress)
+        progress ((gdouble) (i + 1) / frames->len, progress_data);
+    }
+
+  frames_free (frames);
+
+  return apng_assembler_finish (assembler, error);
+}
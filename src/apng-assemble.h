@@ -0,0 +1,80 @@
+/* GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ *   Animated Portable Network Graphics (APNG) plug-in
+ *
+ *   Building an animation from a directory of PNG frames, or from
+ *   frames handed over one at a time.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __APNG_ASSEMBLE_H__
+#define __APNG_ASSEMBLE_H__
+
+#include <glib.h>
+
+
+typedef struct
+{
+  const gchar *manifest;                /* Frame list, or NULL for all the
+                                         * PNG files of the directory */
+  gint         delay;                   /* Frame delay in ms, for frames
+                                         * the manifest gives none */
+  guint32      num_plays;               /* 0 = forever */
+  gint         compression_level;
+  gboolean     optimize;                /* Store only what changed */
+}
+ApngAssembleOptions;
+
+typedef void (* ApngProgressFunc) (gdouble  fraction,
+                                   gpointer data);
+
+typedef struct _ApngAssembler ApngAssembler;
+
+
+/* Each line of a manifest is a file name relative to @dirname,
+ * optionally followed by a delay in ms.  Lines starting with '#' are
+ * comments. */
+gboolean  apng_assemble  (const gchar               *dirname,
+                          const gchar               *filename,
+                          const ApngAssembleOptions *options,
+                          ApngProgressFunc           progress,
+                          gpointer                   progress_data,
+                          GError                   **error);
+
+/* Frames are handed over as 8-bit RGBA and written as @color_type, one
+ * of PNG_COLOR_TYPE_GRAY, _GRAY_ALPHA, _RGB and _RGB_ALPHA; the channels
+ * it leaves out are dropped.  Only "num_plays", "compression_level" and
+ * "optimize" of @options are used.  If @num_frames turns out to be wrong,
+ * or is 0 because it isn't known yet, the right count is patched in on
+ * finish, which fails if the output can't seek. */
+ApngAssembler * apng_assembler_new        (const gchar               *filename,
+                                           guint32                    width,
+                                           guint32                    height,
+                                           guint32                    num_frames,
+                                           gint                       color_type,
+                                           const ApngAssembleOptions *options,
+                                           GError                   **error);
+/* Where to put the next frame, width x height x 4 bytes */
+guchar *        apng_assembler_get_buffer (ApngAssembler             *assembler);
+gboolean        apng_assembler_add_frame  (ApngAssembler             *assembler,
+                                           guint16                    delay_num,
+                                           guint16                    delay_den,
+                                           GError                   **error);
+gboolean        apng_assembler_finish     (ApngAssembler             *assembler,
+                                           GError                   **error);
+void            apng_assembler_abort      (ApngAssembler             *assembler);
+
+#endif /* __APNG_ASSEMBLE_H__ */
@@ -0,0 +1,440 @@
+/* GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ *   Animated Portable Network Graphics (APNG) plug-in
+ *
+ *   Converting many files in one plug-in run.  Starting the plug-in
+ *   costs more than converting a small animation, so batches are handed
+ *   over in one call and converted by a pool of threads.  None of this
+ *   goes through libgimp, which isn't thread safe: image data is decoded
+ *   and encoded again frame by frame and every other chunk is copied.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include <glib.h>
+
+#include <png.h>
+
+#include "apng-batch.h"
+#include "apng-chunk.h"
+#include "apng-encode.h"
+#include "apng-output.h"
+#include "plugin-intl.h"
+
+
+typedef struct
+{
+  ApngOutput   *output;
+  ApngHeader    header;
+  ApngFormat    format;
+  ApngChunk     plte;           /* "data" is NULL without PLTE */
+  guint32       sequence;       /* Of the next fcTL or fdAT */
+  guint32       frame_width;    /* Of the last fcTL */
+  guint32       frame_height;
+  GByteArray   *group;          /* Image data being collected */
+  gboolean      group_fdat;
+}
+Recompress;
+
+typedef struct
+{
+  const guchar *data;
+  gsize         length;
+  gsize         pos;
+}
+RecompressSource;
+
+typedef struct
+{
+  const gchar  *input;
+  const gchar  *output;
+  gint          compression_level;
+  GAsyncQueue  *done;           /* Gets the job once it's done */
+  GError       *error;
+}
+BatchJob;
+
+
+/* Kept between calls, so that a resident plug-in doesn't start new
+ * threads for every batch */
+static GThreadPool *batch_pool = NULL;
+
+
+static void
+read_memory (png_structp pp,
+             png_bytep   data,
+             png_size_t  length)
+{
+  RecompressSource *source = png_get_io_ptr (pp);
+
+  if (length > source->length - source->pos)
+    png_error (pp, "Unexpected end of image data");
+
+  memcpy (data, source->data + source->pos, length);
+  source->pos += length;
+}
+
+/*
+ * 'recompress_group ()' - Encode the collected image data again.
+ *
+ * The data is wrapped up as a PNG of its own for libpng to decode, and
+ * the rows are encoded with the shared frame encoder, as they are.
+ */
+
+static gboolean
+recompress_group (Recompress *rc)
+{
+  ApngFrameEncoder     *encoder;
+  GByteArray           *png = g_byte_array_new ();
+  ApngOutput           *sink;
+  ApngHeader            header = rc->header;
+  guchar                ihdr[APNG_IHDR_SIZE];
+  RecompressSource      source;
+  png_structp           pp;
+  png_infop             info;
+  guchar * volatile     pixels = NULL;
+  png_bytep * volatile  rows   = NULL;
+  gsize                 rowbytes;
+  guint32               y;
+
+  if (rc->group_fdat)
+    {
+      header.width  = rc->frame_width;
+      header.height = rc->frame_height;
+    }
+
+  apng_pack_header (ihdr, &header);
+
+  sink = apng_output_new_for_array (png);
+  apng_write_signature (sink);
+  apng_write_chunk (sink, "IHDR", ihdr, sizeof (ihdr));
+
+  if (rc->plte.data)
+    apng_write_chunk (sink, "PLTE", rc->plte.data, rc->plte.length);
+
+  apng_write_chunk (sink, "IDAT", rc->group->data, rc->group->len);
+  apng_write_chunk (sink, "IEND", NULL, 0);
+  apng_output_close (sink, NULL);
+
+  g_byte_array_set_size (rc->group, 0);
+
+  /*
+   * Decode, without transforms but unpacking
+   */
+
+  source.data   = png->data;
+  source.length = png->len;
+  source.pos    = 0;
+
+  pp   = png_create_read_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  info = png_create_info_struct (pp);
+
+  if (setjmp (png_jmpbuf (pp)))
+    {
+      png_destroy_read_struct (&pp, &info, NULL);
+      g_byte_array_free (png, TRUE);
+      g_free (rows);
+      g_free (pixels);
+
+      return FALSE;
+    }
+
+  png_set_read_fn (pp, &source, read_memory);
+  png_read_info (pp, info);
+
+  if (header.bit_depth < 8)
+    png_set_packing (pp);
+
+  png_set_interlace_handling (pp);
+  png_read_update_info (pp, info);
+
+  rowbytes = png_get_rowbytes (pp, info);
+  pixels   = g_new (guchar, rowbytes * header.height);
+  rows     = g_new (png_bytep, header.height);
+
+  for (y = 0; y < header.height; y++)
+    rows[y] = pixels + y * rowbytes;
+
+  png_read_image (pp, rows);
+  png_read_end (pp, NULL);
+
+  png_destroy_read_struct (&pp, &info, NULL);
+  g_byte_array_free (png, TRUE);
+
+  /*
+   * Encode
+   */
+
+  encoder = apng_frame_encoder_new ();
+
+  if (setjmp (png_jmpbuf (encoder->pp)))
+    {
+      apng_frame_encoder_free (encoder);
+      g_free (rows);
+      g_free (pixels);
+
+      return FALSE;
+    }
+
+  apng_frame_encoder_start (encoder, &rc->format,
+                            header.width, header.height);
+  png_write_image (encoder->pp, rows);
+  apng_frame_encoder_finish (encoder);
+
+  g_free (rows);
+  g_free (pixels);
+
+  /* Write errors are reported on close */
+  apng_write_image_data (rc->output, rc->group_fdat ? &rc->sequence : NULL,
+                         encoder->payload->data, encoder->payload->len);
+
+  apng_frame_encoder_free (encoder);
+
+  return TRUE;
+}
+
+/*
+ * 'apng_recompress ()' - Encode the image data of a file again.
+ */
+
+gboolean
+apng_recompress (const gchar  *input,
+                 const gchar  *output,
+                 gint          compression_level,
+                 GError      **error)
+{
+  ApngChunkReader *reader;
+  ApngChunk        chunk;
+  Recompress       rc;
+  gboolean         have_header = FALSE;
+  GError          *local_error = NULL;
+  gboolean         ok          = TRUE;
+
+  reader = apng_chunk_reader_new (input, error);
+
+  if (! reader)
+    return FALSE;
+
+  memset (&rc, 0, sizeof (rc));
+
+  rc.output = apng_output_open (output, error);
+
+  if (! rc.output)
+    {
+      apng_chunk_reader_free (reader);
+      return FALSE;
+    }
+
+  rc.group                    = g_byte_array_new ();
+  rc.format.compression_level = compression_level;
+
+  apng_write_signature (rc.output);
+
+  while (ok && apng_chunk_reader_next (reader, &chunk, &local_error))
+    {
+      gboolean idat = ! strcmp (chunk.type, "IDAT");
+      gboolean fdat = ! strcmp (chunk.type, "fdAT");
+
+      /* A run of image data ends at the first other chunk */
+      if (rc.group->len > 0 &&
+          ((! idat && ! fdat) || fdat != rc.group_fdat))
+        ok = recompress_group (&rc);
+
+      if (! ok)
+        break;
+
+      if (! have_header)
+        {
+          ok = have_header = (! strcmp (chunk.type, "IHDR") &&
+                              apng_parse_header (&chunk, &rc.header));
+
+          if (ok)
+            {
+              rc.format.bit_depth  = rc.header.bit_depth;
+              rc.format.color_type = rc.header.color_type;
+              rc.format.interlace  = rc.header.interlace;
+
+              apng_write_chunk (rc.output, "IHDR", chunk.data, chunk.length);
+            }
+        }
+      else if (idat || fdat)
+        {
+          if (fdat && chunk.length < 4)
+            {
+              ok = FALSE;
+              break;
+            }
+
+          rc.group_fdat = fdat;
+
+          if (fdat)
+            g_byte_array_append (rc.group, chunk.data + 4, chunk.length - 4);
+          else
+            g_byte_array_append (rc.group, chunk.data, chunk.length);
+        }
+      else if (! strcmp (chunk.type, "fcTL"))
+        {
+          ApngFrameControl fc;
+
+          ok = apng_parse_frame_control (&chunk, &fc);
+
+          if (ok)
+            {
+              /* Sequence numbers change with the number of fdAT chunks */
+              fc.sequence     = rc.sequence++;
+              rc.frame_width  = fc.width;
+              rc.frame_height = fc.height;
+
+              apng_write_fctl (rc.output, &fc);
+            }
+        }
+      else
+        {
+          if (! strcmp (chunk.type, "PLTE"))
+            {
+              guint i;
+
+              rc.plte = chunk;
+
+              rc.format.num_palette = MIN (chunk.length / 3, 256);
+
+              for (i = 0; i < rc.format.num_palette; i++)
+                {
+                  rc.format.palette[i].red   = chunk.data[i * 3];
+                  rc.format.palette[i].green = chunk.data[i * 3 + 1];
+                  rc.format.palette[i].blue  = chunk.data[i * 3 + 2];
+                }
+            }
+          else if (! strcmp (chunk.type, "tRNS") &&
+                   rc.header.color_type == PNG_COLOR_TYPE_PALETTE)
+            {
+              rc.format.num_trans = MIN (chunk.length, 256);
+              memcpy (rc.format.trans, chunk.data, rc.format.num_trans);
+            }
+
+          apng_write_chunk (rc.output, chunk.type, chunk.data, chunk.length);
+        }
+    }
+
+  g_byte_array_free (rc.group, TRUE);
+  apng_chunk_reader_free (reader);
+
+  if (local_error || ! ok)
+    {
+      apng_output_abort (rc.output);
+
+      if (local_error)
+        {
+          g_propagate_error (error, local_error);
+        }
+      else
+        {
+          gchar *name = g_filename_display_name (input);
+
+          g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                       _("Error while reading '%s'. File corrupted?"), name);
+          g_free (name);
+        }
+
+      return FALSE;
+    }
+
+  return apng_output_close (rc.output, error);
+}
+
+static void
+batch_worker (gpointer data,
+              gpointer user_data)
+{
+  BatchJob *job = data;
+
+  apng_recompress (job->input, job->output, job->compression_level,
+                   &job->error);
+
+  g_async_queue_push (job->done, job);
+}
+
+/*
+ * 'apng_batch ()' - Recompress a list of files on a pool of threads.
+ */
+
+gint
+apng_batch (gint                     num_files,
+            const gchar * const     *inputs,
+            const gchar * const     *outputs,
+            const ApngBatchOptions  *options,
+            GError                 **errors,
+            ApngProgressFunc         progress,
+            gpointer                 progress_data)
+{
+  BatchJob    *jobs = g_new0 (BatchJob, num_files);
+  GAsyncQueue *done = g_async_queue_new ();
+  GThreadPool *pool = NULL;
+  gint         failed = 0;
+  gint         i;
+
+  if (options->max_threads > 1 && num_files > 1 && g_thread_supported ())
+    {
+      if (! batch_pool)
+        batch_pool = g_thread_pool_new (batch_worker, NULL,
+                                        options->max_threads, FALSE, NULL);
+      else
+        g_thread_pool_set_max_threads (batch_pool, options->max_threads,
+                                       NULL);
+
+      pool = batch_pool;
+    }
+
+  for (i = 0; i < num_files; i++)
+    {
+      jobs[i].input             = inputs[i];
+      jobs[i].output            = outputs[i];
+      jobs[i].compression_level = options->compression_level;
+      jobs[i].done              = done;
+
+      if (pool)
+        g_thread_pool_push (pool, &jobs[i], NULL);
+    }
+
+  /* Progress is reported from here, as files finish */
+  for (i = 0; i < num_files; i++)
+    {
+      if (! pool)
+        batch_worker (&jobs[i], done);
+
+      g_async_queue_pop (done);
+
+      if (progress)
+        progress ((gdouble) (i + 1) / num_files, progress_data);
+    }
+
+  g_async_queue_unref (done);
+
+  for (i = 0; i < num_files; i++)
+    {
+      errors[i] = jobs[i].error;
+
+      if (jobs[i].error)
+        failed++;
+    }
+
+  g_free (jobs);
+
+  return failed;
+}
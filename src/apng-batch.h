@@ -0,0 +1,57 @@
+/* GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ *   Animated Portable Network Graphics (APNG) plug-in
+ *
+ *   Converting many files in one go.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __APNG_BATCH_H__
+#define __APNG_BATCH_H__
+
+#include <glib.h>
+
+#include "apng-assemble.h"
+
+
+typedef struct
+{
+  gint      compression_level;
+  gint      max_threads;                /* Files converted at once */
+}
+ApngBatchOptions;
+
+
+/* Write the image data of a PNG or APNG file again at another
+ * compression level, keeping everything else, filters and interlacing
+ * included */
+gboolean  apng_recompress  (const gchar             *input,
+                            const gchar             *output,
+                            gint                     compression_level,
+                            GError                 **error);
+
+/* Recompress @inputs[i] to @outputs[i] on a pool of threads.  @errors
+ * gets the error of each file, NULL if it worked out, and the number of
+ * failures is returned.  @progress is called from the calling thread. */
+gint      apng_batch       (gint                     num_files,
+                            const gchar * const     *inputs,
+                            const gchar * const     *outputs,
+                            const ApngBatchOptions  *options,
+                            GError                 **errors,
+                            ApngProgressFunc         progress,
+                            gpointer                 progress_data);
+
+#endif /* __APNG_BATCH_H__ */
@@ -0,0 +1,352 @@
+/* GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ *   Animated Portable Network Graphics (APNG) plug-in
+ *
+ *   Cache of compressed frames, keyed by frame content.  Re-saving an
+ *   animation where only a few layers changed copies the image data of
+ *   the others from here instead of deflating them again.  Entries are
+ *   files named after the key under the user's cache directory, and the
+ *   least recently used ones are dropped when the cache grows too big.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "apng-cache.h"
+#include "apng-chunk.h"
+
+
+#define CACHE_MAGIC      "APNGfc1\n"    /* Entry header, then the level */
+#define CACHE_HEAD_SIZE  12
+#define CACHE_MAX_SIZE   ((guint64) 256 << 20)
+#define CACHE_TRIM_SIZE  (CACHE_MAX_SIZE / 4 * 3) /* What trimming leaves */
+#define CACHE_TOTAL_FILE "total"        /* Running size of the entries */
+
+
+struct _ApngCache
+{
+  gchar    *dirname;            /* Cache directory */
+  guint64   stored;             /* Bytes added since it was opened */
+};
+
+typedef struct
+{
+  gchar    *filename;
+  time_t    mtime;
+  guint64   size;
+}
+CacheEntry;
+
+
+static gchar *
+entry_filename (ApngCache   *cache,
+                const gchar *key,
+                gboolean     create_dir)
+{
+  gchar  fanout[3] = { key[0], key[1], '\0' };
+  gchar *dirname   = g_build_filename (cache->dirname, fanout, NULL);
+  gchar *filename;
+
+  if (create_dir)
+    g_mkdir_with_parents (dirname, 0700);
+
+  filename = g_build_filename (dirname, key, NULL);
+  g_free (dirname);
+
+  return filename;
+}
+
+ApngCache *
+apng_cache_open (void)
+{
+  ApngCache *cache;
+  gchar     *dirname;
+
+  dirname = g_build_filename (g_get_user_cache_dir (), "gimp-apng", "frames",
+                              NULL);
+
+  if (g_mkdir_with_parents (dirname, 0700) != 0)
+    {
+      g_free (dirname);
+      return NULL;
+    }
+
+  cache = g_new0 (ApngCache, 1);
+  cache->dirname = dirname;
+
+  return cache;
+}
+
+static gint
+entry_compare (gconstpointer a,
+               gconstpointer b)
+{
+  const CacheEntry *ea = a;
+  const CacheEntry *eb = b;
+
+  return (ea->mtime > eb->mtime) - (ea->mtime < eb->mtime);
+}
+
+/*
+ * The size of all entries is kept in a file next to them, so closing
+ * the cache only has to walk it when it has grown too big.
+ */
+
+static gboolean
+cache_read_total (ApngCache *cache,
+                  guint64   *total)
+{
+  gchar    *filename = g_build_filename (cache->dirname, CACHE_TOTAL_FILE,
+                                         NULL);
+  gchar    *contents;
+  gboolean  found = FALSE;
+
+  if (g_file_get_contents (filename, &contents, NULL, NULL))
+    {
+      gchar *end;
+
+      *total = g_ascii_strtoull (contents, &end, 10);
+      found  = (end != contents);
+
+      g_free (contents);
+    }
+
+  g_free (filename);
+
+  return found;
+}
+
+static void
+cache_write_total (ApngCache *cache,
+                   guint64    total)
+{
+  gchar *filename = g_build_filename (cache->dirname, CACHE_TOTAL_FILE,
+                                      NULL);
+  gchar *contents = g_strdup_printf ("%" G_GUINT64_FORMAT "\n", total);
+
+  g_file_set_contents (filename, contents, -1, NULL);
+
+  g_free (contents);
+  g_free (filename);
+}
+
+/*
+ * Drop the least recently used entries until the cache is well below
+ * its maximum size.  Returns the size that is left.
+ */
+
+static guint64
+cache_trim (ApngCache *cache)
+{
+  GArray      *entries;
+  GDir        *dir = g_dir_open (cache->dirname, 0, NULL);
+  const gchar *fanout;
+  guint64      total = 0;
+  guint        i;
+
+  if (! dir)
+    return 0;
+
+  entries = g_array_new (FALSE, FALSE, sizeof (CacheEntry));
+
+  while ((fanout = g_dir_read_name (dir)))
+    {
+      gchar       *subname = g_build_filename (cache->dirname, fanout, NULL);
+      GDir        *subdir  = g_dir_open (subname, 0, NULL);
+      const gchar *name;
+
+      while (subdir && (name = g_dir_read_name (subdir)))
+        {
+          CacheEntry  entry;
+          struct stat st;
+
+          entry.filename = g_build_filename (subname, name, NULL);
+
+          if (g_stat (entry.filename, &st) == 0)
+            {
+              entry.mtime = st.st_mtime;
+              entry.size  = st.st_size;
+              total += entry.size;
+              g_array_append_val (entries, entry);
+            }
+          else
+            {
+              g_free (entry.filename);
+            }
+        }
+
+      if (subdir)
+        g_dir_close (subdir);
+
+      g_free (subname);
+    }
+
+  g_dir_close (dir);
+
+  g_array_sort (entries, entry_compare);
+
+  for (i = 0; i < entries->len; i++)
+    {
+      CacheEntry *entry = &g_array_index (entries, CacheEntry, i);
+
+      if (total > CACHE_TRIM_SIZE && g_unlink (entry->filename) == 0)
+        total -= entry->size;
+
+      g_free (entry->filename);
+    }
+
+  g_array_free (entries, TRUE);
+
+  return total;
+}
+
+void
+apng_cache_close (ApngCache *cache)
+{
+  if (cache->stored > 0)
+    {
+      guint64 total;
+
+      if (cache_read_total (cache, &total) &&
+          total + cache->stored <= CACHE_MAX_SIZE)
+        total += cache->stored;
+      else
+        total = cache_trim (cache);
+
+      cache_write_total (cache, total);
+    }
+
+  g_free (cache->dirname);
+  g_free (cache);
+}
+
+GChecksum *
+apng_cache_key_begin (guint32 width,
+                      guint32 height,
+                      gint    bit_depth,
+                      gint    color_type,
+                      gint    interlace)
+{
+  GChecksum *key = g_checksum_new (G_CHECKSUM_MD5);
+  guchar     head[12];
+
+  apng_put_uint32 (head,     width);
+  apng_put_uint32 (head + 4, height);
+  head[8]  = bit_depth;
+  head[9]  = color_type;
+  head[10] = interlace;
+  head[11] = 0;
+
+  g_checksum_update (key, (const guchar *) CACHE_MAGIC, 8);
+  g_checksum_update (key, head, sizeof (head));
+
+  return key;
+}
+
+void
+apng_cache_key_rows (GChecksum  *key,
+                     guchar    **rows,
+                     gint        num_rows,
+                     gsize       row_bytes)
+{
+  gint i;
+
+  for (i = 0; i < num_rows; i++)
+    g_checksum_update (key, rows[i], row_bytes);
+}
+
+gchar *
+apng_cache_key_end (GChecksum *key)
+{
+  gchar *string = g_strdup (g_checksum_get_string (key));
+
+  g_checksum_free (key);
+
+  return string;
+}
+
+gboolean
+apng_cache_lookup (ApngCache   *cache,
+                   const gchar *key,
+                   gint         level,
+                   GByteArray  *payload)
+{
+  gchar    *filename = entry_filename (cache, key, FALSE);
+  gchar    *contents;
+  gsize     length;
+  gboolean  found = FALSE;
+
+  if (g_file_get_contents (filename, &contents, &length, NULL))
+    {
+      if (length > CACHE_HEAD_SIZE &&
+          ! memcmp (contents, CACHE_MAGIC, 8))
+        {
+          gint entry_level;
+
+          entry_level = (gint32) apng_get_uint32 ((guchar *) contents + 8);
+
+          if (level == APNG_CACHE_ANY_LEVEL ||
+              entry_level == APNG_CACHE_ANY_LEVEL ||
+              entry_level >= level)
+            {
+              g_byte_array_append (payload,
+                                   (guchar *) contents + CACHE_HEAD_SIZE,
+                                   length - CACHE_HEAD_SIZE);
+              found = TRUE;
+
+#if GLIB_CHECK_VERSION (2, 18, 0)
+              /* Keep it from being trimmed */
+              g_utime (filename, NULL);
+#endif
+            }
+        }
+
+      g_free (contents);
+    }
+
+  g_free (filename);
+
+  return found;
+}
+
+void
+apng_cache_store (ApngCache    *cache,
+                  const gchar  *key,
+                  gint          level,
+                  const guchar *payload,
+                  gsize         length)
+{
+  gchar  *filename = entry_filename (cache, key, TRUE);
+  guchar *contents = g_new (guchar, CACHE_HEAD_SIZE + length);
+
+  memcpy (contents, CACHE_MAGIC, 8);
+  apng_put_uint32 (contents + 8, (guint32) level);
+  memcpy (contents + CACHE_HEAD_SIZE, payload, length);
+
+  if (g_file_set_contents (filename, (gchar *) contents,
+                           CACHE_HEAD_SIZE + length, NULL))
+    cache->stored += CACHE_HEAD_SIZE + length;
+
+  g_free (contents);
+  g_free (filename);
+}
@@ -0,0 +1,63 @@
+/* GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ *   Animated Portable Network Graphics (APNG) plug-in
+ *
+ *   Cache of compressed frames, keyed by frame content.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __APNG_CACHE_H__
+#define __APNG_CACHE_H__
+
+#include <glib.h>
+
+
+#define APNG_CACHE_ANY_LEVEL  (-1)      /* Level of frames taken from files */
+
+typedef struct _ApngCache ApngCache;
+
+
+/* Opens the cache under the user's cache directory, NULL if it can't be
+ * created */
+ApngCache *  apng_cache_open        (void);
+void         apng_cache_close       (ApngCache    *cache);
+
+/* The key of a frame covers its format and its unpacked rows */
+GChecksum *  apng_cache_key_begin   (guint32       width,
+                                     guint32       height,
+                                     gint          bit_depth,
+                                     gint          color_type,
+                                     gint          interlace);
+void         apng_cache_key_rows    (GChecksum    *key,
+                                     guchar      **rows,
+                                     gint          num_rows,
+                                     gsize         row_bytes);
+/* Frees @key */
+gchar *      apng_cache_key_end     (GChecksum    *key);
+
+/* Find image data compressed at @level or better, or at any level for
+ * APNG_CACHE_ANY_LEVEL */
+gboolean     apng_cache_lookup      (ApngCache    *cache,
+                                     const gchar  *key,
+                                     gint          level,
+                                     GByteArray   *payload);
+void         apng_cache_store       (ApngCache    *cache,
+                                     const gchar  *key,
+                                     gint          level,
+                                     const guchar *payload,
+                                     gsize         length);
+
+#endif /* __APNG_CACHE_H__ */
@@ -0,0 +1,413 @@
+/* GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ *   Animated Portable Network Graphics (APNG) plug-in
+ *
+ *   Reading and writing PNG chunks without libpng, for the operations
+ *   that only move compressed data around.  Files are read through a
+ *   mapping, so walking the chunks of a large animation doesn't copy it.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include <glib.h>
+
+#include <zlib.h>               /* crc32() */
+
+#include "apng-chunk.h"
+#include "plugin-intl.h"
+
+
+#define MAX_IMAGE_CHUNK  (1 << 20)      /* Bytes of image data per chunk */
+
+
+struct _ApngChunkReader
+{
+  gchar        *filename;       /* For messages */
+  GMappedFile  *file;
+  const guchar *contents;
+  gsize         size;
+  gsize         pos;            /* Offset of the next chunk */
+  gboolean      done;           /* IEND was read */
+  gboolean      check_data;     /* Check the CRC of image data too */
+};
+
+
+guint32
+apng_get_uint32 (const guchar *buf)
+{
+  return ((guint32) buf[0] << 24) | ((guint32) buf[1] << 16) |
+         ((guint32) buf[2] << 8)  |  (guint32) buf[3];
+}
+
+guint16
+apng_get_uint16 (const guchar *buf)
+{
+  return (guint16) ((buf[0] << 8) | buf[1]);
+}
+
+void
+apng_put_uint32 (guchar  *buf,
+                 guint32  value)
+{
+  buf[0] = value >> 24;
+  buf[1] = value >> 16;
+  buf[2] = value >> 8;
+  buf[3] = value;
+}
+
+void
+apng_put_uint16 (guchar  *buf,
+                 guint16  value)
+{
+  buf[0] = value >> 8;
+  buf[1] = value;
+}
+
+gboolean
+apng_parse_header (const ApngChunk *chunk,
+                   ApngHeader      *header)
+{
+  if (strcmp (chunk->type, "IHDR") || chunk->length != APNG_IHDR_SIZE)
+    return FALSE;
+
+  header->width       = apng_get_uint32 (chunk->data);
+  header->height      = apng_get_uint32 (chunk->data + 4);
+  header->bit_depth   = chunk->data[8];
+  header->color_type  = chunk->data[9];
+  header->compression = chunk->data[10];
+  header->filter      = chunk->data[11];
+  header->interlace   = chunk->data[12];
+
+  return header->width > 0 && header->height > 0;
+}
+
+gboolean
+apng_parse_frame_control (const ApngChunk  *chunk,
+                          ApngFrameControl *fc)
+{
+  if (strcmp (chunk->type, "fcTL") || chunk->length != APNG_fcTL_SIZE)
+    return FALSE;
+
+  fc->sequence   = apng_get_uint32 (chunk->data);
+  fc->width      = apng_get_uint32 (chunk->data + 4);
+  fc->height     = apng_get_uint32 (chunk->data + 8);
+  fc->x_offset   = apng_get_uint32 (chunk->data + 12);
+  fc->y_offset   = apng_get_uint32 (chunk->data + 16);
+  fc->delay_num  = apng_get_uint16 (chunk->data + 20);
+  fc->delay_den  = apng_get_uint16 (chunk->data + 22);
+  fc->dispose_op = chunk->data[24];
+  fc->blend_op   = chunk->data[25];
+
+  return fc->width > 0 && fc->height > 0;
+}
+
+void
+apng_pack_header (guchar           *buf,
+                  const ApngHeader *header)
+{
+  apng_put_uint32 (buf,     header->width);
+  apng_put_uint32 (buf + 4, header->height);
+  buf[8]  = header->bit_depth;
+  buf[9]  = header->color_type;
+  buf[10] = header->compression;
+  buf[11] = header->filter;
+  buf[12] = header->interlace;
+}
+
+void
+apng_pack_frame_control (guchar                 *buf,
+                         const ApngFrameControl *fc)
+{
+  apng_put_uint32 (buf,      fc->sequence);
+  apng_put_uint32 (buf + 4,  fc->width);
+  apng_put_uint32 (buf + 8,  fc->height);
+  apng_put_uint32 (buf + 12, fc->x_offset);
+  apng_put_uint32 (buf + 16, fc->y_offset);
+  apng_put_uint16 (buf + 20, fc->delay_num);
+  apng_put_uint16 (buf + 22, fc->delay_den);
+  buf[24] = fc->dispose_op;
+  buf[25] = fc->blend_op;
+}
+
+static guint32
+chunk_crc (const gchar  *type,
+           const guchar *data,
+           gsize         length)
+{
+  uLong crc = crc32 (0L, Z_NULL, 0);
+
+  crc = crc32 (crc, (const Bytef *) type, 4);
+
+  /* crc32() takes a uInt length */
+  while (length > 0)
+    {
+      uInt n = MIN (length, G_MAXUINT32 / 2);
+
+      crc = crc32 (crc, data, n);
+      data   += n;
+      length -= n;
+    }
+
+  return crc;
+}
+
+/*
+ * 'apng_chunk_reader_new ()' - Map a PNG file for walking its chunks.
+ */
+
+ApngChunkReader *
+apng_chunk_reader_new (const gchar  *filename,
+                       GError      **error)
+{
+  ApngChunkReader *reader;
+  GMappedFile     *file;
+
+  file = g_mapped_file_new (filename, FALSE, error);
+
+  if (! file)
+    return NULL;
+
+  if (g_mapped_file_get_length (file) < APNG_SIGNATURE_SIZE ||
+      memcmp (g_mapped_file_get_contents (file), APNG_SIGNATURE,
+              APNG_SIGNATURE_SIZE))
+    {
+      gchar *name = g_filename_display_name (filename);
+
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                   _("'%s' is not a PNG file"), name);
+      g_free (name);
+#if GLIB_CHECK_VERSION (2, 22, 0)
+      g_mapped_file_unref (file);
+#else
+      g_mapped_file_free (file);
+#endif
+      return NULL;
+    }
+
+  reader = g_new0 (ApngChunkReader, 1);
+
+  reader->filename   = g_strdup (filename);
+  reader->file       = file;
+  reader->contents   = (const guchar *) g_mapped_file_get_contents (file);
+  reader->size       = g_mapped_file_get_length (file);
+  reader->pos        = APNG_SIGNATURE_SIZE;
+  reader->check_data = TRUE;
+
+  return reader;
+}
+
+/*
+ * 'apng_chunk_reader_next ()' - Get the next chunk, checking its CRC.
+ */
+
+gboolean
+apng_chunk_reader_next (ApngChunkReader  *reader,
+                        ApngChunk        *chunk,
+                        GError          **error)
+{
+  const guchar *p;
+  guint32       length;
+  gint          i;
+
+  if (reader->done)
+    return FALSE;
+
+  if (reader->size - reader->pos < 12)
+    goto corrupt;
+
+  p      = reader->contents + reader->pos;
+  length = apng_get_uint32 (p);
+
+  if (length > 0x7fffffff || reader->size - reader->pos - 12 < length)
+    goto corrupt;
+
+  for (i = 0; i < 4; i++)
+    {
+      if (! g_ascii_isalpha (p[4 + i]))
+        goto corrupt;
+
+      chunk->type[i] = p[4 + i];
+    }
+
+  chunk->type[4] = '\0';
+  chunk->data    = p + 8;
+  chunk->length  = length;
+  chunk->offset  = reader->pos;
+
+  if ((reader->check_data ||
+       (strcmp (chunk->type, "IDAT") && strcmp (chunk->type, "fdAT"))) &&
+      chunk_crc (chunk->type, chunk->data, length) !=
+      apng_get_uint32 (p + 8 + length))
+    goto corrupt;
+
+  reader->pos += 12 + length;
+
+  if (! strcmp (chunk->type, "IEND"))
+    reader->done = TRUE;
+
+  return TRUE;
+
+ corrupt:
+  {
+    gchar *name = g_filename_display_name (reader->filename);
+
+    g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                 _("Error while reading '%s'. File corrupted?"), name);
+    g_free (name);
+  }
+
+  reader->done = TRUE;
+
+  return FALSE;
+}
+
+/*
+ * 'apng_chunk_reader_set_check_data ()' - Turn CRC checks of image data
+ *                                         on or off.
+ *
+ * Without them, walking a file only touches the pages of its chunk
+ * headers.
+ */
+
+void
+apng_chunk_reader_set_check_data (ApngChunkReader *reader,
+                                  gboolean         check_data)
+{
+  reader->check_data = check_data;
+}
+
+gsize
+apng_chunk_reader_size (ApngChunkReader *reader)
+{
+  return reader->size;
+}
+
+void
+apng_chunk_reader_free (ApngChunkReader *reader)
+{
+#if GLIB_CHECK_VERSION (2, 22, 0)
+  g_mapped_file_unref (reader->file);
+#else
+  g_mapped_file_free (reader->file);
+#endif
+  g_free (reader->filename);
+  g_free (reader);
+}
+
+/*
+ * Writing...
+ */
+
+gboolean
+apng_write_signature (ApngOutput *output)
+{
+  return apng_output_write (output, (const guchar *) APNG_SIGNATURE,
+                            APNG_SIGNATURE_SIZE);
+}
+
+gboolean
+apng_write_chunk (ApngOutput   *output,
+                  const gchar  *type,
+                  const guchar *data,
+                  gsize         length)
+{
+  guchar head[8];
+  guchar tail[4];
+
+  apng_put_uint32 (head, length);
+  memcpy (head + 4, type, 4);
+  apng_put_uint32 (tail, chunk_crc (type, data, length));
+
+  return (apng_output_write (output, head, 8) &&
+          apng_output_write (output, data, length) &&
+          apng_output_write (output, tail, 4));
+}
+
+gboolean
+apng_write_actl (ApngOutput *output,
+                 guint32     num_frames,
+                 guint32     num_plays)
+{
+  guchar data[APNG_acTL_SIZE];
+
+  apng_put_uint32 (data,     num_frames);
+  apng_put_uint32 (data + 4, num_plays);
+
+  return apng_write_chunk (output, "acTL", data, sizeof (data));
+}
+
+gboolean
+apng_write_fctl (ApngOutput             *output,
+                 const ApngFrameControl *fc)
+{
+  guchar data[APNG_fcTL_SIZE];
+
+  apng_pack_frame_control (data, fc);
+
+  return apng_write_chunk (output, "fcTL", data, sizeof (data));
+}
+
+gboolean
+apng_write_image_data (ApngOutput   *output,
+                       guint32      *sequence,
+                       const guchar *data,
+                       gsize         length)
+{
+  guchar *fdat = NULL;
+  gboolean ok  = TRUE;
+
+  if (sequence)
+    fdat = g_new (guchar, 4 + MIN (length, MAX_IMAGE_CHUNK));
+
+  do
+    {
+      gsize n = MIN (length, MAX_IMAGE_CHUNK);
+
+      if (sequence)
+        {
+          apng_put_uint32 (fdat, (*sequence)++);
+          memcpy (fdat + 4, data, n);
+          ok = apng_write_chunk (output, "fdAT", fdat, 4 + n);
+        }
+      else
+        {
+          ok = apng_write_chunk (output, "IDAT", data, n);
+        }
+
+      data   += n;
+      length -= n;
+    }
+  while (ok && length > 0);
+
+  g_free (fdat);
+
+  return ok;
+}
+
+void
+apng_chunk_pack (guchar       *buf,
+                 const gchar  *type,
+                 const guchar *data,
+                 guint32       length)
+{
+  apng_put_uint32 (buf, length);
+  memcpy (buf + 4, type, 4);
+  memmove (buf + 8, data, length);
+  apng_put_uint32 (buf + 8 + length, chunk_crc (type, buf + 8, length));
+}
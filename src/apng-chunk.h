@@ -0,0 +1,133 @@
+/* GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ *   Animated Portable Network Graphics (APNG) plug-in
+ *
+ *   Reading and writing PNG chunks without libpng.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __APNG_CHUNK_H__
+#define __APNG_CHUNK_H__
+
+#include <glib.h>
+
+#include "apng-output.h"
+
+
+#define APNG_SIGNATURE        "\211PNG\r\n\032\n"
+#define APNG_SIGNATURE_SIZE   8
+
+#define APNG_IHDR_SIZE        13
+#define APNG_acTL_SIZE        8
+#define APNG_fcTL_SIZE        26
+
+
+/*
+ * A chunk of a mapped file.  "data" points into the mapping.
+ */
+
+typedef struct
+{
+  gchar         type[5];        /* Chunk type, NUL terminated */
+  const guchar *data;           /* Chunk data */
+  guint32       length;         /* Length of the data */
+  gsize         offset;         /* File offset of the length field */
+}
+ApngChunk;
+
+typedef struct
+{
+  guint32   width;
+  guint32   height;
+  guint8    bit_depth;
+  guint8    color_type;
+  guint8    compression;
+  guint8    filter;
+  guint8    interlace;
+}
+ApngHeader;
+
+typedef struct
+{
+  guint32   sequence;
+  guint32   width;
+  guint32   height;
+  guint32   x_offset;
+  guint32   y_offset;
+  guint16   delay_num;
+  guint16   delay_den;
+  guint8    dispose_op;
+  guint8    blend_op;
+}
+ApngFrameControl;
+
+typedef struct _ApngChunkReader ApngChunkReader;
+
+
+guint32            apng_get_uint32           (const guchar           *buf);
+guint16            apng_get_uint16           (const guchar           *buf);
+void               apng_put_uint32           (guchar                 *buf,
+                                              guint32                 value);
+void               apng_put_uint16           (guchar                 *buf,
+                                              guint16                 value);
+
+gboolean           apng_parse_header         (const ApngChunk        *chunk,
+                                              ApngHeader             *header);
+gboolean           apng_parse_frame_control  (const ApngChunk        *chunk,
+                                              ApngFrameControl       *fc);
+void               apng_pack_header          (guchar                 *buf,
+                                              const ApngHeader       *header);
+void               apng_pack_frame_control   (guchar                 *buf,
+                                              const ApngFrameControl *fc);
+
+/* Map @filename and check its signature */
+ApngChunkReader *  apng_chunk_reader_new     (const gchar            *filename,
+                                              GError                **error);
+/* Returns FALSE after IEND, or with @error set if the file is broken */
+gboolean           apng_chunk_reader_next    (ApngChunkReader        *reader,
+                                              ApngChunk              *chunk,
+                                              GError                **error);
+/* Whether the CRCs of IDAT and fdAT chunks are checked, default TRUE */
+void               apng_chunk_reader_set_check_data
+                                             (ApngChunkReader        *reader,
+                                              gboolean                check_data);
+gsize              apng_chunk_reader_size    (ApngChunkReader        *reader);
+void               apng_chunk_reader_free    (ApngChunkReader        *reader);
+
+gboolean           apng_write_signature      (ApngOutput             *output);
+gboolean           apng_write_chunk          (ApngOutput             *output,
+                                              const gchar            *type,
+                                              const guchar           *data,
+                                              gsize                   length);
+gboolean           apng_write_actl           (ApngOutput             *output,
+                                              guint32                 num_frames,
+                                              guint32                 num_plays);
+gboolean           apng_write_fctl           (ApngOutput             *output,
+                                              const ApngFrameControl *fc);
+/* Write zlib image data as IDAT chunks, or as fdAT chunks numbered from
+ * @sequence if @sequence isn't NULL */
+gboolean           apng_write_image_data     (ApngOutput             *output,
+                                              guint32                *sequence,
+                                              const guchar           *data,
+                                              gsize                   length);
+
+/* A whole chunk, for patching files in place */
+void               apng_chunk_pack           (guchar                 *buf,
+                                              const gchar            *type,
+                                              const guchar           *data,
+                                              guint32                 length);
+
+#endif /* __APNG_CHUNK_H__ */
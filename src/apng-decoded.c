@@ -0,0 +1,617 @@
+/* GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ *   Animated Portable Network Graphics (APNG) plug-in
+ *
+ *   Cache of decoded frames.  Opening a large animation again, with the
+ *   same options, maps the layers it was loaded into last time instead
+ *   of inflating every frame again.  An entry is a file named after the
+ *   key of the load under the user's cache directory:
+ *
+ *     "APNGdc1\n", number of frames, length of the comment
+ *     per frame: x, y, width, height, bpp, length of the name,
+ *                the name with its NUL, the rows
+ *     the comment
+ *
+ *   Numbers are 32 bits, big-endian, and names and rows start on 8-byte
+ *   boundaries, so rows can be handed to the core straight from the
+ *   mapping.  The least recently used entries are dropped when the
+ *   cache grows too big.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#ifdef G_OS_WIN32
+#include <io.h>
+#endif
+
+#include "apng-chunk.h"
+#include "apng-decoded.h"
+
+
+#define DECODED_MAGIC        "APNGdc1\n"
+#define DECODED_HEAD_SIZE    16
+#define DECODED_FRAME_SIZE   24         /* Frame header */
+#define DECODED_HASH_BLOCK   (1 << 16)  /* Bytes hashed from each end */
+
+#define PAD8(n)              (((n) + 7) & ~(guint64) 7)
+
+
+struct _ApngDecodedEntry
+{
+  GMappedFile  *file;
+  const guchar *data;
+  gsize         length;
+  guint         num_frames;
+  guint64      *offsets;                /* Of the frame headers */
+  gchar        *comment;
+};
+
+struct _ApngDecodedWriter
+{
+  gchar        *filename;               /* Of the entry */
+  gchar        *tmpname;                /* Written until it's finished */
+  gint          fd;
+  guint64       max_size;
+  guint64       end;                    /* Of the frames so far */
+  guint64       rows;                   /* Offset of the current rows */
+  guint64       pad;                    /* Offset of the padding after */
+  gsize         row_bytes;
+  guint         num_frames;
+  gboolean      failed;
+};
+
+typedef struct
+{
+  gchar        *filename;
+  time_t        mtime;
+  guint64       size;
+}
+DecodedFile;
+
+
+static gchar *
+cache_dirname (void)
+{
+  return g_build_filename (g_get_user_cache_dir (), "gimp-apng", "decoded",
+                           NULL);
+}
+
+static gchar *
+entry_filename (const gchar *key)
+{
+  gchar *dirname  = cache_dirname ();
+  gchar *filename = g_build_filename (dirname, key, NULL);
+
+  g_free (dirname);
+
+  return filename;
+}
+
+/*
+ * 'apng_decoded_key ()' - Key a load on the file and its options.
+ *
+ * Path, size and mtime alone would do for a file that's replaced as a
+ * whole.  The inode and ctime, and a sample of the contents from both
+ * ends, catch one that's rewritten in place within the same second,
+ * without reading the whole file on every load.
+ */
+
+gchar *
+apng_decoded_key (const gchar *filename,
+                  const gchar *options)
+{
+  GChecksum   *key;
+  struct stat  st;
+  gchar       *path;
+  gchar       *head;
+  guchar      *block;
+  FILE        *fp;
+  gsize        n;
+  gchar       *string;
+
+  fp = g_fopen (filename, "rb");
+
+  if (! fp)
+    return NULL;
+
+  if (fstat (fileno (fp), &st) != 0)
+    {
+      fclose (fp);
+      return NULL;
+    }
+
+  if (g_path_is_absolute (filename))
+    {
+      path = g_strdup (filename);
+    }
+  else
+    {
+      gchar *cwd = g_get_current_dir ();
+
+      path = g_build_filename (cwd, filename, NULL);
+      g_free (cwd);
+    }
+
+  head = g_strdup_printf ("%s%s\n%s\n%" G_GUINT64_FORMAT " %ld %ld %"
+                          G_GUINT64_FORMAT "\n",
+                          DECODED_MAGIC, options, path,
+                          (guint64) st.st_size, (glong) st.st_mtime,
+                          (glong) st.st_ctime, (guint64) st.st_ino);
+
+  key = g_checksum_new (G_CHECKSUM_MD5);
+  g_checksum_update (key, (const guchar *) head, strlen (head));
+
+  g_free (head);
+  g_free (path);
+
+  block = g_new (guchar, DECODED_HASH_BLOCK);
+
+  /* The head holds the chunks that say what the frames are, the tail
+   * the last frame's data and the chunks after it.
+   */
+  n = fread (block, 1, DECODED_HASH_BLOCK, fp);
+  g_checksum_update (key, block, n);
+
+  if (! ferror (fp) && st.st_size > 2 * DECODED_HASH_BLOCK &&
+      fseek (fp, -DECODED_HASH_BLOCK, SEEK_END) == 0)
+    {
+      n = fread (block, 1, DECODED_HASH_BLOCK, fp);
+      g_checksum_update (key, block, n);
+    }
+  else if (! ferror (fp))
+    {
+      while ((n = fread (block, 1, DECODED_HASH_BLOCK, fp)) > 0)
+        g_checksum_update (key, block, n);
+    }
+
+  g_free (block);
+
+  if (ferror (fp))
+    {
+      fclose (fp);
+      g_checksum_free (key);
+
+      return NULL;
+    }
+
+  fclose (fp);
+
+  string = g_strdup (g_checksum_get_string (key));
+  g_checksum_free (key);
+
+  return string;
+}
+
+static void
+entry_unmap (ApngDecodedEntry *entry)
+{
+#if GLIB_CHECK_VERSION (2, 22, 0)
+  g_mapped_file_unref (entry->file);
+#else
+  g_mapped_file_free (entry->file);
+#endif
+}
+
+/*
+ * 'entry_check ()' - Walk the frames of an entry, checking that they
+ *                    fit.
+ */
+
+static gboolean
+entry_check (ApngDecodedEntry *entry)
+{
+  const guchar *data = entry->data;
+  guint64       pos  = DECODED_HEAD_SIZE;
+  guint32       comment_length;
+  guint         i;
+
+  if (entry->length < DECODED_HEAD_SIZE ||
+      memcmp (data, DECODED_MAGIC, 8))
+    return FALSE;
+
+  entry->num_frames = apng_get_uint32 (data + 8);
+  comment_length    = apng_get_uint32 (data + 12);
+
+  if (entry->num_frames > entry->length / DECODED_FRAME_SIZE)
+    return FALSE;
+
+  entry->offsets = g_new (guint64, entry->num_frames);
+
+  for (i = 0; i < entry->num_frames; i++)
+    {
+      guint64 width, height, bpp, name_length, size;
+
+      if (pos + DECODED_FRAME_SIZE > entry->length)
+        return FALSE;
+
+      entry->offsets[i] = pos;
+
+      width       = apng_get_uint32 (data + pos + 8);
+      height      = apng_get_uint32 (data + pos + 12);
+      bpp         = apng_get_uint32 (data + pos + 16);
+      name_length = apng_get_uint32 (data + pos + 20);
+
+      if (width > G_MAXINT || height > G_MAXINT || bpp < 1 || bpp > 4 ||
+          name_length < 1)
+        return FALSE;
+
+      pos += DECODED_FRAME_SIZE;
+
+      if (pos + name_length > entry->length ||
+          data[pos + name_length - 1] != '\0')
+        return FALSE;
+
+      pos += PAD8 (name_length);
+
+      /* The pixels are checked against what is left before anything is
+       * added to "pos", so that huge sizes can't wrap it around */
+      size = width * height * bpp;
+
+      if (pos > entry->length || size > entry->length - pos)
+        return FALSE;
+
+      pos += PAD8 (size);
+
+      if (pos > entry->length)
+        return FALSE;
+    }
+
+  if (pos + comment_length != entry->length)
+    return FALSE;
+
+  if (comment_length > 0)
+    entry->comment = g_strndup ((const gchar *) data + pos, comment_length);
+
+  return TRUE;
+}
+
+ApngDecodedEntry *
+apng_decoded_lookup (const gchar *key)
+{
+  ApngDecodedEntry *entry;
+  gchar            *filename = entry_filename (key);
+  GMappedFile      *file;
+
+  file = g_mapped_file_new (filename, FALSE, NULL);
+
+  if (! file)
+    {
+      g_free (filename);
+      return NULL;
+    }
+
+  entry = g_new0 (ApngDecodedEntry, 1);
+  entry->file   = file;
+  entry->data   = (const guchar *) g_mapped_file_get_contents (file);
+  entry->length = g_mapped_file_get_length (file);
+
+  if (! entry_check (entry))
+    {
+      apng_decoded_entry_free (entry);
+      g_unlink (filename);
+      g_free (filename);
+
+      return NULL;
+    }
+
+#if GLIB_CHECK_VERSION (2, 18, 0)
+  /* Keep it from being trimmed */
+  g_utime (filename, NULL);
+#endif
+
+  g_free (filename);
+
+  return entry;
+}
+
+guint
+apng_decoded_num_frames (ApngDecodedEntry *entry)
+{
+  return entry->num_frames;
+}
+
+void
+apng_decoded_get_frame (ApngDecodedEntry *entry,
+                        guint             index,
+                        ApngDecodedFrame *frame)
+{
+  const guchar *data = entry->data + entry->offsets[index];
+  guint32       name_length;
+
+  frame->x      = (gint32) apng_get_uint32 (data);
+  frame->y      = (gint32) apng_get_uint32 (data + 4);
+  frame->width  = apng_get_uint32 (data + 8);
+  frame->height = apng_get_uint32 (data + 12);
+  frame->bpp    = apng_get_uint32 (data + 16);
+  name_length   = apng_get_uint32 (data + 20);
+
+  frame->name   = (const gchar *) data + DECODED_FRAME_SIZE;
+  frame->pixels = data + DECODED_FRAME_SIZE + PAD8 (name_length);
+}
+
+const gchar *
+apng_decoded_comment (ApngDecodedEntry *entry)
+{
+  return entry->comment;
+}
+
+void
+apng_decoded_entry_free (ApngDecodedEntry *entry)
+{
+  entry_unmap (entry);
+
+  g_free (entry->offsets);
+  g_free (entry->comment);
+  g_free (entry);
+}
+
+static void
+writer_pwrite (ApngDecodedWriter *writer,
+               guint64            offset,
+               const guchar      *data,
+               gsize              length)
+{
+  if (writer->failed)
+    return;
+
+  if (lseek (writer->fd, offset, SEEK_SET) == (off_t) -1)
+    {
+      writer->failed = TRUE;
+      return;
+    }
+
+  while (length > 0)
+    {
+      gssize n = write (writer->fd, data, length);
+
+      if (n < 0 && errno == EINTR)
+        continue;
+
+      if (n <= 0)
+        {
+          writer->failed = TRUE;
+          return;
+        }
+
+      data   += n;
+      length -= n;
+    }
+}
+
+ApngDecodedWriter *
+apng_decoded_writer_new (const gchar *key,
+                         guint64      max_size)
+{
+  ApngDecodedWriter *writer;
+  gchar             *dirname = cache_dirname ();
+  gchar             *template;
+  gint               fd;
+
+  if (g_mkdir_with_parents (dirname, 0700) != 0)
+    {
+      g_free (dirname);
+      return NULL;
+    }
+
+  template = g_strdup_printf ("%s.XXXXXX", key);
+
+  writer = g_new0 (ApngDecodedWriter, 1);
+  writer->filename = g_build_filename (dirname, key, NULL);
+  writer->tmpname  = g_build_filename (dirname, template, NULL);
+
+  g_free (template);
+  g_free (dirname);
+
+  fd = g_mkstemp (writer->tmpname);
+
+  if (fd < 0)
+    {
+      g_free (writer->filename);
+      g_free (writer->tmpname);
+      g_free (writer);
+
+      return NULL;
+    }
+
+  writer->fd       = fd;
+  writer->max_size = max_size;
+  writer->end      = DECODED_HEAD_SIZE;
+
+  return writer;
+}
+
+void
+apng_decoded_add_frame (ApngDecodedWriter *writer,
+                        const gchar       *name,
+                        gint               x,
+                        gint               y,
+                        gint               width,
+                        gint               height,
+                        gint               bpp)
+{
+  static const guchar zeros[8] = { 0 };
+  guchar              head[DECODED_FRAME_SIZE];
+  gsize               name_length = strlen (name) + 1;
+
+  apng_put_uint32 (head,      (guint32) x);
+  apng_put_uint32 (head + 4,  (guint32) y);
+  apng_put_uint32 (head + 8,  width);
+  apng_put_uint32 (head + 12, height);
+  apng_put_uint32 (head + 16, bpp);
+  apng_put_uint32 (head + 20, name_length);
+
+  writer_pwrite (writer, writer->end, head, sizeof (head));
+  writer_pwrite (writer, writer->end + DECODED_FRAME_SIZE,
+                 (const guchar *) name, name_length);
+  writer_pwrite (writer, writer->end + DECODED_FRAME_SIZE + name_length,
+                 zeros, PAD8 (name_length) - name_length);
+
+  writer->rows      = writer->end + DECODED_FRAME_SIZE + PAD8 (name_length);
+  writer->row_bytes = (gsize) width * bpp;
+  writer->pad       = writer->rows + (guint64) writer->row_bytes * height;
+  writer->end       = PAD8 (writer->pad);
+  writer->num_frames++;
+
+  if (writer->end > writer->max_size)
+    writer->failed = TRUE;
+}
+
+/*
+ * 'apng_decoded_put_rows ()' - Write rows of the current frame.
+ *
+ * Rows of interlaced frames come in once per pass, the last one wins.
+ */
+
+void
+apng_decoded_put_rows (ApngDecodedWriter *writer,
+                       gint               begin,
+                       const guchar      *pixels,
+                       gint               num_rows)
+{
+  writer_pwrite (writer, writer->rows + (guint64) begin * writer->row_bytes,
+                 pixels, (gsize) num_rows * writer->row_bytes);
+}
+
+static gint
+file_compare (gconstpointer a,
+              gconstpointer b)
+{
+  const DecodedFile *fa = a;
+  const DecodedFile *fb = b;
+
+  return (fa->mtime > fb->mtime) - (fa->mtime < fb->mtime);
+}
+
+/*
+ * Drop the least recently used entries until the cache fits.
+ */
+
+static void
+cache_trim (guint64 max_size)
+{
+  gchar       *dirname = cache_dirname ();
+  GDir        *dir     = g_dir_open (dirname, 0, NULL);
+  GArray      *files;
+  const gchar *name;
+  guint64      total = 0;
+  guint        i;
+
+  if (! dir)
+    {
+      g_free (dirname);
+      return;
+    }
+
+  files = g_array_new (FALSE, FALSE, sizeof (DecodedFile));
+
+  while ((name = g_dir_read_name (dir)))
+    {
+      DecodedFile file;
+      struct stat st;
+
+      file.filename = g_build_filename (dirname, name, NULL);
+
+      if (g_stat (file.filename, &st) == 0)
+        {
+          file.mtime = st.st_mtime;
+          file.size  = st.st_size;
+          total += file.size;
+          g_array_append_val (files, file);
+        }
+      else
+        {
+          g_free (file.filename);
+        }
+    }
+
+  g_dir_close (dir);
+  g_free (dirname);
+
+  g_array_sort (files, file_compare);
+
+  for (i = 0; i < files->len; i++)
+    {
+      DecodedFile *file = &g_array_index (files, DecodedFile, i);
+
+      if (total > max_size && g_unlink (file->filename) == 0)
+        total -= file->size;
+
+      g_free (file->filename);
+    }
+
+  g_array_free (files, TRUE);
+}
+
+void
+apng_decoded_writer_finish (ApngDecodedWriter *writer,
+                            const gchar       *comment)
+{
+  static const guchar zeros[8] = { 0 };
+  guchar              head[DECODED_HEAD_SIZE];
+  gsize               comment_length = comment ? strlen (comment) : 0;
+
+  memcpy (head, DECODED_MAGIC, 8);
+  apng_put_uint32 (head + 8,  writer->num_frames);
+  apng_put_uint32 (head + 12, comment_length);
+
+  /* Padding between frames is filled in by the writes after it, but the
+   * last frame's has to be written */
+  if (writer->num_frames > 0)
+    writer_pwrite (writer, writer->pad, zeros, writer->end - writer->pad);
+
+  writer_pwrite (writer, writer->end, (const guchar *) comment,
+                 comment_length);
+  writer_pwrite (writer, 0, head, sizeof (head));
+
+  if (writer->end + comment_length > writer->max_size)
+    writer->failed = TRUE;
+
+  if (close (writer->fd) != 0)
+    writer->failed = TRUE;
+
+  if (writer->failed || g_rename (writer->tmpname, writer->filename) != 0)
+    g_unlink (writer->tmpname);
+  else
+    cache_trim (writer->max_size);
+
+  g_free (writer->filename);
+  g_free (writer->tmpname);
+  g_free (writer);
+}
+
+void
+apng_decoded_writer_abort (ApngDecodedWriter *writer)
+{
+  close (writer->fd);
+  g_unlink (writer->tmpname);
+
+  g_free (writer->filename);
+  g_free (writer->tmpname);
+  g_free (writer);
+}
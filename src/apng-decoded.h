@@ -0,0 +1,83 @@
+/* GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ *   Animated Portable Network Graphics (APNG) plug-in
+ *
+ *   Cache of decoded frames, keyed by file and load options.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __APNG_DECODED_H__
+#define __APNG_DECODED_H__
+
+#include <glib.h>
+
+
+/*
+ * A layer of a cached image.  "pixels" are "height" rows of "width"
+ * pixels of "bpp" bytes, as stored in the layer before any tRNS fix-up.
+ */
+
+typedef struct
+{
+  const gchar  *name;
+  gint          x, y;                   /* Layer offsets */
+  gint          width, height;
+  gint          bpp;
+  const guchar *pixels;
+}
+ApngDecodedFrame;
+
+typedef struct _ApngDecodedEntry  ApngDecodedEntry;
+typedef struct _ApngDecodedWriter ApngDecodedWriter;
+
+
+/* Key of @filename loaded with @options, from its path, size, times and
+ * the contents at both ends.  NULL if the file can't be read. */
+gchar *              apng_decoded_key           (const gchar        *filename,
+                                                 const gchar        *options);
+
+/* Map the entry of @key, NULL if there's none or it's damaged */
+ApngDecodedEntry *   apng_decoded_lookup        (const gchar        *key);
+guint                apng_decoded_num_frames    (ApngDecodedEntry   *entry);
+void                 apng_decoded_get_frame     (ApngDecodedEntry   *entry,
+                                                 guint               index,
+                                                 ApngDecodedFrame   *frame);
+/* The image comment, NULL if there's none */
+const gchar *        apng_decoded_comment       (ApngDecodedEntry   *entry);
+void                 apng_decoded_entry_free    (ApngDecodedEntry   *entry);
+
+/* Write the entry of @key, giving up if it grows past @max_size bytes,
+ * which is also what the whole cache is trimmed to */
+ApngDecodedWriter *  apng_decoded_writer_new    (const gchar        *key,
+                                                 guint64             max_size);
+/* Start a frame, whose rows are then put in any order */
+void                 apng_decoded_add_frame     (ApngDecodedWriter  *writer,
+                                                 const gchar        *name,
+                                                 gint                x,
+                                                 gint                y,
+                                                 gint                width,
+                                                 gint                height,
+                                                 gint                bpp);
+void                 apng_decoded_put_rows      (ApngDecodedWriter  *writer,
+                                                 gint                begin,
+                                                 const guchar       *pixels,
+                                                 gint                num_rows);
+/* Put the entry in place, or drop it if anything failed */
+void                 apng_decoded_writer_finish (ApngDecodedWriter  *writer,
+                                                 const gchar        *comment);
+void                 apng_decoded_writer_abort  (ApngDecodedWriter  *writer);
+
+#endif /* __APNG_DECODED_H__ */
@@ -0,0 +1,164 @@
+/* GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ *   Animated Portable Network Graphics (APNG) plug-in
+ *
+ *   Encoding single frames to memory with libpng.  Every frame is
+ *   written as a standalone PNG whose IDAT data is picked out of the
+ *   stream as libpng writes it, so frames can be encoded, cached and
+ *   re-wrapped as fdAT chunks independently of each other.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include <glib.h>
+
+#include <png.h>
+
+#include "apng-chunk.h"
+#include "apng-encode.h"
+
+
+/*
+ * 'encoder_write ()' - Split the PNG stream, keeping the IDAT data.
+ *
+ * libpng hands over headers, data and CRCs in pieces of any size, so
+ * this is a small state machine.
+ */
+
+static void
+encoder_write (png_structp pp,
+               png_bytep   data,
+               png_size_t  length)
+{
+  ApngFrameEncoder *encoder = png_get_io_ptr (pp);
+
+  while (length > 0)
+    {
+      gsize n;
+
+      if (encoder->skip > 0)
+        {
+          /* Signature or CRC */
+          n = MIN (length, encoder->skip);
+          encoder->skip -= n;
+        }
+      else if (encoder->data_left > 0)
+        {
+          n = MIN (length, encoder->data_left);
+
+          if (encoder->idat)
+            g_byte_array_append (encoder->payload, data, n);
+
+          encoder->data_left -= n;
+
+          if (encoder->data_left == 0)
+            encoder->skip = 4;
+        }
+      else
+        {
+          n = MIN (length, 8 - encoder->head_len);
+          memcpy (encoder->head + encoder->head_len, data, n);
+          encoder->head_len += n;
+
+          if (encoder->head_len == 8)
+            {
+              encoder->data_left = apng_get_uint32 (encoder->head);
+              encoder->idat      = ! memcmp (encoder->head + 4, "IDAT", 4);
+              encoder->head_len  = 0;
+
+              if (encoder->data_left == 0)
+                encoder->skip = 4;
+            }
+        }
+
+      data   += n;
+      length -= n;
+    }
+}
+
+static void
+encoder_flush (png_structp pp)
+{
+}
+
+ApngFrameEncoder *
+apng_frame_encoder_new (void)
+{
+  ApngFrameEncoder *encoder = g_new0 (ApngFrameEncoder, 1);
+
+  encoder->pp      = png_create_write_struct (PNG_LIBPNG_VER_STRING,
+                                              NULL, NULL, NULL);
+  encoder->info    = png_create_info_struct (encoder->pp);
+  encoder->payload = g_byte_array_new ();
+  encoder->skip    = APNG_SIGNATURE_SIZE;
+
+  png_set_write_fn (encoder->pp, encoder, encoder_write, encoder_flush);
+
+  return encoder;
+}
+
+/*
+ * 'apng_frame_encoder_start ()' - Set up the frame and write its header.
+ */
+
+void
+apng_frame_encoder_start (ApngFrameEncoder *encoder,
+                          const ApngFormat *format,
+                          guint32           width,
+                          guint32           height)
+{
+  png_structp pp   = encoder->pp;
+  png_infop   info = encoder->info;
+
+  png_set_IHDR (pp, info, width, height,
+                format->bit_depth, format->color_type, format->interlace,
+                PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+
+  png_set_compression_level (pp, format->compression_level);
+
+  if (format->color_type == PNG_COLOR_TYPE_PALETTE)
+    {
+      /* libpng wants a palette, though only the image data is kept */
+      png_set_PLTE (pp, info, (png_colorp) format->palette,
+                    MAX (format->num_palette, 1));
+
+      if (format->num_trans > 0)
+        png_set_tRNS (pp, info, (png_bytep) format->trans,
+                      format->num_trans, NULL);
+    }
+
+  png_write_info (pp, info);
+
+  if (format->bit_depth < 8)
+    png_set_packing (pp);
+}
+
+void
+apng_frame_encoder_finish (ApngFrameEncoder *encoder)
+{
+  png_write_end (encoder->pp, encoder->info);
+}
+
+void
+apng_frame_encoder_free (ApngFrameEncoder *encoder)
+{
+  png_destroy_write_struct (&encoder->pp, &encoder->info);
+  g_byte_array_free (encoder->payload, TRUE);
+  g_free (encoder);
+}
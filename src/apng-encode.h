@@ -0,0 +1,79 @@
+/* GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ *   Animated Portable Network Graphics (APNG) plug-in
+ *
+ *   Encoding single frames to memory with libpng.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __APNG_ENCODE_H__
+#define __APNG_ENCODE_H__
+
+#include <glib.h>
+
+#include <png.h>
+
+
+/*
+ * What every frame of an animation shares.
+ */
+
+typedef struct
+{
+  gint         bit_depth;
+  gint         color_type;              /* PNG_COLOR_TYPE_* */
+  gint         interlace;               /* PNG_INTERLACE_* */
+  gint         compression_level;
+  png_color    palette[256];
+  gint         num_palette;
+  png_byte     trans[256];              /* Palette alpha */
+  gint         num_trans;
+}
+ApngFormat;
+
+/*
+ * A frame being encoded as a standalone PNG in memory, of which only the
+ * image data is kept.  libpng errors longjmp to png_jmpbuf (encoder->pp),
+ * so callers set that up before apng_frame_encoder_start().
+ */
+
+typedef struct
+{
+  png_structp  pp;
+  png_infop    info;
+  GByteArray  *payload;                 /* zlib image data of the frame */
+
+  /* State of the chunk splitter */
+  guchar       head[8];
+  gint         head_len;
+  guint32      data_left;
+  guint32      skip;
+  gboolean     idat;
+}
+ApngFrameEncoder;
+
+
+ApngFrameEncoder * apng_frame_encoder_new    (void);
+/* Write the header of a @width x @height frame, rows follow with
+ * png_write_rows (), unpacked */
+void               apng_frame_encoder_start  (ApngFrameEncoder *encoder,
+                                              const ApngFormat *format,
+                                              guint32           width,
+                                              guint32           height);
+void               apng_frame_encoder_finish (ApngFrameEncoder *encoder);
+void               apng_frame_encoder_free   (ApngFrameEncoder *encoder);
+
+#endif /* __APNG_ENCODE_H__ */
@@ -0,0 +1,338 @@
+/* GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ *   Animated Portable Network Graphics (APNG) plug-in
+ *
+ *   Estimating the size of a file while the save dialog is up.  A few
+ *   strips of rows of a few frames are taken from the image once, and a
+ *   thread compresses them with the frame encoder each time a setting
+ *   changes, scaling the result up to the whole file.  A request that
+ *   comes in while an estimate runs cuts it short.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include <glib.h>
+
+#include <png.h>
+
+#include "apng-encode.h"
+#include "apng-estimate.h"
+
+
+typedef struct
+{
+  ApngEstimateSettings  settings;
+  guint                 generation;     /* Of the request */
+  ApngEstimate          estimate;
+}
+EstimateJob;
+
+struct _ApngEstimator
+{
+  GAsyncQueue  *todo;                   /* Requests for the worker */
+  GAsyncQueue  *done;                   /* Finished estimates */
+  GThread      *thread;                 /* Worker, NULL to run inline */
+  guint         generation;             /* Of the last request */
+};
+
+
+static EstimateJob estimate_end;        /* Tells the worker to quit */
+
+
+/*
+ * 'estimate_sample ()' - Compress the rows of a sample.
+ *
+ * "size" gets the size of the smallest of the encodings.
+ */
+
+static gboolean
+estimate_sample (const ApngEstimateSample   *sample,
+                 const ApngEstimateSettings *settings,
+                 gsize                      *size)
+{
+  ApngFrameEncoder     *encoder;
+  ApngFormat            format;
+  gint                  channels;
+  gsize                 row_bytes;
+  guchar * volatile     pixels = NULL;
+  png_bytep * volatile  rows   = NULL;
+  guint32               y;
+  gint                  i;
+
+  switch (sample->color_type)
+    {
+    case PNG_COLOR_TYPE_GRAY_ALPHA:
+      channels = 2;
+      break;
+
+    case PNG_COLOR_TYPE_RGB:
+      channels = 3;
+      break;
+
+    case PNG_COLOR_TYPE_RGB_ALPHA:
+      channels = 4;
+      break;
+
+    default:
+      channels = 1;
+      break;
+    }
+
+  row_bytes = (gsize) sample->width * channels;
+
+  /* Transparent pixels are zeroed when saving, which helps deflate */
+  if (! settings->save_transp_pixels &&
+      (sample->color_type & PNG_COLOR_MASK_ALPHA))
+    {
+      gsize   n = (gsize) sample->width * sample->num_rows;
+      guchar *p;
+
+      pixels = g_memdup (sample->pixels, row_bytes * sample->num_rows);
+
+      for (p = pixels; n > 0; n--, p += channels)
+        if (p[channels - 1] == 0)
+          memset (p, 0, channels - 1);
+    }
+
+  rows = g_new (png_bytep, sample->num_rows);
+
+  for (y = 0; y < sample->num_rows; y++)
+    rows[y] = (pixels ? pixels : sample->pixels) + y * row_bytes;
+
+  memset (&format, 0, sizeof (format));
+  format.bit_depth         = 8;
+  format.color_type        = sample->color_type;
+  format.interlace         = (settings->interlaced ?
+                              PNG_INTERLACE_ADAM7 : PNG_INTERLACE_NONE);
+  format.compression_level = settings->compression_level;
+
+  if (sample->color_type == PNG_COLOR_TYPE_PALETTE)
+    {
+      format.num_palette = sample->num_palette;
+      memcpy (format.palette, sample->palette,
+              sample->num_palette * sizeof (png_color));
+    }
+
+  *size = G_MAXSIZE;
+
+  for (i = 0; i < MAX (settings->num_encodings, 1); i++)
+    {
+      encoder = apng_frame_encoder_new ();
+
+      if (setjmp (png_jmpbuf (encoder->pp)))
+        {
+          apng_frame_encoder_free (encoder);
+          g_free (rows);
+          g_free (pixels);
+
+          return FALSE;
+        }
+
+      apng_frame_encoder_start (encoder, &format,
+                                sample->width, sample->num_rows);
+
+      if (i < settings->num_encodings)
+        {
+          const ApngEstimateEncoding *encoding = &settings->encodings[i];
+
+          if (encoding->filters)
+            png_set_filter (encoder->pp, PNG_FILTER_TYPE_BASE,
+                            encoding->filters);
+
+          if (encoding->strategy >= 0)
+            png_set_compression_strategy (encoder->pp, encoding->strategy);
+        }
+
+      png_write_image (encoder->pp, rows);
+      apng_frame_encoder_finish (encoder);
+
+      *size = MIN (*size, encoder->payload->len);
+
+      apng_frame_encoder_free (encoder);
+    }
+
+  g_free (rows);
+  g_free (pixels);
+
+  return TRUE;
+}
+
+/*
+ * 'estimate_job ()' - Estimate the size of the file, unless a newer
+ *                     request comes in.
+ */
+
+static gboolean
+estimate_job (ApngEstimator *estimator,
+              EstimateJob   *job)
+{
+  const ApngEstimateSettings *settings = &job->settings;
+  GTimer                     *timer    = g_timer_new ();
+  gdouble                     size     = settings->overhead;
+  gdouble                     seconds  = 0.0;
+  gint                        i;
+
+  for (i = 0; i < settings->num_samples; i++)
+    {
+      const ApngEstimateSample *sample = &settings->samples[i];
+      gsize                     sample_size;
+
+      if (estimator->thread && g_async_queue_length (estimator->todo) > 0)
+        break;
+
+      g_timer_start (timer);
+
+      if (sample->num_rows == 0 ||
+          ! estimate_sample (sample, settings, &sample_size))
+        continue;
+
+      size    += sample_size * sample->scale;
+      seconds += g_timer_elapsed (timer, NULL) * sample->scale;
+    }
+
+  g_timer_destroy (timer);
+
+  job->estimate.size    = size;
+  job->estimate.seconds = seconds;
+
+  return (i == settings->num_samples);
+}
+
+static gpointer
+estimator_worker (gpointer data)
+{
+  ApngEstimator *estimator = data;
+  EstimateJob   *job;
+
+  while ((job = g_async_queue_pop (estimator->todo)) != &estimate_end)
+    {
+      EstimateJob *newer;
+
+      /* Only the last request counts */
+      while ((newer = g_async_queue_try_pop (estimator->todo)))
+        {
+          g_free (job);
+          job = newer;
+
+          if (job == &estimate_end)
+            return NULL;
+        }
+
+      if (estimate_job (estimator, job))
+        g_async_queue_push (estimator->done, job);
+      else
+        g_free (job);
+    }
+
+  return NULL;
+}
+
+ApngEstimator *
+apng_estimator_new (void)
+{
+  ApngEstimator *estimator = g_new0 (ApngEstimator, 1);
+
+  estimator->todo = g_async_queue_new ();
+  estimator->done = g_async_queue_new ();
+
+  if (g_thread_supported ())
+    {
+#if GLIB_CHECK_VERSION (2, 32, 0)
+      estimator->thread = g_thread_try_new ("file-apng estimate",
+                                            estimator_worker,
+                                            estimator, NULL);
+#else
+      estimator->thread = g_thread_create (estimator_worker,
+                                           estimator, TRUE, NULL);
+#endif
+    }
+
+  return estimator;
+}
+
+/*
+ * 'apng_estimator_request ()' - Hand new settings to the worker.
+ *
+ * Without threads the estimate is done right away.
+ */
+
+void
+apng_estimator_request (ApngEstimator              *estimator,
+                        const ApngEstimateSettings *settings)
+{
+  EstimateJob *job = g_new0 (EstimateJob, 1);
+
+  job->settings   = *settings;
+  job->generation = ++estimator->generation;
+
+  if (estimator->thread)
+    {
+      g_async_queue_push (estimator->todo, job);
+    }
+  else
+    {
+      estimate_job (estimator, job);
+      g_async_queue_push (estimator->done, job);
+    }
+}
+
+gboolean
+apng_estimator_poll (ApngEstimator *estimator,
+                     ApngEstimate  *estimate)
+{
+  EstimateJob *job;
+  gboolean     found = FALSE;
+
+  while ((job = g_async_queue_try_pop (estimator->done)))
+    {
+      if (job->generation == estimator->generation)
+        {
+          *estimate = job->estimate;
+          found     = TRUE;
+        }
+
+      g_free (job);
+    }
+
+  return found;
+}
+
+void
+apng_estimator_free (ApngEstimator *estimator)
+{
+  EstimateJob *job;
+
+  if (estimator->thread)
+    {
+      g_async_queue_push (estimator->todo, &estimate_end);
+      g_thread_join (estimator->thread);
+    }
+
+  /* Requests the worker quit before */
+  while ((job = g_async_queue_try_pop (estimator->todo)))
+    if (job != &estimate_end)
+      g_free (job);
+
+  while ((job = g_async_queue_try_pop (estimator->done)))
+    g_free (job);
+
+  g_async_queue_unref (estimator->todo);
+  g_async_queue_unref (estimator->done);
+  g_free (estimator);
+}
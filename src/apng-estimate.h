@@ -0,0 +1,91 @@
+/* GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ *   Animated Portable Network Graphics (APNG) plug-in
+ *
+ *   Estimating the size of a file from sample rows, in the background.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __APNG_ESTIMATE_H__
+#define __APNG_ESTIMATE_H__
+
+#include <glib.h>
+
+#include <png.h>
+
+
+#define APNG_ESTIMATE_MAX_ENCODINGS  8
+
+
+/*
+ * Rows taken from one frame, 8-bit and unpacked, the way they are
+ * written.  Indexed samples have no alpha.
+ */
+
+typedef struct
+{
+  guchar    *pixels;
+  guint32    width;
+  guint32    num_rows;
+  gint       color_type;                /* PNG_COLOR_TYPE_* */
+  png_color  palette[256];              /* Of indexed samples */
+  gint       num_palette;
+  gdouble    scale;                     /* Rows of the file per sampled row */
+}
+ApngEstimateSample;
+
+typedef struct
+{
+  gint      filters;                    /* PNG_FILTER_*, 0 = libpng's */
+  gint      strategy;                   /* zlib strategy, -1 = libpng's */
+}
+ApngEstimateEncoding;
+
+typedef struct
+{
+  const ApngEstimateSample *samples;    /* Must outlive the estimator */
+  gint      num_samples;
+  gint      compression_level;
+  gboolean  interlaced;
+  gboolean  save_transp_pixels;         /* FALSE = zero transparent pixels */
+  gsize     overhead;                   /* Bytes outside the image data */
+
+  /* Each sample is compressed every way, the smallest one counts */
+  ApngEstimateEncoding encodings[APNG_ESTIMATE_MAX_ENCODINGS];
+  gint      num_encodings;
+}
+ApngEstimateSettings;
+
+typedef struct
+{
+  guint64   size;                       /* Bytes */
+  gdouble   seconds;                    /* Deflate time */
+}
+ApngEstimate;
+
+typedef struct _ApngEstimator ApngEstimator;
+
+
+ApngEstimator * apng_estimator_new     (void);
+/* Start estimating with @settings, dropping the estimate in progress */
+void            apng_estimator_request (ApngEstimator               *estimator,
+                                        const ApngEstimateSettings  *settings);
+/* TRUE if the estimate of the last request is done since the last poll */
+gboolean        apng_estimator_poll    (ApngEstimator               *estimator,
+                                        ApngEstimate                *estimate);
+void            apng_estimator_free    (ApngEstimator               *estimator);
+
+#endif /* __APNG_ESTIMATE_H__ */
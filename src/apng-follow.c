@@ -0,0 +1,177 @@
+/* GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ *   Animated Portable Network Graphics (APNG) plug-in
+ *
+ *   Reading a file that is still being written, or a pipe.  The end of a
+ *   regular file only means the writer hasn't caught up yet, so reads
+ *   there wait for it to grow, up to a timeout.  Reads come back empty
+ *   every so often while waiting, for the caller to show what it has.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#ifdef G_OS_WIN32
+#include <io.h>
+#endif
+
+#include "apng-follow.h"
+#include "plugin-intl.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define FOLLOW_POLL_INTERVAL  100       /* Milliseconds between checks */
+
+
+struct _ApngFollower
+{
+  gchar     *filename;
+  gint       fd;
+  gboolean   pipe;              /* EOF is the end */
+  gdouble    timeout;           /* Seconds a file may stall */
+  GTimer    *stalled;           /* Since the last data */
+  gboolean   ended;
+};
+
+
+ApngFollower *
+apng_follower_open (const gchar  *filename,
+                    gdouble       timeout,
+                    GError      **error)
+{
+  ApngFollower *follower;
+  struct stat   st;
+  gint          fd;
+
+  /* Opening a FIFO waits for its writer */
+  fd = g_open (filename, O_RDONLY | O_BINARY, 0);
+
+  if (fd < 0 || fstat (fd, &st) < 0)
+    {
+      gint   errsv = errno;
+      gchar *name  = g_filename_display_name (filename);
+
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errsv),
+                   _("Could not open '%s' for reading: %s"),
+                   name, g_strerror (errsv));
+      g_free (name);
+
+      if (fd >= 0)
+        close (fd);
+
+      return NULL;
+    }
+
+  follower = g_new0 (ApngFollower, 1);
+
+  follower->filename = g_strdup (filename);
+  follower->fd       = fd;
+  follower->pipe     = ! S_ISREG (st.st_mode);
+  follower->timeout  = MAX (timeout, 0.0);
+  follower->stalled  = g_timer_new ();
+
+  return follower;
+}
+
+/*
+ * 'apng_follower_read ()' - Read what has come in.
+ */
+
+gssize
+apng_follower_read (ApngFollower  *follower,
+                    guchar        *buf,
+                    gsize          size,
+                    GError       **error)
+{
+  gssize n;
+
+  if (follower->ended)
+    return 0;
+
+#ifndef G_OS_WIN32
+  if (follower->pipe)
+    {
+      GPollFD fds;
+
+      fds.fd     = follower->fd;
+      fds.events = G_IO_IN | G_IO_HUP | G_IO_ERR;
+
+      if (g_poll (&fds, 1, FOLLOW_POLL_INTERVAL) == 0)
+        return 0;
+    }
+#endif
+
+  do
+    n = read (follower->fd, buf, size);
+  while (n < 0 && errno == EINTR);
+
+  if (n < 0)
+    {
+      gint   errsv = errno;
+      gchar *name  = g_filename_display_name (follower->filename);
+
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errsv),
+                   _("Error reading '%s': %s"), name, g_strerror (errsv));
+      g_free (name);
+      follower->ended = TRUE;
+
+      return -1;
+    }
+
+  if (n > 0)
+    {
+      g_timer_start (follower->stalled);
+
+      return n;
+    }
+
+  if (follower->pipe ||
+      g_timer_elapsed (follower->stalled, NULL) >= follower->timeout)
+    follower->ended = TRUE;
+  else
+    g_usleep (FOLLOW_POLL_INTERVAL * 1000);
+
+  return 0;
+}
+
+gboolean
+apng_follower_ended (ApngFollower *follower)
+{
+  return follower->ended;
+}
+
+void
+apng_follower_free (ApngFollower *follower)
+{
+  close (follower->fd);
+  g_timer_destroy (follower->stalled);
+  g_free (follower->filename);
+  g_free (follower);
+}
@@ -0,0 +1,51 @@
+/* GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ *   Animated Portable Network Graphics (APNG) plug-in
+ *
+ *   Reading a file that is still being written, or a pipe.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __APNG_FOLLOW_H__
+#define __APNG_FOLLOW_H__
+
+#include <glib.h>
+
+
+typedef struct _ApngFollower ApngFollower;
+
+
+/* Open @filename for following.  A regular file is taken as finished
+ * once it hasn't grown for @timeout seconds, a pipe once its writer
+ * closes it. */
+ApngFollower * apng_follower_open  (const gchar   *filename,
+                                    gdouble        timeout,
+                                    GError       **error);
+
+/* Read what has come in, at most @size bytes.  Returns 0 if nothing
+ * came in for a while, to let the caller update the display, or -1
+ * with @error set. */
+gssize         apng_follower_read  (ApngFollower  *follower,
+                                    guchar        *buf,
+                                    gsize          size,
+                                    GError       **error);
+
+/* TRUE once no more data is coming */
+gboolean       apng_follower_ended (ApngFollower  *follower);
+
+void           apng_follower_free  (ApngFollower  *follower);
+
+#endif /* __APNG_FOLLOW_H__ */
@@ -0,0 +1,157 @@
+/* GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ *   Animated Portable Network Graphics (APNG) plug-in
+ *
+ *   Reading the size, frames and timing of a file for indexers, which
+ *   don't want the pixels.  Only the chunk headers and the small chunks
+ *   are looked at: the CRCs of image data aren't checked, so the pages
+ *   of a mapped file that hold it are never touched.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "apng-chunk.h"
+#include "apng-info.h"
+#include "plugin-intl.h"
+
+
+/*
+ * 'apng_info_read ()' - Walk the chunks of a file.
+ */
+
+gboolean
+apng_info_read (const gchar  *filename,
+                ApngInfo     *info,
+                GError      **error)
+{
+  ApngChunkReader *reader;
+  ApngChunk        chunk;
+  GArray          *frames;
+  gboolean         have_header = FALSE;
+  gboolean         have_idat   = FALSE;
+  GError          *local_error = NULL;
+  gboolean         ok          = TRUE;
+  guint            i;
+
+  memset (info, 0, sizeof (ApngInfo));
+
+  reader = apng_chunk_reader_new (filename, error);
+
+  if (! reader)
+    return FALSE;
+
+  apng_chunk_reader_set_check_data (reader, FALSE);
+
+  frames = g_array_new (FALSE, FALSE, sizeof (ApngFrameControl));
+
+  while (ok && apng_chunk_reader_next (reader, &chunk, &local_error))
+    {
+      if (! have_header)
+        {
+          ok = have_header = (! strcmp (chunk.type, "IHDR") &&
+                              apng_parse_header (&chunk, &info->header));
+        }
+      else if (! strcmp (chunk.type, "acTL"))
+        {
+          ok = (chunk.length == APNG_acTL_SIZE);
+
+          if (ok)
+            {
+              info->animated  = TRUE;
+              info->num_plays = apng_get_uint32 (chunk.data + 4);
+            }
+        }
+      else if (! strcmp (chunk.type, "fcTL") && info->animated)
+        {
+          ApngFrameControl fc;
+
+          ok = apng_parse_frame_control (&chunk, &fc);
+
+          if (ok)
+            g_array_append_val (frames, fc);
+        }
+      else if (! strcmp (chunk.type, "IDAT") && ! have_idat)
+        {
+          /* Without an fcTL before it, the default image isn't a frame */
+          have_idat = TRUE;
+          info->first_frame_hidden = info->animated && frames->len == 0;
+        }
+    }
+
+  apng_chunk_reader_free (reader);
+
+  if (local_error || ! ok || ! have_idat)
+    {
+      g_array_free (frames, TRUE);
+
+      if (local_error)
+        {
+          g_propagate_error (error, local_error);
+        }
+      else
+        {
+          gchar *name = g_filename_display_name (filename);
+
+          g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                       _("Error while reading '%s'. File corrupted?"), name);
+          g_free (name);
+        }
+
+      return FALSE;
+    }
+
+  /* A still image, or an animation without frames, shows the default
+   * image */
+  if (frames->len == 0)
+    {
+      ApngFrameControl fc;
+
+      memset (&fc, 0, sizeof (fc));
+      fc.width  = info->header.width;
+      fc.height = info->header.height;
+
+      g_array_append_val (frames, fc);
+      info->first_frame_hidden = FALSE;
+    }
+
+  info->num_frames = frames->len;
+  info->frames     = (ApngFrameControl *) g_array_free (frames, FALSE);
+
+  for (i = 0; i < info->num_frames; i++)
+    info->duration += apng_frame_delay_ms (&info->frames[i]);
+
+  return TRUE;
+}
+
+void
+apng_info_clear (ApngInfo *info)
+{
+  g_free (info->frames);
+  info->frames     = NULL;
+  info->num_frames = 0;
+}
+
+gdouble
+apng_frame_delay_ms (const ApngFrameControl *fc)
+{
+  /* A denominator of 0 means 1/100 s */
+  return fc->delay_num * 1000.0 / (fc->delay_den ? fc->delay_den : 100);
+}
@@ -0,0 +1,54 @@
+/* GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ *   Animated Portable Network Graphics (APNG) plug-in
+ *
+ *   Reading what a file holds, without decoding it.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __APNG_INFO_H__
+#define __APNG_INFO_H__
+
+#include <glib.h>
+
+#include "apng-chunk.h"
+
+
+typedef struct
+{
+  ApngHeader         header;
+  gboolean           animated;          /* Has an acTL chunk */
+  guint32            num_plays;         /* 0 = forever */
+  gboolean           first_frame_hidden;  /* The default image isn't
+                                           * part of the animation */
+  ApngFrameControl  *frames;            /* Frames as they are played, a
+                                         * still image is one frame */
+  guint32            num_frames;
+  gdouble            duration;          /* Of one play, in ms */
+}
+ApngInfo;
+
+
+/* Walk the chunks of @filename, without reading image data */
+gboolean  apng_info_read        (const gchar             *filename,
+                                 ApngInfo                *info,
+                                 GError                 **error);
+void      apng_info_clear       (ApngInfo                *info);
+
+/* Delay of a frame in ms */
+gdouble   apng_frame_delay_ms   (const ApngFrameControl  *fc);
+
+#endif /* __APNG_INFO_H__ */
@@ -0,0 +1,271 @@
+/* GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ *   Animated Portable Network Graphics (APNG) plug-in
+ *
+ *   Checks the SIMD pixel kernels against the scalar ones and times
+ *   them.  Run by "make check"; exits with 1 if any output differs.
+ *
+ *   Usage: apng-kernels-bench [iterations]
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "apng-kernels.h"
+
+
+#define BENCH_WIDTH   4093      /* Odd, so the SIMD tails get exercised */
+#define BENCH_ROWS    8
+#define BENCH_FACTOR  3
+
+
+typedef enum
+{
+  KERNEL_NULLIFY,
+  KERNEL_REMAP,
+  KERNEL_STRIP,
+  KERNEL_REDUCE,
+  N_KERNELS
+} Kernel;
+
+static const gchar *kernel_names[N_KERNELS] =
+{
+  "nullify-transparent",
+  "remap-indexed-alpha",
+  "strip-alpha",
+  "reduce-rows"
+};
+
+static const gchar *simd_names[] = { "sse2", "avx2" };
+
+
+typedef struct
+{
+  guchar    *rgba;              /* BENCH_WIDTH RGBA pixels */
+  guchar    *indexed;           /* BENCH_WIDTH IA pixels */
+  guchar    *rows[BENCH_ROWS];  /* RGBA rows to reduce */
+  ApngRemap  remap;
+  guchar    *out;               /* Result of one run */
+  guint16   *sums;
+} BenchData;
+
+
+/*
+ * Local functions...
+ */
+
+static void     bench_data_init (BenchData *data);
+static void     bench_data_free (BenchData *data);
+static gsize    run_kernel      (BenchData *data,
+                                 Kernel     kernel);
+static gdouble  time_kernel     (BenchData *data,
+                                 Kernel     kernel,
+                                 gint       iterations);
+
+
+/*
+ * 'bench_data_init()' - Fill the inputs with repeatable random pixels.
+ */
+
+static void
+bench_data_init (BenchData *data)
+{
+  GRand  *rand = g_rand_new_with_seed (0x61706e67);
+  guchar  inverse[256];
+  gint    rotate;
+  gint    i, k;
+
+  data->rgba    = g_new (guchar, BENCH_WIDTH * 4);
+  data->indexed = g_new (guchar, BENCH_WIDTH * 2);
+  data->out     = g_new (guchar, BENCH_WIDTH * 4);
+  data->sums    = g_new (guint16, BENCH_WIDTH * 4);
+
+  for (k = 0; k < BENCH_ROWS; k++)
+    {
+      data->rows[k] = g_new (guchar, BENCH_WIDTH * 4);
+
+      for (i = 0; i < BENCH_WIDTH * 4; i++)
+        data->rows[k][i] = g_rand_int_range (rand, 0, 256);
+    }
+
+  /* Plenty of fully transparent and half-transparent pixels */
+  for (i = 0; i < BENCH_WIDTH * 4; i++)
+    data->rgba[i] = g_rand_int_range (rand, 0, 256);
+
+  for (i = 0; i < BENCH_WIDTH; i++)
+    if (g_rand_boolean (rand))
+      data->rgba[i * 4 + 3] = 0;
+
+  for (i = 0; i < BENCH_WIDTH * 2; i++)
+    data->indexed[i] = g_rand_int_range (rand, 0, 256);
+
+  /* The shape respin_cmap() produces, so the SIMD path is taken */
+  rotate = g_rand_int_range (rand, 1, 256);
+
+  for (i = 0; i < 256; i++)
+    inverse[i] = (i < rotate) ? i + 1 : (i == rotate) ? 0 : i;
+
+  apng_remap_init (&data->remap, inverse);
+  g_assert (data->remap.rotate == rotate);
+
+  g_rand_free (rand);
+}
+
+static void
+bench_data_free (BenchData *data)
+{
+  gint k;
+
+  for (k = 0; k < BENCH_ROWS; k++)
+    g_free (data->rows[k]);
+
+  g_free (data->rgba);
+  g_free (data->indexed);
+  g_free (data->out);
+  g_free (data->sums);
+}
+
+/*
+ * 'run_kernel()' - Run one kernel with the current set into data->out.
+ *
+ * Returns the number of bytes of output.
+ */
+
+static gsize
+run_kernel (BenchData *data,
+            Kernel     kernel)
+{
+  switch (kernel)
+    {
+    case KERNEL_NULLIFY:
+      memcpy (data->out, data->rgba, BENCH_WIDTH * 4);
+      apng_nullify_transparent (data->out, BENCH_WIDTH, 0x12, 0x34, 0x56);
+      return BENCH_WIDTH * 4;
+
+    case KERNEL_REMAP:
+      apng_remap_indexed_alpha (data->out, data->indexed, BENCH_WIDTH,
+                                &data->remap);
+      return BENCH_WIDTH;
+
+    case KERNEL_STRIP:
+      apng_strip_alpha (data->out, data->indexed, BENCH_WIDTH);
+      return BENCH_WIDTH;
+
+    case KERNEL_REDUCE:
+      apng_reduce_rows (data->out, data->rows, BENCH_ROWS, BENCH_WIDTH, 4,
+                        BENCH_FACTOR, data->sums);
+      return ((BENCH_WIDTH + BENCH_FACTOR - 1) / BENCH_FACTOR) * 4;
+
+    default:
+      g_assert_not_reached ();
+    }
+
+  return 0;
+}
+
+/*
+ * 'time_kernel()' - Microseconds per row for the current set.
+ */
+
+static gdouble
+time_kernel (BenchData *data,
+             Kernel     kernel,
+             gint       iterations)
+{
+  GTimer *timer = g_timer_new ();
+  gdouble seconds;
+  gint    i;
+
+  for (i = 0; i < iterations; i++)
+    run_kernel (data, kernel);
+
+  seconds = g_timer_elapsed (timer, NULL);
+  g_timer_destroy (timer);
+
+  return seconds * 1e6 / iterations;
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  BenchData data;
+  guchar   *expected[N_KERNELS];
+  gsize     length[N_KERNELS];
+  gdouble   scalar_time[N_KERNELS];
+  gint      iterations = 2000;
+  gint      failures   = 0;
+  guint     s;
+  gint      k;
+
+  if (argc > 1)
+    iterations = MAX (atoi (argv[1]), 1);
+
+  bench_data_init (&data);
+
+  apng_kernels_select ("scalar");
+
+  for (k = 0; k < N_KERNELS; k++)
+    {
+      length[k]      = run_kernel (&data, k);
+      expected[k]    = g_memdup (data.out, length[k]);
+      scalar_time[k] = time_kernel (&data, k, iterations);
+
+      g_print ("%-8s %-20s %8.2f us/row\n",
+               "scalar", kernel_names[k], scalar_time[k]);
+    }
+
+  for (s = 0; s < G_N_ELEMENTS (simd_names); s++)
+    {
+      if (! apng_kernels_select (simd_names[s]))
+        {
+          g_print ("%-8s not available, skipped\n", simd_names[s]);
+          continue;
+        }
+
+      for (k = 0; k < N_KERNELS; k++)
+        {
+          gdouble  t;
+          gboolean same;
+
+          memset (data.out, 0, BENCH_WIDTH * 4);
+          run_kernel (&data, k);
+          same = ! memcmp (data.out, expected[k], length[k]);
+
+          t = time_kernel (&data, k, iterations);
+
+          g_print ("%-8s %-20s %8.2f us/row  %5.2fx  %s\n",
+                   simd_names[s], kernel_names[k], t,
+                   t > 0.0 ? scalar_time[k] / t : 0.0,
+                   same ? "ok" : "MISMATCH");
+
+          if (! same)
+            failures++;
+        }
+    }
+
+  for (k = 0; k < N_KERNELS; k++)
+    g_free (expected[k]);
+
+  bench_data_free (&data);
+
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,578 @@
+/* GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ *   Animated Portable Network Graphics (APNG) plug-in
+ *
+ *   Pixel kernels used while loading and saving.  Each kernel has a
+ *   scalar version and, on x86, SSE2 and AVX2 versions which are picked
+ *   at run time by apng_kernels_init().
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "apng-kernels.h"
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__)) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define USE_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+
+typedef void (* NullifyFunc) (guchar *, gint, guchar, guchar, guchar);
+typedef void (* RemapFunc)   (guchar *, const guchar *, gint, gint);
+typedef void (* StripFunc)   (guchar *, const guchar *, gint);
+typedef void (* SumFunc)     (guint16 *, const guchar *, gint);
+
+static NullifyFunc  nullify_func = NULL;
+static RemapFunc    remap_func   = NULL;
+static StripFunc    strip_func   = NULL;
+static SumFunc      sum_func     = NULL;
+static const gchar *kernels_name = "scalar";
+
+
+/*
+ * Scalar kernels, also used for the tail of each SIMD row.
+ */
+
+static void
+nullify_scalar (guchar *rgba,
+                gint    n_pixels,
+                guchar  red,
+                guchar  green,
+                guchar  blue)
+{
+  gint k;
+
+  for (k = 0; k < n_pixels; k++, rgba += 4)
+    {
+      if (! rgba[3])
+        {
+          rgba[0] = red;
+          rgba[1] = green;
+          rgba[2] = blue;
+        }
+    }
+}
+
+static void
+remap_rotate_scalar (guchar       *dst,
+                     const guchar *src,
+                     gint          n_pixels,
+                     gint          rotate)
+{
+  gint k;
+
+  for (k = 0; k < n_pixels; k++)
+    {
+      gint index = src[k * 2];
+
+      if (src[k * 2 + 1] <= 127)
+        dst[k] = 0;
+      else if (index < rotate)
+        dst[k] = index + 1;
+      else if (index == rotate)
+        dst[k] = 0;
+      else
+        dst[k] = index;
+    }
+}
+
+static void
+strip_scalar (guchar       *dst,
+              const guchar *src,
+              gint          n_pixels)
+{
+  gint k;
+
+  for (k = 0; k < n_pixels; k++)
+    dst[k] = src[k * 2];
+}
+
+static void
+sum_scalar (guint16      *sums,
+            const guchar *src,
+            gint          n_bytes)
+{
+  gint k;
+
+  for (k = 0; k < n_bytes; k++)
+    sums[k] += src[k];
+}
+
+
+#if defined(USE_X86_KERNELS)
+
+/*
+ * SSE2 kernels, 4 RGBA or 16 IA pixels at a time.
+ */
+
+__attribute__ ((target ("sse2")))
+static void
+nullify_sse2 (guchar *rgba,
+              gint    n_pixels,
+              guchar  red,
+              guchar  green,
+              guchar  blue)
+{
+  const __m128i alpha = _mm_set1_epi32 ((gint) 0xff000000);
+  const __m128i fill  = _mm_set1_epi32 (red | (green << 8) | (blue << 16));
+  const __m128i zero  = _mm_setzero_si128 ();
+  gint          k;
+
+  for (k = 0; k + 4 <= n_pixels; k += 4, rgba += 16)
+    {
+      __m128i v    = _mm_loadu_si128 ((const __m128i *) rgba);
+      __m128i mask = _mm_cmpeq_epi32 (_mm_and_si128 (v, alpha), zero);
+
+      v = _mm_or_si128 (_mm_andnot_si128 (mask, v),
+                        _mm_and_si128 (mask, fill));
+      _mm_storeu_si128 ((__m128i *) rgba, v);
+    }
+
+  nullify_scalar (rgba, n_pixels - k, red, green, blue);
+}
+
+__attribute__ ((target ("sse2")))
+static void
+remap_rotate_sse2 (guchar       *dst,
+                   const guchar *src,
+                   gint          n_pixels,
+                   gint          rotate)
+{
+  const __m128i low    = _mm_set1_epi16 (0x00ff);
+  const __m128i one    = _mm_set1_epi16 (1);
+  const __m128i half   = _mm_set1_epi16 (127);
+  const __m128i target = _mm_set1_epi16 (rotate);
+  gint          k;
+
+  /* Stores never get ahead of loads, so this works in place */
+  for (k = 0; k + 16 <= n_pixels; k += 16)
+    {
+      __m128i a = _mm_loadu_si128 ((const __m128i *) (src + k * 2));
+      __m128i b = _mm_loadu_si128 ((const __m128i *) (src + k * 2 + 16));
+      __m128i ia = _mm_and_si128 (a, low);
+      __m128i ib = _mm_and_si128 (b, low);
+      __m128i oa = _mm_cmpgt_epi16 (_mm_srli_epi16 (a, 8), half);
+      __m128i ob = _mm_cmpgt_epi16 (_mm_srli_epi16 (b, 8), half);
+
+      /* index < rotate -> index + 1, index == rotate -> 0 */
+      ia = _mm_add_epi16 (ia, _mm_and_si128 (_mm_cmplt_epi16 (ia, target),
+                                             one));
+      ib = _mm_add_epi16 (ib, _mm_and_si128 (_mm_cmplt_epi16 (ib, target),
+                                             one));
+      oa = _mm_andnot_si128 (_mm_cmpeq_epi16 (_mm_and_si128 (a, low), target),
+                             oa);
+      ob = _mm_andnot_si128 (_mm_cmpeq_epi16 (_mm_and_si128 (b, low), target),
+                             ob);
+
+      _mm_storeu_si128 ((__m128i *) (dst + k),
+                        _mm_packus_epi16 (_mm_and_si128 (ia, oa),
+                                          _mm_and_si128 (ib, ob)));
+    }
+
+  remap_rotate_scalar (dst + k, src + k * 2, n_pixels - k, rotate);
+}
+
+__attribute__ ((target ("sse2")))
+static void
+strip_sse2 (guchar       *dst,
+            const guchar *src,
+            gint          n_pixels)
+{
+  const __m128i low = _mm_set1_epi16 (0x00ff);
+  gint          k;
+
+  for (k = 0; k + 16 <= n_pixels; k += 16)
+    {
+      __m128i a = _mm_loadu_si128 ((const __m128i *) (src + k * 2));
+      __m128i b = _mm_loadu_si128 ((const __m128i *) (src + k * 2 + 16));
+
+      _mm_storeu_si128 ((__m128i *) (dst + k),
+                        _mm_packus_epi16 (_mm_and_si128 (a, low),
+                                          _mm_and_si128 (b, low)));
+    }
+
+  strip_scalar (dst + k, src + k * 2, n_pixels - k);
+}
+
+__attribute__ ((target ("sse2")))
+static void
+sum_sse2 (guint16      *sums,
+          const guchar *src,
+          gint          n_bytes)
+{
+  const __m128i zero = _mm_setzero_si128 ();
+  gint          k;
+
+  for (k = 0; k + 16 <= n_bytes; k += 16)
+    {
+      __m128i v  = _mm_loadu_si128 ((const __m128i *) (src + k));
+      __m128i lo = _mm_loadu_si128 ((const __m128i *) (sums + k));
+      __m128i hi = _mm_loadu_si128 ((const __m128i *) (sums + k + 8));
+
+      lo = _mm_add_epi16 (lo, _mm_unpacklo_epi8 (v, zero));
+      hi = _mm_add_epi16 (hi, _mm_unpackhi_epi8 (v, zero));
+      _mm_storeu_si128 ((__m128i *) (sums + k), lo);
+      _mm_storeu_si128 ((__m128i *) (sums + k + 8), hi);
+    }
+
+  sum_scalar (sums + k, src + k, n_bytes - k);
+}
+
+
+/*
+ * AVX2 kernels, 8 RGBA or 32 IA pixels at a time.  _mm256_packus_epi16()
+ * packs within 128 bit lanes, so its result is put back in order with a
+ * 64 bit permute.
+ */
+
+__attribute__ ((target ("avx2")))
+static void
+nullify_avx2 (guchar *rgba,
+              gint    n_pixels,
+              guchar  red,
+              guchar  green,
+              guchar  blue)
+{
+  const __m256i alpha = _mm256_set1_epi32 ((gint) 0xff000000);
+  const __m256i fill  = _mm256_set1_epi32 (red | (green << 8) | (blue << 16));
+  const __m256i zero  = _mm256_setzero_si256 ();
+  gint          k;
+
+  for (k = 0; k + 8 <= n_pixels; k += 8, rgba += 32)
+    {
+      __m256i v    = _mm256_loadu_si256 ((const __m256i *) rgba);
+      __m256i mask = _mm256_cmpeq_epi32 (_mm256_and_si256 (v, alpha), zero);
+
+      _mm256_storeu_si256 ((__m256i *) rgba,
+                           _mm256_blendv_epi8 (v, fill, mask));
+    }
+
+  nullify_scalar (rgba, n_pixels - k, red, green, blue);
+}
+
+__attribute__ ((target ("avx2")))
+static void
+remap_rotate_avx2 (guchar       *dst,
+                   const guchar *src,
+                   gint          n_pixels,
+                   gint          rotate)
+{
+  const __m256i low    = _mm256_set1_epi16 (0x00ff);
+  const __m256i half   = _mm256_set1_epi16 (127);
+  const __m256i target = _mm256_set1_epi16 (rotate);
+  gint          k;
+
+  for (k = 0; k + 32 <= n_pixels; k += 32)
+    {
+      __m256i a  = _mm256_loadu_si256 ((const __m256i *) (src + k * 2));
+      __m256i b  = _mm256_loadu_si256 ((const __m256i *) (src + k * 2 + 32));
+      __m256i ia = _mm256_and_si256 (a, low);
+      __m256i ib = _mm256_and_si256 (b, low);
+      __m256i oa = _mm256_cmpgt_epi16 (_mm256_srli_epi16 (a, 8), half);
+      __m256i ob = _mm256_cmpgt_epi16 (_mm256_srli_epi16 (b, 8), half);
+
+      /* index < rotate -> index + 1 (subtracting the all-ones mask),
+       * index == rotate -> 0 */
+      oa = _mm256_andnot_si256 (_mm256_cmpeq_epi16 (ia, target), oa);
+      ob = _mm256_andnot_si256 (_mm256_cmpeq_epi16 (ib, target), ob);
+      ia = _mm256_sub_epi16 (ia, _mm256_cmpgt_epi16 (target, ia));
+      ib = _mm256_sub_epi16 (ib, _mm256_cmpgt_epi16 (target, ib));
+
+      a = _mm256_packus_epi16 (_mm256_and_si256 (ia, oa),
+                               _mm256_and_si256 (ib, ob));
+      _mm256_storeu_si256 ((__m256i *) (dst + k),
+                           _mm256_permute4x64_epi64 (a, 0xd8));
+    }
+
+  remap_rotate_scalar (dst + k, src + k * 2, n_pixels - k, rotate);
+}
+
+__attribute__ ((target ("avx2")))
+static void
+strip_avx2 (guchar       *dst,
+            const guchar *src,
+            gint          n_pixels)
+{
+  const __m256i low = _mm256_set1_epi16 (0x00ff);
+  gint          k;
+
+  for (k = 0; k + 32 <= n_pixels; k += 32)
+    {
+      __m256i a = _mm256_loadu_si256 ((const __m256i *) (src + k * 2));
+      __m256i b = _mm256_loadu_si256 ((const __m256i *) (src + k * 2 + 32));
+
+      a = _mm256_packus_epi16 (_mm256_and_si256 (a, low),
+                               _mm256_and_si256 (b, low));
+      _mm256_storeu_si256 ((__m256i *) (dst + k),
+                           _mm256_permute4x64_epi64 (a, 0xd8));
+    }
+
+  strip_scalar (dst + k, src + k * 2, n_pixels - k);
+}
+
+__attribute__ ((target ("avx2")))
+static void
+sum_avx2 (guint16      *sums,
+          const guchar *src,
+          gint          n_bytes)
+{
+  gint k;
+
+  for (k = 0; k + 32 <= n_bytes; k += 32)
+    {
+      __m256i lo = _mm256_loadu_si256 ((const __m256i *) (sums + k));
+      __m256i hi = _mm256_loadu_si256 ((const __m256i *) (sums + k + 16));
+
+      lo = _mm256_add_epi16 (lo, _mm256_cvtepu8_epi16 (
+             _mm_loadu_si128 ((const __m128i *) (src + k))));
+      hi = _mm256_add_epi16 (hi, _mm256_cvtepu8_epi16 (
+             _mm_loadu_si128 ((const __m128i *) (src + k + 16))));
+      _mm256_storeu_si256 ((__m256i *) (sums + k), lo);
+      _mm256_storeu_si256 ((__m256i *) (sums + k + 16), hi);
+    }
+
+  sum_scalar (sums + k, src + k, n_bytes - k);
+}
+
+#endif /* USE_X86_KERNELS */
+
+
+/*
+ * 'apng_kernels_select()' - Use one set of kernels, if this CPU has it.
+ */
+
+gboolean
+apng_kernels_select (const gchar *name)
+{
+  if (! strcmp (name, "scalar"))
+    {
+      nullify_func = nullify_scalar;
+      remap_func   = remap_rotate_scalar;
+      strip_func   = strip_scalar;
+      sum_func     = sum_scalar;
+      kernels_name = "scalar";
+    }
+#if defined(USE_X86_KERNELS)
+  else if (! strcmp (name, "avx2"))
+    {
+      __builtin_cpu_init ();
+
+      if (! __builtin_cpu_supports ("avx2"))
+        return FALSE;
+
+      nullify_func = nullify_avx2;
+      remap_func   = remap_rotate_avx2;
+      strip_func   = strip_avx2;
+      sum_func     = sum_avx2;
+      kernels_name = "avx2";
+    }
+  else if (! strcmp (name, "sse2"))
+    {
+      __builtin_cpu_init ();
+
+      if (! __builtin_cpu_supports ("sse2"))
+        return FALSE;
+
+      nullify_func = nullify_sse2;
+      remap_func   = remap_rotate_sse2;
+      strip_func   = strip_sse2;
+      sum_func     = sum_sse2;
+      kernels_name = "sse2";
+    }
+#endif
+  else
+    return FALSE;
+
+  return TRUE;
+}
+
+/*
+ * 'apng_kernels_init()' - Pick the best kernels for this CPU.
+ */
+
+void
+apng_kernels_init (void)
+{
+  if (nullify_func)
+    return;
+
+  if (! apng_kernels_select ("avx2") &&
+      ! apng_kernels_select ("sse2"))
+    apng_kernels_select ("scalar");
+}
+
+const gchar *
+apng_kernels_name (void)
+{
+  return kernels_name;
+}
+
+/*
+ * 'apng_remap_init()' - Build the INDEXEDA re-mapping for a save.
+ */
+
+void
+apng_remap_init (ApngRemap    *remap,
+                 const guchar *inverse)
+{
+  gint i;
+
+  memcpy (remap->table, inverse, sizeof (remap->table));
+
+  /* Find the index that moved to 0, then check the rest of the shape */
+  for (i = 0; i < 256; i++)
+    if (remap->table[i] == 0)
+      break;
+
+  remap->rotate = i;
+
+  for (i = 0; i < 256 && remap->rotate >= 0; i++)
+    {
+      gint expected;
+
+      if (i < remap->rotate)
+        expected = i + 1;
+      else if (i == remap->rotate)
+        expected = 0;
+      else
+        expected = i;
+
+      if (remap->table[i] != expected)
+        remap->rotate = -1;
+    }
+}
+
+void
+apng_nullify_transparent (guchar *rgba,
+                          gint    n_pixels,
+                          guchar  red,
+                          guchar  green,
+                          guchar  blue)
+{
+  nullify_func (rgba, n_pixels, red, green, blue);
+}
+
+void
+apng_remap_indexed_alpha (guchar          *dst,
+                          const guchar    *src,
+                          gint             n_pixels,
+                          const ApngRemap *remap)
+{
+  gint k;
+
+  if (remap->rotate >= 0)
+    {
+      remap_func (dst, src, n_pixels, remap->rotate);
+      return;
+    }
+
+  for (k = 0; k < n_pixels; k++)
+    dst[k] = (src[k * 2 + 1] > 127) ? remap->table[src[k * 2]] : 0;
+}
+
+void
+apng_strip_alpha (guchar       *dst,
+                  const guchar *src,
+                  gint          n_pixels)
+{
+  strip_func (dst, src, n_pixels);
+}
+
+/*
+ * 'apng_reduce_rows()' - Box-filter rows to a fraction of their size.
+ *
+ * The rows are summed column by column first, which is where the time
+ * goes, then each group of "factor" columns of the sums is averaged.
+ * Columns and rows past the edge don't count towards the average.
+ */
+
+void
+apng_reduce_rows (guchar         *dst,
+                  guchar * const *rows,
+                  gint            num_rows,
+                  gint            width,
+                  gint            channels,
+                  gint            factor,
+                  guint16        *sums)
+{
+  gint n_bytes = width * channels;
+  gint x, c, k;
+
+  memset (sums, 0, n_bytes * sizeof (guint16));
+
+  for (k = 0; k < num_rows; k++)
+    sum_func (sums, rows[k], n_bytes);
+
+  for (x = 0; x < width; x += factor)
+    {
+      gint  cols  = MIN (factor, width - x);
+      guint count = cols * num_rows;
+
+      for (c = 0; c < channels; c++)
+        {
+          const guint16 *s     = sums + x * channels + c;
+          guint          total = 0;
+
+          for (k = 0; k < cols; k++, s += channels)
+            total += *s;
+
+          *dst++ = (total + count / 2) / count;
+        }
+    }
+}
+
+gint
+apng_scan_indexed_alpha (const guchar *src,
+                         gint          n_pixels,
+                         gint          bpp,
+                         guchar       *used,
+                         gboolean     *transparent)
+{
+  gint marked = 0;
+  gint k;
+
+  if (bpp == 1)
+    {
+      for (k = 0; k < n_pixels; k++)
+        {
+          marked += ! used[src[k]];
+          used[src[k]] = TRUE;
+        }
+
+      return marked;
+    }
+
+  for (k = 0; k < n_pixels; k++, src += 2)
+    {
+      if (src[1] > 127)
+        {
+          marked += ! used[src[0]];
+          used[src[0]] = TRUE;
+        }
+      else
+        {
+          *transparent = TRUE;
+        }
+    }
+
+  return marked;
+}
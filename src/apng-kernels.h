@@ -0,0 +1,91 @@
+/* GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ *   Animated Portable Network Graphics (APNG) plug-in
+ *
+ *   Pixel kernels used while loading and saving.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __APNG_KERNELS_H__
+#define __APNG_KERNELS_H__
+
+#include <glib.h>
+
+
+/*
+ * Palette re-mapping applied to INDEXEDA pixels, built once per save.
+ */
+
+typedef struct
+{
+  guchar  table[256];           /* GIMP index -> PNG index */
+  gint    rotate;               /* Index moved to 0 with the indices below
+                                 * it shifted up by one (the order that
+                                 * respin_cmap() produces), or -1 if the
+                                 * table has some other shape */
+}
+ApngRemap;
+
+
+void          apng_kernels_init         (void);
+/* Use the "scalar", "sse2" or "avx2" kernels.  Returns FALSE if this
+ * build or CPU doesn't have them. */
+gboolean      apng_kernels_select       (const gchar     *name);
+const gchar * apng_kernels_name         (void);
+
+void          apng_remap_init           (ApngRemap       *remap,
+                                         const guchar    *inverse);
+
+/* Replace the color of fully transparent RGBA pixels */
+void          apng_nullify_transparent  (guchar          *rgba,
+                                         gint             n_pixels,
+                                         guchar           red,
+                                         guchar           green,
+                                         guchar           blue);
+
+/* INDEXEDA -> INDEXED through @remap, alpha <= 127 maps to index 0.
+ * @dst may be equal to @src. */
+void          apng_remap_indexed_alpha  (guchar          *dst,
+                                         const guchar    *src,
+                                         gint             n_pixels,
+                                         const ApngRemap *remap);
+
+/* IA -> I, dropping the alpha byte.  @dst may be equal to @src. */
+void          apng_strip_alpha          (guchar          *dst,
+                                         const guchar    *src,
+                                         gint             n_pixels);
+
+/* Mark the indices of opaque I or IA pixels in @used, and set
+ * @transparent if any IA pixel has alpha <= 127.  Returns the number
+ * of indices that were newly marked. */
+gint          apng_scan_indexed_alpha   (const guchar    *src,
+                                         gint             n_pixels,
+                                         gint             bpp,
+                                         guchar          *used,
+                                         gboolean        *transparent);
+
+/* Average @num_rows rows of @width pixels of @channels bytes over
+ * blocks of @factor columns, into ceil (@width / @factor) pixels.
+ * @num_rows is at most 8, and @sums has room for @width * @channels. */
+void          apng_reduce_rows          (guchar          *dst,
+                                         guchar * const  *rows,
+                                         gint             num_rows,
+                                         gint             width,
+                                         gint             channels,
+                                         gint             factor,
+                                         guint16         *sums);
+
+#endif /* __APNG_KERNELS_H__ */
@@ -0,0 +1,706 @@
+/* GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ *   Animated Portable Network Graphics (APNG) plug-in
+ *
+ *   Buffered output written by a background thread.  The encoder fills
+ *   one large buffer while the other is being written, so deflate never
+ *   waits on the disk unless the disk is the slower of the two.  Files
+ *   are written next to their target and renamed over it once they are
+ *   complete, so a failed save never leaves a truncated file behind.
+ *   Appending overwrites the end of a file in place and puts it back if
+ *   anything goes wrong.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE             /* for fallocate() */
+#endif
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#ifdef G_OS_WIN32
+#include <io.h>
+#endif
+
+#include "apng-output.h"
+#include "plugin-intl.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define OUTPUT_BUFFER_SIZE  (4 << 20)   /* Bytes per buffer */
+#define OUTPUT_POOL_SIZE    4           /* Spare buffers kept */
+
+
+typedef struct
+{
+  guchar   *data;
+  gsize     length;
+}
+OutputBuffer;
+
+typedef struct
+{
+  guint64   offset;
+  guchar   *data;
+  gsize     length;
+}
+OutputPatch;
+
+struct _ApngOutput
+{
+  gchar        *filename;       /* Target file */
+  gchar        *tmpname;        /* Renamed over the target, or NULL */
+  gint          fd;             /* File being written */
+  GByteArray   *array;          /* Memory being written, or NULL */
+  guint64       start;          /* File offset the output starts at */
+  GByteArray   *tail;           /* What was there, for in-place output */
+  GSList       *patches;        /* Written after the rest is on disk */
+  guint64       written;        /* Bytes handed to the writer */
+  guint64       reserved;       /* Bytes preallocated */
+
+  OutputBuffer  buffers[2];
+  OutputBuffer *current;        /* Buffer being filled */
+  gint          nbuffers;       /* Buffers allocated so far */
+
+  GThread      *thread;         /* Writer, started when a buffer fills */
+  gboolean      unthreaded;     /* Write from the calling thread */
+  GAsyncQueue  *full;           /* Buffers for the writer */
+  GAsyncQueue  *empty;          /* Buffers the writer is done with */
+  gint          errsv;          /* errno of the first failed write */
+};
+
+static OutputBuffer buffer_end; /* Stops the writer */
+
+/* Buffers of finished outputs, so a process that saves many files
+ * doesn't get fresh pages from the system for each of them */
+static GSList      *buffer_pool      = NULL;
+static guint        buffer_pool_size = 0;
+G_LOCK_DEFINE_STATIC (buffer_pool);
+
+
+static guchar *
+buffer_alloc (void)
+{
+  guchar *data = NULL;
+
+  G_LOCK (buffer_pool);
+
+  if (buffer_pool)
+    {
+      data        = buffer_pool->data;
+      buffer_pool = g_slist_delete_link (buffer_pool, buffer_pool);
+      buffer_pool_size--;
+    }
+
+  G_UNLOCK (buffer_pool);
+
+  return data ? data : g_new (guchar, OUTPUT_BUFFER_SIZE);
+}
+
+static void
+buffer_release (guchar *data)
+{
+  G_LOCK (buffer_pool);
+
+  if (buffer_pool_size < OUTPUT_POOL_SIZE)
+    {
+      buffer_pool = g_slist_prepend (buffer_pool, data);
+      buffer_pool_size++;
+      data = NULL;
+    }
+
+  G_UNLOCK (buffer_pool);
+
+  g_free (data);
+}
+
+
+static gboolean
+write_all (gint          fd,
+           const guchar *data,
+           gsize         length,
+           gint         *errsv)
+{
+  while (length > 0)
+    {
+      gssize n = write (fd, data, length);
+
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+
+          *errsv = errno;
+          return FALSE;
+        }
+
+      data   += n;
+      length -= n;
+    }
+
+  return TRUE;
+}
+
+static gpointer
+output_writer (gpointer data)
+{
+  ApngOutput   *output = data;
+  OutputBuffer *buffer;
+
+  while ((buffer = g_async_queue_pop (output->full)) != &buffer_end)
+    {
+      if (! output->errsv)
+        write_all (output->fd, buffer->data, buffer->length, &output->errsv);
+
+      buffer->length = 0;
+      g_async_queue_push (output->empty, buffer);
+    }
+
+  return NULL;
+}
+
+/*
+ * Hand the current buffer to the writer and, unless it is the "last",
+ * get an empty one back.  The first full buffer starts the writer, so
+ * small files are written in one go; if there are no threads buffers
+ * are written right away.
+ */
+
+static gboolean
+output_submit (ApngOutput *output,
+               gboolean    last)
+{
+  OutputBuffer *buffer = output->current;
+
+  if (buffer->length == 0)
+    return ! output->errsv;
+
+  output->written += buffer->length;
+
+  if (! output->thread && ! output->unthreaded && ! last &&
+      g_thread_supported ())
+    {
+      output->full  = g_async_queue_new ();
+      output->empty = g_async_queue_new ();
+
+#if GLIB_CHECK_VERSION (2, 32, 0)
+      output->thread = g_thread_try_new ("file-apng output", output_writer,
+                                         output, NULL);
+#else
+      output->thread = g_thread_create (output_writer, output, TRUE, NULL);
+#endif
+    }
+
+  if (! output->thread)
+    {
+      if (! output->errsv)
+        write_all (output->fd, buffer->data, buffer->length, &output->errsv);
+
+      buffer->length = 0;
+
+      return ! output->errsv;
+    }
+
+  g_async_queue_push (output->full, buffer);
+
+  if (last)
+    {
+      output->current = NULL;
+    }
+  else if (output->nbuffers < 2)
+    {
+      output->current = &output->buffers[output->nbuffers++];
+      output->current->data   = buffer_alloc ();
+      output->current->length = 0;
+    }
+  else
+    {
+      output->current = g_async_queue_pop (output->empty);
+    }
+
+  return ! output->errsv;
+}
+
+static void
+output_stop (ApngOutput *output)
+{
+  if (output->thread)
+    {
+      g_async_queue_push (output->full, &buffer_end);
+      g_thread_join (output->thread);
+      output->thread = NULL;
+    }
+}
+
+static gboolean
+seek_to (gint     fd,
+         guint64  offset,
+         gint    *errsv)
+{
+  if (lseek (fd, offset, SEEK_SET) == (off_t) -1)
+    {
+      *errsv = errno;
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/*
+ * Put back the end of a file that was overwritten in place.
+ */
+
+static void
+output_restore (ApngOutput *output)
+{
+  gint errsv = 0;
+
+  if (seek_to (output->fd, output->start, &errsv))
+    write_all (output->fd, output->tail->data, output->tail->len, &errsv);
+
+#ifdef HAVE_UNISTD_H
+  if (! errsv)
+    errsv = ftruncate (output->fd, output->start + output->tail->len);
+#endif
+}
+
+static void
+output_free (ApngOutput *output)
+{
+  GSList *list;
+  gint    i;
+
+  if (output->full)
+    g_async_queue_unref (output->full);
+  if (output->empty)
+    g_async_queue_unref (output->empty);
+
+  for (i = 0; i < output->nbuffers; i++)
+    buffer_release (output->buffers[i].data);
+
+  for (list = output->patches; list; list = list->next)
+    {
+      OutputPatch *patch = list->data;
+
+      g_free (patch->data);
+      g_free (patch);
+    }
+
+  g_slist_free (output->patches);
+
+  if (output->tail)
+    g_byte_array_free (output->tail, TRUE);
+
+  g_free (output->filename);
+  g_free (output->tmpname);
+  g_free (output);
+}
+
+/*
+ * 'apng_output_open ()' - Start writing a file.
+ */
+
+ApngOutput *
+apng_output_open (const gchar  *filename,
+                  GError      **error)
+{
+  ApngOutput *output;
+  struct stat st;
+  gboolean    exists;
+  gint        fd = -1;
+  gchar      *tmpname = NULL;
+
+  exists = (g_lstat (filename, &st) == 0);
+
+  if (! exists || S_ISREG (st.st_mode))
+    {
+      gchar *dirname  = g_path_get_dirname (filename);
+      gchar *basename = g_path_get_basename (filename);
+      gchar *template = g_strdup_printf (".%s.XXXXXX", basename);
+
+      tmpname = g_build_filename (dirname, template, NULL);
+
+      g_free (dirname);
+      g_free (basename);
+      g_free (template);
+
+      /* A new file gets 0666 less the umask, as if it was created
+       * directly; asking for the umask would race with other threads */
+      fd = g_mkstemp_full (tmpname, O_RDWR | O_BINARY, 0666);
+
+      if (fd >= 0)
+        {
+#ifndef G_OS_WIN32
+          if (exists)
+            fchmod (fd, st.st_mode & 0777);
+#endif
+        }
+      else
+        {
+          /* A directory we can't create files in, write in place */
+          g_free (tmpname);
+          tmpname = NULL;
+        }
+    }
+
+  if (fd < 0)
+    fd = g_open (filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+
+  if (fd < 0)
+    {
+      gint   errsv = errno;
+      gchar *name  = g_filename_display_name (filename);
+
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errsv),
+                   _("Could not open '%s' for writing: %s"),
+                   name, g_strerror (errsv));
+      g_free (name);
+      g_free (tmpname);
+
+      return NULL;
+    }
+
+  output = g_new0 (ApngOutput, 1);
+
+  output->filename = g_strdup (filename);
+  output->tmpname  = tmpname;
+  output->fd       = fd;
+
+  output->current  = &output->buffers[output->nbuffers++];
+  output->current->data = buffer_alloc ();
+
+  return output;
+}
+
+/*
+ * 'apng_output_open_at ()' - Start overwriting the end of a file.
+ *
+ * This is for appending to files that end in a chunk that has to stay
+ * last, so the bytes from "offset" on are kept and put back if the
+ * output is aborted.
+ */
+
+ApngOutput *
+apng_output_open_at (const gchar  *filename,
+                     guint64       offset,
+                     GError      **error)
+{
+  ApngOutput *output;
+  GByteArray *tail;
+  guchar      buf[4096];
+  gssize      n;
+  gint        fd;
+  gint        errsv = 0;
+
+  fd = g_open (filename, O_RDWR | O_BINARY, 0);
+
+  if (fd < 0)
+    {
+      errsv = errno;
+      goto fail;
+    }
+
+  tail = g_byte_array_new ();
+
+  if (seek_to (fd, offset, &errsv))
+    {
+      while ((n = read (fd, buf, sizeof (buf))) != 0)
+        {
+          if (n < 0)
+            {
+              if (errno == EINTR)
+                continue;
+
+              errsv = errno;
+              break;
+            }
+
+          g_byte_array_append (tail, buf, n);
+        }
+    }
+
+  if (! errsv)
+    seek_to (fd, offset, &errsv);
+
+  if (errsv)
+    {
+      g_byte_array_free (tail, TRUE);
+      close (fd);
+      goto fail;
+    }
+
+  output = g_new0 (ApngOutput, 1);
+
+  output->filename = g_strdup (filename);
+  output->fd       = fd;
+  output->start    = offset;
+  output->tail     = tail;
+
+  output->current  = &output->buffers[output->nbuffers++];
+  output->current->data = buffer_alloc ();
+
+  return output;
+
+ fail:
+  {
+    gchar *name = g_filename_display_name (filename);
+
+    g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errsv),
+                 _("Could not open '%s' for writing: %s"),
+                 name, g_strerror (errsv));
+    g_free (name);
+  }
+
+  return NULL;
+}
+
+/*
+ * 'apng_output_new_for_array ()' - Start writing to memory.
+ *
+ * The array is the sink itself, so there are no buffers or writer.
+ */
+
+ApngOutput *
+apng_output_new_for_array (GByteArray *array)
+{
+  ApngOutput *output = g_new0 (ApngOutput, 1);
+
+  output->fd    = -1;
+  output->array = array;
+
+  return output;
+}
+
+void
+apng_output_set_threaded (ApngOutput *output,
+                          gboolean    threaded)
+{
+  output->unthreaded = ! threaded;
+}
+
+/*
+ * 'apng_output_reserve ()' - Preallocate the file being written.
+ *
+ * Only temporary files are preallocated, and only where the filesystem
+ * can do it without writing the blocks out.
+ */
+
+void
+apng_output_reserve (ApngOutput *output,
+                     guint64     size)
+{
+  if (output->array)
+    {
+      guint length = output->array->len;
+
+      /* Growing and shrinking back keeps the allocation */
+      if (size > length && size <= G_MAXUINT)
+        {
+          g_byte_array_set_size (output->array, size);
+          g_byte_array_set_size (output->array, length);
+        }
+
+      return;
+    }
+
+#if defined(FALLOC_FL_KEEP_SIZE)
+  if (output->tmpname && size > output->reserved &&
+      fallocate (output->fd, 0, 0, size) == 0)
+    output->reserved = size;
+#endif
+}
+
+/*
+ * 'apng_output_write ()' - Append data to the output.
+ */
+
+gboolean
+apng_output_write (ApngOutput   *output,
+                   const guchar *data,
+                   gsize         length)
+{
+  if (output->array)
+    {
+      g_byte_array_append (output->array, data, length);
+      return TRUE;
+    }
+
+  while (length > 0)
+    {
+      OutputBuffer *buffer = output->current;
+      gsize         n      = MIN (length, OUTPUT_BUFFER_SIZE - buffer->length);
+
+      memcpy (buffer->data + buffer->length, data, n);
+      buffer->length += n;
+      data           += n;
+      length         -= n;
+
+      if (buffer->length == OUTPUT_BUFFER_SIZE &&
+          ! output_submit (output, FALSE))
+        return FALSE;
+    }
+
+  return ! output->errsv;
+}
+
+/*
+ * 'apng_output_patch ()' - Overwrite part of the file on close.
+ */
+
+void
+apng_output_patch (ApngOutput   *output,
+                   guint64       offset,
+                   const guchar *data,
+                   gsize         length)
+{
+  OutputPatch *patch = g_new (OutputPatch, 1);
+
+  patch->offset = offset;
+  patch->data   = g_memdup (data, length);
+  patch->length = length;
+
+  output->patches = g_slist_append (output->patches, patch);
+}
+
+/*
+ * 'apng_output_close ()' - Finish writing and move the file into place.
+ */
+
+gboolean
+apng_output_close (ApngOutput  *output,
+                   GError     **error)
+{
+  gint errsv;
+
+  if (output->array)
+    {
+      output_free (output);
+      return TRUE;
+    }
+
+  output_submit (output, TRUE);
+  output_stop (output);
+
+  errsv = output->errsv;
+
+#ifdef HAVE_UNISTD_H
+  if (! errsv && (output->reserved > output->written || output->tail) &&
+      ftruncate (output->fd, output->start + output->written) != 0)
+    errsv = errno;
+#endif
+
+#ifndef G_OS_WIN32
+  if (! errsv && (output->tmpname || output->tail) && fsync (output->fd) != 0)
+    errsv = errno;
+#endif
+
+  /*
+   * Patches go in once everything they refer to is on disk
+   */
+
+  if (output->patches)
+    {
+      GSList *list;
+
+      for (list = output->patches; list && ! errsv; list = list->next)
+        {
+          OutputPatch *patch = list->data;
+
+          if (seek_to (output->fd, patch->offset, &errsv))
+            write_all (output->fd, patch->data, patch->length, &errsv);
+        }
+
+#ifndef G_OS_WIN32
+      if (! errsv && fsync (output->fd) != 0)
+        errsv = errno;
+#endif
+    }
+
+  if (errsv && output->tail)
+    output_restore (output);
+
+  if (close (output->fd) != 0 && ! errsv)
+    errsv = errno;
+
+  if (! errsv && output->tmpname)
+    {
+#ifdef G_OS_WIN32
+      /* rename() doesn't replace files here */
+      g_unlink (output->filename);
+#endif
+
+      if (g_rename (output->tmpname, output->filename) != 0)
+        errsv = errno;
+    }
+
+  if (errsv)
+    {
+      gchar *name = g_filename_display_name (output->filename);
+
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errsv),
+                   _("Error writing '%s': %s"),
+                   name, g_strerror (errsv));
+      g_free (name);
+
+      if (output->tmpname)
+        g_unlink (output->tmpname);
+    }
+
+  output_free (output);
+
+  return ! errsv;
+}
+
+/*
+ * 'apng_output_abort ()' - Give up on the output.
+ */
+
+void
+apng_output_abort (ApngOutput *output)
+{
+  if (output->array)
+    {
+      g_byte_array_set_size (output->array, 0);
+      output_free (output);
+      return;
+    }
+
+  output_stop (output);
+
+  if (output->tail)
+    output_restore (output);
+
+  close (output->fd);
+
+  if (output->tmpname)
+    g_unlink (output->tmpname);
+
+  output_free (output);
+}
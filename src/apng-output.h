@@ -0,0 +1,74 @@
+/* GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ *   Animated Portable Network Graphics (APNG) plug-in
+ *
+ *   Buffered output written by a background thread.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __APNG_OUTPUT_H__
+#define __APNG_OUTPUT_H__
+
+#include <glib.h>
+
+
+typedef struct _ApngOutput ApngOutput;
+
+
+/* Write to a temporary file next to @filename, which replaces it when
+ * the output is closed.  Targets that aren't regular files (FIFOs,
+ * devices, symlinks) are written in place. */
+ApngOutput * apng_output_open           (const gchar  *filename,
+                                         GError      **error);
+
+/* Overwrite @filename from @offset on, in place.  The bytes that were
+ * there are put back if the output is aborted. */
+ApngOutput * apng_output_open_at        (const gchar  *filename,
+                                         guint64       offset,
+                                         GError      **error);
+
+/* Append to @array, which stays owned by the caller */
+ApngOutput * apng_output_new_for_array  (GByteArray   *array);
+
+/* Whether a thread may write full buffers while more is coming, the
+ * default */
+void         apng_output_set_threaded   (ApngOutput   *output,
+                                         gboolean      threaded);
+
+/* Preallocate @size bytes, a hint that is trimmed on close */
+void         apng_output_reserve        (ApngOutput   *output,
+                                         guint64       size);
+
+/* Returns FALSE if writing has failed, the error is reported on close */
+gboolean     apng_output_write          (ApngOutput   *output,
+                                         const guchar *data,
+                                         gsize         length);
+
+/* Write @data at @offset of the file on close, after the rest of the
+ * output has reached the disk */
+void         apng_output_patch          (ApngOutput   *output,
+                                         guint64       offset,
+                                         const guchar *data,
+                                         gsize         length);
+
+/* Flush, sync and move the result into place */
+gboolean     apng_output_close          (ApngOutput   *output,
+                                         GError      **error);
+
+/* Stop writing, leaving any previous file untouched */
+void         apng_output_abort          (ApngOutput   *output);
+
+#endif /* __APNG_OUTPUT_H__ */
@@ -0,0 +1,691 @@
+/* GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ *   Animated Portable Network Graphics (APNG) plug-in
+ *
+ *   Splitting an animation into a PNG file per frame, without going
+ *   through GIMP layers.  Frames are written as stored by re-wrapping
+ *   their fdAT data as IDAT chunks, which needs neither inflating nor
+ *   deflating.  Composited frames, as they are shown, are decoded and
+ *   encoded again.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include <glib.h>
+
+#include <png.h>
+
+#include "apng-chunk.h"
+#include "apng-encode.h"
+#include "apng-output.h"
+#include "apng-split.h"
+#include "plugin-intl.h"
+
+
+#define DISPOSE_OP_NONE        0
+#define DISPOSE_OP_BACKGROUND  1
+#define DISPOSE_OP_PREVIOUS    2
+
+#define BLEND_OP_SOURCE        0
+#define BLEND_OP_OVER          1
+
+
+typedef struct
+{
+  const ApngSplitOptions *options;
+  const gchar            *filename;     /* The animation */
+  const gchar            *dirname;
+  gchar                  *stem;         /* Frame files are stem-0001.png */
+  ApngHeader              header;
+  GArray                 *prefix;       /* Chunks before the image data */
+  GString                *manifest;
+  guint                   num_frames;   /* Frames written */
+
+  /* The frame being read */
+  gboolean                in_frame;
+  ApngFrameControl        fc;
+  gchar                  *frame_filename;
+  ApngOutput             *output;       /* The frame file, or "png" */
+  GByteArray             *png;          /* Frame to composite */
+
+  /* Compositing */
+  guchar                 *canvas;
+  guchar                 *saved;        /* What a DISPOSE_OP_PREVIOUS
+                                         * frame covers */
+  ApngFrameControl        prev_fc;
+}
+SplitState;
+
+typedef struct
+{
+  const guchar *data;
+  gsize         length;
+  gsize         pos;
+}
+SplitSource;
+
+
+static void
+split_set_corrupt (SplitState  *state,
+                   GError     **error)
+{
+  gchar *name = g_filename_display_name (state->filename);
+
+  g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+               _("Error while reading '%s'. File corrupted?"), name);
+  g_free (name);
+}
+
+/*
+ * 'write_head ()' - Start a PNG file for a frame.
+ *
+ * With "all_prefix" every chunk before the image data of the animation
+ * is copied, otherwise only those that still apply to 8-bit RGBA.
+ */
+
+static gboolean
+write_head (SplitState *state,
+            ApngOutput *output,
+            guint32     width,
+            guint32     height,
+            gboolean    all_prefix)
+{
+  ApngHeader header = state->header;
+  guchar     data[APNG_IHDR_SIZE];
+  guint      i;
+
+  header.width  = width;
+  header.height = height;
+
+  if (! all_prefix)
+    {
+      header.bit_depth  = 8;
+      header.color_type = PNG_COLOR_TYPE_RGB_ALPHA;
+      header.interlace  = PNG_INTERLACE_NONE;
+    }
+
+  apng_pack_header (data, &header);
+
+  if (! apng_write_signature (output) ||
+      ! apng_write_chunk (output, "IHDR", data, sizeof (data)))
+    return FALSE;
+
+  for (i = 0; i < state->prefix->len; i++)
+    {
+      const ApngChunk *chunk = &g_array_index (state->prefix, ApngChunk, i);
+
+      if (! all_prefix &&
+          strcmp (chunk->type, "gAMA") && strcmp (chunk->type, "cHRM") &&
+          strcmp (chunk->type, "sRGB") && strcmp (chunk->type, "iCCP") &&
+          strcmp (chunk->type, "pHYs"))
+        continue;
+
+      if (! apng_write_chunk (output, chunk->type, chunk->data, chunk->length))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+read_memory (png_structp pp,
+             png_bytep   data,
+             png_size_t  length)
+{
+  SplitSource *source = png_get_io_ptr (pp);
+
+  if (length > source->length - source->pos)
+    png_error (pp, "Unexpected end of frame data");
+
+  memcpy (data, source->data + source->pos, length);
+  source->pos += length;
+}
+
+/*
+ * 'decode_frame ()' - Decode a frame as 8-bit RGBA.
+ */
+
+static gboolean
+decode_frame (const GByteArray *png,
+              guchar           *pixels,
+              guint32           width,
+              guint32           height)
+{
+  png_structp           pp;
+  png_infop             info;
+  SplitSource           source = { png->data, png->len, 0 };
+  png_bytep * volatile  rows = NULL;
+  guint32               y;
+
+  pp   = png_create_read_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  info = png_create_info_struct (pp);
+
+  if (setjmp (png_jmpbuf (pp)))
+    {
+      png_destroy_read_struct (&pp, &info, NULL);
+      g_free (rows);
+
+      return FALSE;
+    }
+
+  png_set_read_fn (pp, &source, read_memory);
+  png_read_info (pp, info);
+
+  png_set_expand (pp);
+  png_set_strip_16 (pp);
+  png_set_gray_to_rgb (pp);
+  png_set_filler (pp, 0xff, PNG_FILLER_AFTER);
+  png_set_interlace_handling (pp);
+
+  png_read_update_info (pp, info);
+
+  rows = g_new (png_bytep, height);
+
+  for (y = 0; y < height; y++)
+    rows[y] = pixels + (gsize) y * width * 4;
+
+  png_read_image (pp, rows);
+  png_read_end (pp, NULL);
+
+  png_destroy_read_struct (&pp, &info, NULL);
+  g_free (rows);
+
+  return TRUE;
+}
+
+/*
+ * 'composite_frame ()' - Render a frame on the canvas.
+ *
+ * Disposes of the previous frame first, the way viewers do.
+ */
+
+static void
+composite_frame (SplitState   *state,
+                 const guchar *pixels)
+{
+  const ApngFrameControl *fc     = &state->fc;
+  const ApngFrameControl *prev   = &state->prev_fc;
+  gsize                   stride = (gsize) state->header.width * 4;
+  gsize                   row    = (gsize) fc->width * 4;
+  guint32                 x, y;
+
+  if (state->num_frames > 0)
+    {
+      for (y = 0; y < prev->height; y++)
+        {
+          guchar *dst = (state->canvas + (prev->y_offset + y) * stride +
+                         prev->x_offset * 4);
+
+          if (prev->dispose_op == DISPOSE_OP_BACKGROUND)
+            memset (dst, 0, (gsize) prev->width * 4);
+          else if (prev->dispose_op == DISPOSE_OP_PREVIOUS)
+            memcpy (dst, state->saved + y * (gsize) prev->width * 4,
+                    (gsize) prev->width * 4);
+        }
+    }
+
+  /* The first frame saves the empty canvas, so it is cleared like
+   * DISPOSE_OP_BACKGROUND asks */
+  if (fc->dispose_op == DISPOSE_OP_PREVIOUS)
+    {
+      state->saved = g_renew (guchar, state->saved, row * fc->height);
+
+      for (y = 0; y < fc->height; y++)
+        memcpy (state->saved + y * row,
+                state->canvas + (fc->y_offset + y) * stride + fc->x_offset * 4,
+                row);
+    }
+
+  for (y = 0; y < fc->height; y++)
+    {
+      const guchar *src = pixels + y * row;
+      guchar       *dst = (state->canvas + (fc->y_offset + y) * stride +
+                           fc->x_offset * 4);
+
+      if (fc->blend_op == BLEND_OP_SOURCE)
+        {
+          memcpy (dst, src, row);
+          continue;
+        }
+
+      for (x = 0; x < fc->width; x++, src += 4, dst += 4)
+        {
+          guint32 sa = src[3];
+          guint32 da = dst[3];
+          guint32 a;
+          gint    c;
+
+          if (sa == 255)
+            {
+              memcpy (dst, src, 4);
+              continue;
+            }
+
+          if (sa == 0)
+            continue;
+
+          /* Alpha of the result, times 255 */
+          a = sa * 255 + da * (255 - sa);
+
+          for (c = 0; c < 3; c++)
+            dst[c] = (src[c] * sa * 255 + dst[c] * da * (255 - sa) + a / 2) / a;
+
+          dst[3] = (a + 127) / 255;
+        }
+    }
+}
+
+/*
+ * 'write_canvas ()' - Write the canvas as an 8-bit RGBA file.
+ */
+
+static gboolean
+write_canvas (SplitState  *state,
+              GError     **error)
+{
+  ApngFrameEncoder *encoder = apng_frame_encoder_new ();
+  ApngOutput       *output;
+  ApngFormat        format;
+  gsize             stride  = (gsize) state->header.width * 4;
+  guint32           y;
+
+  if (setjmp (png_jmpbuf (encoder->pp)))
+    {
+      gchar *name = g_filename_display_name (state->frame_filename);
+
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                   _("Could not compress '%s'."), name);
+      g_free (name);
+      apng_frame_encoder_free (encoder);
+
+      return FALSE;
+    }
+
+  memset (&format, 0, sizeof (format));
+
+  format.bit_depth         = 8;
+  format.color_type        = PNG_COLOR_TYPE_RGB_ALPHA;
+  format.interlace         = PNG_INTERLACE_NONE;
+  format.compression_level = state->options->compression_level;
+
+  apng_frame_encoder_start (encoder, &format,
+                            state->header.width, state->header.height);
+
+  for (y = 0; y < state->header.height; y++)
+    png_write_row (encoder->pp, state->canvas + y * stride);
+
+  apng_frame_encoder_finish (encoder);
+
+  output = apng_output_open (state->frame_filename, error);
+
+  if (! output)
+    {
+      apng_frame_encoder_free (encoder);
+      return FALSE;
+    }
+
+  /* Write errors are reported on close */
+  if (write_head (state, output,
+                  state->header.width, state->header.height, FALSE) &&
+      apng_write_image_data (output, NULL,
+                             encoder->payload->data, encoder->payload->len))
+    apng_write_chunk (output, "IEND", NULL, 0);
+
+  apng_frame_encoder_free (encoder);
+
+  return apng_output_close (output, error);
+}
+
+/*
+ * 'frame_begin ()' - Start a frame on its fcTL chunk.
+ */
+
+static gboolean
+frame_begin (SplitState  *state,
+             GError     **error)
+{
+  const ApngFrameControl *fc = &state->fc;
+  gchar                  *basename;
+
+  if (fc->width == 0 || fc->height == 0 ||
+      fc->x_offset >= state->header.width ||
+      fc->y_offset >= state->header.height ||
+      fc->width  > state->header.width  - fc->x_offset ||
+      fc->height > state->header.height - fc->y_offset)
+    {
+      split_set_corrupt (state, error);
+      return FALSE;
+    }
+
+  basename = g_strdup_printf ("%s-%04u.png", state->stem,
+                              state->num_frames + 1);
+  state->frame_filename = g_build_filename (state->dirname, basename, NULL);
+  g_free (basename);
+
+  if (state->options->composite)
+    {
+      state->png    = g_byte_array_new ();
+      state->output = apng_output_new_for_array (state->png);
+    }
+  else
+    {
+      state->output = apng_output_open (state->frame_filename, error);
+
+      if (! state->output)
+        return FALSE;
+    }
+
+  state->in_frame = TRUE;
+
+  /* Write errors are reported on close */
+  write_head (state, state->output, fc->width, fc->height, TRUE);
+
+  return TRUE;
+}
+
+/*
+ * 'frame_end ()' - Finish the frame file and list it in the manifest.
+ */
+
+static gboolean
+frame_end (SplitState  *state,
+           GError     **error)
+{
+  const ApngFrameControl *fc = &state->fc;
+  ApngOutput             *output = state->output;
+  gchar                  *basename;
+  guint                   delay_den;
+  gboolean                ok;
+
+  state->in_frame = FALSE;
+  state->output   = NULL;
+
+  apng_write_chunk (output, "IEND", NULL, 0);
+  ok = apng_output_close (output, error);
+
+  if (ok && state->options->composite)
+    {
+      guchar *pixels = g_new (guchar, (gsize) fc->width * fc->height * 4);
+
+      ok = decode_frame (state->png, pixels, fc->width, fc->height);
+
+      if (ok)
+        {
+          composite_frame (state, pixels);
+          ok = write_canvas (state, error);
+        }
+      else
+        {
+          split_set_corrupt (state, error);
+        }
+
+      g_free (pixels);
+    }
+
+  if (state->png)
+    {
+      g_byte_array_free (state->png, TRUE);
+      state->png = NULL;
+    }
+
+  if (ok)
+    {
+      static const gchar *dispose_ops[] = { "none", "background", "previous" };
+      static const gchar *blend_ops[]   = { "source", "over" };
+
+      /* A denominator of 0 means 1/100 s */
+      delay_den = fc->delay_den ? fc->delay_den : 100;
+
+      if (! state->options->composite)
+        g_string_append_printf (state->manifest,
+                                "# %ux%u+%u+%u, dispose %s, blend %s\n",
+                                fc->width, fc->height,
+                                fc->x_offset, fc->y_offset,
+                                dispose_ops[MIN (fc->dispose_op, 2)],
+                                blend_ops[MIN (fc->blend_op, 1)]);
+
+      basename = g_path_get_basename (state->frame_filename);
+      g_string_append_printf (state->manifest, "%s %u\n", basename,
+                              (fc->delay_num * 1000 + delay_den / 2) /
+                              delay_den);
+      g_free (basename);
+
+      state->prev_fc = *fc;
+      state->num_frames++;
+    }
+
+  g_free (state->frame_filename);
+  state->frame_filename = NULL;
+
+  return ok;
+}
+
+/*
+ * 'write_manifest ()' - Write the list of frames and their delays.
+ */
+
+static gboolean
+write_manifest (SplitState  *state,
+                GError     **error)
+{
+  ApngOutput *output;
+  gchar      *basename;
+  gchar      *filename;
+
+  basename = g_strconcat (state->stem, ".txt", NULL);
+  filename = g_build_filename (state->dirname, basename, NULL);
+  g_free (basename);
+
+  output = apng_output_open (filename, error);
+  g_free (filename);
+
+  if (! output)
+    return FALSE;
+
+  apng_output_write (output,
+                     (const guchar *) state->manifest->str,
+                     state->manifest->len);
+
+  return apng_output_close (output, error);
+}
+
+/*
+ * 'apng_split ()' - Write the frames of an animation as PNG files.
+ */
+
+gboolean
+apng_split (const gchar            *filename,
+            const gchar            *dirname,
+            const ApngSplitOptions *options,
+            ApngProgressFunc        progress,
+            gpointer                progress_data,
+            GError                **error)
+{
+  ApngChunkReader *reader;
+  ApngChunk        chunk;
+  SplitState       state;
+  gboolean         have_header = FALSE;
+  gboolean         animated    = FALSE;
+  gboolean         in_image    = FALSE;     /* Past the leading chunks */
+  guint32          num_frames  = 1;
+  GError          *local_error = NULL;
+  gboolean         ok          = TRUE;
+
+  reader = apng_chunk_reader_new (filename, error);
+
+  if (! reader)
+    return FALSE;
+
+  memset (&state, 0, sizeof (state));
+
+  state.options  = options;
+  state.filename = filename;
+  state.dirname  = dirname;
+  state.prefix   = g_array_new (FALSE, FALSE, sizeof (ApngChunk));
+  state.manifest = g_string_new (NULL);
+
+  {
+    gchar *basename = g_path_get_basename (filename);
+    gchar *dot      = strrchr (basename, '.');
+
+    if (dot && dot != basename)
+      *dot = '\0';
+
+    state.stem = basename;
+  }
+
+  {
+    gchar *name = g_filename_display_name (filename);
+
+    g_string_append_printf (state.manifest,
+                            "# Frames of %s and their delays in ms\n", name);
+    g_free (name);
+  }
+
+  while (ok && apng_chunk_reader_next (reader, &chunk, &local_error))
+    {
+      if (! have_header)
+        {
+          have_header = (! strcmp (chunk.type, "IHDR") &&
+                         apng_parse_header (&chunk, &state.header));
+
+          if (! have_header)
+            {
+              split_set_corrupt (&state, &local_error);
+              ok = FALSE;
+            }
+          else if (options->composite)
+            {
+              state.canvas = g_new0 (guchar,
+                                     (gsize) state.header.width *
+                                     state.header.height * 4);
+            }
+        }
+      else if (! strcmp (chunk.type, "acTL"))
+        {
+          if (chunk.length >= 4)
+            num_frames = MAX (apng_get_uint32 (chunk.data), 1);
+
+          animated = TRUE;
+        }
+      else if (! strcmp (chunk.type, "fcTL"))
+        {
+          in_image = TRUE;
+
+          if (state.in_frame)
+            ok = frame_end (&state, &local_error);
+
+          if (ok && ! apng_parse_frame_control (&chunk, &state.fc))
+            {
+              split_set_corrupt (&state, &local_error);
+              ok = FALSE;
+            }
+
+          if (ok)
+            ok = frame_begin (&state, &local_error);
+
+          if (ok && progress)
+            progress ((gdouble) state.num_frames / num_frames, progress_data);
+        }
+      else if (! strcmp (chunk.type, "IDAT"))
+        {
+          /* A still image is a single frame, the default image of an
+           * animation without fcTL is not a frame at all */
+          if (! in_image && ! animated)
+            {
+              memset (&state.fc, 0, sizeof (state.fc));
+              state.fc.width  = state.header.width;
+              state.fc.height = state.header.height;
+
+              ok = frame_begin (&state, &local_error);
+            }
+
+          in_image = TRUE;
+
+          if (ok && state.in_frame)
+            apng_write_chunk (state.output, "IDAT", chunk.data, chunk.length);
+        }
+      else if (! strcmp (chunk.type, "fdAT"))
+        {
+          if (chunk.length < 4)
+            {
+              split_set_corrupt (&state, &local_error);
+              ok = FALSE;
+            }
+          else if (state.in_frame)
+            {
+              /* Drop the sequence number, the rest is plain IDAT data */
+              apng_write_chunk (state.output, "IDAT",
+                                chunk.data + 4, chunk.length - 4);
+            }
+        }
+      else if (! strcmp (chunk.type, "IEND"))
+        {
+          if (state.in_frame)
+            ok = frame_end (&state, &local_error);
+        }
+      else if (! in_image)
+        {
+          g_array_append_val (state.prefix, chunk);
+        }
+    }
+
+  if (local_error)
+    ok = FALSE;
+
+  if (state.in_frame)
+    {
+      apng_output_abort (state.output);
+
+      if (ok)
+        split_set_corrupt (&state, &local_error);
+
+      ok = FALSE;
+    }
+
+  if (ok && state.num_frames == 0)
+    {
+      split_set_corrupt (&state, &local_error);
+      ok = FALSE;
+    }
+
+  if (ok)
+    ok = write_manifest (&state, &local_error);
+
+  if (ok && progress)
+    progress (1.0, progress_data);
+
+  if (! ok)
+    g_propagate_error (error, local_error);
+
+  if (state.png)
+    g_byte_array_free (state.png, TRUE);
+
+  g_free (state.frame_filename);
+  g_free (state.canvas);
+  g_free (state.saved);
+  g_free (state.stem);
+  g_string_free (state.manifest, TRUE);
+  g_array_free (state.prefix, TRUE);
+
+  /* The prefix chunks point into the mapping */
+  apng_chunk_reader_free (reader);
+
+  return ok;
+}
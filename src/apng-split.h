@@ -0,0 +1,49 @@
+/* GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ *   Animated Portable Network Graphics (APNG) plug-in
+ *
+ *   Splitting an animation into a PNG file per frame.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __APNG_SPLIT_H__
+#define __APNG_SPLIT_H__
+
+#include <glib.h>
+
+#include "apng-assemble.h"
+
+
+typedef struct
+{
+  gboolean  composite;                  /* Write what is shown on screen,
+                                         * not the stored frame regions */
+  gint      compression_level;          /* For composited frames */
+}
+ApngSplitOptions;
+
+
+/* Frames are written to @dirname as NAME-0001.png and so on, NAME being
+ * the name of @filename without its extension, and listed with their
+ * delays in NAME.txt, a manifest apng_assemble() reads back. */
+gboolean  apng_split  (const gchar            *filename,
+                       const gchar            *dirname,
+                       const ApngSplitOptions *options,
+                       ApngProgressFunc        progress,
+                       gpointer                progress_data,
+                       GError                **error);
+
+#endif /* __APNG_SPLIT_H__ */
@@ -0,0 +1,473 @@
+/* GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ *   Animated Portable Network Graphics (APNG) plug-in
+ *
+ *   Encoding a stream of raw frames read from a file descriptor, so a
+ *   recorder can pipe its frames straight into an animation.  Each
+ *   frame is diffed against the previous one and written before the
+ *   next is read, so memory use doesn't grow with the length of the
+ *   recording.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <glib.h>
+
+#include <png.h>
+
+#ifdef G_OS_WIN32
+#include <io.h>
+#endif
+
+#include "apng-assemble.h"
+#include "apng-stream.h"
+#include "plugin-intl.h"
+
+
+#define Y4M_SIGNATURE       "YUV4MPEG2 "
+#define Y4M_SIGNATURE_SIZE  10
+#define Y4M_MAX_LINE        1024
+
+
+typedef struct
+{
+  gint      fd;
+  guchar    peek[Y4M_SIGNATURE_SIZE];   /* Read to tell the format */
+  gsize     peek_len;
+  gsize     peek_pos;
+  gint      errsv;                      /* errno of a failed read */
+  gboolean  truncated;                  /* Ended inside a frame */
+
+  /* YUV4MPEG2 */
+  gboolean  y4m;
+  gint      x_shift;                    /* Chroma subsampling */
+  gint      y_shift;
+  gboolean  mono;
+  guchar   *planes;                     /* Y, Cb and Cr of a frame */
+}
+StreamSource;
+
+
+/*
+ * 'source_read ()' - Read up to "length" bytes.
+ *
+ * Returns fewer only at the end of the stream, or if reading failed.
+ */
+
+static gsize
+source_read (StreamSource *source,
+             guchar       *buf,
+             gsize         length)
+{
+  gsize done = 0;
+
+  if (source->peek_pos < source->peek_len)
+    {
+      done = MIN (length, source->peek_len - source->peek_pos);
+      memcpy (buf, source->peek + source->peek_pos, done);
+      source->peek_pos += done;
+    }
+
+  while (done < length)
+    {
+      gssize n = read (source->fd, buf + done, length - done);
+
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+
+          source->errsv = errno;
+          break;
+        }
+
+      if (n == 0)
+        break;
+
+      done += n;
+    }
+
+  return done;
+}
+
+/*
+ * 'source_read_line ()' - Read a YUV4MPEG2 header line, without the
+ *                         newline.
+ *
+ * A line cut short or too long marks the stream truncated, one that
+ * isn't started is its clean end.
+ */
+
+static gboolean
+source_read_line (StreamSource *source,
+                  gchar        *line)
+{
+  gsize len = 0;
+
+  while (len < Y4M_MAX_LINE - 1)
+    {
+      guchar c;
+
+      if (source_read (source, &c, 1) != 1)
+        {
+          source->truncated = (len > 0);
+          return FALSE;
+        }
+
+      if (c == '\n')
+        {
+          line[len] = '\0';
+          return TRUE;
+        }
+
+      line[len++] = c;
+    }
+
+  source->truncated = TRUE;
+
+  return FALSE;
+}
+
+static void
+set_y4m_error (GError **error)
+{
+  g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+               _("Not a YUV4MPEG2 stream this plug-in can read."));
+}
+
+/*
+ * 'parse_y4m_header ()' - Read the stream header after the signature.
+ *
+ * Only 8-bit 4:2:0, 4:2:2, 4:4:4 and grayscale streams are read.  A
+ * frame rate replaces the delay.
+ */
+
+static gboolean
+parse_y4m_header (StreamSource  *source,
+                  guint32       *width,
+                  guint32       *height,
+                  guint16       *delay_num,
+                  guint16       *delay_den,
+                  GError       **error)
+{
+  gchar   line[Y4M_MAX_LINE];
+  gchar **params;
+  gint    i;
+
+  if (! source_read_line (source, line))
+    {
+      set_y4m_error (error);
+      return FALSE;
+    }
+
+  /* C420jpeg is the default */
+  source->x_shift = 1;
+  source->y_shift = 1;
+
+  params = g_strsplit (line, " ", -1);
+
+  for (i = 0; params[i]; i++)
+    {
+      const gchar *value = params[i] + 1;
+
+      switch (params[i][0])
+        {
+        case 'W':
+          *width = strtoul (value, NULL, 10);
+          break;
+
+        case 'H':
+          *height = strtoul (value, NULL, 10);
+          break;
+
+        case 'F':
+          {
+            gulong  num, den;
+            gchar  *end;
+
+            num = strtoul (value, &end, 10);
+            den = (*end == ':') ? strtoul (end + 1, NULL, 10) : 0;
+
+            if (num > 0 && den > 0)
+              {
+                /* The delay is the inverse of the rate, in 16 bits */
+                while (num > G_MAXUINT16 || den > G_MAXUINT16)
+                  {
+                    num = (num + 1) / 2;
+                    den = (den + 1) / 2;
+                  }
+
+                *delay_num = den;
+                *delay_den = num;
+              }
+          }
+          break;
+
+        case 'C':
+          if (! strcmp (value, "420")      || ! strcmp (value, "420jpeg") ||
+              ! strcmp (value, "420mpeg2") || ! strcmp (value, "420paldv"))
+            {
+              /* 420jpeg, 420mpeg2 and 420paldv differ in chroma siting
+               * only */
+              source->x_shift = 1;
+              source->y_shift = 1;
+            }
+          else if (! strcmp (value, "422"))
+            {
+              source->x_shift = 1;
+              source->y_shift = 0;
+            }
+          else if (! strcmp (value, "444"))
+            {
+              source->x_shift = 0;
+              source->y_shift = 0;
+            }
+          else if (! strcmp (value, "mono"))
+            {
+              source->mono = TRUE;
+            }
+          else
+            {
+              g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                           _("Unsupported YUV4MPEG2 color space '%s'."),
+                           value);
+              g_strfreev (params);
+
+              return FALSE;
+            }
+          break;
+
+        default:
+          break;
+        }
+    }
+
+  g_strfreev (params);
+
+  if (*width == 0 || *height == 0)
+    {
+      set_y4m_error (error);
+      return FALSE;
+    }
+
+  source->y4m = TRUE;
+
+  return TRUE;
+}
+
+/*
+ * 'read_y4m_frame ()' - Read a YUV4MPEG2 frame as 8-bit RGBA.
+ *
+ * Samples are converted with the ITU-R BT.601 matrix, studio swing.
+ */
+
+static gboolean
+read_y4m_frame (StreamSource *source,
+                guchar       *pixels,
+                guint32       width,
+                guint32       height)
+{
+  gchar         line[Y4M_MAX_LINE];
+  gsize         chroma_width  = (width  + source->x_shift) >> source->x_shift;
+  gsize         chroma_height = (height + source->y_shift) >> source->y_shift;
+  gsize         luma_size     = (gsize) width * height;
+  gsize         chroma_size   = source->mono ? 0 : chroma_width * chroma_height;
+  const guchar *cb;
+  const guchar *cr;
+  guint32       x, y;
+
+  if (! source_read_line (source, line))
+    return FALSE;
+
+  if (strncmp (line, "FRAME", 5))
+    {
+      source->truncated = TRUE;
+      return FALSE;
+    }
+
+  if (! source->planes)
+    source->planes = g_new (guchar, luma_size + 2 * chroma_size);
+
+  if (source_read (source, source->planes, luma_size + 2 * chroma_size) !=
+      luma_size + 2 * chroma_size)
+    {
+      source->truncated = TRUE;
+      return FALSE;
+    }
+
+  cb = source->planes + luma_size;
+  cr = cb + chroma_size;
+
+  for (y = 0; y < height; y++)
+    {
+      const guchar *luma = source->planes + (gsize) y * width;
+      gsize         row  = (y >> source->y_shift) * chroma_width;
+
+      for (x = 0; x < width; x++, pixels += 4)
+        {
+          gint c = (luma[x] - 16) * 298;
+          gint d = 0;
+          gint e = 0;
+
+          if (! source->mono)
+            {
+              d = cb[row + (x >> source->x_shift)] - 128;
+              e = cr[row + (x >> source->x_shift)] - 128;
+            }
+
+          pixels[0] = CLAMP ((c + 409 * e + 128) >> 8, 0, 255);
+          pixels[1] = CLAMP ((c - 100 * d - 208 * e + 128) >> 8, 0, 255);
+          pixels[2] = CLAMP ((c + 516 * d + 128) >> 8, 0, 255);
+          pixels[3] = 255;
+        }
+    }
+
+  return TRUE;
+}
+
+/*
+ * 'apng_encode_stream ()' - Encode frames as they are read.
+ */
+
+gboolean
+apng_encode_stream (gint                      fd,
+                    const gchar              *filename,
+                    const ApngStreamOptions  *options,
+                    GError                  **error)
+{
+  StreamSource         source;
+  ApngAssembleOptions  assemble_options;
+  ApngAssembler       *assembler;
+  guint32              width     = options->width;
+  guint32              height    = options->height;
+  guint16              delay_num = options->delay_num;
+  guint16              delay_den = options->delay_den;
+  guint32              num_frames = 0;
+
+  memset (&source, 0, sizeof (source));
+  source.fd = fd;
+
+  source.peek_len = source_read (&source, source.peek, Y4M_SIGNATURE_SIZE);
+
+  if (source.peek_len == Y4M_SIGNATURE_SIZE &&
+      ! memcmp (source.peek, Y4M_SIGNATURE, Y4M_SIGNATURE_SIZE))
+    {
+      source.peek_pos = source.peek_len;
+
+      if (! parse_y4m_header (&source, &width, &height,
+                              &delay_num, &delay_den, error))
+        return FALSE;
+    }
+  else if (width == 0 || height == 0)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                   _("The size of raw frames must be given."));
+      return FALSE;
+    }
+
+  if (width > 0x7fffffff || height > 0x7fffffff ||
+      (guint64) width * height > G_MAXSIZE / 4)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                   _("Frames of %u x %u pixels are too large."),
+                   width, height);
+      g_free (source.planes);
+
+      return FALSE;
+    }
+
+  assemble_options.manifest          = NULL;
+  assemble_options.delay             = 0;
+  assemble_options.num_plays         = options->num_plays;
+  assemble_options.compression_level = options->compression_level;
+  assemble_options.optimize          = options->optimize;
+
+  /* YUV4MPEG2 frames are opaque, raw frames may not be */
+  assembler = apng_assembler_new (filename, width, height,
+                                  options->num_frames,
+                                  ! source.y4m ? PNG_COLOR_TYPE_RGB_ALPHA :
+                                  source.mono  ? PNG_COLOR_TYPE_GRAY :
+                                                 PNG_COLOR_TYPE_RGB,
+                                  &assemble_options, error);
+
+  if (! assembler)
+    {
+      g_free (source.planes);
+      return FALSE;
+    }
+
+  while (! options->num_frames || num_frames < options->num_frames)
+    {
+      guchar   *pixels = apng_assembler_get_buffer (assembler);
+      gsize     size   = (gsize) width * height * 4;
+      gboolean  got;
+
+      if (source.y4m)
+        {
+          got = read_y4m_frame (&source, pixels, width, height);
+        }
+      else
+        {
+          gsize n = source_read (&source, pixels, size);
+
+          got = (n == size);
+          source.truncated = (n > 0 && ! got);
+        }
+
+      if (! got)
+        break;
+
+      if (! apng_assembler_add_frame (assembler, delay_num, delay_den, error))
+        {
+          apng_assembler_abort (assembler);
+          g_free (source.planes);
+
+          return FALSE;
+        }
+
+      num_frames++;
+    }
+
+  g_free (source.planes);
+
+  if (source.errsv || source.truncated || num_frames == 0)
+    {
+      apng_assembler_abort (assembler);
+
+      if (source.errsv)
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (source.errsv),
+                     _("Error reading frames: %s"),
+                     g_strerror (source.errsv));
+      else if (source.truncated)
+        g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                     _("The stream ends inside frame %u."), num_frames + 1);
+      else
+        g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                     _("No frames were read."));
+
+      return FALSE;
+    }
+
+  return apng_assembler_finish (assembler, error);
+}
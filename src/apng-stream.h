@@ -0,0 +1,53 @@
+/* GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ *   Animated Portable Network Graphics (APNG) plug-in
+ *
+ *   Encoding a stream of raw frames, as screen recorders write them.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __APNG_STREAM_H__
+#define __APNG_STREAM_H__
+
+#include <glib.h>
+
+
+typedef struct
+{
+  guint32   width;                      /* Of raw frames, YUV4MPEG2 */
+  guint32   height;                     /* streams have it in the header */
+  guint16   delay_num;                  /* Frame delay, unless the */
+  guint16   delay_den;                  /* stream gives a frame rate */
+  guint32   num_frames;                 /* 0 = count them and patch the
+                                         * count in at the end */
+  guint32   num_plays;                  /* 0 = forever */
+  gint      compression_level;
+  gboolean  optimize;                   /* Store only what changed */
+}
+ApngStreamOptions;
+
+
+/* Read frames from @fd until the end of the stream and write them to
+ * @filename as they come.  The stream is either 8-bit RGBA frames of
+ * the size in @options, back to back, or YUV4MPEG2 with 8-bit samples,
+ * which is recognized by its signature.  A partial frame at the end is
+ * an error.  Writing to a pipe needs the frame count up front. */
+gboolean  apng_encode_stream  (gint                      fd,
+                               const gchar              *filename,
+                               const ApngStreamOptions  *options,
+                               GError                  **error);
+
+#endif /* __APNG_STREAM_H__ */
@@ -0,0 +1,418 @@
+/* GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ *   Animated Portable Network Graphics (APNG) plug-in
+ *
+ *   Command line tools.  GIMP starts plug-ins with "-gimp" as the first
+ *   argument; anything else runs one of these instead, which don't need
+ *   GIMP at all:
+ *
+ *     file-apng assemble [OPTION...] DIRECTORY OUTPUT
+ *     file-apng split [OPTION...] INPUT DIRECTORY
+ *     file-apng encode [OPTION...] INPUT OUTPUT
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "apng-assemble.h"
+#include "apng-info.h"
+#include "apng-split.h"
+#include "apng-stream.h"
+#include "apng-tool.h"
+
+
+typedef struct
+{
+  const gchar  *name;
+  gint        (* run) (gint    argc,
+                       gchar **argv);
+  const gchar  *summary;
+}
+ApngTool;
+
+
+static gint  tool_assemble  (gint    argc,
+                             gchar **argv);
+static gint  tool_split     (gint    argc,
+                             gchar **argv);
+static gint  tool_encode    (gint    argc,
+                             gchar **argv);
+static gint  tool_info      (gint    argc,
+                             gchar **argv);
+
+
+static const ApngTool tools[] =
+{
+  { "assemble", tool_assemble,
+    "Build an animation from a directory of PNG frames" },
+  { "split", tool_split,
+    "Write the frames of an animation as PNG files" },
+  { "encode", tool_encode,
+    "Build an animation from raw RGBA or YUV4MPEG2 frames" },
+  { "info", tool_info,
+    "Print the size, frames and timing of files" }
+};
+
+
+/*
+ * Parse the options of a tool, which gets "argv" with its name first.
+ * "num_args" 0 takes one or more.  Returns FALSE after printing the
+ * problem.
+ */
+
+static gboolean
+tool_parse (const gchar   *parameters,
+            GOptionEntry  *entries,
+            gint          *argc,
+            gchar       ***argv,
+            gint           num_args)
+{
+  GOptionContext *context;
+  GError         *error = NULL;
+  gboolean        ok;
+
+  context = g_option_context_new (parameters);
+  g_option_context_add_main_entries (context, entries, NULL);
+
+  ok = g_option_context_parse (context, argc, argv, &error);
+
+  if (! ok)
+    {
+      g_printerr ("%s: %s\n", g_get_prgname (), error->message);
+      g_error_free (error);
+    }
+  else if (num_args > 0 ? *argc != num_args + 1 : *argc < 2)
+    {
+      gchar *help = g_option_context_get_help (context, TRUE, NULL);
+
+      g_printerr ("%s", help);
+      g_free (help);
+      ok = FALSE;
+    }
+
+  g_option_context_free (context);
+
+  return ok;
+}
+
+/*
+ * 'tool_assemble ()' - file-apng assemble [OPTION...] DIRECTORY OUTPUT
+ */
+
+static gint
+tool_assemble (gint    argc,
+               gchar **argv)
+{
+  ApngAssembleOptions  options;
+  gchar               *manifest    = NULL;
+  gint                 delay       = 100;
+  gint                 plays       = 0;
+  gint                 level       = 9;
+  gboolean             no_optimize = FALSE;
+  GError              *error       = NULL;
+  gboolean             ok;
+
+  GOptionEntry entries[] =
+  {
+    { "delay", 'd', 0, G_OPTION_ARG_INT, &delay,
+      "Frame delay in ms, for frames without one (default 100)", "MS" },
+    { "manifest", 'm', 0, G_OPTION_ARG_FILENAME, &manifest,
+      "Take the frames and their delays from FILE", "FILE" },
+    { "plays", 'p', 0, G_OPTION_ARG_INT, &plays,
+      "Number of times to play, 0 = forever (default)", "N" },
+    { "level", 'l', 0, G_OPTION_ARG_INT, &level,
+      "Compression level, 0-9 (default 9)", "N" },
+    { "no-optimize", 0, 0, G_OPTION_ARG_NONE, &no_optimize,
+      "Store whole frames, not just what changed", NULL },
+    { NULL }
+  };
+
+  if (! tool_parse ("DIRECTORY OUTPUT - build an animation from PNG frames",
+                    entries, &argc, &argv, 2))
+    return 2;
+
+  options.manifest          = manifest;
+  options.delay             = MAX (delay, 0);
+  options.num_plays         = MAX (plays, 0);
+  options.compression_level = CLAMP (level, 0, 9);
+  options.optimize          = ! no_optimize;
+
+  ok = apng_assemble (argv[1], argv[2], &options, NULL, NULL, &error);
+
+  if (! ok)
+    {
+      g_printerr ("%s: %s\n", g_get_prgname (), error->message);
+      g_error_free (error);
+    }
+
+  g_free (manifest);
+
+  return ok ? 0 : 1;
+}
+
+/*
+ * 'tool_split ()' - file-apng split [OPTION...] INPUT DIRECTORY
+ */
+
+static gint
+tool_split (gint    argc,
+            gchar **argv)
+{
+  ApngSplitOptions  options;
+  gboolean          composite = FALSE;
+  gint              level     = 9;
+  GError           *error     = NULL;
+  gboolean          ok;
+
+  GOptionEntry entries[] =
+  {
+    { "composite", 'c', 0, G_OPTION_ARG_NONE, &composite,
+      "Write frames as shown, not just the area each one stores", NULL },
+    { "level", 'l', 0, G_OPTION_ARG_INT, &level,
+      "Compression level of composited frames, 0-9 (default 9)", "N" },
+    { NULL }
+  };
+
+  if (! tool_parse ("INPUT DIRECTORY - write the frames of an animation",
+                    entries, &argc, &argv, 2))
+    return 2;
+
+  options.composite         = composite;
+  options.compression_level = CLAMP (level, 0, 9);
+
+  ok = apng_split (argv[1], argv[2], &options, NULL, NULL, &error);
+
+  if (! ok)
+    {
+      g_printerr ("%s: %s\n", g_get_prgname (), error->message);
+      g_error_free (error);
+    }
+
+  return ok ? 0 : 1;
+}
+
+/*
+ * 'tool_encode ()' - file-apng encode [OPTION...] INPUT OUTPUT
+ *
+ * INPUT is "-" for the standard input, or a file such as a FIFO.
+ */
+
+static gint
+tool_encode (gint    argc,
+             gchar **argv)
+{
+  ApngStreamOptions  options;
+  gchar             *size        = NULL;
+  gint               delay       = 100;
+  gint               frames      = 0;
+  gint               plays       = 0;
+  gint               level       = 9;
+  gboolean           no_optimize = FALSE;
+  guint              width       = 0;
+  guint              height      = 0;
+  gint               fd;
+  GError            *error       = NULL;
+  gboolean           ok;
+
+  GOptionEntry entries[] =
+  {
+    { "size", 's', 0, G_OPTION_ARG_STRING, &size,
+      "Size of raw RGBA frames", "WxH" },
+    { "delay", 'd', 0, G_OPTION_ARG_INT, &delay,
+      "Frame delay in ms, unless the stream has a rate (default 100)", "MS" },
+    { "frames", 'n', 0, G_OPTION_ARG_INT, &frames,
+      "Stop after N frames, which lets OUTPUT be a pipe", "N" },
+    { "plays", 'p', 0, G_OPTION_ARG_INT, &plays,
+      "Number of times to play, 0 = forever (default)", "N" },
+    { "level", 'l', 0, G_OPTION_ARG_INT, &level,
+      "Compression level, 0-9 (default 9)", "N" },
+    { "no-optimize", 0, 0, G_OPTION_ARG_NONE, &no_optimize,
+      "Store whole frames, not just what changed", NULL },
+    { NULL }
+  };
+
+  if (! tool_parse ("INPUT OUTPUT - build an animation from raw frames",
+                    entries, &argc, &argv, 2))
+    return 2;
+
+  if (size && sscanf (size, "%ux%u", &width, &height) != 2)
+    {
+      g_printerr ("%s: Bad frame size '%s'\n", g_get_prgname (), size);
+      g_free (size);
+
+      return 2;
+    }
+
+  g_free (size);
+
+  options.width             = width;
+  options.height            = height;
+  options.delay_num         = CLAMP (delay, 0, G_MAXUINT16);
+  options.delay_den         = 1000;
+  options.num_frames        = MAX (frames, 0);
+  options.num_plays         = MAX (plays, 0);
+  options.compression_level = CLAMP (level, 0, 9);
+  options.optimize          = ! no_optimize;
+
+  if (! strcmp (argv[1], "-"))
+    fd = 0;
+  else
+    fd = g_open (argv[1], O_RDONLY, 0);
+
+  if (fd < 0)
+    {
+      gint errsv = errno;
+
+      g_printerr ("%s: %s: %s\n", g_get_prgname (), argv[1],
+                  g_strerror (errsv));
+
+      return 1;
+    }
+
+  ok = apng_encode_stream (fd, argv[2], &options, &error);
+
+  if (fd != 0)
+    close (fd);
+
+  if (! ok)
+    {
+      g_printerr ("%s: %s\n", g_get_prgname (), error->message);
+      g_error_free (error);
+    }
+
+  return ok ? 0 : 1;
+}
+
+/*
+ * 'tool_info ()' - file-apng info [OPTION...] FILE...
+ */
+
+static gint
+tool_info (gint    argc,
+           gchar **argv)
+{
+  gboolean  list_frames = FALSE;
+  gint      failed      = 0;
+  gint      i;
+
+  GOptionEntry entries[] =
+  {
+    { "frames", 'f', 0, G_OPTION_ARG_NONE, &list_frames,
+      "List the geometry, delay and ops of each frame", NULL },
+    { NULL }
+  };
+
+  if (! tool_parse ("FILE... - print the size, frames and timing of files",
+                    entries, &argc, &argv, 0))
+    return 2;
+
+  for (i = 1; i < argc; i++)
+    {
+      ApngInfo  info;
+      GError   *error = NULL;
+      guint32   j;
+
+      if (! apng_info_read (argv[i], &info, &error))
+        {
+          g_printerr ("%s: %s\n", g_get_prgname (), error->message);
+          g_error_free (error);
+          failed++;
+
+          continue;
+        }
+
+      g_print ("%s: %ux%u, frames %u, plays %u, duration %.3f ms%s\n",
+               argv[i], info.header.width, info.header.height,
+               info.num_frames, info.num_plays, info.duration,
+               info.first_frame_hidden ? ", first frame hidden" : "");
+
+      for (j = 0; list_frames && j < info.num_frames; j++)
+        {
+          const ApngFrameControl *fc = &info.frames[j];
+
+          g_print ("  %u: %ux%u+%u+%u, delay %.3f ms, dispose %u, blend %u\n",
+                   j, fc->width, fc->height, fc->x_offset, fc->y_offset,
+                   apng_frame_delay_ms (fc), fc->dispose_op, fc->blend_op);
+        }
+
+      apng_info_clear (&info);
+    }
+
+  return failed ? 1 : 0;
+}
+
+gboolean
+apng_tool_wanted (gint    argc,
+                  gchar **argv)
+{
+  return argc > 1 && strcmp (argv[1], "-gimp") != 0;
+}
+
+/*
+ * 'apng_tool_main ()' - Run a command line tool.
+ */
+
+gint
+apng_tool_main (gint    argc,
+                gchar **argv)
+{
+  gchar *basename;
+  gchar *prgname;
+  guint  i;
+
+#if ! GLIB_CHECK_VERSION (2, 32, 0)
+  if (! g_thread_supported ())
+    g_thread_init (NULL);
+#endif
+
+  for (i = 0; i < G_N_ELEMENTS (tools); i++)
+    {
+      if (strcmp (argv[1], tools[i].name))
+        continue;
+
+      /* Messages start with "file-apng assemble:" and the like */
+      basename = g_path_get_basename (argv[0]);
+      prgname  = g_strdup_printf ("%s %s", basename, tools[i].name);
+      g_set_prgname (prgname);
+      g_free (prgname);
+      g_free (basename);
+
+      return tools[i].run (argc - 1, argv + 1);
+    }
+
+  g_printerr ("Usage: %s COMMAND [OPTION...]\n\n"
+              "This is a GIMP plug-in.  Outside of GIMP it provides these "
+              "commands:\n\n", argv[0]);
+
+  for (i = 0; i < G_N_ELEMENTS (tools); i++)
+    g_printerr ("  %-12s %s\n", tools[i].name, tools[i].summary);
+
+  g_printerr ("\nRun '%s COMMAND --help' for the options of a command.\n",
+              argv[0]);
+
+  return 2;
+}
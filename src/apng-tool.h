@@ -0,0 +1,36 @@
+/* GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ *   Animated Portable Network Graphics (APNG) plug-in
+ *
+ *   Command line tools, for running the plug-in outside of GIMP.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __APNG_TOOL_H__
+#define __APNG_TOOL_H__
+
+#include <glib.h>
+
+
+/* Returns TRUE if the arguments name a tool rather than come from GIMP */
+gboolean  apng_tool_wanted  (gint    argc,
+                             gchar **argv);
+
+/* Run the tool named by argv[1], returns the exit status */
+gint      apng_tool_main    (gint    argc,
+                             gchar **argv);
+
+#endif /* __APNG_TOOL_H__ */
@@ -25,20 +25,53 @@
  *
  * Contents:
  *
- *   main()                      - Main entry - just call gimp_main()...
+ *   main()                      - Main entry - call gimp_main() or a tool.
  *   query()                     - Respond to a plug-in query...
  *   run()                       - Run the plug-in...
+ *   resident_serve()            - Serve calls from a resident instance.
+ *   setup_read_transforms()     - Set up libpng to read rows the way
+ *                                 layers store them.
+ *   load_image_properties()     - Set the gamma, resolution and offsets
+ *                                 of an image.
+ *   load_colormap()             - Load the colormap of an indexed image.
+ *   frame_layer_name()          - Name the layer of a frame.
  *   load_image()                - Load a PNG image into a new image window.
+ *   load_image_follow()         - Load a PNG image that is still being
+ *                                 written, frame by frame.
+ *   follow_frame_finish()       - Turn the frame just read into a layer.
  *   read_frame()                - Read a PNG frame into a layer.
+ *   read_cached_frames()        - Load the layers of an image from the
+ *                                 cache of decoded frames.
+ *   cache_file_frames()         - Enter the frames of an animation into
+ *                                 the frame cache.
  *   respin_cmap()               - Re-order a Gimp colormap for PNG tRNS
  *   save_image()                - Save the specified image to a PNG file.
+ *   plan_frames()               - Place the layers of an animation.
  *   write_frame()               - Write the specified layer to a PNG frame.
+ *   write_frame_free()          - Free what write_frame() allocated.
+ *   get_frame_below()           - Place the layer a frame's mode applies
+ *                                 against.
+ *   simple_layer_mode()         - Whether apply_layer_mode() does a mode.
+ *   apply_layer_mode()          - Combine frame rows with the layer below.
+ *   encode_animation_frame()    - Compress a frame as a PNG of its own.
+ *   encode_frame_rows()         - Compress fetched frame rows again.
+ *   write_animation_frame()     - Write a frame of an animation.
+ *   append_image()              - Append the layers of an image to an
+ *                                 animation.
+ *   time_sample_encode()        - Time the frame encoder on sample rows.
+ *   choose_frame_compression()  - Pick zlib settings for a frame.
+ *   set_frame_compression()     - Set zlib up for a frame.
+ *   strip_pipeline_new()        - Overlap tile transfers with libpng.
  *   parse_delay_tag()           - Parse delay tag.
  *   parse_ms_tag()              - Parse milli seconds tag.
  *   parse_dispose_op_tag()      - Parse dispose_op tag.
  *   save_compression_callback() - Update the image compression level.
  *   save_interlace_update()     - Update the interlacing option.
+ *   estimate_take_samples()     - Sample frames for the size estimate.
+ *   save_estimate_update()      - Estimate the size with new settings.
  *   save_dialog()               - Pop up the save dialog.
+ *   load_vals_set()             - Set the options of file-apng-load2.
+ *   save_vals_set()             - Set the settings of file-apng-save3.
  *
  * Revision History:
  *
@@ -56,7 +89,21 @@
 #include <libgimp/gimpui.h>
 
 #include <png.h>                /* PNG library definitions */
-
+#include <zlib.h>               /* zlib definitions, for the strategies */
+
+#include "apng-assemble.h"
+#include "apng-batch.h"
+#include "apng-cache.h"
+#include "apng-chunk.h"
+#include "apng-decoded.h"
+#include "apng-encode.h"
+#include "apng-estimate.h"
+#include "apng-follow.h"
+#include "apng-info.h"
+#include "apng-kernels.h"
+#include "apng-output.h"
+#include "apng-split.h"
+#include "apng-tool.h"
 #include "plugin-intl.h"
 
 
@@ -65,11 +112,24 @@
  */
 
 #define LOAD_PROC              "file-apng-load"
+#define LOAD2_PROC             "file-apng-load2"
 #define SAVE_PROC              "file-apng-save"
 #define SAVE2_PROC             "file-apng-save2"
+#define SAVE3_PROC             "file-apng-save3"
+#define SAVE_BUFFER_PROC       "file-apng-save-to-buffer"
+#define APPEND_PROC            "file-apng-append"
+#define ASSEMBLE_PROC          "file-apng-assemble"
+#define SPLIT_PROC             "file-apng-split"
+#define RECOMPRESS_PROC        "file-apng-recompress"
+#define INFO_PROC              "file-apng-info"
+#define FOLLOW_PROC            "file-apng-load-follow"
 #define SAVE_DEFAULTS_PROC     "file-apng-save-defaults"
 #define GET_DEFAULTS_PROC      "file-apng-get-defaults"
 #define SET_DEFAULTS_PROC      "file-apng-set-defaults"
+#define GET_DEFAULTS3_PROC     "file-apng-get-defaults3"
+#define SET_DEFAULTS3_PROC     "file-apng-set-defaults3"
+#define RESIDENT_PROC          "extension-apng-resident"
+#define RESIDENT_SUFFIX        "-resident"
 #define PLUG_IN_BINARY         "file-apng"
 
 #define PLUG_IN_VERSION        "0.1.0 - 25 April 2010"
@@ -79,6 +139,22 @@
 
 #define PNG_DEFAULTS_PARASITE  "apng-save-defaults"
 
+#define BUDGET_SAMPLE_ROWS     16       /* Rows sampled per frame to
+                                         * estimate its compressibility */
+
+#define ESTIMATE_FRAMES        8        /* Frames sampled for the size
+                                         * estimate of the save dialog */
+#define ESTIMATE_STRIPS        4        /* Strips sampled per frame */
+#define ESTIMATE_STRIP_ROWS    8        /* Rows per strip */
+#define ESTIMATE_POLL_MS       100
+
+#define MAX_REDUCTION          8        /* Of file-apng-load2 */
+
+#define FOLLOW_BUFFER_SIZE     (64 << 10) /* Bytes handed to libpng at once */
+
+#define NUM_SAVE3_VALUES       22       /* Settings of file-apng-save3 */
+#define MAX_OPTIMIZE_PASSES    8        /* See optimize_trials[] */
+
 /*
  * Structures...
  */
@@ -94,6 +170,12 @@ typedef struct
   gboolean  comment;
   gboolean  save_transp_pixels;
   gint      compression_level;
+  gint      compression_budget;         /* Time budget in ms, 0 = off */
+  gboolean  frame_cache;                /* Reuse compressed frames */
+  gint      num_threads;                /* 0 = automatic, 1 = no helpers */
+  gint      filter;                     /* Index in png_filters[] */
+  gint      compression_strategy;       /* Index in zlib_strategies[] */
+  gint      optimize_passes;            /* Encodings tried per frame */
 #if defined(PNG_APNG_SUPPORTED)
   gboolean  as_animation;
   gboolean  first_frame_is_hidden;
@@ -106,6 +188,19 @@ typedef struct
 }
 PngSaveVals;
 
+typedef struct
+{
+  gint      reduction;                  /* Scale down by 1, 2, 4 or 8 */
+  gint      roi_x, roi_y;               /* Part of the canvas loaded, */
+  gint      roi_width, roi_height;      /* all of it if empty */
+  gint      decode_cache;               /* Size of the cache of decoded
+                                         * frames in MB, 0 = off */
+  gboolean  trusted;                    /* Skip CRC and Adler-32 checks */
+  gboolean  merge_duplicates;           /* One layer for repeated frames */
+  gboolean  frame_cache;                /* Enter frames in the frame cache */
+}
+PngLoadVals;
+
 typedef struct
 {
   gboolean   run;
@@ -119,14 +214,169 @@ typedef struct
   GtkWidget *comment;
   GtkWidget *save_transp_pixels;
   GtkObject *compression_level;
+  GtkObject *compression_budget;
 #if defined(PNG_APNG_SUPPORTED)
   GtkWidget *as_animation;
   GtkWidget *first_frame_is_hidden;
   GtkObject *num_plays;
 #endif
+
+  /* Size estimate */
+  GtkWidget          *estimate;
+  ApngEstimator      *estimator;
+  guint               estimate_poll;      /* Timeout source */
+  gint32              image_ID;
+  ApngEstimateSample *still_samples;      /* Of the drawable */
+  gint                num_still_samples;
+  ApngEstimateSample *frame_samples;      /* Of the layers, NULL until
+                                           * saving as animation */
+  gint                num_frame_samples;
+  gint                num_frames;
 }
 PngSaveGui;
 
+typedef struct
+{
+  gint32    layer_ID;                   /* Layer the frame is read from */
+  gint      x, y;                       /* Frame position on the canvas */
+  gint      width, height;              /* Frame size */
+  gint      layer_x, layer_y;           /* Layer position on the canvas */
+  gint      opacity;                    /* Layer opacity, 0..255 */
+  gint      extra_delay;                /* Delay in ms of the layers dropped
+                                         * after this one */
+  GimpLayerModeEffects mode;            /* Layer mode, applied against... */
+  gint32    below_ID;                   /* ...this layer, or -1 */
+}
+PngFrame;
+
+typedef struct
+{
+  gint      tiles_fetched;              /* Tiles read from the core */
+  gint      tiles_in_frames;            /* Distinct tiles the frames cover */
+}
+PngSaveStats;
+
+typedef struct
+{
+  GTimer   *timer;                      /* Wall-clock time of this save */
+  gdouble   budget;                     /* Budget in seconds, 0 = off */
+  gint      frames_left;                /* Frames not written yet */
+  gint      filter;                     /* Of the encoding being tried, */
+  gint      strategy;                   /* as in pngvals */
+}
+CompressionBudget;
+
+/*
+ * Strips of rows are handed between the thread that talks to the GIMP
+ * core and the thread that runs libpng, so that tile transfers overlap
+ * with filtering and deflate.  libgimp isn't thread-safe: while a
+ * pipeline runs, its worker is the only thread that may call libgimp.
+ */
+
+typedef struct
+{
+  guchar   *pixel;                      /* Pixel data */
+  guchar  **rows;                       /* Pixel rows */
+  gint      pass;                       /* Interlace pass */
+  gint      begin;                      /* Beginning frame row */
+  gint      num;                        /* Number of rows */
+}
+PngStrip;
+
+typedef void (* PngStripFunc) (PngStrip *strip,
+                               gpointer  data);
+
+typedef struct
+{
+  GAsyncQueue  *todo;                   /* Strips for the worker */
+  GAsyncQueue  *done;                   /* Strips the worker is done with */
+  gboolean      threaded;               /* Worker from strip_pool, or inline */
+  PngStripFunc  func;                   /* Work done on each strip */
+  gpointer      data;                   /* Data passed to func */
+  gint          pending;                /* Strips not popped back yet */
+}
+PngStripPipeline;
+
+typedef struct
+{
+  const PngFrame *frame;                /* Frame being written */
+  GimpDrawable   *drawable;             /* Drawable for layer */
+  gint            bpp;                  /* Bytes per pixel written */
+  gboolean        direct;               /* Layer rows can be used as is */
+  guchar         *scratch;              /* Layer rows to be converted */
+  gint            num_passes;           /* Number of interlace passes */
+  PngFrame        below;                /* Frame area of the layer below */
+  GimpDrawable   *below_drawable;       /* Drawable for it, or NULL if the
+                                         * layer mode is normal */
+  guchar         *below_pixel;          /* Rows of the layer below */
+  guchar         *below_scratch;        /* Those rows to be converted */
+}
+PngFetchJob;
+
+typedef struct
+{
+  GimpPixelRgn   *pixel_rgn;            /* Pixel region for layer */
+  gint            width;                /* Layer width */
+  gint            height;               /* Layer height */
+  gsize           size;                 /* Size of a strip buffer */
+  gint            num_passes;           /* Number of interlace passes */
+  gint            reduce;               /* Frame pixels per layer pixel,
+                                         * across and down */
+  gint            x;                    /* First column stored */
+  gint            frame_width;          /* Columns stored, before reducing */
+  gint            bpp;                  /* Bytes per pixel */
+  gsize           stride;               /* Bytes per row read */
+  gboolean        indexed;              /* Sample instead of averaging */
+  guchar         *reduced;              /* Strip scaled down */
+  guint16        *sums;                 /* Column sums while reducing */
+  ApngDecodedWriter *writer;            /* Cache entry written, or NULL */
+}
+PngStoreJob;
+
+/*
+ * State of a progressive load, see load_image_follow().  Rows of a frame
+ * are collected and the frame becomes a layer once all of them are in.
+ */
+
+typedef struct
+{
+  const gchar    *filename;
+  gboolean        interactive;
+  gint32          image;                /* -1 until the header is in */
+  gint32          display;              /* Shown while loading, or -1 */
+  png_infop       info;
+  int             trns, bpp, empty;
+  gint            image_type, layer_type;
+  guchar          alpha[256];           /* Index -> Alpha */
+  gint            offset_x, offset_y;   /* From oFFs */
+  png_uint_32     frame;                /* Frame being read */
+  png_uint_32     frame_width, frame_height;
+  png_uint_32     frame_x_offset, frame_y_offset;
+  gint            delay;                /* In ms, -1 = none */
+  png_byte        dispose_op;
+  png_byte        previous_dispose_op;
+  guchar         *pixels;               /* Rows of the frame */
+  gboolean        in_frame;             /* Rows are coming in */
+  gint            num_ready;            /* Frames turned into layers */
+  gboolean        done;                 /* IEND is in */
+}
+PngFollow;
+
+/*
+ * Frames of an animation are looked up by content in the frame cache
+ * before they're compressed, see apng-cache.c.
+ */
+
+typedef struct
+{
+  ApngCache      *cache;                /* Frame cache, NULL if off */
+  gint            level;                /* Compression level wanted */
+  GByteArray     *payload;              /* Image data found in the cache */
+  gchar          *key;                  /* Key of the frame */
+  gboolean        hit;                  /* Found, nothing was written */
+}
+PngFrameLookup;
+
 
 /*
  * Local functions...
@@ -142,11 +392,63 @@ static void      run                       (const gchar      *name,
 static gint32    load_image                (const gchar      *filename,
                                             gboolean          interactive,
                                             GError          **error);
+static gint32    load_image_follow         (const gchar      *filename,
+                                            gdouble           timeout,
+                                            gboolean          interactive,
+                                            gint             *num_ready,
+                                            GError          **error);
+static gboolean  setup_read_transforms     (png_structp       pp,
+                                            png_infop         info,
+                                            guchar           *alpha,
+                                            int              *trns,
+                                            int              *bpp,
+                                            gint             *image_type,
+                                            gint             *layer_type);
+static void      load_image_properties     (gint32            image,
+                                            png_structp       pp,
+                                            png_infop         info,
+                                            gboolean          interactive,
+                                            gint              reduce,
+                                            gint             *offset_x,
+                                            gint             *offset_y);
+static int       load_colormap             (gint32            image,
+                                            png_structp       pp,
+                                            png_infop         info,
+                                            guchar           *alpha);
+#if defined(PNG_APNG_SUPPORTED)
+static gchar *   frame_layer_name          (png_uint_32       frame,
+                                            gint              delay,
+                                            png_byte          previous_dispose_op);
+#endif
+static void      follow_frame_start        (PngFollow        *follow,
+                                            png_structp       pp,
+                                            png_infop         info);
+static void      follow_frame_finish       (PngFollow        *follow);
+static void      follow_info               (png_structp       pp,
+                                            png_infop         info);
+static void      follow_row                (png_structp       pp,
+                                            png_bytep         new_row,
+                                            png_uint_32       row_num,
+                                            int               pass);
+static void      follow_end                (png_structp       pp,
+                                            png_infop         info);
+#if defined(PNG_APNG_SUPPORTED)
+static void      follow_frame_info         (png_structp       pp,
+                                            png_uint_32       frame);
+static void      follow_frame_end          (png_structp       pp,
+                                            png_uint_32       frame);
+#endif
 static gboolean  save_image                (const gchar      *filename,
+                                            GByteArray       *buffer,
                                             gint32            image_ID,
                                             gint32            drawable_ID,
                                             gint32            orig_image_ID,
                                             GError          **error);
+#if defined(PNG_APNG_SUPPORTED)
+static gboolean  append_image              (const gchar      *filename,
+                                            gint32            image_ID,
+                                            GError          **error);
+#endif
 
 static void      read_frame                (gint32            layer,
                                             int               bpp,
@@ -157,29 +459,114 @@ static void      read_frame                (gint32            layer,
                                             png_infop         info,
                                             png_uint_32       frame_width,
                                             png_uint_32       frame_height,
-                                            png_uint_32       frame_x_offset,
-                                            png_uint_32       frame_y_offset,
+                                            gint              crop_x,
+                                            gint              crop_y,
+                                            gint              crop_width,
+                                            gint              crop_height,
+                                            GChecksum        *key,
+                                            ApngDecodedWriter *writer,
                                             GError          **error);
-static gboolean  write_frame               (gint32            drawable_ID,
+static void      add_trns_alpha            (gint32            layer,
+                                            int               empty,
+                                            guchar           *alpha);
+static void      skip_rows                 (png_structp       pp,
+                                            gint              num_rows);
+static void      read_cached_frames        (gint32            image,
+                                            ApngDecodedEntry *entry,
+                                            gint              layer_type,
+                                            int               bpp,
+                                            int               empty,
+                                            int               trns,
+                                            guchar           *alpha);
+static void      cache_decoded_layer       (ApngDecodedWriter *writer,
+                                            gint32            layer,
+                                            const gchar      *name,
+                                            int               bpp);
+#if defined(PNG_APNG_SUPPORTED)
+static void      cache_file_frames         (const gchar      *filename,
+                                            GPtrArray        *keys);
+#endif
+#if defined(PNG_APNG_SUPPORTED)
+static PngFrame * plan_frames              (gint32            image_ID,
+                                            const gint32     *layers,
+                                            gint              nlayers,
+                                            gint             *nframes,
+                                            GimpImageType    *type);
+#endif
+static gboolean  write_frame               (const PngFrame   *frame,
                                             gint              bpp,
                                             guchar            red,
                                             guchar            green,
                                             guchar            blue,
-                                            guchar           *remap,
-                                            gboolean          as_animation,
+                                            const ApngRemap  *remap,
                                             png_structp       pp,
                                             png_infop         info,
-                                            png_uint_32       offx,
-                                            png_uint_32       offy,
-                                            png_uint_16       frame_delay_num,
-                                            png_uint_16       frame_delay_den,
-                                            png_byte          frame_dispose_op,
-                                            png_byte          frame_blend_op,
+                                            PngFrameLookup   *lookup,
+                                            CompressionBudget *budget,
+                                            guchar          **keep_pixel,
+                                            GError          **error);
+#if defined(PNG_APNG_SUPPORTED)
+static ApngFrameEncoder * encode_animation_frame (const PngFrame    *frame,
+                                                  gint               bpp,
+                                                  guchar             red,
+                                                  guchar             green,
+                                                  guchar             blue,
+                                                  const ApngRemap   *remap,
+                                                  const ApngFormat  *format,
+                                                  PngFrameLookup    *lookup,
+                                                  CompressionBudget *budget,
+                                                  guchar           **keep_pixel,
+                                                  GError           **error);
+static ApngFrameEncoder * encode_frame_rows      (const PngFrame    *frame,
+                                                  guchar            *pixel,
+                                                  gint               bpp,
+                                                  const ApngFormat  *format,
+                                                  gint               filter,
+                                                  gint               strategy);
+static gboolean  write_animation_frame     (const PngFrame   *frame,
+                                            gint              index,
+                                            gint              bpp,
+                                            guchar            red,
+                                            guchar            green,
+                                            guchar            blue,
+                                            const ApngRemap  *remap,
+                                            const ApngFormat *format,
+                                            ApngFrameControl *fc,
+                                            guint32          *sequence,
+                                            ApngOutput       *output,
+                                            ApngCache        *cache,
+                                            CompressionBudget *budget,
                                             GError          **error);
+#endif
+static gdouble   time_sample_encode        (const guchar     *sample,
+                                            gint              width,
+                                            gint              rows,
+                                            gint              bpp,
+                                            gint              level,
+                                            const CompressionBudget *budget,
+                                            gsize            *packed_len);
+static void      write_frame_free          (PngFetchJob      *job,
+                                            PngStrip         *strips,
+                                            guchar           *frame_pixel,
+                                            guchar          **frame_rows);
+static void      choose_frame_compression  (png_structp       pp,
+                                            GimpPixelRgn     *pixel_rgn,
+                                            gint              bpp,
+                                            gint              row_bytes,
+                                            gint              height,
+                                            gboolean          indexed,
+                                            CompressionBudget *budget);
+static void      set_frame_compression     (png_structp       pp,
+                                            gint              row_bytes,
+                                            gint              height,
+                                            gint              level,
+                                            gint              strategy,
+                                            gint              filter);
 #if defined(PNG_APNG_SUPPORTED)
 static void      parse_delay_tag           (png_uint_16      *delay_num,
                                             png_uint_16      *delay_den,
-                                            const gchar      *str);
+                                            const gchar      *str,
+                                            gint              extra);
 static gint      parse_ms_tag              (const gchar      *str);
 static gint      parse_dispose_op_tag      (const gchar      *str);
 #endif
@@ -188,7 +575,8 @@ static void      respin_cmap               (png_structp       pp,
                                             png_infop         info,
                                             guchar           *remap,
                                             gint32            image_ID,
-                                            GimpDrawable     *drawable);
+                                            const gint32     *layers,
+                                            gint              nframes);
 
 static gboolean  save_dialog               (gint32            image_ID,
                                             gboolean          alpha);
@@ -197,11 +585,99 @@ static void      save_dialog_response      (GtkWidget        *widget,
                                             gint              response_id,
                                             gpointer          data);
 
-static gboolean  ia_has_transparent_pixels (GimpDrawable     *drawable);
+static ApngEstimateSample * estimate_take_samples (gint32          image_ID,
+                                                   const PngFrame *frames,
+                                                   gint            nframes,
+                                                   GimpImageType   type,
+                                                   gint           *num_samples);
+static void      estimate_free_samples     (ApngEstimateSample *samples,
+                                            gint              num_samples);
+static void      save_estimate_update      (PngSaveGui       *pg);
+static gboolean  save_estimate_poll        (gpointer          data);
+
+static gint      fetch_strip               (GimpDrawable     *drawable,
+                                            guchar           *buf,
+                                            gint              x,
+                                            gint              y,
+                                            gint              width,
+                                            gint              height);
+static GimpDrawable * get_frame_below     (const PngFrame   *frame,
+                                            PngFrame         *below);
+static gboolean  simple_layer_mode         (GimpLayerModeEffects mode);
+static void      apply_layer_mode          (const PngFrame   *frame,
+                                            const PngFrame   *below,
+                                            GimpDrawable     *below_drawable,
+                                            gint              bpp,
+                                            guchar           *pixel,
+                                            const guchar     *below_pixel,
+                                            gint              begin,
+                                            gint              num);
+static void      fetch_frame_rows          (const PngFrame   *frame,
+                                            GimpDrawable     *drawable,
+                                            gint              bpp,
+                                            guchar           *pixel,
+                                            guchar           *scratch,
+                                            gint              begin,
+                                            gint              num);
+
+static void      strip_alloc               (PngStrip         *strip,
+                                            gint              num_rows,
+                                            gsize             row_bytes);
+static void      strip_free                (PngStrip         *strip);
+static gboolean  strip_next                (PngStrip         *strip,
+                                            gint             *pass,
+                                            gint             *begin,
+                                            gint              first,
+                                            gint              tile_height,
+                                            gint              height,
+                                            gint              num_passes);
+static void      fetch_strip_rows          (PngStrip         *strip,
+                                            gpointer          data);
+static void      crop_strip_rows           (PngStrip         *strip,
+                                            PngStoreJob      *job,
+                                            gboolean          pack);
+static void      reduce_strip_rows         (PngStrip         *strip,
+                                            PngStoreJob      *job);
+static void      store_strip_rows          (PngStrip         *strip,
+                                            gpointer          data);
+
+static PngStripPipeline * strip_pipeline_new  (PngStripFunc   func,
+                                               gpointer       data,
+                                               gboolean       threaded);
+static void      strip_pipeline_push       (PngStripPipeline *pipeline,
+                                            PngStrip         *strip);
+static PngStrip * strip_pipeline_pop       (PngStripPipeline *pipeline);
+static void      strip_pipeline_free       (PngStripPipeline *pipeline);
+
+#if defined(PNG_APNG_SUPPORTED)
+static gboolean  animation_needs_export    (gint32            image_ID);
+#endif
+
+static gint      find_unused_ia_color      (const gint32     *layers,
+                                            gint              nframes,
+                                            gint             *colors,
+                                            gboolean         *trans_used);
+
+static void      tool_progress             (gdouble           fraction,
+                                            gpointer          data);
+
+static void      resident_serve            (void);
+static void      resident_run              (const gchar      *name,
+                                            gint              nparams,
+                                            const GimpParam  *param,
+                                            gint             *nreturn_vals,
+                                            GimpParam       **return_vals);
 
-static gint      find_unused_ia_color      (GimpDrawable     *drawable,
-                                            gint             *colors);
+static void      write_output_data         (png_structp       pp,
+                                            png_bytep         data,
+                                            png_size_t        length);
+static void      flush_output_data         (png_structp       pp);
 
+static gboolean  load_vals_set             (const GimpParam  *param,
+                                            gint              nparams);
+static void      save_vals_get             (gint             *values);
+static gboolean  save_vals_set             (const gint       *values,
+                                            gint              num_values);
 static void      load_defaults             (void);
 static void      save_defaults             (void);
 static void      load_gui_defaults         (PngSaveGui       *pg);
@@ -236,6 +712,12 @@ static const PngSaveVals defaults =
   TRUE,
   TRUE,
   9,
+  0,
+  TRUE,
+  0,
+  0,
+  0,
+  1,
 #if defined(PNG_APNG_SUPPORTED)
   FALSE,
   FALSE,
@@ -249,12 +731,91 @@ static const PngSaveVals defaults =
 
 static PngSaveVals pngvals;
 
+static const PngLoadVals load_defaults_vals =
+{
+  1,
+  0, 0,
+  0, 0,
+  0,
+  FALSE,
+  FALSE,
+  FALSE
+};
+
+static PngLoadVals loadvals;
+
+static PngSaveStats save_stats;
+
+static PngStrip     strip_end;          /* Stops a pipeline worker */
+
+/* Threads of the pipeline workers, kept for the next frame or call */
+static GThreadPool *strip_pool = NULL;
+
+/* Row filters of the "filter" setting, 0 leaves them to libpng */
+static const gint png_filters[] =
+{
+  0,
+  PNG_FILTER_NONE,
+  PNG_FILTER_SUB,
+  PNG_FILTER_UP,
+  PNG_FILTER_AVG,
+  PNG_FILTER_PAETH,
+  PNG_ALL_FILTERS
+};
+
+/* zlib strategies of the "strategy" setting, -1 picks one per frame */
+static const gint zlib_strategies[] =
+{
+  -1,
+  Z_DEFAULT_STRATEGY,
+  Z_FILTERED,
+  Z_HUFFMAN_ONLY,
+#if defined(Z_RLE)
+  Z_RLE
+#else
+  Z_DEFAULT_STRATEGY
+#endif
+};
+
+/* Filter and strategy tried by each optimization pass after the first,
+ * which uses the settings */
+static const struct
+{
+  gint filter;
+  gint strategy;
+}
+optimize_trials[MAX_OPTIMIZE_PASSES - 1] =
+{
+  { 6, 2 },                             /* Adaptive, filtered */
+  { 1, 1 },                             /* None, default */
+  { 5, 2 },                             /* Paeth, filtered */
+  { 3, 4 },                             /* Up, run-length */
+  { 6, 1 },                             /* Adaptive, default */
+  { 2, 1 },                             /* Sub, default */
+  { 1, 4 }                              /* None, run-length */
+};
+
 
 /*
- * 'main()' - Main entry - just call gimp_main()...
+ * 'main()' - Main entry - call gimp_main() or a tool.
+ *
+ * Started by GIMP this is a plug-in, from the command line it runs the
+ * tools of apng-tool.c.
  */
 
+#ifdef G_OS_WIN32
 MAIN ()
+#else
+int
+main (int    argc,
+      char **argv)
+{
+  if (apng_tool_wanted (argc, argv))
+    return apng_tool_main (argc, argv);
+
+  return gimp_main (&PLUG_IN_INFO, argc, argv);
+}
+#endif
 
 
 /*
@@ -274,6 +835,21 @@ query (void)
   {
     { GIMP_PDB_IMAGE, "image", "Output image" }
   };
+  static const GimpParamDef load2_args[] =
+  {
+    { GIMP_PDB_INT32,  "run-mode",     "Interactive, non-interactive" },
+    { GIMP_PDB_STRING, "filename",     "The name of the file to load" },
+    { GIMP_PDB_STRING, "raw-filename", "The name of the file to load" },
+    { GIMP_PDB_INT32,  "reduction",    "Scale the image down by 1, 2, 4 or 8" },
+    { GIMP_PDB_INT32,  "roi-x",        "Left edge of the region of the canvas to load" },
+    { GIMP_PDB_INT32,  "roi-y",        "Top edge of the region" },
+    { GIMP_PDB_INT32,  "roi-width",    "Width of the region, 0 = the whole canvas" },
+    { GIMP_PDB_INT32,  "roi-height",   "Height of the region, 0 = the whole canvas" },
+    { GIMP_PDB_INT32,  "decode-cache", "Size of the cache of decoded frames in MB, 0 = no cache" },
+    { GIMP_PDB_INT32,  "trusted",      "Skip the checksums of chunks and image data (TRUE or FALSE)" },
+    { GIMP_PDB_INT32,  "merge-duplicates", "Load repeated frames as one layer (TRUE or FALSE)" },
+    { GIMP_PDB_INT32,  "frame-cache",  "Enter the frames in the frame cache of file-apng-save3 (TRUE or FALSE)" }
+  };
 
 #define COMMON_SAVE_ARGS \
     { GIMP_PDB_INT32,    "run-mode",     "Interactive, non-interactive" }, \
@@ -296,6 +872,22 @@ query (void)
     { GIMP_PDB_INT32, "comment", "Write comment?"                        }, \
     { GIMP_PDB_INT32, "svtrans", "Preserve color of transparent pixels?" }
 
+#define SAVE3_CONFIG_ARGS \
+    FULL_CONFIG_ARGS,                                                       \
+    { GIMP_PDB_INT32, "as-animation",       "Save the layers as the frames of an animation?" }, \
+    { GIMP_PDB_INT32, "first-frame-hidden", "Leave the first frame out of the animation, for viewers without APNG support?" }, \
+    { GIMP_PDB_INT32, "num-plays",          "Number of times to play, 0 = forever" }, \
+    { GIMP_PDB_INT32, "delay-num",          "Numerator of the delay in seconds of frames whose layer names give none" }, \
+    { GIMP_PDB_INT32, "delay-den",          "Denominator of the delay, 0 = 100" }, \
+    { GIMP_PDB_INT32, "dispose-op",         "Disposal of frames whose layer names give none { NONE (0), BACKGROUND (1), PREVIOUS (2) }" }, \
+    { GIMP_PDB_INT32, "blend-op",           "Blending of frames { SOURCE (0), OVER (1) }" }, \
+    { GIMP_PDB_INT32, "frame-cache",        "Reuse frames compressed by earlier saves?" }, \
+    { GIMP_PDB_INT32, "compression-budget", "Time in ms to fit the compression of all frames in, 0 = off" }, \
+    { GIMP_PDB_INT32, "threads",            "Helper threads, 0 = automatic, 1 = do all work in the calling thread" }, \
+    { GIMP_PDB_INT32, "filter",             "Row filter { AUTO (0), NONE (1), SUB (2), UP (3), AVERAGE (4), PAETH (5), ADAPTIVE (6) }" }, \
+    { GIMP_PDB_INT32, "strategy",           "Deflate strategy { AUTO (0), DEFAULT (1), FILTERED (2), HUFFMAN-ONLY (3), RLE (4) }" }, \
+    { GIMP_PDB_INT32, "passes",             "Encodings tried per animation frame, keeping the smallest (1--8)" }
+
   static const GimpParamDef save_args[] =
   {
     COMMON_SAVE_ARGS,
@@ -308,11 +900,120 @@ query (void)
     FULL_CONFIG_ARGS
   };
 
+  static const GimpParamDef save_args3[] =
+  {
+    COMMON_SAVE_ARGS,
+    SAVE3_CONFIG_ARGS
+  };
+
+  static const GimpParamDef save_args_buffer[] =
+  {
+    { GIMP_PDB_INT32,    "run-mode",     "Non-interactive"              },
+    { GIMP_PDB_IMAGE,    "image",        "Input image"                  },
+    { GIMP_PDB_DRAWABLE, "drawable",     "Drawable to save"             },
+    FULL_CONFIG_ARGS
+  };
+
+  static const GimpParamDef save_buffer_return_vals[] =
+  {
+    { GIMP_PDB_INT32,     "length", "Length of the encoded image" },
+    { GIMP_PDB_INT8ARRAY, "data",   "The encoded image"           }
+  };
+
+  static const GimpParamDef save3_return_vals[] =
+  {
+    { GIMP_PDB_INT32, "tiles-fetched",   "Number of tiles read from the layers" },
+    { GIMP_PDB_INT32, "tiles-in-frames", "Number of layer tiles the frames cover, each of which is read once unless a layer mode needs the layer below" }
+  };
+
   static const GimpParamDef save_args_defaults[] =
   {
     COMMON_SAVE_ARGS
   };
 
+  static const GimpParamDef assemble_args[] =
+  {
+    { GIMP_PDB_INT32,  "run-mode",  "Interactive, non-interactive" },
+    { GIMP_PDB_STRING, "directory", "Directory of PNG frames"      },
+    { GIMP_PDB_STRING, "filename",  "The name of the file to save the animation in" },
+    { GIMP_PDB_INT32,  "delay",     "Frame delay in ms, for frames the manifest gives none" },
+    { GIMP_PDB_STRING, "manifest",  "File listing the frames and their delays, or empty for all PNG files of the directory" },
+    { GIMP_PDB_INT32,  "num-plays", "Number of times to play, 0 = forever" },
+    { GIMP_PDB_INT32,  "optimize",  "Store only what changed between frames?" }
+  };
+
+  static const GimpParamDef split_args[] =
+  {
+    { GIMP_PDB_INT32,  "run-mode",     "Interactive, non-interactive" },
+    { GIMP_PDB_STRING, "filename",     "The name of the APNG file to split" },
+    { GIMP_PDB_STRING, "raw-filename", "The name of the APNG file to split" },
+    { GIMP_PDB_STRING, "directory",    "Directory to write the frames to" },
+    { GIMP_PDB_INT32,  "composite",    "Write frames as shown, rather than as stored?" }
+  };
+
+  static const GimpParamDef recompress_args[] =
+  {
+    { GIMP_PDB_INT32,       "run-mode",    "Interactive, non-interactive" },
+    { GIMP_PDB_INT32,       "num-inputs",  "Number of input files"        },
+    { GIMP_PDB_STRINGARRAY, "inputs",      "The PNG or APNG files to convert" },
+    { GIMP_PDB_INT32,       "num-outputs", "Number of output files, the same as num-inputs" },
+    { GIMP_PDB_STRINGARRAY, "outputs",     "The names to save the recompressed files as" },
+    { GIMP_PDB_INT32,       "compression", "Deflate Compression factor (0--9)" }
+  };
+
+  static const GimpParamDef info_args[] =
+  {
+    { GIMP_PDB_INT32,  "run-mode",     "Interactive, non-interactive" },
+    { GIMP_PDB_STRING, "filename",     "The name of the file to look at" },
+    { GIMP_PDB_STRING, "raw-filename", "The name of the file to look at" }
+  };
+
+  static const GimpParamDef info_return_vals[] =
+  {
+    { GIMP_PDB_INT32,      "width",        "Width of the image"              },
+    { GIMP_PDB_INT32,      "height",       "Height of the image"             },
+    { GIMP_PDB_INT32,      "num-plays",    "Number of times to play, 0 = forever" },
+    { GIMP_PDB_FLOAT,      "duration",     "Duration of one play in ms"      },
+    { GIMP_PDB_INT32,      "num-frames",   "Number of frames, 1 for still images" },
+    { GIMP_PDB_FLOATARRAY, "delays",       "Delay of each frame in ms"       },
+    { GIMP_PDB_INT32,      "num-geometry", "Four times the number of frames" },
+    { GIMP_PDB_INT32ARRAY, "geometry",     "X offset, Y offset, width and height of each frame" }
+  };
+
+  static const GimpParamDef follow_args[] =
+  {
+    { GIMP_PDB_INT32,  "run-mode",     "Interactive, non-interactive" },
+    { GIMP_PDB_STRING, "filename",     "The name of the file or pipe to load" },
+    { GIMP_PDB_STRING, "raw-filename", "The name of the file or pipe to load" },
+    { GIMP_PDB_FLOAT,  "timeout",      "Seconds without new data after which a file is taken as finished" }
+  };
+
+  static const GimpParamDef follow_return_vals[] =
+  {
+    { GIMP_PDB_IMAGE, "image",      "Output image" },
+    { GIMP_PDB_INT32, "num-frames", "Number of frames that were complete" }
+  };
+
+  static const GimpParamDef resident_args[] =
+  {
+    { GIMP_PDB_INT32, "run-mode", "Interactive, non-interactive" }
+  };
+
+  static const GimpParamDef recompress_return_vals[] =
+  {
+    { GIMP_PDB_INT32,       "num-errors",  "Number of error messages, one per input file" },
+    { GIMP_PDB_STRINGARRAY, "errors",      "Error message of each file, empty if it was recompressed" }
+  };
+
+  static const GimpParamDef append_args[] =
+  {
+    { GIMP_PDB_INT32,    "run-mode",     "Interactive, non-interactive" },
+    { GIMP_PDB_IMAGE,    "image",        "Image whose layers are appended" },
+    { GIMP_PDB_DRAWABLE, "drawable",     "Drawable (unused)"            },
+    { GIMP_PDB_STRING,   "filename",     "The name of the APNG file to append to" },
+    { GIMP_PDB_STRING,   "raw-filename", "The name of the APNG file to append to" }
+  };
+
   static const GimpParamDef save_get_defaults_return_vals[] =
   {
     FULL_CONFIG_ARGS
@@ -323,6 +1024,16 @@ query (void)
     FULL_CONFIG_ARGS
   };
 
+  static const GimpParamDef save_get_defaults3_return_vals[] =
+  {
+    SAVE3_CONFIG_ARGS
+  };
+
+  static const GimpParamDef save_args_set_defaults3[] =
+  {
+    SAVE3_CONFIG_ARGS
+  };
+
   gchar *help_path;
   gchar *help_uri;
 
@@ -359,6 +1070,46 @@ query (void)
   gimp_register_magic_load_handler (LOAD_PROC,
                                     "png", "", "0,string,\211PNG\r\n\032\n");
 
+  gimp_install_procedure (LOAD2_PROC,
+                          "Loads PNG and APNG files with options",
+                          "This procedure loads Portable Network Graphics "
+                          "(PNG+APNG) files like file-apng-load, with these "
+                          "options: \"reduction\" scales every frame down "
+                          "by a power of two while it's decoded, averaging "
+                          "each square of pixels, or sampling them in "
+                          "indexed images.  Layer sizes are rounded up and "
+                          "offsets down, so long animations can be looked "
+                          "through at a fraction of the memory.  "
+                          "\"roi-*\" load a rectangle of the canvas: the "
+                          "image is the rectangle, each frame is cut down "
+                          "to its part of it, and frames outside of it "
+                          "aren't loaded.  \"decode-cache\" keeps the "
+                          "decoded frames in a cache of that many MB on "
+                          "disk, from where loading the same file with the "
+                          "same options again maps them instead of "
+                          "decoding.  \"trusted\" is for files known to be "
+                          "good, such as those just written by a script: "
+                          "neither chunk CRCs nor the Adler-32 of image "
+                          "data are computed, while broken structure is "
+                          "still reported.  \"merge-duplicates\" loads a "
+                          "frame that repeats the one before it, in the "
+                          "same place, as part of the layer of that frame, "
+                          "adding its delay to the layer's; the cache of "
+                          "decoded frames isn't used then.  \"frame-cache\" "
+                          "enters the compressed frames of 8-bit and "
+                          "indexed animations in the frame cache, so that "
+                          "saving them unchanged with the frame cache on "
+                          "copies their image data.",
+                          "Daisuke Nishikawa <daisuken@users.sourceforge.net>",
+                          "Daisuke Nishikawa <daisuken@users.sourceforge.net>",
+                          PLUG_IN_VERSION,
+                          NULL,
+                          NULL,
+                          GIMP_PLUGIN,
+                          G_N_ELEMENTS (load2_args),
+                          G_N_ELEMENTS (load_return_vals),
+                          load2_args, load_return_vals);
+
   gimp_install_procedure (SAVE_PROC,
                           "Saves files in PNG+APNG file format",
                           "This plug-in saves Portable Network Graphics "
@@ -399,6 +1150,171 @@ query (void)
                           G_N_ELEMENTS (save_args2), 0,
                           save_args2, NULL);
 
+  gimp_install_procedure (SAVE3_PROC,
+                          "Saves files in PNG+APNG file format",
+                          "This plug-in saves Portable Network Graphics "
+                          "(PNG+APNG) files.  "
+                          "This procedure adds the animation settings and "
+                          "the encoder settings to file-apng-save2.  Run "
+                          "non-interactively, images with several layers "
+                          "are flattened unless \"as-animation\" is set.  "
+                          "Layer names can still give the delay and "
+                          "disposal of each frame, as in \"(250ms) "
+                          "(replace)\".  The numbers of tiles read and "
+                          "covered are returned, to check that each tile "
+                          "crossed over from GIMP once.",
+                          "Daisuke Nishikawa <daisuken@users.sourceforge.net>",
+                          "Daisuke Nishikawa <daisuken@users.sourceforge.net>",
+                          PLUG_IN_VERSION,
+                          N_("PNG+APNG image"),
+                          "RGB*,GRAY*,INDEXED*",
+                          GIMP_PLUGIN,
+                          G_N_ELEMENTS (save_args3),
+                          G_N_ELEMENTS (save3_return_vals),
+                          save_args3, save3_return_vals);
+
+  gimp_install_procedure (SAVE_BUFFER_PROC,
+                          "Saves an image in PNG+APNG format to memory",
+                          "This procedure encodes the image like "
+                          "file-apng-save2, but returns the encoded data "
+                          "instead of writing a file.  Images with several "
+                          "layers are saved as animations.",
+                          "Daisuke Nishikawa <daisuken@users.sourceforge.net>",
+                          "Daisuke Nishikawa <daisuken@users.sourceforge.net>",
+                          PLUG_IN_VERSION,
+                          NULL,
+                          "RGB*,GRAY*,INDEXED*",
+                          GIMP_PLUGIN,
+                          G_N_ELEMENTS (save_args_buffer),
+                          G_N_ELEMENTS (save_buffer_return_vals),
+                          save_args_buffer, save_buffer_return_vals);
+
+  gimp_install_procedure (ASSEMBLE_PROC,
+                          "Builds an APNG file from a directory of PNG files",
+                          "This procedure writes the PNG files of a "
+                          "directory, in name order, or those listed in a "
+                          "manifest, as the frames of an animation.  Frames "
+                          "are read one at a time, without loading them "
+                          "into GIMP.  The animation is in gray or without "
+                          "alpha if none of the frames needs more.  Each "
+                          "line of a manifest is a file name relative to "
+                          "the directory, optionally followed by the delay "
+                          "of the frame in ms.",
+                          "Daisuke Nishikawa <daisuken@users.sourceforge.net>",
+                          "Daisuke Nishikawa <daisuken@users.sourceforge.net>",
+                          PLUG_IN_VERSION,
+                          NULL,
+                          NULL,
+                          GIMP_PLUGIN,
+                          G_N_ELEMENTS (assemble_args), 0,
+                          assemble_args, NULL);
+
+  gimp_install_procedure (SPLIT_PROC,
+                          "Writes the frames of an APNG file as PNG files",
+                          "This procedure writes each frame of an animation "
+                          "to a PNG file of its own, NAME-0001.png and so "
+                          "on, without loading it into GIMP, and lists them "
+                          "with their delays in NAME.txt, a manifest that "
+                          "file-apng-assemble reads back.  Frames are "
+                          "written as stored, by copying their compressed "
+                          "data, unless \"composite\" asks for them as "
+                          "they are shown.",
+                          "Daisuke Nishikawa <daisuken@users.sourceforge.net>",
+                          "Daisuke Nishikawa <daisuken@users.sourceforge.net>",
+                          PLUG_IN_VERSION,
+                          NULL,
+                          NULL,
+                          GIMP_PLUGIN,
+                          G_N_ELEMENTS (split_args), 0,
+                          split_args, NULL);
+
+  gimp_install_procedure (RECOMPRESS_PROC,
+                          "Recompresses many PNG and APNG files in one call",
+                          "This procedure writes each input file to the "
+                          "output file of the same index, with its image "
+                          "data compressed again at the given level and "
+                          "everything else, frames and metadata alike, "
+                          "kept.  Only the deflate level changes: the "
+                          "pixels, color type, interlacing and filters "
+                          "stay as they are, other save options need "
+                          "loading and saving the file.  Files are "
+                          "recompressed in parallel, without loading them "
+                          "into GIMP, so large batches don't pay for "
+                          "starting the plug-in once per file.  The output "
+                          "may be the input file itself.",
+                          "Daisuke Nishikawa <daisuken@users.sourceforge.net>",
+                          "Daisuke Nishikawa <daisuken@users.sourceforge.net>",
+                          PLUG_IN_VERSION,
+                          NULL,
+                          NULL,
+                          GIMP_PLUGIN,
+                          G_N_ELEMENTS (recompress_args),
+                          G_N_ELEMENTS (recompress_return_vals),
+                          recompress_args, recompress_return_vals);
+
+  gimp_install_procedure (INFO_PROC,
+                          "Tells the size, frames and timing of a PNG or "
+                          "APNG file",
+                          "This procedure reads only the chunk headers and "
+                          "the small chunks of a file, without decoding "
+                          "image data or creating an image, and returns "
+                          "its size, the number of times it plays, and the "
+                          "delay and place of each frame.  Frames are those "
+                          "that are played, so a hidden default image isn't "
+                          "one.",
+                          "Daisuke Nishikawa <daisuken@users.sourceforge.net>",
+                          "Daisuke Nishikawa <daisuken@users.sourceforge.net>",
+                          PLUG_IN_VERSION,
+                          NULL,
+                          NULL,
+                          GIMP_PLUGIN,
+                          G_N_ELEMENTS (info_args),
+                          G_N_ELEMENTS (info_return_vals),
+                          info_args, info_return_vals);
+
+  gimp_install_procedure (FOLLOW_PROC,
+                          "Loads a PNG or APNG file while it is written",
+                          "This procedure reads a file that another program "
+                          "is still writing, or a named pipe, with libpng's "
+                          "progressive reader.  Each frame becomes a layer "
+                          "as soon as all of its image data is in, and the "
+                          "progress tells how many frames are ready; run "
+                          "interactively, the image is shown from the first "
+                          "frame on.  The load ends at the end of the "
+                          "animation, when a pipe is closed, or when a file "
+                          "hasn't grown for \"timeout\" seconds, keeping "
+                          "the frames that are complete.",
+                          "Daisuke Nishikawa <daisuken@users.sourceforge.net>",
+                          "Daisuke Nishikawa <daisuken@users.sourceforge.net>",
+                          PLUG_IN_VERSION,
+                          NULL,
+                          NULL,
+                          GIMP_PLUGIN,
+                          G_N_ELEMENTS (follow_args),
+                          G_N_ELEMENTS (follow_return_vals),
+                          follow_args, follow_return_vals);
+
+#if defined(PNG_APNG_SUPPORTED)
+  gimp_install_procedure (APPEND_PROC,
+                          "Appends the layers of an image to an APNG file",
+                          "This procedure adds the layers of the image, "
+                          "bottom layer first, as new frames at the end of "
+                          "an existing APNG animation.  Only the new frames "
+                          "are compressed, and the file is updated in place.  "
+                          "The image must have the size and color type of "
+                          "the animation, and indexed images its palette.  "
+                          "Frame delays are taken from the layer names, the "
+                          "other settings are those of the last save.",
+                          "Daisuke Nishikawa <daisuken@users.sourceforge.net>",
+                          "Daisuke Nishikawa <daisuken@users.sourceforge.net>",
+                          PLUG_IN_VERSION,
+                          NULL,
+                          "RGB*,GRAY*,INDEXED*",
+                          GIMP_PLUGIN,
+                          G_N_ELEMENTS (append_args), 0,
+                          append_args, NULL);
+#endif
+
   gimp_install_procedure (SAVE_DEFAULTS_PROC,
                           "Saves files in PNG file format",
                           "This plug-in saves Portable Network Graphics (PNG) "
@@ -465,21 +1381,74 @@ query (void)
                           GIMP_PLUGIN,
                           G_N_ELEMENTS (save_args_set_defaults), 0,
                           save_args_set_defaults, NULL);
-}
-
-
-/*
- * 'run()' - Run the plug-in...
- */
 
-static void
-run (const gchar      *name,
+  gimp_install_procedure (GET_DEFAULTS3_PROC,
+                          "Get all the defaults used by the PNG file save "
+                          "plug-in",
+                          "This procedure returns the defaults stored as a "
+                          "parasite for the PNG save plug-in, with the "
+                          "settings of file-apng-save3.",
+                          "Daisuke Nishikawa <daisuken@users.sourceforge.net>",
+                          "Daisuke Nishikawa <daisuken@users.sourceforge.net>",
+                          PLUG_IN_VERSION,
+                          NULL,
+                          NULL,
+                          GIMP_PLUGIN,
+                          0, G_N_ELEMENTS (save_get_defaults3_return_vals),
+                          NULL, save_get_defaults3_return_vals);
+
+  gimp_install_procedure (SET_DEFAULTS3_PROC,
+                          "Set all the defaults used by the PNG file save "
+                          "plug-in",
+                          "This procedure sets the defaults stored as a "
+                          "parasite for the PNG save plug-in, with the "
+                          "settings of file-apng-save3.",
+                          "Daisuke Nishikawa <daisuken@users.sourceforge.net>",
+                          "Daisuke Nishikawa <daisuken@users.sourceforge.net>",
+                          PLUG_IN_VERSION,
+                          NULL,
+                          NULL,
+                          GIMP_PLUGIN,
+                          G_N_ELEMENTS (save_args_set_defaults3), 0,
+                          save_args_set_defaults3, NULL);
+
+  gimp_install_procedure (RESIDENT_PROC,
+                          "Keeps the APNG plug-in running between calls",
+                          "This procedure starts an instance of the plug-in "
+                          "that stays around and serves the file-apng-load, "
+                          "-save, -save2, -save3, -save-to-buffer, -append, "
+                          "-assemble, -split, -recompress and -info "
+                          "procedures under "
+                          "the same names with \"" RESIDENT_SUFFIX "\" "
+                          "appended, as in file-apng-load" RESIDENT_SUFFIX
+                          ".  These take the same arguments and skip "
+                          "starting the plug-in, which is most of the cost "
+                          "of loading or saving a small file.  The "
+                          "procedure returns once they are installed; the "
+                          "instance runs until GIMP quits.",
+                          "Daisuke Nishikawa <daisuken@users.sourceforge.net>",
+                          "Daisuke Nishikawa <daisuken@users.sourceforge.net>",
+                          PLUG_IN_VERSION,
+                          NULL,
+                          NULL,
+                          GIMP_EXTENSION,
+                          G_N_ELEMENTS (resident_args), 0,
+                          resident_args, NULL);
+}
+
+
+/*
+ * 'run()' - Run the plug-in...
+ */
+
+static void
+run (const gchar      *name,
      gint              nparams,
      const GimpParam  *param,
      gint             *nreturn_vals,
      GimpParam       **return_vals)
 {
-  static GimpParam  values[10];
+  static GimpParam  values[1 + NUM_SAVE3_VALUES];
   GimpRunMode       run_mode;
   GimpPDBStatusType status = GIMP_PDB_SUCCESS;
   gint32            image_ID;
@@ -488,34 +1457,75 @@ run (const gchar      *name,
   GimpExportReturn  export = GIMP_EXPORT_CANCEL;
   GError           *error  = NULL;
 
+  /* What the previous call returned, which a resident instance frees
+   * once GIMP has it */
+  static GError    *returned_error   = NULL;
+  static gchar    **returned_strings = NULL;
+  static GSList    *returned_data    = NULL;
+
+  g_clear_error (&returned_error);
+  g_strfreev (returned_strings);
+#if GLIB_CHECK_VERSION (2, 28, 0)
+  g_slist_free_full (returned_data, g_free);
+#else
+  while (returned_data)
+    {
+      g_free (returned_data->data);
+      returned_data = g_slist_delete_link (returned_data, returned_data);
+    }
+#endif
+  returned_strings = NULL;
+  returned_data    = NULL;
+
   INIT_I18N ();
 
+#if ! GLIB_CHECK_VERSION (2, 32, 0)
+  if (! g_thread_supported ())
+    g_thread_init (NULL);
+#endif
+
   *nreturn_vals = 1;
   *return_vals = values;
 
   values[0].type          = GIMP_PDB_STATUS;
   values[0].data.d_status = GIMP_PDB_EXECUTION_ERROR;
 
-  if (strcmp (name, LOAD_PROC) == 0)
+  if (strcmp (name, RESIDENT_PROC) == 0)
+    {
+      resident_serve ();
+    }
+  else if (strcmp (name, LOAD_PROC)  == 0 ||
+           strcmp (name, LOAD2_PROC) == 0)
     {
       run_mode = param[0].data.d_int32;
 
-      image_ID = load_image (param[1].data.d_string,
-                             run_mode == GIMP_RUN_INTERACTIVE, &error);
+      /* A resident instance must not carry options over */
+      loadvals = load_defaults_vals;
 
-      if (image_ID != -1)
+      if (strcmp (name, LOAD2_PROC) == 0 && ! load_vals_set (param, nparams))
         {
-          *nreturn_vals = 2;
-          values[1].type = GIMP_PDB_IMAGE;
-          values[1].data.d_image = image_ID;
+          status = GIMP_PDB_CALLING_ERROR;
         }
       else
         {
-          status = GIMP_PDB_EXECUTION_ERROR;
+          image_ID = load_image (param[1].data.d_string,
+                                 run_mode == GIMP_RUN_INTERACTIVE, &error);
+
+          if (image_ID != -1)
+            {
+              *nreturn_vals = 2;
+              values[1].type = GIMP_PDB_IMAGE;
+              values[1].data.d_image = image_ID;
+            }
+          else
+            {
+              status = GIMP_PDB_EXECUTION_ERROR;
+            }
         }
     }
   else if (strcmp (name, SAVE_PROC)  == 0 ||
            strcmp (name, SAVE2_PROC) == 0 ||
+           strcmp (name, SAVE3_PROC) == 0 ||
            strcmp (name, SAVE_DEFAULTS_PROC) == 0)
     {
       gboolean alpha;
@@ -557,7 +1567,19 @@ run (const gchar      *name,
           /*
            * Make sure all the arguments are there!
            */
-          if (nparams != 5)
+          if (strcmp (name, SAVE3_PROC) == 0)
+            {
+              gint values3[NUM_SAVE3_VALUES];
+              gint i;
+
+              for (i = 0; i < NUM_SAVE3_VALUES && 5 + i < nparams; i++)
+                values3[i] = param[5 + i].data.d_int32;
+
+              if (nparams != 5 + NUM_SAVE3_VALUES ||
+                  ! save_vals_set (values3, NUM_SAVE3_VALUES))
+                status = GIMP_PDB_CALLING_ERROR;
+            }
+          else if (nparams != 5)
             {
               if (nparams != 12 && nparams != 14)
                 {
@@ -619,6 +1641,14 @@ run (const gchar      *name,
 #if defined(PNG_APNG_SUPPORTED)
             if (pngvals.as_animation)
               capabilities |= GIMP_EXPORT_CAN_HANDLE_LAYERS;
+
+            /* save_image() converts animation frames on the fly, which
+             * saves duplicating (and maybe converting) the whole image */
+            if (pngvals.as_animation && ! animation_needs_export (image_ID))
+              {
+                export = GIMP_EXPORT_IGNORE;
+                break;
+              }
 #endif
 
             export = gimp_export_image (&image_ID, &drawable_ID, NULL,
@@ -632,16 +1662,53 @@ run (const gchar      *name,
               }
           }
           break;
+
+        case GIMP_RUN_NONINTERACTIVE:
+          /* There is no export dialog to ask, so file-apng-save3 merges
+           * the layers of what it isn't told to save as an animation */
+          if (status == GIMP_PDB_SUCCESS && strcmp (name, SAVE3_PROC) == 0
+#if defined(PNG_APNG_SUPPORTED)
+              && ! pngvals.as_animation
+#endif
+              )
+            {
+              gint32 *layers;
+              gint    nlayers;
+
+              layers = gimp_image_get_layers (image_ID, &nlayers);
+              g_free (layers);
+
+              if (nlayers > 1)
+                {
+                  image_ID = gimp_image_duplicate (image_ID);
+                  gimp_image_undo_disable (image_ID);
+                  drawable_ID =
+                    gimp_image_merge_visible_layers (image_ID,
+                                                     GIMP_CLIP_TO_IMAGE);
+                  export = GIMP_EXPORT_EXPORT;
+                }
+            }
+          break;
+
         default:
           break;
         }
 
       if (status == GIMP_PDB_SUCCESS)
         {
-          if (save_image (param[3].data.d_string,
+          if (save_image (param[3].data.d_string, NULL,
                           image_ID, drawable_ID, orig_image_ID, &error))
             {
               gimp_set_data (SAVE_PROC, &pngvals, sizeof (pngvals));
+
+              if (strcmp (name, SAVE3_PROC) == 0)
+                {
+                  *nreturn_vals = 3;
+                  values[1].type         = GIMP_PDB_INT32;
+                  values[1].data.d_int32 = save_stats.tiles_fetched;
+                  values[2].type         = GIMP_PDB_INT32;
+                  values[2].data.d_int32 = save_stats.tiles_in_frames;
+                }
             }
           else
             {
@@ -652,6 +1719,259 @@ run (const gchar      *name,
       if (export == GIMP_EXPORT_EXPORT)
         gimp_image_delete (image_ID);
     }
+  else if (strcmp (name, SAVE_BUFFER_PROC) == 0)
+    {
+      image_ID    = param[1].data.d_int32;
+      drawable_ID = param[2].data.d_int32;
+
+      load_defaults ();
+
+      if (nparams != 12)
+        {
+          status = GIMP_PDB_CALLING_ERROR;
+        }
+      else
+        {
+          pngvals.interlaced          = param[3].data.d_int32;
+          pngvals.compression_level   = param[4].data.d_int32;
+          pngvals.bkgd                = param[5].data.d_int32;
+          pngvals.gama                = param[6].data.d_int32;
+          pngvals.offs                = param[7].data.d_int32;
+          pngvals.phys                = param[8].data.d_int32;
+          pngvals.time                = param[9].data.d_int32;
+          pngvals.comment             = param[10].data.d_int32;
+          pngvals.save_transp_pixels  = param[11].data.d_int32;
+
+          if (pngvals.compression_level < 0 ||
+              pngvals.compression_level > 9)
+            status = GIMP_PDB_CALLING_ERROR;
+        }
+
+      if (status == GIMP_PDB_SUCCESS)
+        {
+          GByteArray *buffer = g_byte_array_new ();
+          gchar      *label  = gimp_image_get_name (image_ID);
+
+          if (save_image (label, buffer,
+                          image_ID, drawable_ID, image_ID, &error))
+            {
+              *nreturn_vals = 3;
+              values[1].type              = GIMP_PDB_INT32;
+              values[1].data.d_int32      = buffer->len;
+              values[2].type              = GIMP_PDB_INT8ARRAY;
+              values[2].data.d_int8array  = g_byte_array_free (buffer, FALSE);
+
+              returned_data = g_slist_prepend (returned_data,
+                                               values[2].data.d_int8array);
+            }
+          else
+            {
+              g_byte_array_free (buffer, TRUE);
+              status = GIMP_PDB_EXECUTION_ERROR;
+            }
+
+          g_free (label);
+        }
+    }
+  else if (strcmp (name, ASSEMBLE_PROC) == 0)
+    {
+      ApngAssembleOptions options;
+
+      load_defaults ();
+
+      if (nparams != 7)
+        {
+          status = GIMP_PDB_CALLING_ERROR;
+        }
+      else
+        {
+          const gchar *manifest = param[4].data.d_string;
+
+          options.manifest          = (manifest && *manifest) ? manifest : NULL;
+          options.delay             = MAX (param[3].data.d_int32, 0);
+          options.num_plays         = MAX (param[5].data.d_int32, 0);
+          options.compression_level = pngvals.compression_level;
+          options.optimize          = param[6].data.d_int32;
+
+          gimp_progress_init_printf (_("Saving '%s'"),
+                                     gimp_filename_to_utf8 (param[2].data.d_string));
+
+          if (! apng_assemble (param[1].data.d_string, param[2].data.d_string,
+                               &options, tool_progress, NULL, &error))
+            status = GIMP_PDB_EXECUTION_ERROR;
+        }
+    }
+  else if (strcmp (name, SPLIT_PROC) == 0)
+    {
+      ApngSplitOptions options;
+
+      load_defaults ();
+
+      if (nparams != 5)
+        {
+          status = GIMP_PDB_CALLING_ERROR;
+        }
+      else
+        {
+          options.composite         = param[4].data.d_int32;
+          options.compression_level = pngvals.compression_level;
+
+          gimp_progress_init_printf (_("Opening '%s'"),
+                                     gimp_filename_to_utf8 (param[1].data.d_string));
+
+          if (! apng_split (param[1].data.d_string, param[3].data.d_string,
+                            &options, tool_progress, NULL, &error))
+            status = GIMP_PDB_EXECUTION_ERROR;
+        }
+    }
+  else if (strcmp (name, RECOMPRESS_PROC) == 0)
+    {
+      if (nparams != 6 ||
+          param[1].data.d_int32 < 0 ||
+          param[1].data.d_int32 != param[3].data.d_int32 ||
+          param[5].data.d_int32 < 0 || param[5].data.d_int32 > 9)
+        {
+          status = GIMP_PDB_CALLING_ERROR;
+        }
+      else
+        {
+          ApngBatchOptions   options;
+          gint               num_files = param[1].data.d_int32;
+          GError           **errors    = g_new0 (GError *, MAX (num_files, 1));
+          gchar            **messages  = g_new0 (gchar *, num_files + 1);
+          gchar             *threads   = gimp_gimprc_query ("num-processors");
+          gint               i;
+
+          options.compression_level = param[5].data.d_int32;
+          options.max_threads       = threads ? atoi (threads) : 1;
+          g_free (threads);
+
+          gimp_progress_init (_("Recompressing files"));
+
+          apng_batch (num_files,
+                      (const gchar * const *) param[2].data.d_stringarray,
+                      (const gchar * const *) param[4].data.d_stringarray,
+                      &options, errors, tool_progress, NULL);
+
+          for (i = 0; i < num_files; i++)
+            {
+              messages[i] = g_strdup (errors[i] ? errors[i]->message : "");
+
+              if (errors[i])
+                g_error_free (errors[i]);
+            }
+
+          g_free (errors);
+
+          /* The call succeeds even if some files fail */
+          *nreturn_vals = 3;
+          values[1].type                 = GIMP_PDB_INT32;
+          values[1].data.d_int32         = num_files;
+          values[2].type                 = GIMP_PDB_STRINGARRAY;
+          values[2].data.d_stringarray   = messages;
+
+          returned_strings = messages;
+        }
+    }
+  else if (strcmp (name, INFO_PROC) == 0)
+    {
+      ApngInfo info;
+
+      if (nparams != 3)
+        {
+          status = GIMP_PDB_CALLING_ERROR;
+        }
+      else if (! apng_info_read (param[1].data.d_string, &info, &error))
+        {
+          status = GIMP_PDB_EXECUTION_ERROR;
+        }
+      else
+        {
+          gdouble *delays   = g_new (gdouble, info.num_frames);
+          gint32  *geometry = g_new (gint32, 4 * info.num_frames);
+          guint32  i;
+
+          for (i = 0; i < info.num_frames; i++)
+            {
+              delays[i]           = apng_frame_delay_ms (&info.frames[i]);
+              geometry[4 * i]     = info.frames[i].x_offset;
+              geometry[4 * i + 1] = info.frames[i].y_offset;
+              geometry[4 * i + 2] = info.frames[i].width;
+              geometry[4 * i + 3] = info.frames[i].height;
+            }
+
+          *nreturn_vals = 9;
+          values[1].type               = GIMP_PDB_INT32;
+          values[1].data.d_int32       = info.header.width;
+          values[2].type               = GIMP_PDB_INT32;
+          values[2].data.d_int32       = info.header.height;
+          values[3].type               = GIMP_PDB_INT32;
+          values[3].data.d_int32       = MIN (info.num_plays, G_MAXINT);
+          values[4].type               = GIMP_PDB_FLOAT;
+          values[4].data.d_float       = info.duration;
+          values[5].type               = GIMP_PDB_INT32;
+          values[5].data.d_int32       = info.num_frames;
+          values[6].type               = GIMP_PDB_FLOATARRAY;
+          values[6].data.d_floatarray  = delays;
+          values[7].type               = GIMP_PDB_INT32;
+          values[7].data.d_int32       = 4 * info.num_frames;
+          values[8].type               = GIMP_PDB_INT32ARRAY;
+          values[8].data.d_int32array  = geometry;
+
+          returned_data = g_slist_prepend (returned_data, delays);
+          returned_data = g_slist_prepend (returned_data, geometry);
+
+          apng_info_clear (&info);
+        }
+    }
+  else if (strcmp (name, FOLLOW_PROC) == 0)
+    {
+      gint num_ready = 0;
+
+      run_mode = param[0].data.d_int32;
+
+      if (nparams != 4 || param[3].data.d_float < 0.0)
+        {
+          status = GIMP_PDB_CALLING_ERROR;
+        }
+      else
+        {
+          image_ID = load_image_follow (param[1].data.d_string,
+                                        param[3].data.d_float,
+                                        run_mode == GIMP_RUN_INTERACTIVE,
+                                        &num_ready, &error);
+
+          if (image_ID != -1)
+            {
+              *nreturn_vals = 3;
+              values[1].type = GIMP_PDB_IMAGE;
+              values[1].data.d_image = image_ID;
+              values[2].type = GIMP_PDB_INT32;
+              values[2].data.d_int32 = num_ready;
+            }
+          else
+            {
+              status = GIMP_PDB_EXECUTION_ERROR;
+            }
+        }
+    }
+#if defined(PNG_APNG_SUPPORTED)
+  else if (strcmp (name, APPEND_PROC) == 0)
+    {
+      run_mode = param[0].data.d_int32;
+      image_ID = param[1].data.d_int32;
+
+      load_defaults ();
+
+      if (run_mode != GIMP_RUN_NONINTERACTIVE)
+        gimp_get_data (SAVE_PROC, &pngvals);
+
+      if (nparams != 5)
+        status = GIMP_PDB_CALLING_ERROR;
+      else if (! append_image (param[3].data.d_string, image_ID, &error))
+        status = GIMP_PDB_EXECUTION_ERROR;
+    }
+#endif
   else if (strcmp (name, GET_DEFAULTS_PROC) == 0)
     {
       load_defaults ();
@@ -675,6 +1995,38 @@ run (const gchar      *name,
 
 #undef SET_VALUE
     }
+  else if (strcmp (name, GET_DEFAULTS3_PROC) == 0)
+    {
+      gint values3[NUM_SAVE3_VALUES];
+      gint i;
+
+      load_defaults ();
+      save_vals_get (values3);
+
+      *nreturn_vals = 1 + NUM_SAVE3_VALUES;
+
+      for (i = 0; i < NUM_SAVE3_VALUES; i++)
+        {
+          values[1 + i].type         = GIMP_PDB_INT32;
+          values[1 + i].data.d_int32 = values3[i];
+        }
+    }
+  else if (strcmp (name, SET_DEFAULTS3_PROC) == 0)
+    {
+      gint values3[NUM_SAVE3_VALUES];
+      gint i;
+
+      load_defaults ();
+
+      for (i = 0; i < NUM_SAVE3_VALUES && i < nparams; i++)
+        values3[i] = param[i].data.d_int32;
+
+      if (nparams == NUM_SAVE3_VALUES &&
+          save_vals_set (values3, NUM_SAVE3_VALUES))
+        save_defaults ();
+      else
+        status = GIMP_PDB_CALLING_ERROR;
+    }
   else if (strcmp (name, SET_DEFAULTS_PROC) == 0)
     {
       if (nparams == 9)
@@ -706,11 +2058,95 @@ run (const gchar      *name,
       *nreturn_vals = 2;
       values[1].type          = GIMP_PDB_STRING;
       values[1].data.d_string = error->message;
+
+      returned_error = error;
     }
 
   values[0].data.d_status = status;
 }
 
+/*
+ * 'resident_serve ()' - Install the resident procedures and serve them.
+ *
+ * Never returns, GIMP ends the extension when it quits.
+ */
+
+static void
+resident_serve (void)
+{
+  static const gchar *procs[] =
+  {
+    LOAD_PROC, LOAD2_PROC, SAVE_PROC, SAVE2_PROC, SAVE3_PROC,
+    SAVE_BUFFER_PROC,
+#if defined(PNG_APNG_SUPPORTED)
+    APPEND_PROC,
+#endif
+    ASSEMBLE_PROC, SPLIT_PROC, RECOMPRESS_PROC, INFO_PROC
+  };
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (procs); i++)
+    {
+      gchar           *blurb, *help, *author, *copyright, *date;
+      GimpPDBProcType  type;
+      gint             nparams, nvalues;
+      GimpParamDef    *params, *values;
+      gchar           *temp_name;
+
+      /* The arguments are those of the regular procedure */
+      if (! gimp_procedural_db_proc_info (procs[i],
+                                          &blurb, &help, &author,
+                                          &copyright, &date, &type,
+                                          &nparams, &nvalues,
+                                          &params, &values))
+        continue;
+
+      temp_name = g_strconcat (procs[i], RESIDENT_SUFFIX, NULL);
+
+      gimp_install_temp_proc (temp_name, blurb, help, author, copyright, date,
+                              NULL, NULL, GIMP_TEMPORARY,
+                              nparams, nvalues, params, values,
+                              resident_run);
+
+      g_free (temp_name);
+      g_free (blurb);
+      g_free (help);
+      g_free (author);
+      g_free (copyright);
+      g_free (date);
+      gimp_destroy_paramdefs (params, nparams);
+      gimp_destroy_paramdefs (values, nvalues);
+    }
+
+  /* Threads of the strip and recompress pools wait for the next call,
+   * rather than exiting once they've been idle for a while */
+  g_thread_pool_set_max_unused_threads (-1);
+  g_thread_pool_set_max_idle_time (0);
+
+  gimp_extension_ack ();
+
+  while (TRUE)
+    gimp_extension_process (0);
+}
+
+/*
+ * 'resident_run ()' - Run a resident procedure as its regular one.
+ */
+
+static void
+resident_run (const gchar      *name,
+              gint              nparams,
+              const GimpParam  *param,
+              gint             *nreturn_vals,
+              GimpParam       **return_vals)
+{
+  gchar *proc = g_strndup (name, strlen (name) - strlen (RESIDENT_SUFFIX));
+
+  run (proc, nparams, param, nreturn_vals, return_vals);
+
+  g_free (proc);
+}
+
 
 struct read_error_data
 {
@@ -724,6 +2160,9 @@ struct read_error_data
   gint          begin;           /* Beginning tile row */
   gint          end;             /* Ending tile row */
   gint          num;             /* Number of rows to load */
+  PngStripPipeline *pipeline;    /* Strips being stored, or NULL */
+  PngStrip     *strip;           /* Strip being read */
+  PngStoreJob  *job;             /* How strips are stored */
 };
 
 static void
@@ -736,11 +2175,17 @@ on_read_error (png_structp png_ptr, png_const_charp error_msg)
 
   g_warning (_("Error loading PNG file: %s"), error_msg);
 
+  /* Let the worker store the strips already read, libgimp is ours after */
+
+  if (error_data->pipeline)
+    {
+      strip_pipeline_free (error_data->pipeline);
+      error_data->pipeline = NULL;
+    }
+
   /* Flush the current half-read row of tiles */
 
-  gimp_pixel_rgn_set_rect (error_data->pixel_rgn, error_data->pixel, 0,
-                                error_data->begin, error_data->drawable->width,
-                                error_data->num);
+  store_strip_rows (error_data->strip, error_data->job);
 
   /* Fill the rest of the rows of tiles with 0s */
 
@@ -766,81 +2211,32 @@ on_read_error (png_structp png_ptr, png_const_charp error_msg)
 }
 
 /*
- * 'load_image()' - Load a PNG image into a new image window.
+ * 'setup_read_transforms()' - Set up libpng to read rows the way layers
+ *                             store them.
+ *
+ * Returns FALSE for color models GIMP has no layers for.
  */
 
-static gint32
-load_image (const gchar  *filename,
-            gboolean      interactive,
-            GError      **error)
+static gboolean
+setup_read_transforms (png_structp  pp,
+                       png_infop    info,
+                       guchar      *alpha,
+                       int         *trns,
+                       int         *bpp,
+                       gint        *image_type,
+                       gint        *layer_type)
 {
   int i,                        /* Looping var */
-    trns,                       /* Transparency present */
-    bpp,                        /* Bytes per pixel */
-    image_type,                 /* Type of image */
-    layer_type,                 /* Type of drawable/layer */
-    empty,                      /* Number of fully transparent indices */
-    num;                        /* Number of rows to load */
-  FILE *fp;                     /* File pointer */
-  volatile gint32 image = -1;   /* Image -- preserved against setjmp() */
-  gint32 layer;                 /* Layer */
-  gint offset_x = 0;            /* Offset x from origin */
-  gint offset_y = 0;            /* Offset y from origin */
-  png_structp pp;               /* PNG read pointer */
-  png_infop info;               /* PNG info pointers */
-  guchar alpha[256],            /* Index -> Alpha */
-   *alpha_ptr;                  /* Temporary pointer */
-
-  png_textp  text;
-  gint       num_texts;
+    num;                        /* Number of tRNS entries */
+  guchar *alpha_ptr;            /* Temporary pointer */
 
-  pp = png_create_read_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-  info = png_create_info_struct (pp);
+  /*
+   * Latest attempt, this should be my best yet :)
+   */
 
-  if (setjmp (png_jmpbuf (pp)))
+  if (png_get_bit_depth (pp, info) == 16)
     {
-      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
-                   _("Error while reading '%s'. File corrupted?"),
-                   gimp_filename_to_utf8 (filename));
-      return image;
-    }
-
-  /* initialise image here, thus avoiding compiler warnings */
-
-  image = -1;
-
-  /*
-   * Open the file and initialize the PNG read "engine"...
-   */
-
-  fp = g_fopen (filename, "rb");
-
-  if (fp == NULL)
-    {
-      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
-                   _("Could not open '%s' for reading: %s"),
-                   gimp_filename_to_utf8 (filename), g_strerror (errno));
-      return -1;
-    }
-
-  png_init_io (pp, fp);
-
-  gimp_progress_init_printf (_("Opening '%s'"),
-                             gimp_filename_to_utf8 (filename));
-
-  /*
-   * Get the image dimensions and create the image...
-   */
-
-  png_read_info (pp, info);
-
-  /*
-   * Latest attempt, this should be my best yet :)
-   */
-
-  if (png_get_bit_depth (pp, info) == 16)
-    {
-      png_set_strip_16 (pp);
+      png_set_strip_16 (pp);
     }
 
   if (png_get_color_type (pp, info) == PNG_COLOR_TYPE_GRAY &&
@@ -879,11 +2275,11 @@ load_image (const gchar  *filename,
       /* And set any others to fully opaque (255)  */
       for (i = num; i < 256; ++i)
         alpha[i] = 255;
-      trns = 1;
+      *trns = 1;
     }
   else
     {
-      trns = 0;
+      *trns = 0;
     }
 
   /*
@@ -895,52 +2291,159 @@ load_image (const gchar  *filename,
   switch (png_get_color_type (pp, info))
     {
     case PNG_COLOR_TYPE_RGB:           /* RGB */
-      bpp = 3;
-      image_type = GIMP_RGB;
-      layer_type = GIMP_RGB_IMAGE;
+      *bpp = 3;
+      *image_type = GIMP_RGB;
+      *layer_type = GIMP_RGB_IMAGE;
       break;
 
     case PNG_COLOR_TYPE_RGB_ALPHA:     /* RGBA */
-      bpp = 4;
-      image_type = GIMP_RGB;
-      layer_type = GIMP_RGBA_IMAGE;
+      *bpp = 4;
+      *image_type = GIMP_RGB;
+      *layer_type = GIMP_RGBA_IMAGE;
       break;
 
     case PNG_COLOR_TYPE_GRAY:          /* Grayscale */
-      bpp = 1;
-      image_type = GIMP_GRAY;
-      layer_type = GIMP_GRAY_IMAGE;
+      *bpp = 1;
+      *image_type = GIMP_GRAY;
+      *layer_type = GIMP_GRAY_IMAGE;
       break;
 
     case PNG_COLOR_TYPE_GRAY_ALPHA:    /* Grayscale + alpha */
-      bpp = 2;
-      image_type = GIMP_GRAY;
-      layer_type = GIMP_GRAYA_IMAGE;
+      *bpp = 2;
+      *image_type = GIMP_GRAY;
+      *layer_type = GIMP_GRAYA_IMAGE;
       break;
 
     case PNG_COLOR_TYPE_PALETTE:       /* Indexed */
-      bpp = 1;
-      image_type = GIMP_INDEXED;
-      layer_type = GIMP_INDEXED_IMAGE;
+      *bpp = 1;
+      *image_type = GIMP_INDEXED;
+      *layer_type = GIMP_INDEXED_IMAGE;
       break;
 
     default:                           /* Aie! Unknown type */
-      g_set_error (error, 0, 0,
-                   _("Unknown color model in PNG file '%s'."),
-                   gimp_filename_to_utf8 (filename));
-      return -1;
+      return FALSE;
     }
 
-  image = gimp_image_new (png_get_image_width (pp, info),
-                          png_get_image_height (pp, info), image_type);
-  if (image == -1)
+  return TRUE;
+}
+
+/*
+ * 'load_colormap()' - Load the colormap of an indexed image.
+ *
+ * Returns the number of fully transparent palette entries, which are
+ * left out.
+ */
+
+static int
+load_colormap (gint32       image,
+               png_structp  pp,
+               png_infop    info,
+               guchar      *alpha)
+{
+  int empty;                    /* Number of fully transparent indices */
+
+  empty = 0; /* by default assume no full transparent palette entries */
+
+  if (png_get_color_type (pp, info) & PNG_COLOR_MASK_PALETTE)
     {
-      g_set_error (error, 0, 0,
-                   "Could not create new image for '%s': %s",
-                   gimp_filename_to_utf8 (filename), gimp_get_pdb_error ());
-      return -1;
+      png_colorp palette;
+      int num_palette;
+
+      if (png_get_PLTE (pp, info, &palette, &num_palette))
+        {
+          if (png_get_valid (pp, info, PNG_INFO_tRNS))
+            {
+              for (empty = 0; empty < 256 && alpha[empty] == 0; ++empty)
+                /* Calculates number of fully transparent "empty" entries */;
+
+              /*  keep at least one entry  */
+              empty = MIN (empty, num_palette - 1);
+
+              gimp_image_set_colormap (image, (guchar *) (palette + empty),
+                                       num_palette - empty);
+            }
+          else
+            {
+              gimp_image_set_colormap (image, (guchar *) palette,
+                                       num_palette);
+            }
+        }
+    }
+
+  return empty;
+}
+
+#if defined(PNG_APNG_SUPPORTED)
+/*
+ * 'frame_layer_name()' - Name the layer of a frame after its delay and
+ *                        how the frame before it is disposed of.
+ */
+
+static gchar *
+frame_layer_name (png_uint_32 frame,
+                  gint        delay,
+                  png_byte    previous_dispose_op)
+{
+  gchar *framename;
+  gchar *framename_ptr;
+
+  if (frame == 0)
+    {
+      if (delay < 0)
+        framename = g_strdup (_("Background"));
+      else
+        framename = g_strdup_printf (_("Background (%d%s)"),
+                                     delay, "ms");
+    }
+  else
+    {
+      if (delay < 0)
+        framename = g_strdup_printf (_("Frame %d"), frame + 1);
+      else
+        framename = g_strdup_printf (_("Frame %d (%d%s)"), frame + 1,
+                                     delay, "ms");
+    }
+
+  switch (previous_dispose_op)
+    {
+    case PNG_DISPOSE_OP_NONE:
+      framename_ptr = framename;
+      framename = g_strconcat (framename, " (combine)", NULL);
+      g_free (framename_ptr);
+      break;
+    case PNG_DISPOSE_OP_BACKGROUND:
+      framename_ptr = framename;
+      framename = g_strconcat (framename, " (replace)", NULL);
+      g_free (framename_ptr);
+      break;
+    case PNG_DISPOSE_OP_PREVIOUS: /* For now, cannot handle this */
+      framename_ptr = framename;
+      framename = g_strconcat (framename, " (combine) (!)", NULL);
+      g_free (framename_ptr);
+      break;
+    default:
+      g_message ("dispose_op got corrupted.");
+      break;
     }
 
+  return framename;
+}
+#endif
+
+/*
+ * 'load_image_properties()' - Set the gamma, resolution and offsets of an
+ *                             image from its header chunks.
+ */
+
+static void
+load_image_properties (gint32       image,
+                       png_structp  pp,
+                       png_infop    info,
+                       gboolean     interactive,
+                       gint         reduce,
+                       gint        *offset_x,
+                       gint        *offset_y)
+{
   /*
    * Find out everything we can about the image resolution
    * This is only practical with the new 1.0 APIs, I'm afraid
@@ -966,16 +2469,19 @@ load_image (const gchar  *filename,
 
   if (png_get_valid (pp, info, PNG_INFO_oFFs))
     {
-      offset_x = png_get_x_offset_pixels (pp, info);
-      offset_y = png_get_y_offset_pixels (pp, info);
+      *offset_x = png_get_x_offset_pixels (pp, info);
+      *offset_y = png_get_y_offset_pixels (pp, info);
 
-      if ((abs (offset_x) > png_get_image_width (pp, info)) ||
-          (abs (offset_y) > png_get_image_height (pp, info)))
+      if ((abs (*offset_x) > png_get_image_width (pp, info)) ||
+          (abs (*offset_y) > png_get_image_height (pp, info)))
         {
           if (interactive)
             g_message (_("The PNG file specifies an offset that caused "
                          "the layer to be positioned outside the image."));
         }
+
+      *offset_x /= reduce;
+      *offset_y /= reduce;
     }
 
   if (png_get_valid (pp, info, PNG_INFO_pHYs))
@@ -1004,9 +2510,10 @@ load_image (const gchar  *filename,
               break;
 
             case PNG_RESOLUTION_METER:
+              /* A reduced image keeps its print size */
               gimp_image_set_resolution (image,
-                                         (gdouble) xres * 0.0254,
-                                         (gdouble) yres * 0.0254);
+                                         (gdouble) xres * 0.0254 / reduce,
+                                         (gdouble) yres * 0.0254 / reduce);
               break;
 
             default:
@@ -1015,6 +2522,173 @@ load_image (const gchar  *filename,
         }
 
     }
+}
+
+/*
+ * 'load_image()' - Load a PNG image into a new image window.
+ */
+
+static gint32
+load_image (const gchar  *filename,
+            gboolean      interactive,
+            GError      **error)
+{
+  int i,                        /* Looping var */
+    trns,                       /* Transparency present */
+    bpp,                        /* Bytes per pixel */
+    image_type,                 /* Type of image */
+    layer_type,                 /* Type of drawable/layer */
+    empty;                      /* Number of fully transparent indices */
+  FILE *fp;                     /* File pointer */
+  volatile gint32 image = -1;   /* Image -- preserved against setjmp() */
+  gint32 layer;                 /* Layer */
+  gint offset_x = 0;            /* Offset x from origin */
+  gint offset_y = 0;            /* Offset y from origin */
+  png_structp pp;               /* PNG read pointer */
+  png_infop info;               /* PNG info pointers */
+  guchar alpha[256];            /* Index -> Alpha */
+
+  png_textp  text;
+  gint       num_texts;
+
+  gint       file_bit_depth;    /* Format of the image data in the file */
+  gint       file_color_type;
+  gint       file_interlace;
+  GPtrArray *keys = NULL;       /* Frame cache keys of the frames */
+  gint       reduce = loadvals.reduction;
+  gint       roi_x, roi_y;      /* Part of the canvas loaded */
+  gint       roi_width, roi_height;
+  gchar     *comment = NULL;
+
+  ApngDecodedEntry  * volatile cached = NULL; /* Decoded frames, if cached */
+  ApngDecodedWriter * volatile writer = NULL; /* Entry of the frames read */
+
+  pp = png_create_read_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  info = png_create_info_struct (pp);
+
+  if (setjmp (png_jmpbuf (pp)))
+    {
+      if (writer)
+        apng_decoded_writer_abort (writer);
+
+      if (cached)
+        apng_decoded_entry_free (cached);
+
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                   _("Error while reading '%s'. File corrupted?"),
+                   gimp_filename_to_utf8 (filename));
+      return image;
+    }
+
+  /* initialise image here, thus avoiding compiler warnings */
+
+  image = -1;
+
+  /*
+   * Open the file and initialize the PNG read "engine"...
+   */
+
+  fp = g_fopen (filename, "rb");
+
+  if (fp == NULL)
+    {
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                   _("Could not open '%s' for reading: %s"),
+                   gimp_filename_to_utf8 (filename), g_strerror (errno));
+      return -1;
+    }
+
+  png_init_io (pp, fp);
+
+  /*
+   * Trusted files skip the CRC of every chunk and the Adler-32 of the
+   * image data; broken structure still ends up in on_read_error()
+   */
+
+  if (loadvals.trusted)
+    {
+      png_set_crc_action (pp, PNG_CRC_QUIET_USE, PNG_CRC_QUIET_USE);
+#if defined(PNG_IGNORE_ADLER32)
+      png_set_option (pp, PNG_IGNORE_ADLER32, PNG_OPTION_ON);
+#endif
+    }
+
+  gimp_progress_init_printf (_("Opening '%s'"),
+                             gimp_filename_to_utf8 (filename));
+
+  /*
+   * Get the image dimensions and create the image...
+   */
+
+  png_read_info (pp, info);
+
+  if (reduce > 1)
+    apng_kernels_init ();
+
+  file_bit_depth  = png_get_bit_depth (pp, info);
+  file_color_type = png_get_color_type (pp, info);
+  file_interlace  = png_get_interlace_type (pp, info);
+
+  if (! setup_read_transforms (pp, info, alpha, &trns, &bpp,
+                               &image_type, &layer_type))
+    {
+      g_set_error (error, 0, 0,
+                   _("Unknown color model in PNG file '%s'."),
+                   gimp_filename_to_utf8 (filename));
+      return -1;
+    }
+
+  /*
+   * The image is the region of interest of the canvas, all of it unless
+   * one was asked for
+   */
+
+  roi_x      = 0;
+  roi_y      = 0;
+  roi_width  = png_get_image_width (pp, info);
+  roi_height = png_get_image_height (pp, info);
+
+  if (loadvals.roi_width > 0 && loadvals.roi_height > 0)
+    {
+      gint x1 = MIN ((gint64) loadvals.roi_x + loadvals.roi_width, roi_width);
+      gint y1 = MIN ((gint64) loadvals.roi_y + loadvals.roi_height,
+                     roi_height);
+
+      roi_x      = MAX (loadvals.roi_x, 0);
+      roi_y      = MAX (loadvals.roi_y, 0);
+      roi_width  = x1 - roi_x;
+      roi_height = y1 - roi_y;
+
+      if (roi_width <= 0 || roi_height <= 0)
+        {
+          g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                       _("The region to load lies outside of '%s'."),
+                       gimp_filename_to_utf8 (filename));
+          png_destroy_read_struct (&pp, &info, NULL);
+          fclose (fp);
+
+          return -1;
+        }
+    }
+
+  /*
+   * A reduced image has every size and offset divided by "reduce",
+   * rounding sizes up
+   */
+
+  image = gimp_image_new ((roi_width + reduce - 1) / reduce,
+                          (roi_height + reduce - 1) / reduce,
+                          image_type);
+  if (image == -1)
+    {
+      g_set_error (error, 0, 0,
+                   "Could not create new image for '%s': %s",
+                   gimp_filename_to_utf8 (filename), gimp_get_pdb_error ());
+      return -1;
+    }
+
+  load_image_properties (image, pp, info, interactive, reduce,
+                         &offset_x, &offset_y);
 
   gimp_image_set_filename (image, filename);
 
@@ -1022,44 +2696,78 @@ load_image (const gchar  *filename,
    * Load the colormap as necessary...
    */
 
-  empty = 0; /* by default assume no full transparent palette entries */
+  empty = load_colormap (image, pp, info, alpha);
 
-  if (png_get_color_type (pp, info) & PNG_COLOR_MASK_PALETTE)
+  /*
+   * Frames decoded before with the same options come from the cache of
+   * decoded frames, frames decoded now go into it.  Its entries hold the
+   * layers as decoded, so merged ones don't go there.
+   */
+
+  if (loadvals.decode_cache > 0 && ! loadvals.merge_duplicates)
     {
-      png_colorp palette;
-      int num_palette;
+      gchar *options = g_strdup_printf ("reduction=%d roi=%d,%d,%dx%d",
+                                        reduce, roi_x, roi_y,
+                                        roi_width, roi_height);
+      gchar *key     = apng_decoded_key (filename, options);
 
-      if (png_get_PLTE (pp, info, &palette, &num_palette))
+      if (key)
         {
-          if (png_get_valid (pp, info, PNG_INFO_tRNS))
-            {
-              for (empty = 0; empty < 256 && alpha[empty] == 0; ++empty)
-                /* Calculates number of fully transparent "empty" entries */;
-
-              /*  keep at least one entry  */
-              empty = MIN (empty, num_palette - 1);
+          cached = apng_decoded_lookup (key);
 
-              gimp_image_set_colormap (image, (guchar *) (palette + empty),
-                                       num_palette - empty);
-            }
-          else
-            {
-              gimp_image_set_colormap (image, (guchar *) palette,
-                                       num_palette);
-            }
+          if (! cached)
+            writer = apng_decoded_writer_new (key,
+                                              (guint64) loadvals.decode_cache
+                                              << 20);
         }
+
+      g_free (key);
+      g_free (options);
     }
 
+  if (cached)
+    {
+      read_cached_frames (image, cached, layer_type, bpp, empty, trns, alpha);
+    }
+  else
 #if defined(PNG_APNG_SUPPORTED)
   if (png_get_valid (pp, info, PNG_INFO_acTL))
     {
       gchar       *framename;
-      gchar       *framename_ptr;
       png_uint_32  num_frames;
       png_uint_32  num_plays;
       png_byte     is_hidden;
       png_uint_32  frame;
       png_byte     previous_dispose_op = PNG_DISPOSE_OP_NONE;
+      GChecksum   *key = NULL;
+      gboolean     opaque;              /* Frames can't show through */
+      gint32       last_layer = -1;     /* Layer of the last frame read */
+      png_uint_32  last_frame = 0;
+      png_uint_32  last_x_offset = 0;
+      png_uint_32  last_y_offset = 0;
+      gint         last_delay = -1;
+      png_byte     last_name_dispose_op = PNG_DISPOSE_OP_NONE;
+      gchar       *last_key = NULL;
+      gint         skipped_delay = 0;   /* Of frames skipped before any
+                                         * layer was made */
+
+      opaque = (! trns &&
+                (layer_type == GIMP_RGB_IMAGE  ||
+                 layer_type == GIMP_GRAY_IMAGE ||
+                 layer_type == GIMP_INDEXED_IMAGE));
+
+      /*
+       * Frames read as they were compressed go into the frame cache if
+       * asked, so that saving them unchanged copies their image data.
+       * Reduced or cropped frames never are.
+       */
+
+      if (loadvals.frame_cache && reduce == 1 &&
+          roi_width  == png_get_image_width (pp, info) &&
+          roi_height == png_get_image_height (pp, info) &&
+          (file_color_type == PNG_COLOR_TYPE_PALETTE ||
+           (file_bit_depth == 8 && ! png_get_valid (pp, info, PNG_INFO_tRNS))))
+        keys = g_ptr_array_new ();
 
       num_frames = png_get_num_frames(pp, info);
       num_plays = png_get_num_plays(pp, info);
@@ -1072,13 +2780,17 @@ load_image (const gchar  *filename,
           png_uint_32  frame_x_offset = 0;
           png_uint_32  frame_y_offset = 0;
           png_byte     frame_dispose_op;
+          png_byte     frame_blend_op = PNG_BLEND_OP_SOURCE;
+          png_byte     name_dispose_op;     /* Of the frame before */
+          gchar       *frame_key;
+          gint         crop_x, crop_y;      /* Frame within the region */
+          gint         crop_width, crop_height;
 
           png_read_frame_head(pp, info);
           if (png_get_valid (pp, info, PNG_INFO_fcTL))
             {
               png_uint_16  frame_delay_num;
               png_uint_16  frame_delay_den;
-              png_byte     frame_blend_op;
 
               png_get_next_frame_fcTL(pp, info,
                                       &frame_width, &frame_height,
@@ -1104,12 +2816,6 @@ load_image (const gchar  *filename,
 
           if (frame == 0)
             {
-              if (delay < 0)
-                framename = g_strdup (_("Background"));
-              else
-                framename = g_strdup_printf (_("Background (%d%s)"),
-                                             delay, "ms");
-
               if (frame_dispose_op == PNG_DISPOSE_OP_PREVIOUS)
                 frame_dispose_op = PNG_DISPOSE_OP_BACKGROUND;
             }
@@ -1119,52 +2825,150 @@ load_image (const gchar  *filename,
                                              gimp_filename_to_utf8 (filename),
                                              frame);
               gimp_progress_pulse ();
+            }
 
-              if (delay < 0)
-                framename = g_strdup_printf (_("Frame %d"), frame + 1);
-              else
-                framename = g_strdup_printf (_("Frame %d (%d%s)"), frame + 1,
-                                             delay, "ms");
+          name_dispose_op     = previous_dispose_op;
+          previous_dispose_op = frame_dispose_op;
+
+          crop_x      = MAX ((gint) frame_x_offset, roi_x);
+          crop_y      = MAX ((gint) frame_y_offset, roi_y);
+          crop_width  = MIN ((gint) (frame_x_offset + frame_width),
+                             roi_x + roi_width) - crop_x;
+          crop_height = MIN ((gint) (frame_y_offset + frame_height),
+                             roi_y + roi_height) - crop_y;
+
+          /*
+           * Frames outside of the region only need inflating.  Their
+           * delay makes the frame before last longer, or the first one
+           * that is shown if they come first.
+           */
+
+          if (crop_width <= 0 || crop_height <= 0)
+            {
+              gint num_passes = png_set_interlace_handling (pp);
+              gint pass;
+
+              for (pass = 0; pass < num_passes; pass++)
+                skip_rows (pp, frame_height);
+
+              if (delay > 0 && last_layer != -1 && last_delay >= 0)
+                {
+                  gchar *name;
+
+                  last_delay += delay;
+
+                  name = frame_layer_name (last_frame, last_delay,
+                                           last_name_dispose_op);
+                  gimp_drawable_set_name (last_layer, name);
+                  g_free (name);
+
+                  /* The entry has the old name, and can't be renamed */
+                  if (writer)
+                    {
+                      apng_decoded_writer_abort (writer);
+                      writer = NULL;
+                    }
+                }
+              else if (delay > 0)
+                {
+                  skipped_delay += delay;
+                }
+
+              continue;
             }
 
-          switch (previous_dispose_op)
+          if (delay >= 0)
             {
-            case PNG_DISPOSE_OP_NONE:
-              framename_ptr = framename;
-              framename = g_strconcat (framename, " (combine)", NULL);
-              g_free (framename_ptr);
-              break;
-            case PNG_DISPOSE_OP_BACKGROUND:
-              framename_ptr = framename;
-              framename = g_strconcat (framename, " (replace)", NULL);
-              g_free (framename_ptr);
-              break;
-            case PNG_DISPOSE_OP_PREVIOUS: /* For now, cannot handle this */
-              framename_ptr = framename;
-              framename = g_strconcat (framename, " (combine) (!)", NULL);
-              g_free (framename_ptr);
-              break;
-            default:
-              g_message ("dispose_op got corrupted.");
-              break;
+              delay         += skipped_delay;
+              skipped_delay  = 0;
             }
-          previous_dispose_op = frame_dispose_op;
 
-          layer = gimp_layer_new (image, framename, frame_width, frame_height,
+          framename = frame_layer_name (frame, delay, name_dispose_op);
+
+          layer = gimp_layer_new (image, framename,
+                                  (crop_width + reduce - 1) / reduce,
+                                  (crop_height + reduce - 1) / reduce,
                                   layer_type, 100, GIMP_NORMAL_MODE);
-          g_free (framename);
           gimp_image_add_layer (image, layer, 0);
 
           if (offset_x != 0 && offset_y != 0)
             gimp_layer_set_offsets (layer, offset_x, offset_y);
 
           gimp_layer_translate (layer,
-                                (gint) frame_x_offset, (gint) frame_y_offset);
+                                (crop_x - roi_x) / reduce,
+                                (crop_y - roi_y) / reduce);
+
+          if (writer)
+            cache_decoded_layer (writer, layer, framename, bpp);
+
+          g_free (framename);
+
+          if (keys || loadvals.merge_duplicates)
+            key = apng_cache_key_begin (frame_width, frame_height,
+                                        file_bit_depth, file_color_type,
+                                        file_interlace);
 
           read_frame (layer, bpp, empty, trns, alpha, pp, info,
                       frame_width, frame_height,
-                      frame_x_offset, frame_y_offset, error);
+                      crop_x - (gint) frame_x_offset,
+                      crop_y - (gint) frame_y_offset,
+                      crop_width, crop_height, key, writer, error);
+
+          if (! key)
+            {
+              last_layer           = layer;
+              last_frame           = frame;
+              last_delay           = delay;
+              last_name_dispose_op = name_dispose_op;
+              continue;
+            }
+
+          /*
+           * A frame that repeats the last one in the same place, drawn
+           * over it, only makes it last longer.  The key covers the size
+           * and the decoded rows.
+           */
+
+          frame_key = apng_cache_key_end (key);
+          key       = NULL;
+
+          if (loadvals.merge_duplicates && last_layer != -1 &&
+              ! strcmp (frame_key, last_key) &&
+              frame_x_offset == last_x_offset &&
+              frame_y_offset == last_y_offset &&
+              name_dispose_op == PNG_DISPOSE_OP_NONE &&
+              (frame_blend_op == PNG_BLEND_OP_SOURCE || opaque) &&
+              delay >= 0 && last_delay >= 0)
+            {
+              gchar *name;
+
+              gimp_image_remove_layer (image, layer);
+
+              last_delay += delay;
+
+              name = frame_layer_name (last_frame, last_delay,
+                                       last_name_dispose_op);
+              gimp_drawable_set_name (last_layer, name);
+              g_free (name);
+            }
+          else
+            {
+              last_layer           = layer;
+              last_frame           = frame;
+              last_x_offset        = frame_x_offset;
+              last_y_offset        = frame_y_offset;
+              last_delay           = delay;
+              last_name_dispose_op = name_dispose_op;
+            }
+
+          if (keys)
+            g_ptr_array_add (keys, g_strdup (frame_key));
+
+          g_free (last_key);
+          last_key = frame_key;
         }
+
+      g_free (last_key);
     }
   else
 #endif
@@ -1174,26 +2978,41 @@ load_image (const gchar  *filename,
        */
 
       layer = gimp_layer_new (image, _("Background"),
-                              png_get_image_width (pp, info),
-                              png_get_image_height (pp, info),
+                              (roi_width + reduce - 1) / reduce,
+                              (roi_height + reduce - 1) / reduce,
                               layer_type, 100, GIMP_NORMAL_MODE);
       gimp_image_add_layer (image, layer, 0);
 
       if (offset_x != 0 && offset_y != 0)
         gimp_layer_set_offsets (layer, offset_x, offset_y);
 
+      if (writer)
+        cache_decoded_layer (writer, layer, _("Background"), bpp);
+
       read_frame (layer, bpp, empty, trns, alpha, pp, info,
                   png_get_image_width (pp, info),
                   png_get_image_height (pp, info),
-                  0, 0, error);
+                  roi_x, roi_y, roi_width, roi_height, NULL, writer, error);
     }
 
-  png_read_end (pp, info);
+  /* The text after the image data is only read when decoding */
+  if (! cached)
+    png_read_end (pp, info);
 
-  if (png_get_text (pp, info, &text, &num_texts))
+#if defined(PNG_APNG_SUPPORTED)
+  if (keys)
     {
-      gchar *comment = NULL;
+      cache_file_frames (filename, keys);
+
+      for (i = 0; i < (int) keys->len; i++)
+        g_free (g_ptr_array_index (keys, i));
+
+      g_ptr_array_free (keys, TRUE);
+    }
+#endif
 
+  if (png_get_text (pp, info, &text, &num_texts))
+    {
       for (i = 0; i < num_texts && !comment; i++, text++)
         {
           if (text->key == NULL || strcmp (text->key, "Comment"))
@@ -1210,21 +3029,30 @@ load_image (const gchar  *filename,
               comment = g_strdup (text->text);
             }
         }
+    }
 
-      if (comment && *comment)
-        {
-          GimpParasite *parasite;
+  if (! comment && cached)
+    comment = g_strdup (apng_decoded_comment (cached));
 
-          parasite = gimp_parasite_new ("gimp-comment",
-                                        GIMP_PARASITE_PERSISTENT,
-                                        strlen (comment) + 1, comment);
-          gimp_image_parasite_attach (image, parasite);
-          gimp_parasite_free (parasite);
-        }
+  if (comment && *comment)
+    {
+      GimpParasite *parasite;
 
-      g_free (comment);
+      parasite = gimp_parasite_new ("gimp-comment",
+                                    GIMP_PARASITE_PERSISTENT,
+                                    strlen (comment) + 1, comment);
+      gimp_image_parasite_attach (image, parasite);
+      gimp_parasite_free (parasite);
     }
 
+  if (writer)
+    apng_decoded_writer_finish (writer, comment);
+
+  if (cached)
+    apng_decoded_entry_free (cached);
+
+  g_free (comment);
+
 #if defined(PNG_iCCP_SUPPORTED)
   /*
    * Get the iCCP (colour profile) chunk, if any, and attach it as
@@ -1279,8 +3107,304 @@ load_image (const gchar  *filename,
   return image;
 }
 
+/*
+ * 'follow_frame_start()' - Get ready for the rows of a frame.
+ */
+
+static void
+follow_frame_start (PngFollow   *follow,
+                    png_structp  pp,
+                    png_infop    info)
+{
+  follow->frame_width    = png_get_image_width (pp, info);
+  follow->frame_height   = png_get_image_height (pp, info);
+  follow->frame_x_offset = 0;
+  follow->frame_y_offset = 0;
+  follow->delay          = -1;
+
+#if defined(PNG_APNG_SUPPORTED)
+  follow->dispose_op = PNG_DISPOSE_OP_NONE;
+
+  if (png_get_valid (pp, info, PNG_INFO_fcTL))
+    {
+      png_uint_16  delay_num;
+      png_uint_16  delay_den;
+      png_byte     blend_op;
+
+      png_get_next_frame_fcTL (pp, info,
+                               &follow->frame_width, &follow->frame_height,
+                               &follow->frame_x_offset,
+                               &follow->frame_y_offset,
+                               &delay_num, &delay_den,
+                               &follow->dispose_op, &blend_op);
+      if (delay_den == 0)
+        delay_den = 100;
+
+      follow->delay = delay_num * 1000 / delay_den;
+    }
+
+  if (follow->frame == 0 && follow->dispose_op == PNG_DISPOSE_OP_PREVIOUS)
+    follow->dispose_op = PNG_DISPOSE_OP_BACKGROUND;
+#endif
+
+  /* Interlaced rows build on what the earlier passes left */
+  g_free (follow->pixels);
+  follow->pixels = g_new0 (guchar, (gsize) follow->frame_width *
+                                   follow->frame_height * follow->bpp);
+
+  follow->in_frame = TRUE;
+}
+
+/*
+ * 'follow_frame_finish()' - Turn the frame just read into a layer.
+ */
+
+static void
+follow_frame_finish (PngFollow *follow)
+{
+  GimpDrawable *drawable;
+  GimpPixelRgn  pixel_rgn;
+  gchar        *framename;
+  gint32        layer;
+  gint          tile_height = gimp_tile_height ();
+  gint          begin;
+
+  if (! follow->in_frame)
+    return;
+
+  follow->in_frame = FALSE;
+
+#if defined(PNG_APNG_SUPPORTED)
+  framename = frame_layer_name (follow->frame, follow->delay,
+                                follow->previous_dispose_op);
+  follow->previous_dispose_op = follow->dispose_op;
+#else
+  framename = g_strdup (_("Background"));
+#endif
+
+  layer = gimp_layer_new (follow->image, framename,
+                          follow->frame_width, follow->frame_height,
+                          follow->layer_type, 100, GIMP_NORMAL_MODE);
+  g_free (framename);
+  gimp_image_add_layer (follow->image, layer, 0);
+
+  if (follow->offset_x != 0 && follow->offset_y != 0)
+    gimp_layer_set_offsets (layer, follow->offset_x, follow->offset_y);
+
+  gimp_layer_translate (layer,
+                        follow->frame_x_offset, follow->frame_y_offset);
+
+  drawable = gimp_drawable_get (layer);
+  gimp_pixel_rgn_init (&pixel_rgn, drawable, 0, 0, drawable->width,
+                       drawable->height, TRUE, FALSE);
+
+  for (begin = 0; begin < drawable->height; begin += tile_height)
+    gimp_pixel_rgn_set_rect (&pixel_rgn,
+                             follow->pixels +
+                             (gsize) begin * drawable->width * follow->bpp,
+                             0, begin, drawable->width,
+                             MIN (tile_height, drawable->height - begin));
+
+  gimp_drawable_flush (drawable);
+  gimp_drawable_detach (drawable);
+
+  if (follow->trns)
+    add_trns_alpha (layer, follow->empty, follow->alpha);
+
+  follow->num_ready++;
+
+  gimp_progress_set_text_printf (_("Opening '%s' (%d frames ready)"),
+                                 gimp_filename_to_utf8 (follow->filename),
+                                 follow->num_ready);
+
+  if (follow->interactive && follow->display == -1)
+    follow->display = gimp_display_new (follow->image);
+
+  if (follow->display != -1)
+    gimp_displays_flush ();
+}
+
+static void
+follow_info (png_structp pp,
+             png_infop   info)
+{
+  PngFollow *follow = png_get_progressive_ptr (pp);
+
+  png_set_interlace_handling (pp);
+
+  if (! setup_read_transforms (pp, info, follow->alpha, &follow->trns,
+                               &follow->bpp, &follow->image_type,
+                               &follow->layer_type))
+    png_error (pp, "Unknown color model");
+
+  follow->image = gimp_image_new (png_get_image_width (pp, info),
+                                  png_get_image_height (pp, info),
+                                  follow->image_type);
+
+  if (follow->image == -1)
+    png_error (pp, "Could not create new image");
+
+  load_image_properties (follow->image, pp, info, follow->interactive, 1,
+                         &follow->offset_x, &follow->offset_y);
+
+  gimp_image_set_filename (follow->image, follow->filename);
+
+  follow->empty = load_colormap (follow->image, pp, info, follow->alpha);
+
+  follow_frame_start (follow, pp, info);
+}
+
+static void
+follow_row (png_structp pp,
+            png_bytep   new_row,
+            png_uint_32 row_num,
+            int         pass)
+{
+  PngFollow *follow = png_get_progressive_ptr (pp);
+
+  if (! follow->in_frame || row_num >= follow->frame_height)
+    return;
+
+  png_progressive_combine_row (pp,
+                               follow->pixels + (gsize) row_num *
+                               follow->frame_width * follow->bpp,
+                               new_row);
+}
+
+static void
+follow_end (png_structp pp,
+            png_infop   info)
+{
+  PngFollow *follow = png_get_progressive_ptr (pp);
+
+  follow_frame_finish (follow);
+
+  follow->done = TRUE;
+}
+
+#if defined(PNG_APNG_SUPPORTED)
+static void
+follow_frame_info (png_structp pp,
+                   png_uint_32 frame)
+{
+  PngFollow *follow = png_get_progressive_ptr (pp);
+
+  follow->frame = frame;
+
+  follow_frame_start (follow, pp, follow->info);
+}
+
+static void
+follow_frame_end (png_structp pp,
+                  png_uint_32 frame)
+{
+  follow_frame_finish (png_get_progressive_ptr (pp));
+}
+#endif
+
+/*
+ * 'load_image_follow()' - Load a PNG image that is still being written,
+ *                         frame by frame.
+ *
+ * The file is handed to libpng's progressive reader as it comes in, and
+ * each frame becomes a layer once all of its rows are in.  A file that
+ * hasn't grown for "timeout" seconds, or a pipe that is closed, ends the
+ * load with the frames that are complete; so does corrupt data.
+ */
+
+static gint32
+load_image_follow (const gchar  *filename,
+                   gdouble       timeout,
+                   gboolean      interactive,
+                   gint         *num_ready,
+                   GError      **error)
+{
+  ApngFollower *follower;
+  PngFollow     follow;
+  png_structp   pp;
+  png_infop     info;
+  guchar       *buf;
+  GError       *read_error = NULL;
+
+  follower = apng_follower_open (filename, timeout, error);
+
+  if (! follower)
+    return -1;
+
+  memset (&follow, 0, sizeof (follow));
+  follow.filename    = filename;
+  follow.interactive = interactive;
+  follow.image       = -1;
+  follow.display     = -1;
+#if defined(PNG_APNG_SUPPORTED)
+  follow.previous_dispose_op = PNG_DISPOSE_OP_NONE;
+#endif
+
+  buf  = g_new (guchar, FOLLOW_BUFFER_SIZE);
+  pp   = png_create_read_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  info = png_create_info_struct (pp);
+
+  follow.info = info;
+
+  gimp_progress_init_printf (_("Opening '%s'"),
+                             gimp_filename_to_utf8 (filename));
+
+  if (! setjmp (png_jmpbuf (pp)))
+    {
+      png_set_progressive_read_fn (pp, &follow,
+                                   follow_info, follow_row, follow_end);
+#if defined(PNG_APNG_SUPPORTED)
+      png_set_progressive_frame_fn (pp, follow_frame_info, follow_frame_end);
+#endif
+
+      while (! follow.done)
+        {
+          gssize n = apng_follower_read (follower, buf, FOLLOW_BUFFER_SIZE,
+                                         &read_error);
+
+          if (n > 0)
+            png_process_data (pp, info, buf, n);
+          else if (n < 0 || apng_follower_ended (follower))
+            break;
+          else
+            gimp_progress_pulse ();
+        }
+    }
+
+  png_destroy_read_struct (&pp, &info, NULL);
+  apng_follower_free (follower);
+  g_free (follow.pixels);
+  g_free (buf);
+
+  if (follow.num_ready == 0)
+    {
+      if (follow.image != -1)
+        gimp_image_delete (follow.image);
+
+      if (read_error)
+        g_propagate_error (error, read_error);
+      else
+        g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                     _("Error while reading '%s'. File corrupted?"),
+                     gimp_filename_to_utf8 (filename));
+
+      return -1;
+    }
+
+  if (read_error)
+    g_error_free (read_error);
+
+  *num_ready = follow.num_ready;
+
+  return follow.image;
+}
+
 /*
  * 'read_frame()' - Read a PNG frame into a layer.
+ *
+ * Only the "crop_*" rectangle of the frame goes into the layer.  The
+ * other rows are decoded and dropped, the other columns left out when
+ * the rows are stored.
  */
 
 static void
@@ -1293,21 +3417,28 @@ read_frame (gint32        layer,
             png_infop     info,
             png_uint_32   frame_width,
             png_uint_32   frame_height,
-            png_uint_32   frame_x_offset,
-            png_uint_32   frame_y_offset,
+            gint          crop_x,
+            gint          crop_y,
+            gint          crop_width,
+            gint          crop_height,
+            GChecksum    *key,
+            ApngDecodedWriter *writer,
             GError      **error)
 {
   int i,                        /* Looping var */
     num_passes,                 /* Number of interlace passes in file */
     pass,                       /* Current pass in file */
     tile_height,                /* Height of tile in GIMP */
+    strip_height,               /* Frame rows per strip */
     begin,                      /* Beginning tile row */
     end,                        /* Ending tile row */
     num;                        /* Number of rows to load */
+  gboolean whole;               /* Frame is read as one strip */
   GimpDrawable *drawable;       /* Drawable for layer */
   GimpPixelRgn pixel_rgn;       /* Pixel region for layer */
-  guchar **pixels,              /* Pixel rows */
-   *pixel;                      /* Pixel data */
+  PngStrip strips[2];           /* Strips being read and stored */
+  PngStoreJob job;              /* What the worker does with them */
+  PngStripPipeline *pipeline;   /* Worker storing the strips */
   struct read_error_data
    error_data;
 
@@ -1321,106 +3452,160 @@ read_frame (gint32        layer,
                        drawable->height, TRUE, FALSE);
 
   /*
-   * Temporary buffer...
+   * Turn on interlace handling... libpng returns just 1 (ie single pass)
+   * if the image is not interlaced
    */
 
-  tile_height = gimp_tile_height ();
-  pixel = g_new0 (guchar, tile_height * frame_width * bpp);
-  pixels = g_new (guchar *, tile_height);
+  num_passes = png_set_interlace_handling (pp);
 
-  for (i = 0; i < tile_height; i++)
-    pixels[i] = pixel + frame_width * png_get_channels(pp, info) * i;
+  /*
+   * Temporary buffers, one being decoded while the other is sent...
+   *
+   * A reduced strip is a tile high, so it takes "reduction" times the
+   * rows.  Later passes of interlaced PiNGs build on earlier ones, which
+   * can't be read back from a reduced layer, so those frames are read
+   * in one strip.
+   */
+
+  tile_height  = gimp_tile_height ();
+  strip_height = tile_height * loadvals.reduction;
+  whole        = (loadvals.reduction > 1 && num_passes > 1);
+
+  if (whole)
+    strip_height = crop_height;
+
+  memset (strips, 0, sizeof (strips));
+
+  for (i = 0; i < (whole ? 1 : 2); i++)
+    strip_alloc (&strips[i], strip_height,
+                 frame_width * png_get_channels (pp, info));
+
+  job.pixel_rgn   = &pixel_rgn;
+  job.width       = drawable->width;
+  job.height      = crop_height;
+  job.size        = strip_height * frame_width * bpp;
+  job.num_passes  = num_passes;
+  job.reduce      = loadvals.reduction;
+  job.x           = crop_x;
+  job.frame_width = crop_width;
+  job.bpp         = bpp;
+  job.stride      = frame_width * bpp;
+  job.indexed     = (gimp_drawable_type (layer) == GIMP_INDEXED_IMAGE);
+  job.reduced     = NULL;
+  job.sums        = NULL;
+  job.writer      = writer;
+
+  if (job.reduce > 1)
+    {
+      job.reduced = g_new (guchar, ((strip_height + job.reduce - 1) /
+                                    job.reduce) * drawable->width * bpp);
+      job.sums    = g_new (guint16, crop_width * bpp);
+    }
+
+  /*
+   * Later passes of interlaced PiNGs read back what was stored, so those
+   * can't have the worker storing behind libpng's back
+   */
 
-  /* Install our own error handler to handle incomplete PNG files better */
+  pipeline = strip_pipeline_new (store_strip_rows, &job,
+                                 num_passes == 1 &&
+                                 crop_height > strip_height);
+
+  /* Install our own error handler to handle incomplete PNG files better,
+   * its rows are those of the layer */
   error_data.drawable    = drawable;
-  error_data.pixel       = pixel;
-  error_data.tile_height = tile_height;
+  error_data.pixel       = strips[0].pixel;
+  error_data.tile_height = (strip_height + job.reduce - 1) / job.reduce;
   error_data.width       = frame_width;
-  error_data.height      = frame_height;
+  error_data.height      = drawable->height;
   error_data.bpp         = bpp;
   error_data.pixel_rgn   = &pixel_rgn;
+  error_data.pipeline    = pipeline;
+  error_data.strip       = &strips[0];
+  error_data.job         = &job;
 
   png_set_error_fn (pp, &error_data, on_read_error, NULL);
 
-  /*
-   * Turn on interlace handling... libpng returns just 1 (ie single pass)
-   * if the image is not interlaced
-   */
+  if (whole)
+    {
+      PngStrip *strip = &strips[0];
 
-  num_passes = png_set_interlace_handling (pp);
+      strip->begin = 0;
+      strip->num   = crop_height;
 
-  for (pass = 0; pass < num_passes; pass++)
-    {
-      /*
-       * This works if you are only reading one row at a time...
-       */
+      error_data.strip = strip;
+      error_data.begin = 0;
+      error_data.end   = drawable->height;
+      error_data.num   = drawable->height;
 
-      for (begin = 0, end = tile_height;
-           begin < frame_height; begin += tile_height, end += tile_height)
+      for (pass = 0; pass < num_passes; pass++)
         {
-          if (end > frame_height)
-            end = frame_height;
+          strip->pass = pass;
+          skip_rows (pp, crop_y);
+          png_read_rows (pp, strip->rows, NULL, crop_height);
+          skip_rows (pp, frame_height - crop_y - crop_height);
+        }
 
-          num = end - begin;
+      if (key)
+        apng_cache_key_rows (key, strip->rows, crop_height,
+                             frame_width * png_get_channels (pp, info));
 
-          if (pass != 0)        /* to handle interlaced PiNGs */
-            gimp_pixel_rgn_get_rect (&pixel_rgn, pixel, 0, begin,
-                                     drawable->width, num);
+      strip_pipeline_push (pipeline, strip);
+    }
 
-          error_data.begin = begin;
-          error_data.end   = end;
-          error_data.num   = num;
+  /*
+   * This works if you are only reading one row at a time...
+   */
 
-          png_read_rows (pp, pixels, NULL, num);
+  for (i = 0, pass = 0, begin = 0; ! whole; i++)
+    {
+      PngStrip *strip = (i < 2) ? &strips[i] : strip_pipeline_pop (pipeline);
 
-          gimp_pixel_rgn_set_rect (&pixel_rgn, pixel, 0, begin,
-                                   drawable->width, num);
+      if (! strip_next (strip, &pass, &begin, 0, strip_height,
+                        crop_height, num_passes))
+        break;
 
-          memset (pixel, 0, tile_height * frame_width * bpp);
+      end = strip->begin + strip->num;
+      num = strip->num;
 
-          gimp_progress_update (((gdouble) pass +
-                                 (gdouble) end / (gdouble) frame_height) /
-                                (gdouble) num_passes);
+      if (strip->pass != 0)     /* to handle interlaced PiNGs */
+        {
+          gimp_pixel_rgn_get_rect (&pixel_rgn, strip->pixel, 0, strip->begin,
+                                   drawable->width, num);
+          crop_strip_rows (strip, &job, FALSE);
         }
-    }
 
-  /* Switch back to default error handler */
-  png_set_error_fn (pp, NULL, NULL, NULL);
+      error_data.strip = strip;
+      error_data.pixel = strip->pixel;
+      error_data.begin = strip->begin / job.reduce;
+      error_data.end   = (end + job.reduce - 1) / job.reduce;
+      error_data.num   = error_data.end - error_data.begin;
 
-  g_free (pixel);
-  g_free (pixels);
+      if (strip->begin == 0)
+        skip_rows (pp, crop_y);
 
-  if (trns)
-    {
-      gimp_layer_add_alpha (layer);
-      drawable = gimp_drawable_get (layer);
-      gimp_pixel_rgn_init (&pixel_rgn, drawable, 0, 0, drawable->width,
-                           drawable->height, TRUE, FALSE);
+      png_read_rows (pp, strip->rows, NULL, num);
 
-      pixel = g_new (guchar, tile_height * drawable->width * 2); /* bpp == 1 */
+      if (end == crop_height)
+        skip_rows (pp, frame_height - crop_y - crop_height);
 
-      for (begin = 0, end = tile_height;
-           begin < drawable->height; begin += tile_height, end += tile_height)
-        {
-          if (end > drawable->height)
-            end = drawable->height;
-          num = end - begin;
+      if (key && strip->pass == num_passes - 1)
+        apng_cache_key_rows (key, strip->rows, num,
+                             frame_width * png_get_channels (pp, info));
 
-          gimp_pixel_rgn_get_rect (&pixel_rgn, pixel, 0, begin,
-                                   drawable->width, num);
+      strip_pipeline_push (pipeline, strip);
+    }
 
-          for (i = 0; i < tile_height * drawable->width; ++i)
-            {
-              pixel[i * 2 + 1] = alpha[pixel[i * 2]];
-              pixel[i * 2] -= empty;
-            }
+  strip_pipeline_free (pipeline);
 
-          gimp_pixel_rgn_set_rect (&pixel_rgn, pixel, 0, begin,
-                                   drawable->width, num);
-        }
+  /* Switch back to default error handler */
+  png_set_error_fn (pp, NULL, NULL, NULL);
 
-      g_free (pixel);
-    }
+  for (i = 0; i < 2; i++)
+    strip_free (&strips[i]);
+
+  g_free (job.reduced);
+  g_free (job.sums);
 
   /*
    * Update the display...
@@ -1428,7 +3613,220 @@ read_frame (gint32        layer,
 
   gimp_drawable_flush (drawable);
   gimp_drawable_detach (drawable);
+
+  if (trns)
+    add_trns_alpha (layer, empty, alpha);
+}
+
+/*
+ * 'add_trns_alpha()' - Turn the tRNS palette entries of an indexed layer
+ *                      into an alpha channel.
+ */
+
+static void
+add_trns_alpha (gint32  layer,
+                int     empty,
+                guchar *alpha)
+{
+  int i,                        /* Looping var */
+    tile_height,                /* Height of tile in GIMP */
+    begin,                      /* Beginning tile row */
+    end,                        /* Ending tile row */
+    num;                        /* Number of rows to load */
+  GimpDrawable *drawable;       /* Drawable for layer */
+  GimpPixelRgn pixel_rgn;       /* Pixel region for layer */
+  guchar *pixel;                /* Pixel data */
+
+  tile_height = gimp_tile_height ();
+
+  gimp_layer_add_alpha (layer);
+  drawable = gimp_drawable_get (layer);
+  gimp_pixel_rgn_init (&pixel_rgn, drawable, 0, 0, drawable->width,
+                       drawable->height, TRUE, FALSE);
+
+  pixel = g_new (guchar, tile_height * drawable->width * 2); /* bpp == 1 */
+
+  for (begin = 0, end = tile_height;
+       begin < drawable->height; begin += tile_height, end += tile_height)
+    {
+      if (end > drawable->height)
+        end = drawable->height;
+      num = end - begin;
+
+      gimp_pixel_rgn_get_rect (&pixel_rgn, pixel, 0, begin,
+                               drawable->width, num);
+
+      for (i = 0; i < tile_height * drawable->width; ++i)
+        {
+          pixel[i * 2 + 1] = alpha[pixel[i * 2]];
+          pixel[i * 2] -= empty;
+        }
+
+      gimp_pixel_rgn_set_rect (&pixel_rgn, pixel, 0, begin,
+                               drawable->width, num);
+    }
+
+  g_free (pixel);
+
+  gimp_drawable_flush (drawable);
+  gimp_drawable_detach (drawable);
+}
+
+/*
+ * 'skip_rows()' - Decode rows of the current pass without keeping them.
+ */
+
+static void
+skip_rows (png_structp pp,
+           gint        num_rows)
+{
+  for (; num_rows > 0; num_rows--)
+    png_read_row (pp, NULL, NULL);
+}
+
+/*
+ * 'read_cached_frames()' - Load the layers of an image from the cache of
+ *                          decoded frames.
+ *
+ * The rows go to the core straight from the mapped entry, so the file
+ * is neither inflated nor copied.
+ */
+
+static void
+read_cached_frames (gint32            image,
+                    ApngDecodedEntry *entry,
+                    gint              layer_type,
+                    int               bpp,
+                    int               empty,
+                    int               trns,
+                    guchar           *alpha)
+{
+  guint num_frames  = apng_decoded_num_frames (entry);
+  gint  tile_height = gimp_tile_height ();
+  guint i;
+
+  for (i = 0; i < num_frames; i++)
+    {
+      ApngDecodedFrame  frame;
+      GimpDrawable     *drawable;
+      GimpPixelRgn      pixel_rgn;
+      gint32            layer;
+      gint              begin;
+
+      apng_decoded_get_frame (entry, i, &frame);
+
+      layer = gimp_layer_new (image, frame.name, frame.width, frame.height,
+                              layer_type, 100, GIMP_NORMAL_MODE);
+      gimp_image_add_layer (image, layer, 0);
+      gimp_layer_set_offsets (layer, frame.x, frame.y);
+
+      drawable = gimp_drawable_get (layer);
+      gimp_pixel_rgn_init (&pixel_rgn, drawable, 0, 0, drawable->width,
+                           drawable->height, TRUE, FALSE);
+
+      for (begin = 0; begin < frame.height; begin += tile_height)
+        gimp_pixel_rgn_set_rect (&pixel_rgn,
+                                 frame.pixels +
+                                 (gsize) begin * frame.width * bpp,
+                                 0, begin, frame.width,
+                                 MIN (tile_height, frame.height - begin));
+
+      gimp_drawable_flush (drawable);
+      gimp_drawable_detach (drawable);
+
+      if (trns)
+        add_trns_alpha (layer, empty, alpha);
+
+      gimp_progress_update ((gdouble) (i + 1) / (gdouble) num_frames);
+    }
+}
+
+/*
+ * 'cache_decoded_layer()' - Start the cache entry of a layer being read.
+ */
+
+static void
+cache_decoded_layer (ApngDecodedWriter *writer,
+                     gint32             layer,
+                     const gchar       *name,
+                     int                bpp)
+{
+  gint x, y;
+
+  gimp_drawable_offsets (layer, &x, &y);
+
+  apng_decoded_add_frame (writer, name, x, y,
+                          gimp_drawable_width (layer),
+                          gimp_drawable_height (layer), bpp);
+}
+
+#if defined(PNG_APNG_SUPPORTED)
+/*
+ * 'cache_file_frames ()' - Enter the frames of an animation into the
+ *                          frame cache.
+ *
+ * "keys" are the keys of the frames that were read, in file order.  The
+ * image data of each frame is the IDAT or fdAT chunks up to the next
+ * fcTL, and fits any compression level since it's what the file had.
+ */
+
+static void
+cache_file_frames (const gchar *filename,
+                   GPtrArray   *keys)
+{
+  ApngChunkReader *reader;
+  ApngCache       *cache;
+  ApngChunk        chunk;
+  GByteArray      *payload;
+  guint            frame = 0;
+
+  reader = apng_chunk_reader_new (filename, NULL);
+
+  if (! reader)
+    return;
+
+  apng_chunk_reader_set_check_data (reader, ! loadvals.trusted);
+
+  cache = apng_cache_open ();
+
+  if (! cache)
+    {
+      apng_chunk_reader_free (reader);
+      return;
+    }
+
+  payload = g_byte_array_new ();
+
+  while (frame < keys->len &&
+         apng_chunk_reader_next (reader, &chunk, NULL))
+    {
+      if (! strcmp (chunk.type, "IDAT"))
+        {
+          g_byte_array_append (payload, chunk.data, chunk.length);
+        }
+      else if (! strcmp (chunk.type, "fdAT"))
+        {
+          if (chunk.length > 4)
+            g_byte_array_append (payload, chunk.data + 4, chunk.length - 4);
+        }
+      else if (payload->len > 0 &&
+               (! strcmp (chunk.type, "fcTL") ||
+                ! strcmp (chunk.type, "IEND")))
+        {
+          apng_cache_store (cache, g_ptr_array_index (keys, frame),
+                            APNG_CACHE_ANY_LEVEL,
+                            payload->data, payload->len);
+
+          g_byte_array_set_size (payload, 0);
+          frame++;
+        }
+    }
+
+  g_byte_array_free (payload, TRUE);
+  apng_cache_close (cache);
+  apng_chunk_reader_free (reader);
 }
+#endif
 
 
 /*
@@ -1437,6 +3835,7 @@ read_frame (gint32        layer,
 
 static gboolean
 save_image (const gchar  *filename,
+            GByteArray   *buffer,
             gint32        image_ID,
             gint32        drawable_ID,
             gint32        orig_image_ID,
@@ -1445,7 +3844,9 @@ save_image (const gchar  *filename,
   gint i,                       /* Looping vars */
     bpp = 0,                    /* Bytes per pixel */
     drawable_type;              /* Type of drawable/layer */
-  FILE *fp;                     /* File pointer */
+  ApngOutput * volatile output = NULL; /* Output file */
+  ApngCache * volatile cache = NULL; /* Compressed frames */
+  guint64 raw_size = 0;         /* Size of the frames uncompressed */
   GimpDrawable *drawable;       /* Drawable for layer */
   png_structp pp;               /* PNG read pointer */
   png_infop info;               /* PNG info pointer */
@@ -1454,6 +3855,9 @@ save_image (const gchar  *filename,
   gdouble xres, yres;           /* GIMP resolution (dpi) */
   gint32 *layers;               /* Layers */
   gint nlayers;                 /* Number of Layers */
+  PngFrame *frames;             /* Frames, in the order they're written */
+  gint nframes;                 /* Number of frames */
+  gint width, height;           /* Canvas size */
   int color_type;               /* PNG color type */
   int bit_depth;                /* PNG bit depth */
   png_color_16 background;      /* Background color */
@@ -1463,6 +3867,9 @@ save_image (const gchar  *filename,
   struct tm *gmt;               /* GMT broken down */
 
   guchar remap[256];            /* Re-mapping for the palette */
+  guchar inverse_remap[256];    /* GIMP index -> PNG index */
+  ApngRemap pixel_remap;        /* Same, for the fix-up kernels */
+  CompressionBudget budget;     /* Time-budgeted compression state */
 
   png_textp  text = NULL;
 
@@ -1512,6 +3919,12 @@ save_image (const gchar  *filename,
 
   if (setjmp (png_jmpbuf (pp)))
     {
+      if (output)
+        apng_output_abort (output);
+
+      if (cache)
+        apng_cache_close (cache);
+
       g_set_error (error, 0, 0,
                    _("Error while saving '%s'. Could not save image."),
                    gimp_filename_to_utf8 (filename));
@@ -1525,16 +3938,17 @@ save_image (const gchar  *filename,
    * Open the file and initialize the PNG write "engine"...
    */
 
-  fp = g_fopen (filename, "wb");
-  if (fp == NULL)
-    {
-      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
-                   _("Could not open '%s' for writing: %s"),
-                   gimp_filename_to_utf8 (filename), g_strerror (errno));
-      return FALSE;
-    }
+  if (buffer)
+    output = apng_output_new_for_array (buffer);
+  else
+    output = apng_output_open (filename, error);
 
-  png_init_io (pp, fp);
+  if (output == NULL)
+    return FALSE;
+
+  apng_output_set_threaded (output, pngvals.num_threads != 1);
+
+  png_set_write_fn (pp, output, write_output_data, flush_output_data);
 
   gimp_progress_init_printf (_("Saving '%s'"),
                              gimp_filename_to_utf8 (filename));
@@ -1547,6 +3961,38 @@ save_image (const gchar  *filename,
   drawable = gimp_drawable_get (layers[0]);
   drawable_type = gimp_drawable_type (layers[0]);
 
+#if defined(PNG_APNG_SUPPORTED)
+  if (nlayers > 1)
+    {
+      /*
+       * The frames are placed on the canvas and converted to a common
+       * type while they're written, so the layers may differ in alpha,
+       * size, offsets and opacity.
+       */
+
+      GimpImageType frames_type;
+
+      frames = plan_frames (image_ID, layers, nlayers, &nframes,
+                            &frames_type);
+      drawable_type = frames_type;
+      width  = gimp_image_width (image_ID);
+      height = gimp_image_height (image_ID);
+    }
+  else
+#endif
+    {
+      nframes = 1;
+      frames  = g_new0 (PngFrame, 1);
+
+      frames->layer_ID = layers[0];
+      frames->width    = width  = drawable->width;
+      frames->height   = height = drawable->height;
+      frames->opacity  = 255;
+      gimp_drawable_offsets (layers[0], &frames->x, &frames->y);
+      frames->layer_x  = frames->x;
+      frames->layer_y  = frames->y;
+    }
+
   /*
    * Set color type and remember bytes per pixel count
    */
@@ -1584,10 +4030,20 @@ save_image (const gchar  *filename,
       break;
 
     default:
+      apng_output_abort (output);
       g_set_error (error, 0, 0, "Image type can't be saved as PNG");
       return FALSE;
     }
 
+  /*
+   * Preallocate the file, guessing that deflate halves the frames
+   */
+
+  for (i = 0; i < nframes; i++)
+    raw_size += (guint64) frames[i].width * frames[i].height * bpp;
+
+  apng_output_reserve (output, raw_size / 2);
+
   /*
    * Fix bit depths for (possibly) smaller colormap images
    */
@@ -1608,7 +4064,7 @@ save_image (const gchar  *filename,
    * Set the image dimensions, bit depth, interlacing and compression
    */
 
-  png_set_IHDR(pp, info, drawable->width, drawable->height,
+  png_set_IHDR(pp, info, width, height,
                bit_depth, color_type,
                pngvals.interlaced, PNG_COMPRESSION_TYPE_BASE,
                PNG_FILTER_TYPE_BASE);
@@ -1631,8 +4087,13 @@ save_image (const gchar  *filename,
         }
       else
         {
-          /* fix up transparency */
-          respin_cmap (pp, info, remap, image_ID, drawable);
+          /* fix up transparency, for all frames sharing the palette */
+#if defined(PNG_APNG_SUPPORTED)
+          if (nlayers > 1)
+            respin_cmap (pp, info, remap, image_ID, layers, nlayers);
+          else
+#endif
+            respin_cmap (pp, info, remap, image_ID, layers, 1);
         }
     }
 
@@ -1674,11 +4135,12 @@ save_image (const gchar  *filename,
       png_set_gAMA (pp, info, gamma);
     }
 
-  offx = 0;
-  offy = 0;
+  /* The offset is that of the first frame: the layer of a still image,
+   * 0,0 for animations, whose frames are placed on the canvas */
+  offx = frames[0].x;
+  offy = frames[0].y;
   if (pngvals.offs)
     {
-      gimp_drawable_offsets (drawable_ID, &offx, &offy);
       if (offx != 0 || offy != 0)
         {
           png_set_oFFs (pp, info, offx, offy, PNG_OFFSET_PIXEL);
@@ -1736,21 +4198,21 @@ save_image (const gchar  *filename,
   }
 #endif
 
+  png_write_info (pp, info);
+
 #if defined(PNG_APNG_SUPPORTED)
-  if (nlayers > 1)
-    {
-      png_uint_32 num_plays;
-      png_byte first_frame_is_hidden;
+  /*
+   * The chunks of an animation are written by write_animation_frame(),
+   * a hidden first frame doesn't count as part of the animation
+   */
 
-      num_plays = pngvals.num_plays;
-      first_frame_is_hidden = pngvals.first_frame_is_hidden;
-      png_set_acTL (pp, info, nlayers, num_plays);
-      png_set_first_frame_is_hidden (pp, info, first_frame_is_hidden);
-    }
+  if (nlayers > 1 &&
+      ! apng_write_actl (output,
+                         nframes - (pngvals.first_frame_is_hidden ? 1 : 0),
+                         pngvals.num_plays))
+    png_error (pp, "Write Error");
 #endif
 
-  png_write_info (pp, info);
-
   /*
    * Convert unpacked pixels to packed if necessary
    */
@@ -1758,38 +4220,98 @@ save_image (const gchar  *filename,
   if (color_type == PNG_COLOR_TYPE_PALETTE && bit_depth < 8)
     png_set_packing (pp);
 
+  /*
+   * The pixel re-mapping is the same for every frame, build it once
+   */
+
+  for (i = 0; i < 256; i++)
+    inverse_remap[ remap[i] ] = i;
+
+  apng_kernels_init ();
+  apng_remap_init (&pixel_remap, inverse_remap);
+
+  budget.timer       = g_timer_new ();
+  budget.budget      = pngvals.compression_budget / 1000.0;
+  budget.filter      = pngvals.filter;
+  budget.strategy    = pngvals.compression_strategy;
+  budget.frames_left = 1;
+
+  memset (&save_stats, 0, sizeof (save_stats));
+
 #if defined(PNG_APNG_SUPPORTED)
   if (nlayers > 1)
     {
-      for (i = nlayers - 1; i >= 0; i--)
+      ApngFormat format;        /* Format shared by the frames */
+      png_colorp palette;
+      png_bytep  trans;
+      guint32    sequence = 0;  /* Next fcTL/fdAT sequence number */
+
+      memset (&format, 0, sizeof (format));
+
+      format.bit_depth         = bit_depth;
+      format.color_type        = color_type;
+      format.interlace         = (pngvals.interlaced ?
+                                  PNG_INTERLACE_ADAM7 : PNG_INTERLACE_NONE);
+      format.compression_level = pngvals.compression_level;
+
+      if (png_get_PLTE (pp, info, &palette, &format.num_palette))
+        memcpy (format.palette, palette,
+                format.num_palette * sizeof (png_color));
+
+      if (png_get_tRNS (pp, info, &trans, &format.num_trans, NULL))
+        memcpy (format.trans, trans, format.num_trans);
+
+      if (pngvals.frame_cache)
+        cache = apng_cache_open ();
+
+      budget.frames_left = nframes;
+
+      for (i = 0; i < nframes; i++)
         {
-          gchar        *layer_name;
-          png_uint_16   frame_delay_num;
-          png_uint_16   frame_delay_den;
-          png_byte      frame_dispose_op;
-          png_byte      frame_blend_op;
+          ApngFrameControl fc;
+          gchar           *layer_name;
+
+          fc.width    = frames[i].width;
+          fc.height   = frames[i].height;
+          fc.x_offset = frames[i].x;
+          fc.y_offset = frames[i].y;
+
+          layer_name = gimp_drawable_get_name (frames[i].layer_ID);
+          parse_delay_tag (&fc.delay_num, &fc.delay_den, layer_name,
+                           frames[i].extra_delay);
+          fc.dispose_op = parse_dispose_op_tag (layer_name);
+          fc.blend_op   = pngvals.blend_op;
+          g_free (layer_name);
+
+          if (! write_animation_frame (&frames[i], i, bpp, red, green, blue,
+                                       &pixel_remap, &format, &fc, &sequence,
+                                       output, cache, &budget, error))
+            png_error (pp, "Write Error");
+        }
 
-          layer_name = gimp_drawable_get_name (layers[i]);
-          parse_delay_tag (&frame_delay_num, &frame_delay_den, layer_name);
-          frame_dispose_op = parse_dispose_op_tag (layer_name);
-          frame_blend_op = pngvals.blend_op;
-          write_frame (layers[i], bpp, red, green, blue, remap, TRUE,
-                       pp, info, offx, offy,
-                       frame_delay_num, frame_delay_den,
-                       frame_dispose_op, frame_blend_op,
-                       error);
+      if (cache)
+        {
+          apng_cache_close (cache);
+          cache = NULL;
         }
+
+      if (! apng_write_chunk (output, "IEND", NULL, 0))
+        png_error (pp, "Write Error");
     }
   else
 #endif
     {
-      write_frame (layers[0], bpp, red, green, blue, remap, FALSE,
-                   pp, info, offx, offy, 0, 0, 0, 0, error);
+      write_frame (&frames[0], bpp, red, green, blue, &pixel_remap,
+                   pp, info, NULL, &budget, NULL, error);
+
+      png_write_end (pp, info);
     }
 
-  png_write_end (pp, info);
   png_destroy_write_struct (&pp, &info);
 
+  g_timer_destroy (budget.timer);
+  g_free (frames);
+
   /*
    * Done with the file...
    */
@@ -1800,51 +4322,181 @@ save_image (const gchar  *filename,
       g_free (text);
     }
 
-  fclose (fp);
+  return apng_output_close (output, error);
+}
 
-  return TRUE;
+#if defined(PNG_APNG_SUPPORTED)
+/*
+ * 'plan_frames ()' - Place the layers of an animation.
+ *
+ * Frames are written bottom layer first.  The first frame always covers
+ * the whole canvas, the others are the part of their layer inside the
+ * canvas.  If any layer has alpha or isn't fully opaque all frames get
+ * alpha.  Layers entirely outside the canvas are dropped and their
+ * delay is added to the frame before.  Layers with a simple mode
+ * keep it when they aren't the bottom frame, see apply_layer_mode().
+ */
+
+static PngFrame *
+plan_frames (gint32         image_ID,
+             const gint32  *layers,
+             gint           nlayers,
+             gint          *nframes,
+             GimpImageType *type)
+{
+  PngFrame *frames;
+  gint      canvas_width  = gimp_image_width (image_ID);
+  gint      canvas_height = gimp_image_height (image_ID);
+  gboolean  alpha = FALSE;
+  gint      i;
+
+  for (i = 0; i < nlayers; i++)
+    {
+      if (gimp_drawable_has_alpha (layers[i]) ||
+          gimp_layer_get_opacity (layers[i]) < 100.0)
+        alpha = TRUE;
+    }
+
+  switch (gimp_image_base_type (image_ID))
+    {
+    case GIMP_RGB:
+      *type = alpha ? GIMP_RGBA_IMAGE : GIMP_RGB_IMAGE;
+      break;
+    case GIMP_GRAY:
+      *type = alpha ? GIMP_GRAYA_IMAGE : GIMP_GRAY_IMAGE;
+      break;
+    default:
+      *type = alpha ? GIMP_INDEXEDA_IMAGE : GIMP_INDEXED_IMAGE;
+      break;
+    }
+
+  frames = g_new0 (PngFrame, nlayers);
+  *nframes = 0;
+
+  for (i = nlayers - 1; i >= 0; i--)
+    {
+      PngFrame *frame = &frames[*nframes];
+      gint      x1, y1;
+
+      frame->layer_ID = layers[i];
+      frame->opacity  = RINT (gimp_layer_get_opacity (layers[i]) * 2.55);
+      frame->mode     = GIMP_NORMAL_MODE;
+      frame->below_ID = -1;
+      gimp_drawable_offsets (layers[i], &frame->layer_x, &frame->layer_y);
+
+      if (*nframes == 0)
+        {
+          frame->x      = 0;
+          frame->y      = 0;
+          frame->width  = canvas_width;
+          frame->height = canvas_height;
+        }
+      else
+        {
+          frame->x = CLAMP (frame->layer_x, 0, canvas_width);
+          frame->y = CLAMP (frame->layer_y, 0, canvas_height);
+          x1 = CLAMP (frame->layer_x + gimp_drawable_width (layers[i]),
+                      0, canvas_width);
+          y1 = CLAMP (frame->layer_y + gimp_drawable_height (layers[i]),
+                      0, canvas_height);
+
+          frame->width  = x1 - frame->x;
+          frame->height = y1 - frame->y;
+
+          if (frame->width <= 0 || frame->height <= 0)
+            {
+              gchar       *name = gimp_drawable_get_name (layers[i]);
+              png_uint_16  num, den;
+
+              parse_delay_tag (&num, &den, name, 0);
+              frames[*nframes - 1].extra_delay +=
+                num * 1000 / (den ? den : 100);
+              g_free (name);
+              continue;
+            }
+          else if (*type != GIMP_INDEXED_IMAGE &&
+                   *type != GIMP_INDEXEDA_IMAGE &&
+                   simple_layer_mode (gimp_layer_get_mode (layers[i])))
+            {
+              frame->mode     = gimp_layer_get_mode (layers[i]);
+              frame->below_ID = frames[*nframes - 1].layer_ID;
+            }
+        }
+
+      (*nframes)++;
+    }
+
+  return frames;
 }
+#endif
 
 /*
  * 'write_frame ()' - Write the specified frame.
+ *
+ * If "keep_pixel" isn't NULL it gets the rows as they were compressed,
+ * "frame->width * bpp" bytes apart, or NULL on a frame cache hit.
  */
 
 static gboolean
-write_frame (gint32        drawable_ID,
+write_frame (const PngFrame *frame,
              gint          bpp,
              guchar        red,
              guchar        green,
              guchar        blue,
-             guchar       *remap,
-             gboolean      as_animation,
+             const ApngRemap *remap,
              png_structp   pp,
              png_infop     info,
-             png_uint_32   offx,
-             png_uint_32   offy,
-             png_uint_16   frame_delay_num,
-             png_uint_16   frame_delay_den,
-             png_byte      frame_dispose_op,
-             png_byte      frame_blend_op,
+             PngFrameLookup *lookup,
+             CompressionBudget *budget,
+             guchar      **keep_pixel,
              GError      **error)
 {
-  gint i, k,                    /* Looping vars */
+  gint i,                       /* Looping var */
     num_passes,                 /* Number of interlace passes in file */
     pass,                       /* Current pass in file */
+    tile_width,                 /* Width of tile in GIMP */
     tile_height,                /* Height of tile in GIMP */
-    begin,                      /* Beginning tile row */
-    end,                        /* Ending tile row */
-    num;                        /* Number of rows to load */
+    first,                      /* Frame row where layer tile rows start */
+    begin;                      /* Beginning tile row */
+  gint x0, y0, x1, y1;          /* Layer area read, in layer coordinates */
   GimpDrawable *drawable;       /* Drawable for layer */
   GimpPixelRgn pixel_rgn;       /* Pixel region for layer */
-  guchar **pixels,              /* Pixel rows */
-   *fixed,                      /* Fixed-up pixel data */
-   *pixel;                      /* Pixel data */
+  PngStrip strips[2];           /* Strips being fetched and written */
+  PngFetchJob job;              /* What the worker does with them */
+  PngStripPipeline * volatile pipeline; /* Worker fetching the strips */
+  jmp_buf saved_jmpbuf;         /* Error return of our caller */
+  guchar **frame_rows = NULL,   /* Frame rows kept for later passes */
+   *frame_pixel = NULL;         /* Frame pixel data */
+  GChecksum * volatile key = NULL; /* Key of the frame in the cache */
+  gsize key_bytes;              /* Bytes per row that are hashed */
 
   /*
    * Get the drawable for the current image...
    */
 
-  drawable = gimp_drawable_get (drawable_ID);
+  drawable = gimp_drawable_get (frame->layer_ID);
+
+  /*
+   * Rows need converting if the layer doesn't cover the whole frame, or
+   * its type or opacity differs from the image being written
+   */
+
+  job.frame    = frame;
+  job.drawable = drawable;
+  job.bpp      = bpp;
+  job.direct   = (frame->x == frame->layer_x && frame->y == frame->layer_y &&
+                  frame->width <= drawable->width &&
+                  frame->height <= drawable->height &&
+                  drawable->bpp == bpp && frame->opacity == 255 &&
+                  frame->mode == GIMP_NORMAL_MODE);
+
+  /*
+   * A layer mode needs the same area of the layer below
+   */
+
+  job.below_drawable = get_frame_below (frame, &job.below);
+  job.below_pixel    = NULL;
+  job.below_scratch  = NULL;
 
   /*
    * Turn on interlace handling...
@@ -1855,132 +4507,1612 @@ write_frame (gint32        drawable_ID,
   else
     num_passes = 1;
 
+  job.num_passes = num_passes;
+
   /*
-   * Allocate memory for "tile_height" rows and save the image...
+   * Allocate memory for two strips of "tile_height" rows and save the
+   * image...
    */
 
+  tile_width  = gimp_tile_width ();
   tile_height = gimp_tile_height ();
-  pixel = g_new (guchar, tile_height * drawable->width * bpp);
-  pixels = g_new (guchar *, tile_height);
 
-  for (i = 0; i < tile_height; i++)
-    pixels[i] = pixel + drawable->width * bpp * i;
+  for (i = 0; i < 2; i++)
+    strip_alloc (&strips[i], tile_height, frame->width * bpp);
 
-  gimp_pixel_rgn_init (&pixel_rgn, drawable, 0, 0, drawable->width,
-                       drawable->height, FALSE, FALSE);
+  /*
+   * Interlaced frames are fetched once, during the first pass, and the
+   * other passes are taken from a copy of the fixed-up frame, which is
+   * also what optimization passes compress again.  Frames that may be
+   * in the cache are only fetched and hashed at first, and compressed
+   * from the copy if the cache doesn't have them.
+   */
 
-#if defined(PNG_APNG_SUPPORTED)
-  if (as_animation)
-    {
-      gint         offset_x;
-      gint         offset_y;
-      png_uint_32  frame_x_offset;
-      png_uint_32  frame_y_offset;
-
-      gimp_drawable_offsets (drawable_ID, &offset_x, &offset_y);
-      frame_x_offset = offset_x - offx;
-      frame_y_offset = offset_y - offy;
-      png_write_frame_head (pp, info, (png_bytepp)&pixel,
-                            drawable->width, drawable->height,
-                            frame_x_offset, frame_y_offset,
-                            frame_delay_num, frame_delay_den,
-                            frame_dispose_op, frame_blend_op);
+  if (lookup && lookup->cache)
+    {
+      key = apng_cache_key_begin (frame->width, frame->height,
+                                  png_get_bit_depth (pp, info),
+                                  png_get_color_type (pp, info),
+                                  png_get_interlace_type (pp, info));
+
+      if (png_get_valid (pp, info, PNG_INFO_PLTE))
+        key_bytes = frame->width;
+      else
+        key_bytes = (gsize) frame->width * bpp;
     }
-#endif
 
-  for (pass = 0; pass < num_passes; pass++)
+  if (num_passes > 1 || keep_pixel || key)
     {
-      /* This works if you are only writing one row at a time... */
-      for (begin = 0, end = tile_height;
-           begin < drawable->height; begin += tile_height, end += tile_height)
-        {
-          if (end > drawable->height)
-            end = drawable->height;
+      frame_pixel = g_new (guchar, (gsize) frame->height * frame->width * bpp);
+      frame_rows  = g_new (guchar *, frame->height);
 
-          num = end - begin;
+      for (i = 0; i < frame->height; i++)
+        frame_rows[i] = frame_pixel + (gsize) frame->width * bpp * i;
+    }
 
-          gimp_pixel_rgn_get_rect (&pixel_rgn, pixel, 0, begin,
-                                   drawable->width, num);
-          /*if we are with a RGBA image and have to pre-multiply the alpha channel */
-          if (bpp == 4 && ! pngvals.save_transp_pixels)
-            {
-              for (i = 0; i < num; ++i)
-                {
-                  fixed = pixels[i];
-                  for (k = 0; k < drawable->width; ++k)
-                    {
-                      gint aux = k << 2;
-
-                      if (! fixed[aux + 3])
-                        {
-                          fixed[aux + 0] = red;
-                          fixed[aux + 1] = green;
-                          fixed[aux + 2] = blue;
-                        }
-                    }
-                }
-            }
+  job.scratch = NULL;
 
-          /* If we're dealing with a paletted image with
-           * transparency set, write out the remapped palette */
-          if (png_get_valid (pp, info, PNG_INFO_tRNS))
-            {
-              guchar inverse_remap[256];
+  if (! job.direct)
+    job.scratch = g_new (guchar, tile_height * frame->width * drawable->bpp);
 
-              for (i = 0; i < 256; i++)
-                inverse_remap[ remap[i] ] = i;
+  if (job.below_drawable)
+    {
+      job.below_pixel   = g_new (guchar, tile_height * frame->width * bpp);
+      job.below_scratch = g_new (guchar, tile_height * frame->width *
+                                         job.below_drawable->bpp);
+    }
 
-              for (i = 0; i < num; ++i)
-                {
-                  fixed = pixels[i];
-                  for (k = 0; k < drawable->width; ++k)
-                    {
-                      fixed[k] = (fixed[k*2+1] > 127) ?
-                                 inverse_remap[ fixed[k*2] ] :
-                                 0;
-                    }
-                }
-            }
-          /* Otherwise if we have a paletted image and transparency
-           * couldn't be set, we ignore the alpha channel */
-          else if (png_get_valid (pp, info, PNG_INFO_PLTE) && bpp == 2)
-            {
-              for (i = 0; i < num; ++i)
-                {
-                  fixed = pixels[i];
-                  for (k = 0; k < drawable->width; ++k)
-                    {
-                      fixed[k] = fixed[k * 2];
-                    }
-                }
-            }
+  gimp_pixel_rgn_init (&pixel_rgn, drawable, 0, 0, drawable->width,
+                       drawable->height, FALSE, FALSE);
+
+  /*
+   * Strips follow the tile rows of the layer, and the tile cache holds
+   * exactly one tile row of the part that is read, so every tile should
+   * cross the wire once
+   */
+
+  x0 = CLAMP (frame->x - frame->layer_x, 0, drawable->width);
+  y0 = CLAMP (frame->y - frame->layer_y, 0, drawable->height);
+  x1 = CLAMP (frame->x + frame->width - frame->layer_x, 0, drawable->width);
+  y1 = CLAMP (frame->y + frame->height - frame->layer_y, 0, drawable->height);
+
+  first = ((frame->layer_y - frame->y) % tile_height + tile_height) %
+          tile_height;
+
+  if (x0 < x1 && y0 < y1)
+    {
+      gint tile_cols = (x1 - 1) / tile_width - x0 / tile_width + 1;
+      gint tile_rows = (y1 - 1) / tile_height - y0 / tile_height + 1;
+
+      gimp_tile_cache_ntiles (tile_cols);
+      save_stats.tiles_in_frames += tile_cols * tile_rows;
+    }
+
+  /*
+   * A worker fetches the next strip from the core while this thread
+   * filters and deflates the current one.  Frames of a single strip
+   * have nothing to overlap.
+   */
+
+  pipeline = strip_pipeline_new (fetch_strip_rows, &job,
+                                 pngvals.num_threads != 1 &&
+                                 frame->height > (first ? first :
+                                                  tile_height));
+
+  /*
+   * libpng errors unwind through here until the last pass is written,
+   * so stop the worker and free the frame on the way
+   */
+
+  memcpy (saved_jmpbuf, png_jmpbuf (pp), sizeof (jmp_buf));
+
+  if (setjmp (png_jmpbuf (pp)))
+    {
+      if (pipeline)
+        strip_pipeline_free (pipeline);
+
+      if (key)
+        g_checksum_free (key);
+
+      write_frame_free (&job, strips, frame_pixel, frame_rows);
+
+      memcpy (png_jmpbuf (pp), saved_jmpbuf, sizeof (jmp_buf));
+      longjmp (png_jmpbuf (pp), 1);
+    }
+
+  /*
+   * Pick the zlib settings for this frame before its first IDAT/fdAT
+   */
+
+  if (png_get_valid (pp, info, PNG_INFO_PLTE))
+    choose_frame_compression (pp, &pixel_rgn, drawable->bpp, frame->width,
+                              frame->height, TRUE, budget);
+  else
+    choose_frame_compression (pp, &pixel_rgn, drawable->bpp,
+                              frame->width * bpp, frame->height,
+                              FALSE, budget);
+
+  for (i = 0, pass = 0, begin = 0; i < 2; i++)
+    if (strip_next (&strips[i], &pass, &begin, first, tile_height,
+                    frame->height, 1))
+      strip_pipeline_push (pipeline, &strips[i]);
+
+  while (pipeline->pending > 0)
+    {
+      PngStrip *strip = strip_pipeline_pop (pipeline);
+
+      /*if we are with a RGBA image and have to pre-multiply the alpha channel */
+      if (bpp == 4 && ! pngvals.save_transp_pixels)
+        {
+          for (i = 0; i < strip->num; ++i)
+            apng_nullify_transparent (strip->rows[i], frame->width,
+                                      red, green, blue);
+        }
+
+      /* If we're dealing with a paletted image with
+       * transparency set, write out the remapped palette */
+      if (bpp == 2 && png_get_valid (pp, info, PNG_INFO_tRNS))
+        {
+          for (i = 0; i < strip->num; ++i)
+            apng_remap_indexed_alpha (strip->rows[i], strip->rows[i],
+                                      frame->width, remap);
+        }
+      /* Otherwise if we have a paletted image and transparency
+       * couldn't be set, we ignore the alpha channel */
+      else if (png_get_valid (pp, info, PNG_INFO_PLTE) && bpp == 2)
+        {
+          for (i = 0; i < strip->num; ++i)
+            apng_strip_alpha (strip->rows[i], strip->rows[i], frame->width);
+        }
+
+      if (key)
+        apng_cache_key_rows (key, strip->rows, strip->num, key_bytes);
+      else
+        png_write_rows (pp, strip->rows, strip->num);
+
+      if (frame_pixel)
+        memcpy (frame_rows[strip->begin], strip->pixel,
+                (gsize) strip->num * frame->width * bpp);
+
+      if (strip_next (strip, &pass, &begin, first, tile_height,
+                      frame->height, 1))
+        strip_pipeline_push (pipeline, strip);
+    }
+
+  strip_pipeline_free (pipeline);
+  pipeline = NULL;
+
+  /*
+   * The key is known once the frame is fetched.  Nothing is compressed
+   * yet, so a frame the cache has is taken from there as it is.
+   */
+
+  pass = 1;
+
+  if (key)
+    {
+      lookup->key = apng_cache_key_end (key);
+      key = NULL;
+
+      lookup->hit = apng_cache_lookup (lookup->cache, lookup->key,
+                                       lookup->level, lookup->payload);
+
+      pass = lookup->hit ? num_passes : 0;
+    }
+
+  for (; pass < num_passes; pass++)
+    {
+      png_write_rows (pp, frame_rows, frame->height);
+
+      gimp_progress_update ((gdouble) (pass + 1) / (gdouble) num_passes);
+    }
+
+  memcpy (png_jmpbuf (pp), saved_jmpbuf, sizeof (jmp_buf));
+
+  /* Hand the fixed-up frame over, unless the cache had it */
+  if (keep_pixel && ! (lookup && lookup->hit))
+    {
+      *keep_pixel = frame_pixel;
+      frame_pixel = NULL;
+    }
+
+  write_frame_free (&job, strips, frame_pixel, frame_rows);
+
+  budget->frames_left--;
+
+  return TRUE;
+}
+
+/*
+ * 'write_frame_free ()' - Free what write_frame() allocated.
+ */
+
+static void
+write_frame_free (PngFetchJob *job,
+                  PngStrip    *strips,
+                  guchar      *frame_pixel,
+                  guchar     **frame_rows)
+{
+  gint i;
+
+  g_free (frame_pixel);
+  g_free (frame_rows);
+
+  for (i = 0; i < 2; i++)
+    strip_free (&strips[i]);
+
+  g_free (job->scratch);
+
+  if (job->below_drawable)
+    {
+      g_free (job->below_pixel);
+      g_free (job->below_scratch);
+      gimp_drawable_detach (job->below_drawable);
+    }
+
+  gimp_drawable_detach (job->drawable);
+}
+
+#if defined(PNG_APNG_SUPPORTED)
+/*
+ * 'encode_animation_frame ()' - Compress a frame as a PNG of its own.
+ *
+ * Returns NULL if libpng failed.
+ */
+
+static ApngFrameEncoder *
+encode_animation_frame (const PngFrame    *frame,
+                        gint               bpp,
+                        guchar             red,
+                        guchar             green,
+                        guchar             blue,
+                        const ApngRemap   *remap,
+                        const ApngFormat  *format,
+                        PngFrameLookup    *lookup,
+                        CompressionBudget *budget,
+                        guchar           **keep_pixel,
+                        GError           **error)
+{
+  ApngFrameEncoder *encoder = apng_frame_encoder_new ();
+
+  if (setjmp (png_jmpbuf (encoder->pp)))
+    {
+      apng_frame_encoder_free (encoder);
+      return NULL;
+    }
+
+  apng_frame_encoder_start (encoder, format, frame->width, frame->height);
+
+  lookup->payload = encoder->payload;
+
+  write_frame (frame, bpp, red, green, blue, remap,
+               encoder->pp, encoder->info, lookup, budget, keep_pixel, error);
+
+  if (! lookup->hit)
+    apng_frame_encoder_finish (encoder);
+
+  return encoder;
+}
+
+/*
+ * 'encode_frame_rows ()' - Compress fetched frame rows again, with
+ *                          another filter and strategy.
+ *
+ * Returns NULL if libpng failed.
+ */
+
+static ApngFrameEncoder *
+encode_frame_rows (const PngFrame   *frame,
+                   guchar           *pixel,
+                   gint              bpp,
+                   const ApngFormat *format,
+                   gint              filter,
+                   gint              strategy)
+{
+  ApngFrameEncoder *encoder = apng_frame_encoder_new ();
+  guchar **rows = g_new (guchar *, frame->height);
+  gint     num_passes = 1;
+  gint     row_bytes;
+  gint     i;
+
+  for (i = 0; i < frame->height; i++)
+    rows[i] = pixel + (gsize) frame->width * bpp * i;
+
+  if (setjmp (png_jmpbuf (encoder->pp)))
+    {
+      g_free (rows);
+      apng_frame_encoder_free (encoder);
+      return NULL;
+    }
+
+  apng_frame_encoder_start (encoder, format, frame->width, frame->height);
+
+  if (format->color_type == PNG_COLOR_TYPE_PALETTE)
+    row_bytes = frame->width;
+  else
+    row_bytes = frame->width * bpp;
+
+  set_frame_compression (encoder->pp, row_bytes, frame->height,
+                         format->compression_level,
+                         zlib_strategies[strategy], filter);
+
+  if (format->interlace == PNG_INTERLACE_ADAM7)
+    num_passes = png_set_interlace_handling (encoder->pp);
+
+  for (i = 0; i < num_passes; i++)
+    png_write_rows (encoder->pp, rows, frame->height);
+
+  apng_frame_encoder_finish (encoder);
+
+  g_free (rows);
+
+  return encoder;
+}
+
+/*
+ * 'write_animation_frame ()' - Write a frame of an animation.
+ *
+ * The frame is compressed as a PNG of its own, or taken from the frame
+ * cache if the same pixels were compressed before, and its image data
+ * is wrapped in IDAT chunks for the first frame and fdAT chunks for the
+ * others.  With optimization passes the frame is compressed again with
+ * other filters and strategies, and the smallest result is kept.
+ * Returns FALSE if the frame couldn't be compressed or written.
+ */
+
+static gboolean
+write_animation_frame (const PngFrame   *frame,
+                       gint              index,
+                       gint              bpp,
+                       guchar            red,
+                       guchar            green,
+                       guchar            blue,
+                       const ApngRemap  *remap,
+                       const ApngFormat *format,
+                       ApngFrameControl *fc,
+                       guint32          *sequence,
+                       ApngOutput       *output,
+                       ApngCache        *cache,
+                       CompressionBudget *budget,
+                       GError          **error)
+{
+  ApngFrameEncoder *encoder;    /* Smallest encoding of this frame */
+  PngFrameLookup lookup;        /* Frame cache lookup */
+  gint passes;                  /* Encodings to try */
+  gint pass;
+  guchar *pixel = NULL;         /* Frame rows, for more passes */
+  gboolean ok = TRUE;
+
+  /*
+   * Under a time budget frames get whatever level there is time for, so
+   * any cached level will do, and what is stored may be the fastest
+   */
+
+  lookup.cache   = cache;
+  lookup.level   = (budget->budget > 0 ?
+                    APNG_CACHE_ANY_LEVEL : format->compression_level);
+  lookup.key     = NULL;
+  lookup.hit     = FALSE;
+
+  /* A time budget leaves no time for more passes */
+  passes = budget->budget > 0 ? 1 : pngvals.optimize_passes;
+
+  encoder = encode_animation_frame (frame, bpp, red, green, blue, remap,
+                                    format, &lookup, budget,
+                                    passes > 1 ? &pixel : NULL, error);
+
+  if (! encoder)
+    {
+      g_free (pixel);
+      g_free (lookup.key);
+      return FALSE;
+    }
+
+  /* The other passes compress the rows the first one fetched; a frame
+   * from the cache has none */
+  if (! pixel)
+    passes = 1;
+
+  for (pass = 1; pass < passes; pass++)
+    {
+      ApngFrameEncoder *trial;
+
+      trial = encode_frame_rows (frame, pixel, bpp, format,
+                                 optimize_trials[pass - 1].filter,
+                                 optimize_trials[pass - 1].strategy);
+
+      if (trial && trial->payload->len < encoder->payload->len)
+        {
+          apng_frame_encoder_free (encoder);
+          encoder = trial;
+        }
+      else if (trial)
+        {
+          apng_frame_encoder_free (trial);
+        }
+    }
+
+  g_free (pixel);
+
+  if (lookup.key && ! lookup.hit)
+    apng_cache_store (cache, lookup.key,
+                      budget->budget > 0 ? 0 : format->compression_level,
+                      encoder->payload->data, encoder->payload->len);
+
+  g_free (lookup.key);
+
+  if (index > 0 || ! pngvals.first_frame_is_hidden)
+    {
+      fc->sequence = (*sequence)++;
+      ok = apng_write_fctl (output, fc);
+    }
+
+  if (ok)
+    ok = apng_write_image_data (output, index > 0 ? sequence : NULL,
+                                encoder->payload->data,
+                                encoder->payload->len);
+
+  apng_frame_encoder_free (encoder);
+
+  return ok;
+}
+#endif
+
+#if defined(PNG_APNG_SUPPORTED)
+/*
+ * 'append_image ()' - Append the layers of an image to an animation.
+ *
+ * Only the new frames are compressed.  They are written over the IEND
+ * chunk of the file, followed by a new one, and the frame count in acTL
+ * is patched in place once they're on disk.  The image must have the
+ * size and the color type of the animation; indexed images also need
+ * the colors of its palette.
+ */
+
+static gboolean
+append_image (const gchar  *filename,
+              gint32        image_ID,
+              GError      **error)
+{
+  ApngChunkReader *reader;      /* Chunks of the file */
+  ApngChunk chunk;              /* Current chunk */
+  ApngHeader header;            /* IHDR of the file */
+  ApngFormat format;            /* Format of the new frames */
+  ApngOutput *output;           /* Output, from IEND on */
+  ApngCache *cache = NULL;      /* Compressed frames */
+  ApngRemap pixel_remap;        /* GIMP index -> PNG index */
+  CompressionBudget budget;     /* Time-budgeted compression state */
+  GError *local_error = NULL;
+  gint32 *layers;               /* Layers */
+  gint nlayers;                 /* Number of layers */
+  PngFrame *frames;             /* Frames, in the order they're written */
+  gint nframes;                 /* Number of frames */
+  GimpImageType type;           /* Type of the frames */
+  gint color_type;              /* PNG color type of the frames */
+  gint bpp = 0;                 /* Bytes per pixel */
+  gint i;                       /* Looping var */
+  gboolean have_header = FALSE; /* IHDR was found */
+  gboolean have_actl = FALSE;   /* acTL was found */
+  gsize actl_offset = 0;        /* File offset of acTL */
+  gsize iend_offset = 0;        /* File offset of IEND */
+  guint32 num_frames = 0;       /* Frames in the file */
+  guint32 num_plays = 0;        /* Number of plays in the file */
+  guint32 sequence = 0;         /* Next sequence number */
+  guchar inverse_remap[256];    /* GIMP index -> PNG index */
+  gboolean ok = TRUE;
+
+  /*
+   * Walk the chunks of the file.  Only their headers are needed, so
+   * the image data isn't checked, and doesn't have to be read.
+   */
+
+  reader = apng_chunk_reader_new (filename, error);
+
+  if (! reader)
+    return FALSE;
+
+  apng_chunk_reader_set_check_data (reader, FALSE);
+
+  memset (&format, 0, sizeof (format));
+
+  while (apng_chunk_reader_next (reader, &chunk, &local_error))
+    {
+      if (! strcmp (chunk.type, "IHDR"))
+        {
+          have_header = apng_parse_header (&chunk, &header);
+        }
+      else if (! strcmp (chunk.type, "PLTE") && chunk.length <= 3 * 256)
+        {
+          format.num_palette = chunk.length / 3;
+          memcpy (format.palette, chunk.data, chunk.length);
+        }
+      else if (! strcmp (chunk.type, "tRNS") && chunk.length <= 256)
+        {
+          format.num_trans = chunk.length;
+          memcpy (format.trans, chunk.data, chunk.length);
+        }
+      else if (! strcmp (chunk.type, "acTL") &&
+               chunk.length == APNG_acTL_SIZE)
+        {
+          have_actl   = TRUE;
+          actl_offset = chunk.offset;
+          num_frames  = apng_get_uint32 (chunk.data);
+          num_plays   = apng_get_uint32 (chunk.data + 4);
+        }
+      else if ((! strcmp (chunk.type, "fcTL") ||
+                ! strcmp (chunk.type, "fdAT")) && chunk.length >= 4)
+        {
+          sequence = MAX (sequence, apng_get_uint32 (chunk.data) + 1);
+        }
+      else if (! strcmp (chunk.type, "IEND"))
+        {
+          iend_offset = chunk.offset;
+        }
+    }
+
+  apng_chunk_reader_free (reader);
+
+  if (local_error)
+    {
+      g_propagate_error (error, local_error);
+      return FALSE;
+    }
+
+  if (! have_header || ! have_actl || iend_offset == 0)
+    {
+      g_set_error (error, 0, 0,
+                   _("'%s' is not an animated PNG file."),
+                   gimp_filename_to_utf8 (filename));
+      return FALSE;
+    }
+
+  if (header.width  != gimp_image_width (image_ID) ||
+      header.height != gimp_image_height (image_ID))
+    {
+      g_set_error (error, 0, 0,
+                   _("The image is %d x %d pixels, but the animation in "
+                     "'%s' is %d x %d pixels."),
+                   gimp_image_width (image_ID), gimp_image_height (image_ID),
+                   gimp_filename_to_utf8 (filename),
+                   (gint) header.width, (gint) header.height);
+      return FALSE;
+    }
+
+  /*
+   * Check that the frames can be written in the format of the file.
+   * Layers without alpha can go into an animation with alpha.
+   */
+
+  layers = gimp_image_get_layers (image_ID, &nlayers);
+  frames = plan_frames (image_ID, layers, nlayers, &nframes, &type);
+  g_free (layers);
+
+  if (header.color_type == PNG_COLOR_TYPE_RGB_ALPHA && type == GIMP_RGB_IMAGE)
+    type = GIMP_RGBA_IMAGE;
+  else if (header.color_type == PNG_COLOR_TYPE_GRAY_ALPHA &&
+           type == GIMP_GRAY_IMAGE)
+    type = GIMP_GRAYA_IMAGE;
+
+  switch (type)
+    {
+    case GIMP_RGB_IMAGE:
+      color_type = PNG_COLOR_TYPE_RGB;
+      bpp = 3;
+      break;
+
+    case GIMP_RGBA_IMAGE:
+      color_type = PNG_COLOR_TYPE_RGB_ALPHA;
+      bpp = 4;
+      break;
+
+    case GIMP_GRAY_IMAGE:
+      color_type = PNG_COLOR_TYPE_GRAY;
+      bpp = 1;
+      break;
+
+    case GIMP_GRAYA_IMAGE:
+      color_type = PNG_COLOR_TYPE_GRAY_ALPHA;
+      bpp = 2;
+      break;
+
+    case GIMP_INDEXED_IMAGE:
+      color_type = PNG_COLOR_TYPE_PALETTE;
+      bpp = 1;
+      break;
+
+    default:
+      color_type = PNG_COLOR_TYPE_PALETTE;
+      bpp = 2;
+      break;
+    }
+
+  if (color_type != header.color_type ||
+      (color_type != PNG_COLOR_TYPE_PALETTE && header.bit_depth != 8))
+    {
+      g_set_error (error, 0, 0,
+                   _("The image can't be added to '%s', the color type or "
+                     "the bit depth of the animation is different."),
+                   gimp_filename_to_utf8 (filename));
+      g_free (frames);
+      return FALSE;
+    }
+
+  /*
+   * Indexed layers are written as they are, while indexed layers with
+   * alpha are mapped to palette entries of the same color, transparent
+   * pixels going to index 0 like save_image() does
+   */
+
+  for (i = 0; i < 256; i++)
+    inverse_remap[i] = i;
+
+  if (color_type == PNG_COLOR_TYPE_PALETTE)
+    {
+      guchar *cmap;
+      gint    num_colors;
+
+      cmap = gimp_image_get_colormap (image_ID, &num_colors);
+
+      if (bpp == 2 && (format.num_trans == 0 || format.trans[0] != 0))
+        ok = FALSE;
+
+      for (i = 0; i < num_colors && ok; i++)
+        {
+          const guchar *color = cmap + 3 * i;
+          gint          best  = -1;
+          gint          j;
+
+          if (bpp == 1)
+            {
+              ok = (i < format.num_palette &&
+                    ! memcmp (color, &format.palette[i], 3));
+              continue;
+            }
+
+          for (j = 0; j < format.num_palette; j++)
+            {
+              if (memcmp (color, &format.palette[j], 3))
+                continue;
+
+              if (j >= format.num_trans || format.trans[j] == 255)
+                {
+                  best = j;
+                  break;
+                }
+
+              if (best < 0)
+                best = j;
+            }
+
+          inverse_remap[i] = best;
+          ok = (best >= 0);
+        }
+
+      g_free (cmap);
+
+      if (! ok)
+        {
+          g_set_error (error, 0, 0,
+                       _("The colormap of the image doesn't match the "
+                         "palette of '%s'."),
+                       gimp_filename_to_utf8 (filename));
+          g_free (frames);
+          return FALSE;
+        }
+    }
+
+  apng_kernels_init ();
+  apng_remap_init (&pixel_remap, inverse_remap);
+
+  format.bit_depth         = header.bit_depth;
+  format.color_type        = header.color_type;
+  format.interlace         = header.interlace;
+  format.compression_level = pngvals.compression_level;
+
+  /* write_frame() interlaces according to pngvals */
+  pngvals.interlaced = (header.interlace != PNG_INTERLACE_NONE);
+
+  /*
+   * Write the new frames and a new IEND over the old one
+   */
+
+  output = apng_output_open_at (filename, iend_offset, error);
+
+  if (! output)
+    {
+      g_free (frames);
+      return FALSE;
+    }
+
+  apng_output_set_threaded (output, pngvals.num_threads != 1);
+
+  gimp_progress_init_printf (_("Saving '%s'"),
+                             gimp_filename_to_utf8 (filename));
+
+  if (pngvals.frame_cache)
+    cache = apng_cache_open ();
+
+  budget.timer       = g_timer_new ();
+  budget.budget      = pngvals.compression_budget / 1000.0;
+  budget.filter      = pngvals.filter;
+  budget.strategy    = pngvals.compression_strategy;
+  budget.frames_left = nframes;
+
+  memset (&save_stats, 0, sizeof (save_stats));
+
+  for (i = 0; i < nframes && ok; i++)
+    {
+      ApngFrameControl fc;
+      gchar           *layer_name;
+
+      fc.width    = frames[i].width;
+      fc.height   = frames[i].height;
+      fc.x_offset = frames[i].x;
+      fc.y_offset = frames[i].y;
+
+      layer_name = gimp_drawable_get_name (frames[i].layer_ID);
+      parse_delay_tag (&fc.delay_num, &fc.delay_den, layer_name,
+                       frames[i].extra_delay);
+      fc.dispose_op = parse_dispose_op_tag (layer_name);
+      fc.blend_op   = pngvals.blend_op;
+      g_free (layer_name);
+
+      /* The default image is already there, so these are fdAT frames */
+      ok = write_animation_frame (&frames[i], 1 + i, bpp, 0, 0, 0,
+                                  &pixel_remap, &format, &fc, &sequence,
+                                  output, cache, &budget, error);
+    }
+
+  if (cache)
+    apng_cache_close (cache);
+
+  g_timer_destroy (budget.timer);
+  g_free (frames);
+
+  if (ok)
+    ok = apng_write_chunk (output, "IEND", NULL, 0);
+
+  if (ok)
+    {
+      guchar data[APNG_acTL_SIZE];
+      guchar actl[12 + APNG_acTL_SIZE];
+
+      apng_put_uint32 (data,     num_frames + nframes);
+      apng_put_uint32 (data + 4, num_plays);
+      apng_chunk_pack (actl, "acTL", data, sizeof (data));
+
+      apng_output_patch (output, actl_offset, actl, sizeof (actl));
+
+      return apng_output_close (output, error);
+    }
+
+  apng_output_abort (output);
+
+  g_set_error (error, 0, 0,
+               _("Error while saving '%s'. Could not save image."),
+               gimp_filename_to_utf8 (filename));
+
+  return FALSE;
+}
+#endif
+
+/*
+ * 'fetch_strip ()' - Read a strip of a drawable, one tile at a time.
+ *
+ * Returns the number of tiles that were transferred.
+ */
+
+static gint
+fetch_strip (GimpDrawable *drawable,
+             guchar       *buf,
+             gint          x,
+             gint          y,
+             gint          width,
+             gint          height)
+{
+  GimpPixelRgn  pixel_rgn;
+  gpointer      pr;
+  gint          rowstride = width * drawable->bpp;
+  gint          ntiles    = 0;
+
+  gimp_pixel_rgn_init (&pixel_rgn, drawable, x, y, width, height,
+                       FALSE, FALSE);
+
+  for (pr = gimp_pixel_rgns_register (1, &pixel_rgn);
+       pr != NULL;
+       pr = gimp_pixel_rgns_process (pr))
+    {
+      const guchar *src = pixel_rgn.data;
+      guchar       *dst = buf + (pixel_rgn.y - y) * rowstride +
+                          (pixel_rgn.x - x) * drawable->bpp;
+      gint          row;
+
+      for (row = 0; row < pixel_rgn.h; row++)
+        {
+          memcpy (dst, src, pixel_rgn.w * drawable->bpp);
+          src += pixel_rgn.rowstride;
+          dst += rowstride;
+        }
+
+      ntiles++;
+    }
+
+  return ntiles;
+}
+
+/*
+ * 'fetch_frame_rows ()' - Read frame rows from a layer, converting them.
+ *
+ * The part of the frame outside the layer is transparent (or zero if
+ * there is no alpha), layers without alpha get an opaque alpha channel
+ * and the layer opacity is applied to the alpha channel.
+ */
+
+static void
+fetch_frame_rows (const PngFrame *frame,
+                  GimpDrawable   *drawable,
+                  gint            bpp,
+                  guchar         *pixel,
+                  guchar         *scratch,
+                  gint            begin,
+                  gint            num)
+{
+  gint src_bpp = drawable->bpp;
+  gint x0, x1, y0, y1;          /* Layer part of the strip, frame coords */
+  gint row, k;
+
+  memset (pixel, 0, (gsize) num * frame->width * bpp);
+
+  x0 = MAX (frame->layer_x - frame->x, 0);
+  y0 = MAX (frame->layer_y - frame->y, begin);
+  x1 = MIN (frame->layer_x + (gint) drawable->width - frame->x,
+            frame->width);
+  y1 = MIN (frame->layer_y + (gint) drawable->height - frame->y,
+            begin + num);
+
+  if (x0 >= x1 || y0 >= y1)
+    return;
+
+  save_stats.tiles_fetched +=
+    fetch_strip (drawable, scratch,
+                 frame->x + x0 - frame->layer_x,
+                 frame->y + y0 - frame->layer_y,
+                 x1 - x0, y1 - y0);
+
+  for (row = 0; row < y1 - y0; row++)
+    {
+      const guchar *src = scratch + (gsize) row * (x1 - x0) * src_bpp;
+      guchar       *dst = pixel + ((gsize) (y0 - begin + row) * frame->width +
+                                   x0) * bpp;
+
+      if (src_bpp == bpp)
+        {
+          memcpy (dst, src, (gsize) (x1 - x0) * bpp);
+
+          if (frame->opacity < 255)
+            for (k = 0; k < x1 - x0; k++)
+              dst[k * bpp + bpp - 1] =
+                (dst[k * bpp + bpp - 1] * frame->opacity + 127) / 255;
+        }
+      else
+        {
+          /* The layer has no alpha channel */
+          for (k = 0; k < x1 - x0; k++, src += src_bpp, dst += bpp)
+            {
+              memcpy (dst, src, src_bpp);
+              dst[src_bpp] = frame->opacity;
+            }
+        }
+    }
+}
+
+/*
+ * 'get_frame_below ()' - Place the layer a frame's mode applies against.
+ *
+ * Returns its drawable, or NULL if the frame has the normal mode.
+ */
+
+static GimpDrawable *
+get_frame_below (const PngFrame *frame,
+                 PngFrame       *below)
+{
+  if (frame->mode == GIMP_NORMAL_MODE || frame->below_ID == -1)
+    return NULL;
+
+  *below          = *frame;
+  below->layer_ID = frame->below_ID;
+  below->opacity  = RINT (gimp_layer_get_opacity (frame->below_ID) * 2.55);
+  gimp_drawable_offsets (frame->below_ID, &below->layer_x, &below->layer_y);
+
+  return gimp_drawable_get (frame->below_ID);
+}
 
-          png_write_rows (pp, pixels, num);
+/*
+ * 'simple_layer_mode ()' - Whether apply_layer_mode() does a mode.
+ */
+
+static gboolean
+simple_layer_mode (GimpLayerModeEffects mode)
+{
+  switch (mode)
+    {
+    case GIMP_MULTIPLY_MODE:
+    case GIMP_SCREEN_MODE:
+    case GIMP_DIFFERENCE_MODE:
+    case GIMP_ADDITION_MODE:
+    case GIMP_SUBTRACT_MODE:
+    case GIMP_DARKEN_ONLY_MODE:
+    case GIMP_LIGHTEN_ONLY_MODE:
+      return TRUE;
+
+    default:
+      return FALSE;
+    }
+}
+
+/*
+ * 'apply_layer_mode ()' - Combine frame rows with the layer below.
+ *
+ * Each channel is combined the way GIMP does for the mode, with the
+ * smaller of the two alphas.  Drawn over the layer below, which is
+ * what the frame is drawn over when that layer is opaque, the frame
+ * then looks the way it does in GIMP.  For frames that replace what
+ * is below them the result is drawn over the layer below here.  Parts
+ * of the frame outside the layer below are left alone.
+ */
+
+static void
+apply_layer_mode (const PngFrame *frame,
+                  const PngFrame *below,
+                  GimpDrawable   *below_drawable,
+                  gint            bpp,
+                  guchar         *pixel,
+                  const guchar   *below_pixel,
+                  gint            begin,
+                  gint            num)
+{
+  gboolean has_alpha = (bpp == 2 || bpp == 4);
+  gint     channels  = has_alpha ? bpp - 1 : bpp;
+  gint     x0, x1, y0, y1;      /* Part over the layer below, frame coords */
+  gint     row, k, c;
+
+  x0 = MAX (below->layer_x - frame->x, 0);
+  y0 = MAX (below->layer_y - frame->y, begin);
+  x1 = MIN (below->layer_x + (gint) below_drawable->width - frame->x,
+            frame->width);
+  y1 = MIN (below->layer_y + (gint) below_drawable->height - frame->y,
+            begin + num);
+
+  for (row = y0; row < y1; row++)
+    {
+      gsize         offset = ((gsize) (row - begin) * frame->width + x0) * bpp;
+      guchar       *dst    = pixel + offset;
+      const guchar *src    = below_pixel + offset;
+
+      for (k = x0; k < x1; k++, dst += bpp, src += bpp)
+        {
+          guchar blend[3];
+
+          for (c = 0; c < channels; c++)
+            {
+              gint b = src[c];
+              gint l = dst[c];
+
+              switch (frame->mode)
+                {
+                case GIMP_MULTIPLY_MODE:
+                  blend[c] = (b * l + 127) / 255;
+                  break;
+                case GIMP_SCREEN_MODE:
+                  blend[c] = 255 - ((255 - b) * (255 - l) + 127) / 255;
+                  break;
+                case GIMP_DIFFERENCE_MODE:
+                  blend[c] = ABS (b - l);
+                  break;
+                case GIMP_ADDITION_MODE:
+                  blend[c] = MIN (b + l, 255);
+                  break;
+                case GIMP_SUBTRACT_MODE:
+                  blend[c] = MAX (b - l, 0);
+                  break;
+                case GIMP_DARKEN_ONLY_MODE:
+                  blend[c] = MIN (b, l);
+                  break;
+                case GIMP_LIGHTEN_ONLY_MODE:
+                  blend[c] = MAX (b, l);
+                  break;
+                default:
+                  blend[c] = l;
+                  break;
+                }
+            }
+
+          if (! has_alpha)
+            {
+              memcpy (dst, blend, channels);
+              continue;
+            }
+
+          dst[channels] = MIN (dst[channels], src[channels]);
+
+          if (pngvals.blend_op == PNG_BLEND_OP_SOURCE)
+            {
+              gint a     = dst[channels];
+              gint under = (src[channels] * (255 - a) + 127) / 255;
+              gint total = a + under;
+
+              for (c = 0; c < channels && total > 0; c++)
+                dst[c] = (blend[c] * a + src[c] * under + total / 2) / total;
 
-          gimp_progress_update (((double) pass + (double) end /
-                                 (double) png_get_image_height (pp, info)) /
-                                (double) num_passes);
+              dst[channels] = total;
+            }
+          else
+            {
+              memcpy (dst, blend, channels);
+            }
         }
     }
+}
 
-  g_free (pixel);
-  g_free (pixels);
+/*
+ * 'tool_progress ()' - Progress of apng_assemble(), apng_split() and
+ *                     apng_batch().
+ */
+
+static void
+tool_progress (gdouble  fraction,
+               gpointer data)
+{
+  gimp_progress_update (fraction);
+}
+
+/*
+ * 'write_output_data ()' - Write callback handing libpng output over to
+ *                          the background writer.
+ */
+
+static void
+write_output_data (png_structp pp,
+                   png_bytep   data,
+                   png_size_t  length)
+{
+  if (! apng_output_write (png_get_io_ptr (pp), data, length))
+    png_error (pp, "Write Error");
+}
+
+static void
+flush_output_data (png_structp pp)
+{
+  /* The writer flushes on close */
+}
+
+/*
+ * 'strip_alloc ()' - Allocate the rows of a strip.
+ */
+
+static void
+strip_alloc (PngStrip *strip,
+             gint      num_rows,
+             gsize     row_bytes)
+{
+  gint i;
+
+  strip->pixel = g_new0 (guchar, num_rows * row_bytes);
+  strip->rows  = g_new (guchar *, num_rows);
+
+  for (i = 0; i < num_rows; i++)
+    strip->rows[i] = strip->pixel + row_bytes * i;
+
+  strip->pass  = 0;
+  strip->begin = 0;
+  strip->num   = 0;
+}
+
+static void
+strip_free (PngStrip *strip)
+{
+  g_free (strip->pixel);
+  g_free (strip->rows);
+}
+
+/*
+ * 'strip_next ()' - Place a strip on the next rows of a frame.
+ *
+ * Strips end on multiples of "tile_height" past "first" and run through
+ * all the interlace passes.  Returns FALSE once the frame is done.
+ */
+
+static gboolean
+strip_next (PngStrip *strip,
+            gint     *pass,
+            gint     *begin,
+            gint      first,
+            gint      tile_height,
+            gint      height,
+            gint      num_passes)
+{
+  gint end;
+
+  if (*begin >= height)
+    {
+      (*pass)++;
+      *begin = 0;
+    }
+
+  if (*pass >= num_passes)
+    return FALSE;
+
+  if (*begin == 0 && first)
+    end = first;
+  else
+    end = *begin + tile_height;
+
+  if (end > height)
+    end = height;
+
+  strip->pass  = *pass;
+  strip->begin = *begin;
+  strip->num   = end - *begin;
+
+  *begin = end;
+
+  return TRUE;
+}
+
+/*
+ * 'fetch_strip_rows ()' - Fetch the rows of a strip being saved.
+ */
+
+static void
+fetch_strip_rows (PngStrip *strip,
+                  gpointer  data)
+{
+  PngFetchJob    *job   = data;
+  const PngFrame *frame = job->frame;
+
+  if (job->direct)
+    save_stats.tiles_fetched +=
+      fetch_strip (job->drawable, strip->pixel, 0, strip->begin,
+                   frame->width, strip->num);
+  else
+    fetch_frame_rows (frame, job->drawable, job->bpp, strip->pixel,
+                      job->scratch, strip->begin, strip->num);
 
 #if defined(PNG_APNG_SUPPORTED)
-  if (as_animation)
+  if (job->below_drawable)
     {
-      png_write_frame_tail (pp, info);
+      fetch_frame_rows (&job->below, job->below_drawable, job->bpp,
+                        job->below_pixel, job->below_scratch,
+                        strip->begin, strip->num);
+      apply_layer_mode (frame, &job->below, job->below_drawable, job->bpp,
+                        strip->pixel, job->below_pixel,
+                        strip->begin, strip->num);
     }
 #endif
 
-  return TRUE;
+  gimp_progress_update (((gdouble) strip->pass +
+                         (gdouble) (strip->begin + strip->num) /
+                         (gdouble) frame->height) /
+                        (gdouble) job->num_passes);
+}
+
+/*
+ * 'crop_strip_rows ()' - Pack the columns of the layer in the rows of a
+ *                        strip together, or unpack them again.
+ *
+ * Packed, the columns "job->x" to "job->x + job->frame_width" of the
+ * rows follow each other from the start of the strip buffer, the way
+ * pixel regions take them.
+ */
+
+static void
+crop_strip_rows (PngStrip    *strip,
+                 PngStoreJob *job,
+                 gboolean     pack)
+{
+  gsize width = job->frame_width * job->bpp;
+  gint  y;
+
+  if (job->x == 0 && width == job->stride)
+    return;
+
+  /* Each move goes toward the row's own place, so none overwrites a
+   * row that's still to be moved */
+  if (pack)
+    for (y = 0; y < strip->num; y++)
+      memmove (strip->pixel + y * width,
+               strip->rows[y] + job->x * job->bpp, width);
+  else
+    for (y = strip->num - 1; y >= 0; y--)
+      memmove (strip->rows[y] + job->x * job->bpp,
+               strip->pixel + y * width, width);
+}
+
+/*
+ * 'reduce_strip_rows ()' - Scale the rows of a strip being loaded down.
+ *
+ * Every "reduce" rows of the strip become one row of "job->reduced",
+ * box-filtered, except indexed rows which can only be sampled.  Strips
+ * begin on a multiple of "reduce" rows.
+ */
+
+static void
+reduce_strip_rows (PngStrip    *strip,
+                   PngStoreJob *job)
+{
+  gint    row_bytes = job->width * job->bpp;
+  guchar *dst       = job->reduced;
+  gint    y;
+
+  for (y = 0; y < strip->num; y += job->reduce, dst += row_bytes)
+    {
+      guchar *rows[MAX_REDUCTION];
+      gint    num = MIN (job->reduce, strip->num - y);
+      gint    k;
+
+      for (k = 0; k < num; k++)
+        rows[k] = strip->rows[y + k] + job->x * job->bpp;
+
+      if (job->indexed)
+        {
+          gint x;
+
+          for (x = 0; x < job->width; x++)
+            dst[x] = rows[0][x * job->reduce];
+        }
+      else
+        {
+          apng_reduce_rows (dst, rows, num, job->frame_width, job->bpp,
+                            job->reduce, job->sums);
+        }
+    }
+}
+
+/*
+ * 'store_strip_rows ()' - Store the rows of a strip being loaded.
+ */
+
+static void
+store_strip_rows (PngStrip *strip,
+                  gpointer  data)
+{
+  PngStoreJob *job   = data;
+  guchar      *pixel = strip->pixel;
+  gint         begin = strip->begin;
+  gint         num   = strip->num;
+
+  if (job->reduce > 1)
+    {
+      reduce_strip_rows (strip, job);
+
+      pixel = job->reduced;
+      begin = strip->begin / job->reduce;
+      num   = (strip->num + job->reduce - 1) / job->reduce;
+    }
+  else
+    {
+      crop_strip_rows (strip, job, TRUE);
+    }
+
+  gimp_pixel_rgn_set_rect (job->pixel_rgn, pixel, 0, begin,
+                           job->width, num);
+
+  if (job->writer)
+    apng_decoded_put_rows (job->writer, begin, pixel, num);
+
+  memset (strip->pixel, 0, job->size);
+
+  gimp_progress_update (((gdouble) strip->pass +
+                         (gdouble) (strip->begin + strip->num) /
+                         (gdouble) job->height) /
+                        (gdouble) job->num_passes);
+}
+
+/*
+ * 'strip_pipeline_worker ()' - Work on strips until told to stop.
+ *
+ * The end marker is handed back, so that the pipeline knows the worker
+ * is done with it.
+ */
+
+static void
+strip_pipeline_worker (gpointer data,
+                       gpointer user_data)
+{
+  PngStripPipeline *pipeline = data;
+  PngStrip         *strip;
+
+  while ((strip = g_async_queue_pop (pipeline->todo)) != &strip_end)
+    {
+      pipeline->func (strip, pipeline->data);
+      g_async_queue_push (pipeline->done, strip);
+    }
+
+  g_async_queue_push (pipeline->done, &strip_end);
+}
+
+/*
+ * 'strip_pipeline_new ()' - Overlap tile transfers with libpng.
+ *
+ * "func" is run on every strip pushed, in order, on a worker thread if
+ * "threaded" is set and threads are available, otherwise right away.
+ * Workers come from a pool that outlives the pipeline, so writing many
+ * frames, or serving many calls when resident, doesn't start a thread
+ * for each of them.
+ */
+
+static PngStripPipeline *
+strip_pipeline_new (PngStripFunc func,
+                    gpointer     data,
+                    gboolean     threaded)
+{
+  PngStripPipeline *pipeline = g_new0 (PngStripPipeline, 1);
+
+  pipeline->todo = g_async_queue_new ();
+  pipeline->done = g_async_queue_new ();
+  pipeline->func = func;
+  pipeline->data = data;
+
+  if (threaded && ! strip_pool && g_thread_supported ())
+    strip_pool = g_thread_pool_new (strip_pipeline_worker, NULL,
+                                    -1, FALSE, NULL);
+
+  if (threaded && strip_pool)
+    {
+      g_thread_pool_push (strip_pool, pipeline, NULL);
+      pipeline->threaded = TRUE;
+    }
+
+  return pipeline;
+}
+
+static void
+strip_pipeline_push (PngStripPipeline *pipeline,
+                     PngStrip         *strip)
+{
+  pipeline->pending++;
+
+  if (pipeline->threaded)
+    {
+      g_async_queue_push (pipeline->todo, strip);
+    }
+  else
+    {
+      pipeline->func (strip, pipeline->data);
+      g_async_queue_push (pipeline->done, strip);
+    }
+}
+
+static PngStrip *
+strip_pipeline_pop (PngStripPipeline *pipeline)
+{
+  pipeline->pending--;
+
+  return g_async_queue_pop (pipeline->done);
+}
+
+/*
+ * 'strip_pipeline_free ()' - Wait for the pending strips and the worker.
+ */
+
+static void
+strip_pipeline_free (PngStripPipeline *pipeline)
+{
+  while (pipeline->pending > 0)
+    strip_pipeline_pop (pipeline);
+
+  /* The worker goes back to the pool once it hands the end back */
+  if (pipeline->threaded)
+    {
+      g_async_queue_push (pipeline->todo, &strip_end);
+      g_async_queue_pop (pipeline->done);
+    }
+
+  g_async_queue_unref (pipeline->todo);
+  g_async_queue_unref (pipeline->done);
+  g_free (pipeline);
+}
+
+/*
+ * 'time_sample_encode ()' - Time the frame encoder on sample rows.
+ *
+ * Returns the seconds it took, or a negative value if libpng failed.
+ */
+
+static gdouble
+time_sample_encode (const guchar            *sample,
+                    gint                     width,
+                    gint                     rows,
+                    gint                     bpp,
+                    gint                     level,
+                    const CompressionBudget *budget,
+                    gsize                   *packed_len)
+{
+  static const gint color_types[5] =
+    { 0, PNG_COLOR_TYPE_GRAY, PNG_COLOR_TYPE_GRAY_ALPHA,
+      PNG_COLOR_TYPE_RGB, PNG_COLOR_TYPE_RGB_ALPHA };
+
+  ApngFrameEncoder     *encoder;
+  ApngFormat            format;
+  png_bytep * volatile  row_ptrs = g_new (png_bytep, rows);
+  GTimer               *timer;
+  gdouble               seconds;
+  gint                  i;
+
+  for (i = 0; i < rows; i++)
+    row_ptrs[i] = (png_bytep) sample + (gsize) width * bpp * i;
+
+  /* Indices filter and deflate like gray levels */
+  memset (&format, 0, sizeof (format));
+  format.bit_depth         = 8;
+  format.color_type        = color_types[CLAMP (bpp, 1, 4)];
+  format.interlace         = PNG_INTERLACE_NONE;
+  format.compression_level = level;
+
+  encoder = apng_frame_encoder_new ();
+  timer   = g_timer_new ();
+
+  if (setjmp (png_jmpbuf (encoder->pp)))
+    {
+      apng_frame_encoder_free (encoder);
+      g_timer_destroy (timer);
+      g_free (row_ptrs);
+
+      return -1.0;
+    }
+
+  apng_frame_encoder_start (encoder, &format, width, rows);
+
+  if (zlib_strategies[budget->strategy] >= 0)
+    png_set_compression_strategy (encoder->pp,
+                                  zlib_strategies[budget->strategy]);
+
+  if (png_filters[budget->filter])
+    png_set_filter (encoder->pp, PNG_FILTER_TYPE_BASE,
+                    png_filters[budget->filter]);
+
+  png_write_rows (encoder->pp, row_ptrs, rows);
+  apng_frame_encoder_finish (encoder);
+
+  seconds     = g_timer_elapsed (timer, NULL);
+  *packed_len = encoder->payload->len;
+
+  apng_frame_encoder_free (encoder);
+  g_timer_destroy (timer);
+  g_free (row_ptrs);
+
+  return seconds;
+}
+
+/*
+ * 'choose_frame_compression ()' - Pick zlib settings for a frame.
+ *
+ * The window and hash table are shrunk to fit the frame, so that small
+ * difference frames don't pay for a 32K window.  With a time budget the
+ * level and strategy are picked by encoding a few sample rows, filters
+ * and all, from the level asked for down until one fits the remaining
+ * budget spread evenly over the remaining frames.  The level asked for
+ * is never exceeded.
+ */
+
+static void
+choose_frame_compression (png_structp        pp,
+                          GimpPixelRgn      *pixel_rgn,
+                          gint               bpp,
+                          gint               row_bytes,
+                          gint               height,
+                          gboolean           indexed,
+                          CompressionBudget *budget)
+{
+  gint  level;                  /* zlib compression level */
+  gint  strategy = -1;          /* zlib strategy, -1 = libpng's choice */
+
+  level = pngvals.compression_level;
+
+  if (budget->budget > 0.0)
+    {
+      gint     rows = MIN (BUDGET_SAMPLE_ROWS, pixel_rgn->h);
+      gsize    sample_len = (gsize) pixel_rgn->w * bpp * rows;
+      guchar  *sample = g_new (guchar, sample_len);
+      gsize    packed_len = sample_len;
+      gdouble  ratio;
+      gdouble  allowance;
+      gint     i;
+
+      /* Spread the sample rows evenly over the frame */
+      for (i = 0; i < rows; i++)
+        gimp_pixel_rgn_get_row (pixel_rgn,
+                                sample + (gsize) pixel_rgn->w * bpp * i,
+                                0, i * pixel_rgn->h / rows, pixel_rgn->w);
+
+      allowance = (budget->budget - g_timer_elapsed (budget->timer, NULL)) /
+                  MAX (budget->frames_left, 1);
+
+      for (;; level--)
+        {
+          gdouble seconds = time_sample_encode (sample, pixel_rgn->w, rows,
+                                                bpp, level, budget,
+                                                &packed_len);
+
+          if (seconds < 0.0 || level <= 1 ||
+              seconds * ((gdouble) height / (gdouble) rows) <= allowance)
+            break;
+        }
+
+      ratio = (gdouble) packed_len / (gdouble) sample_len;
+
+      g_free (sample);
+
+      /* Flat frames compress as well with run-length matching only */
+#if defined(Z_RLE)
+      if (ratio < 0.05)
+        strategy = Z_RLE;
+      else
+#endif
+      if (indexed)
+        strategy = Z_DEFAULT_STRATEGY;
+      else
+        strategy = Z_FILTERED;
+    }
+
+  /* A strategy that was asked for wins */
+  if (zlib_strategies[budget->strategy] >= 0)
+    strategy = zlib_strategies[budget->strategy];
+
+  set_frame_compression (pp, row_bytes, height, level, strategy,
+                         budget->filter);
+}
+
+/*
+ * 'set_frame_compression ()' - Set zlib up for a frame.
+ *
+ * "strategy" is a zlib strategy or -1 for libpng's choice, "filter" an
+ * index into png_filters[].
+ */
+
+static void
+set_frame_compression (png_structp pp,
+                       gint        row_bytes,
+                       gint        height,
+                       gint        level,
+                       gint        strategy,
+                       gint        filter)
+{
+  gsize frame_bytes;            /* Filtered frame size */
+  gint  window_bits;            /* zlib window size (log2) */
+  gint  mem_level;              /* zlib hash table size */
+
+  frame_bytes = (gsize) (row_bytes + 1) * height;
+
+  for (window_bits = 9; window_bits < 15; window_bits++)
+    if (((gsize) 1 << window_bits) >= frame_bytes)
+      break;
+
+  mem_level = CLAMP (window_bits - 6, 1, 8);
+
+  png_set_compression_level (pp, level);
+  png_set_compression_window_bits (pp, window_bits);
+  png_set_compression_mem_level (pp, mem_level);
+
+  if (strategy >= 0)
+    png_set_compression_strategy (pp, strategy);
+
+  if (png_filters[filter])
+    png_set_filter (pp, PNG_FILTER_TYPE_BASE, png_filters[filter]);
 }
 
 #if defined(PNG_APNG_SUPPORTED)
+/*
+ * 'parse_delay_tag ()' - Parse delay tag.
+ *
+ * "extra" ms are added, for the layers dropped after the frame.
+ */
+
 static void
 parse_delay_tag (png_uint_16 *delay_num,
                  png_uint_16 *delay_den,
-                 const gchar *str)
+                 const gchar *str,
+                 gint         extra)
 {
   gint delay;
   gint n;
@@ -1988,11 +6120,19 @@ parse_delay_tag (png_uint_16 *delay_num,
   delay = parse_ms_tag (str);
   if (delay < 0)
     {
-      *delay_num = pngvals.delay_num;
-      *delay_den = pngvals.delay_den;
-      return;
+      if (extra == 0)
+        {
+          *delay_num = pngvals.delay_num;
+          *delay_den = pngvals.delay_den;
+          return;
+        }
+
+      delay = pngvals.delay_num * 1000 / (pngvals.delay_den ?
+                                          pngvals.delay_den : 100);
     }
 
+  delay = MIN (delay + extra, G_MAXUINT16);
+
   for (n = 1000; n > 0; n /= 10)
     {
       if ((delay % n) == 0)
@@ -2062,85 +6202,100 @@ parse_dispose_op_tag (const gchar *str)
 }
 #endif
 
+#if defined(PNG_APNG_SUPPORTED)
+/*
+ * 'animation_needs_export ()' - Whether gimp_export_image() is needed.
+ *
+ * save_image() copes with layers that differ in alpha, size, offsets
+ * and opacity, and simple layer modes.  Layer masks and layer groups are
+ * still left to gimp_export_image().
+ */
+
 static gboolean
-ia_has_transparent_pixels (GimpDrawable *drawable)
+animation_needs_export (gint32 image_ID)
 {
-  GimpPixelRgn  pixel_rgn;
-  gpointer      pr;
-  guchar       *pixel_row;
-  gint          row, col;
-  guchar       *pixel;
+  gint32   *layers;
+  gint      nlayers;
+  gint      i;
+  gboolean  needs_export;
 
-  gimp_pixel_rgn_init (&pixel_rgn, drawable, 0, 0,
-                       drawable->width, drawable->height, FALSE, FALSE);
+  layers = gimp_image_get_layers (image_ID, &nlayers);
+  needs_export = (nlayers < 2);
 
-  for (pr = gimp_pixel_rgns_register (1, &pixel_rgn);
-       pr != NULL;
-       pr = gimp_pixel_rgns_process (pr))
+  for (i = 0; i < nlayers && ! needs_export; i++)
     {
-      pixel_row = pixel_rgn.data;
-      for (row = 0; row < pixel_rgn.h; row++)
-        {
-          pixel = pixel_row;
-          for (col = 0; col < pixel_rgn.w; col++)
-            {
-              if (pixel[1] <= 127)
-                return TRUE;
-              pixel += 2;
-            }
-          pixel_row += pixel_rgn.rowstride;
-        }
+      if (gimp_layer_get_mask (layers[i]) != -1)
+        needs_export = TRUE;
+
+#if ((GIMP_MAJOR_VERSION > 2) || (GIMP_MAJOR_VERSION == 2 && GIMP_MINOR_VERSION >= 8))
+      if (gimp_item_is_group (layers[i]))
+        needs_export = TRUE;
+#endif
     }
 
-  return FALSE;
+  g_free (layers);
+
+  return needs_export;
 }
+#endif
 
 /* Try to find a color in the palette which isn't actually
- * used in the image, so that we can use it as the transparency
- * index. Taken from gif.c */
+ * used in any of the frames, so that we can use it as the transparency
+ * index.  All frames share the PLTE/tRNS, so this is a single pass over
+ * all of them which also finds out whether there is any transparency,
+ * and stops as soon as the answer can't change anymore.
+ * Taken from gif.c */
 static gint
-find_unused_ia_color (GimpDrawable *drawable,
-                      gint         *colors)
+find_unused_ia_color (const gint32 *layers,
+                      gint          nframes,
+                      gint         *colors,
+                      gboolean     *trans_used)
 {
-  gboolean      ix_used[256];
-  gboolean      trans_used = FALSE;
-  GimpPixelRgn  pixel_rgn;
-  gpointer      pr;
-  gint          row, col;
+  guchar        ix_used[256];
+  gint          n_used = 0;
+  gint          frame;
   gint          i;
 
-  for (i = 0; i < *colors; i++)
-    ix_used[i] = FALSE;
-
-  gimp_pixel_rgn_init (&pixel_rgn, drawable, 0, 0,
-                       drawable->width, drawable->height, FALSE, FALSE);
+  memset (ix_used, 0, sizeof (ix_used));
+  *trans_used = FALSE;
 
-  for (pr = gimp_pixel_rgns_register (1, &pixel_rgn);
-       pr != NULL;
-       pr = gimp_pixel_rgns_process (pr))
+  for (frame = 0; frame < nframes; frame++)
     {
-      const guchar *pixel_row = pixel_rgn.data;
+      GimpDrawable *drawable = gimp_drawable_get (layers[frame]);
+      GimpPixelRgn  pixel_rgn;
+      gpointer      pr;
+      gint          row;
 
-      for (row = 0; row < pixel_rgn.h; row++)
+      gimp_pixel_rgn_init (&pixel_rgn, drawable, 0, 0,
+                           drawable->width, drawable->height, FALSE, FALSE);
+
+      for (pr = gimp_pixel_rgns_register (1, &pixel_rgn);
+           pr != NULL;
+           pr = gimp_pixel_rgns_process (pr))
         {
-          const guchar *pixel = pixel_row;
+          const guchar *pixel_row = pixel_rgn.data;
 
-          for (col = 0; col < pixel_rgn.w; col++)
+          for (row = 0; row < pixel_rgn.h; row++)
             {
-              if (pixel[1] > 127)
-                ix_used[ pixel[0] ] = TRUE;
-              else
-                trans_used = TRUE;
-
-              pixel += 2;
+              n_used += apng_scan_indexed_alpha (pixel_row, pixel_rgn.w,
+                                                 pixel_rgn.bpp, ix_used,
+                                                 trans_used);
+              pixel_row += pixel_rgn.rowstride;
             }
 
-          pixel_row += pixel_rgn.rowstride;
+          /* Every index is taken and we know there is transparency */
+          if (*trans_used && n_used >= *colors)
+            break;
         }
+
+      gimp_drawable_detach (drawable);
+
+      if (*trans_used && n_used >= *colors)
+        break;
     }
 
   /* If there is no transparency, ignore alpha. */
-  if (trans_used == FALSE)
+  if (*trans_used == FALSE)
     return -1;
 
   for (i = 0; i < *colors; i++)
@@ -2168,12 +6323,15 @@ respin_cmap (png_structp   pp,
              png_infop     info,
              guchar       *remap,
              gint32        image_ID,
-             GimpDrawable *drawable)
+             const gint32 *layers,
+             gint          nframes)
 {
   static const guchar trans[] = { 0 };
 
   gint          colors;
   guchar       *before;
+  gint          transparent;
+  gboolean      trans_used;
 
   before = gimp_image_get_colormap (image_ID, &colors);
 
@@ -2189,10 +6347,10 @@ respin_cmap (png_structp   pp,
   /* Try to find an entry which isn't actually used in the
      image, for a transparency index. */
 
-  if (ia_has_transparent_pixels (drawable))
-    {
-      gint transparent = find_unused_ia_color (drawable, &colors);
+  transparent = find_unused_ia_color (layers, nframes, &colors, &trans_used);
 
+  if (trans_used)
+    {
       if (transparent != -1)        /* we have a winner for a transparent
                                      * index - do like gif2png and swap
                                      * index 0 and index transparent */
@@ -2239,6 +6397,284 @@ respin_cmap (png_structp   pp,
 
 }
 
+/*
+ * 'estimate_take_samples ()' - Sample frames for the size estimate.
+ *
+ * A few strips of rows are read from up to ESTIMATE_FRAMES frames, spread
+ * evenly, and each sample is scaled up to stand for its frame and the
+ * frames that weren't sampled.  The rows are converted the way
+ * write_frame() converts them, so that cropping, opacity and layer modes
+ * count.  This is done once, in the main thread: libgimp isn't
+ * thread-safe.
+ */
+
+static ApngEstimateSample *
+estimate_take_samples (gint32          image_ID,
+                       const PngFrame *frames,
+                       gint            nframes,
+                       GimpImageType   type,
+                       gint           *num_samples)
+{
+  ApngEstimateSample *samples;
+  gint                n = MIN (nframes, ESTIMATE_FRAMES);
+  guchar             *cmap = NULL;
+  gint                num_colors = 0;
+  gint                color_type;
+  gint                bpp;
+  gint                i;
+
+  switch (type)
+    {
+    case GIMP_RGB_IMAGE:
+      color_type = PNG_COLOR_TYPE_RGB;
+      bpp = 3;
+      break;
+
+    case GIMP_RGBA_IMAGE:
+      color_type = PNG_COLOR_TYPE_RGB_ALPHA;
+      bpp = 4;
+      break;
+
+    case GIMP_GRAY_IMAGE:
+      color_type = PNG_COLOR_TYPE_GRAY;
+      bpp = 1;
+      break;
+
+    case GIMP_GRAYA_IMAGE:
+      color_type = PNG_COLOR_TYPE_GRAY_ALPHA;
+      bpp = 2;
+      break;
+
+    case GIMP_INDEXEDA_IMAGE:
+      color_type = PNG_COLOR_TYPE_PALETTE;
+      bpp = 2;
+      break;
+
+    default:
+      color_type = PNG_COLOR_TYPE_PALETTE;
+      bpp = 1;
+      break;
+    }
+
+  if (color_type == PNG_COLOR_TYPE_PALETTE)
+    cmap = gimp_image_get_colormap (image_ID, &num_colors);
+
+  samples = g_new0 (ApngEstimateSample, n);
+
+  for (i = 0; i < n; i++)
+    {
+      const PngFrame     *frame  = &frames[i * nframes / n];
+      ApngEstimateSample *sample = &samples[i];
+      GimpDrawable       *drawable;
+      GimpDrawable       *below_drawable;
+      PngFrame            below;
+      guchar             *scratch;
+      guchar             *below_pixel   = NULL;
+      guchar             *below_scratch = NULL;
+      gint                strip_rows;
+      gint                strips;
+      gsize               strip_size;
+      gint                j;
+
+      drawable       = gimp_drawable_get (frame->layer_ID);
+      below_drawable = get_frame_below (frame, &below);
+      strip_rows     = MIN (ESTIMATE_STRIP_ROWS, frame->height);
+      strips         = MIN (ESTIMATE_STRIPS, frame->height / strip_rows);
+      strip_size     = (gsize) frame->width * bpp * strip_rows;
+      scratch        = g_new (guchar, (gsize) frame->width * drawable->bpp *
+                                      strip_rows);
+
+      if (below_drawable)
+        {
+          below_pixel   = g_new (guchar, strip_size);
+          below_scratch = g_new (guchar, (gsize) frame->width *
+                                         below_drawable->bpp * strip_rows);
+        }
+
+      sample->width      = frame->width;
+      sample->num_rows   = strips * strip_rows;
+      sample->pixels     = g_new (guchar, strip_size * strips);
+      sample->color_type = color_type;
+      sample->scale      = ((gdouble) frame->height / sample->num_rows *
+                            (gdouble) nframes / n);
+
+      /* Strips of consecutive rows, so that filters and deflate see
+       * what they would see in the whole frame */
+      for (j = 0; j < strips; j++)
+        {
+          guchar *pixel = sample->pixels + strip_size * j;
+          gint    begin = j * (frame->height - strip_rows) / MAX (strips - 1, 1);
+
+          fetch_frame_rows (frame, drawable, bpp, pixel, scratch,
+                            begin, strip_rows);
+
+          if (below_drawable)
+            {
+              fetch_frame_rows (&below, below_drawable, bpp,
+                                below_pixel, below_scratch,
+                                begin, strip_rows);
+              apply_layer_mode (frame, &below, below_drawable, bpp,
+                                pixel, below_pixel, begin, strip_rows);
+            }
+        }
+
+      if (color_type == PNG_COLOR_TYPE_PALETTE)
+        {
+          /* Alpha goes into tRNS when saving, keep the indices */
+          if (bpp == 2)
+            {
+              gsize k;
+
+              for (k = 0; k < (gsize) sample->width * sample->num_rows; k++)
+                sample->pixels[k] = sample->pixels[k * 2];
+            }
+
+          sample->num_palette = MIN (num_colors, 256);
+
+          for (j = 0; j < sample->num_palette; j++)
+            {
+              sample->palette[j].red   = cmap[j * 3];
+              sample->palette[j].green = cmap[j * 3 + 1];
+              sample->palette[j].blue  = cmap[j * 3 + 2];
+            }
+        }
+
+      g_free (scratch);
+
+      if (below_drawable)
+        {
+          g_free (below_pixel);
+          g_free (below_scratch);
+          gimp_drawable_detach (below_drawable);
+        }
+
+      gimp_drawable_detach (drawable);
+    }
+
+  g_free (cmap);
+
+  *num_samples = n;
+
+  return samples;
+}
+
+static void
+estimate_free_samples (ApngEstimateSample *samples,
+                       gint                num_samples)
+{
+  gint i;
+
+  for (i = 0; i < num_samples; i++)
+    g_free (samples[i].pixels);
+
+  g_free (samples);
+}
+
+/*
+ * 'save_estimate_update ()' - Estimate the size with new settings.
+ *
+ * The estimate is done in the background, the label is greyed out until
+ * save_estimate_poll() finds it done.
+ */
+
+static void
+save_estimate_update (PngSaveGui *pg)
+{
+  ApngEstimateSettings settings;
+
+  settings.samples     = pg->still_samples;
+  settings.num_samples = pg->num_still_samples;
+  settings.overhead    = 8 + 25 + 12;       /* Signature, IHDR and IEND */
+
+#if defined(PNG_APNG_SUPPORTED)
+  if (pngvals.as_animation)
+    {
+      if (! pg->frame_samples)
+        {
+          gint32        *layers;
+          gint           nlayers;
+          PngFrame      *frames;
+          GimpImageType  type;
+
+          /* The frames save_image() would write */
+          layers = gimp_image_get_layers (pg->image_ID, &nlayers);
+          frames = plan_frames (pg->image_ID, layers, nlayers,
+                                &pg->num_frames, &type);
+          pg->frame_samples = estimate_take_samples (pg->image_ID,
+                                                     frames, pg->num_frames,
+                                                     type,
+                                                     &pg->num_frame_samples);
+          g_free (frames);
+          g_free (layers);
+        }
+
+      settings.samples     = pg->frame_samples;
+      settings.num_samples = pg->num_frame_samples;
+
+      /* acTL, an fcTL per frame and the fdAT of all but the first */
+      settings.overhead += 20 + pg->num_frames * 38 +
+                           MAX (pg->num_frames - 1, 0) * 16;
+    }
+#endif
+
+  settings.compression_level  = pngvals.compression_level;
+  settings.interlaced         = pngvals.interlaced;
+  settings.save_transp_pixels = pngvals.save_transp_pixels;
+
+  /* The encodings of the optimization passes, see write_animation_frame() */
+  settings.num_encodings = 1;
+  settings.encodings[0].filters  = png_filters[pngvals.filter];
+  settings.encodings[0].strategy = zlib_strategies[pngvals.compression_strategy];
+
+#if defined(PNG_APNG_SUPPORTED)
+  if (pngvals.as_animation && pngvals.compression_budget == 0)
+    {
+      gint passes = MIN (pngvals.optimize_passes,
+                         APNG_ESTIMATE_MAX_ENCODINGS);
+
+      for (; settings.num_encodings < passes; settings.num_encodings++)
+        {
+          ApngEstimateEncoding *encoding =
+            &settings.encodings[settings.num_encodings];
+
+          encoding->filters  =
+            png_filters[optimize_trials[settings.num_encodings - 1].filter];
+          encoding->strategy =
+            zlib_strategies[optimize_trials[settings.num_encodings - 1].strategy];
+        }
+    }
+#endif
+
+  gtk_widget_set_sensitive (pg->estimate, FALSE);
+
+  apng_estimator_request (pg->estimator, &settings);
+}
+
+static gboolean
+save_estimate_poll (gpointer data)
+{
+  PngSaveGui   *pg = data;
+  ApngEstimate  estimate;
+
+  if (apng_estimator_poll (pg->estimator, &estimate))
+    {
+      gchar *size = gimp_memsize_to_string (estimate.size);
+      gchar *text;
+
+      text = g_strdup_printf (_("Estimated file size: %s, "
+                                "about %.1f s to compress"),
+                              size, estimate.seconds);
+
+      gtk_label_set_text (GTK_LABEL (pg->estimate), text);
+      gtk_widget_set_sensitive (pg->estimate, TRUE);
+
+      g_free (text);
+      g_free (size);
+    }
+
+  return TRUE;
+}
+
 static GtkWidget *
 toggle_button_init (GtkBuilder  *builder,
                     const gchar *name,
@@ -2265,6 +6701,8 @@ save_dialog (gint32    image_ID,
   GtkBuilder   *builder;
   gchar        *ui_file;
   GimpParasite *parasite;
+  gint32        drawable_ID;
+  PngFrame      still;          /* The drawable, saved as a still image */
   GError       *error = NULL;
 
   /* Dialog init */
@@ -2349,6 +6787,15 @@ save_dialog (gint32    image_ID,
                     G_CALLBACK (gimp_int_adjustment_update),
                     &pngvals.compression_level);
 
+  /* Compression time budget */
+  pg.compression_budget =
+    GTK_OBJECT (gtk_builder_get_object (builder, "compression-budget"));
+  gtk_adjustment_set_value (GTK_ADJUSTMENT (pg.compression_budget),
+                            pngvals.compression_budget);
+  g_signal_connect (pg.compression_budget, "value-changed",
+                    G_CALLBACK (gimp_int_adjustment_update),
+                    &pngvals.compression_budget);
+
 #if defined(PNG_APNG_SUPPORTED)
   /* Number of plays */
   pg.num_plays =
@@ -2369,6 +6816,63 @@ save_dialog (gint32    image_ID,
                             G_CALLBACK (save_defaults),
                             &pg);
 
+  /* Size estimate, redone when a setting that matters changes */
+  pg.image_ID  = image_ID;
+  pg.estimate  = GTK_WIDGET (gtk_builder_get_object (builder,
+                                                     "size-estimate"));
+  pg.estimator = apng_estimator_new ();
+
+  pg.frame_samples     = NULL;
+  pg.num_frame_samples = 0;
+  pg.num_frames        = 0;
+
+  drawable_ID = gimp_image_get_active_drawable (image_ID);
+
+  if (drawable_ID == -1)
+    {
+      gint32 *layers;
+      gint    nlayers;
+
+      layers = gimp_image_get_layers (image_ID, &nlayers);
+      drawable_ID = layers[0];
+      g_free (layers);
+    }
+
+  /* Placed the way save_image() places a single layer */
+  memset (&still, 0, sizeof (still));
+  still.layer_ID = drawable_ID;
+  still.width    = gimp_drawable_width (drawable_ID);
+  still.height   = gimp_drawable_height (drawable_ID);
+  still.opacity  = 255;
+  gimp_drawable_offsets (drawable_ID, &still.x, &still.y);
+  still.layer_x  = still.x;
+  still.layer_y  = still.y;
+  still.mode     = GIMP_NORMAL_MODE;
+  still.below_ID = -1;
+
+  pg.still_samples = estimate_take_samples (image_ID, &still, 1,
+                                            gimp_drawable_type (drawable_ID),
+                                            &pg.num_still_samples);
+
+  g_signal_connect_swapped (pg.interlaced, "toggled",
+                            G_CALLBACK (save_estimate_update),
+                            &pg);
+  g_signal_connect_swapped (pg.save_transp_pixels, "toggled",
+                            G_CALLBACK (save_estimate_update),
+                            &pg);
+  g_signal_connect_swapped (pg.compression_level, "value-changed",
+                            G_CALLBACK (save_estimate_update),
+                            &pg);
+#if defined(PNG_APNG_SUPPORTED)
+  g_signal_connect_swapped (pg.as_animation, "toggled",
+                            G_CALLBACK (save_estimate_update),
+                            &pg);
+#endif
+
+  save_estimate_update (&pg);
+  pg.estimate_poll = g_timeout_add (ESTIMATE_POLL_MS,
+                                    save_estimate_poll, &pg);
+
   /* Show dialog and run */
   gtk_widget_show (dialog);
 
@@ -2376,6 +6880,13 @@ save_dialog (gint32    image_ID,
 
   gtk_main ();
 
+  g_source_remove (pg.estimate_poll);
+  apng_estimator_free (pg.estimator);
+  estimate_free_samples (pg.still_samples, pg.num_still_samples);
+
+  if (pg.frame_samples)
+    estimate_free_samples (pg.frame_samples, pg.num_frame_samples);
+
   return pg.run;
 }
 
@@ -2397,72 +6908,260 @@ save_dialog_response (GtkWidget *widget,
     }
 }
 
+/*
+ * 'load_vals_set ()' - Set the load options from the arguments of
+ *                      file-apng-load2.
+ *
+ * The region of interest may be left out.  Nothing is set if any option
+ * is out of range.
+ */
+
+static gboolean
+load_vals_set (const GimpParam *param,
+               gint             nparams)
+{
+  gint reduction;
+
+  if (nparams < 4 || nparams > 12 || (nparams > 4 && nparams < 8))
+    return FALSE;
+
+  reduction = param[3].data.d_int32;
+
+  if (reduction < 1 || reduction > MAX_REDUCTION ||
+      (reduction & (reduction - 1)))
+    return FALSE;
+
+  if (nparams > 4 &&
+      (param[6].data.d_int32 < 0 || param[7].data.d_int32 < 0))
+    return FALSE;
+
+  if (nparams > 8 && param[8].data.d_int32 < 0)
+    return FALSE;
+
+  loadvals.reduction = reduction;
+
+  if (nparams == 4)
+    return TRUE;
+
+  loadvals.roi_x      = param[4].data.d_int32;
+  loadvals.roi_y      = param[5].data.d_int32;
+  loadvals.roi_width  = param[6].data.d_int32;
+  loadvals.roi_height = param[7].data.d_int32;
+
+  if (nparams >= 9)
+    loadvals.decode_cache = param[8].data.d_int32;
+
+  if (nparams >= 10)
+    loadvals.trusted = param[9].data.d_int32 != FALSE;
+
+  if (nparams >= 11)
+    loadvals.merge_duplicates = param[10].data.d_int32 != FALSE;
+
+  if (nparams == 12)
+    loadvals.frame_cache = param[11].data.d_int32 != FALSE;
+
+  return TRUE;
+}
+
+/*
+ * 'save_vals_get ()' - Get the settings in the order of file-apng-save3.
+ */
+
+static void
+save_vals_get (gint *values)
+{
+  memset (values, 0, NUM_SAVE3_VALUES * sizeof (gint));
+
+  values[0]  = pngvals.interlaced;
+  values[1]  = pngvals.compression_level;
+  values[2]  = pngvals.bkgd;
+  values[3]  = pngvals.gama;
+  values[4]  = pngvals.offs;
+  values[5]  = pngvals.phys;
+  values[6]  = pngvals.time;
+  values[7]  = pngvals.comment;
+  values[8]  = pngvals.save_transp_pixels;
+#if defined(PNG_APNG_SUPPORTED)
+  values[9]  = pngvals.as_animation;
+  values[10] = pngvals.first_frame_is_hidden;
+  values[11] = MIN (pngvals.num_plays, G_MAXINT);
+  values[12] = pngvals.delay_num;
+  values[13] = pngvals.delay_den;
+  values[14] = pngvals.dispose_op;
+  values[15] = pngvals.blend_op;
+#endif
+  values[16] = pngvals.frame_cache;
+  values[17] = pngvals.compression_budget;
+  values[18] = pngvals.num_threads;
+  values[19] = pngvals.filter;
+  values[20] = pngvals.compression_strategy;
+  values[21] = pngvals.optimize_passes;
+}
+
+/*
+ * 'save_vals_set ()' - Set the first "num_values" settings, in the order
+ *                      of file-apng-save3.
+ *
+ * Either the 9 settings of file-apng-save2 or all of them are set, and
+ * nothing is if any is out of range.
+ */
+
+static gboolean
+save_vals_set (const gint *values,
+               gint        num_values)
+{
+  if (num_values != 9 && num_values != NUM_SAVE3_VALUES)
+    return FALSE;
+
+  if (values[1] < 0 || values[1] > 9)
+    return FALSE;
+
+  if (num_values > 9 &&
+      (values[11] < 0 ||
+       values[12] < 0 || values[12] > G_MAXUINT16 ||
+       values[13] < 0 || values[13] > G_MAXUINT16 ||
+       values[14] < 0 || values[15] < 0 ||
+       values[17] < 0 ||
+       values[18] < 0 ||
+       values[19] < 0 || values[19] >= G_N_ELEMENTS (png_filters) ||
+       values[20] < 0 || values[20] >= G_N_ELEMENTS (zlib_strategies) ||
+       values[21] < 0 || values[21] > MAX_OPTIMIZE_PASSES))
+    return FALSE;
+
+#if defined(PNG_APNG_SUPPORTED)
+  if (num_values > 9 &&
+      (values[14] > PNG_DISPOSE_OP_PREVIOUS || values[15] > PNG_BLEND_OP_OVER))
+    return FALSE;
+#endif
+
+  pngvals.interlaced            = values[0];
+  pngvals.compression_level     = values[1];
+  pngvals.bkgd                  = values[2];
+  pngvals.gama                  = values[3];
+  pngvals.offs                  = values[4];
+  pngvals.phys                  = values[5];
+  pngvals.time                  = values[6];
+  pngvals.comment               = values[7];
+  pngvals.save_transp_pixels    = values[8];
+
+  if (num_values == 9)
+    return TRUE;
+
+#if defined(PNG_APNG_SUPPORTED)
+  pngvals.as_animation          = values[9];
+  pngvals.first_frame_is_hidden = values[10];
+  pngvals.num_plays             = values[11];
+  pngvals.delay_num             = values[12];
+  pngvals.delay_den             = values[13];
+  pngvals.dispose_op            = values[14];
+  pngvals.blend_op              = values[15];
+#endif
+  pngvals.frame_cache           = values[16];
+  pngvals.compression_budget    = values[17];
+  pngvals.num_threads           = values[18];
+  pngvals.filter                = values[19];
+  pngvals.compression_strategy  = values[20];
+  pngvals.optimize_passes       = MAX (values[21], 1);
+
+  return TRUE;
+}
+
+/*
+ * 'load_defaults ()' - Load the settings stored as a parasite.
+ *
+ * The parasite starts with the 9 settings of older versions, in their
+ * order, the compression level last, and goes on with the rest of the
+ * settings of file-apng-save3.
+ */
+
 static void
 load_defaults (void)
 {
   GimpParasite *parasite;
 
+  memcpy (&pngvals, &defaults, sizeof (defaults));
+
   parasite = gimp_parasite_find (PNG_DEFAULTS_PARASITE);
 
   if (parasite)
     {
-      gchar        *def_str;
-      PngSaveVals   tmpvals;
-      gint          num_fields;
+      gchar  *def_str;
+      gchar  *p;
+      gint    stored[NUM_SAVE3_VALUES];
+      gint    values[NUM_SAVE3_VALUES];
+      gint    num_fields = 0;
 
       def_str = g_strndup (gimp_parasite_data (parasite),
                            gimp_parasite_data_size (parasite));
 
       gimp_parasite_free (parasite);
 
-      num_fields = sscanf (def_str, "%d %d %d %d %d %d %d %d %d",
-                           &tmpvals.interlaced,
-                           &tmpvals.bkgd,
-                           &tmpvals.gama,
-                           &tmpvals.offs,
-                           &tmpvals.phys,
-                           &tmpvals.time,
-                           &tmpvals.comment,
-                           &tmpvals.save_transp_pixels,
-                           &tmpvals.compression_level);
+      for (p = def_str; num_fields < NUM_SAVE3_VALUES; num_fields++)
+        {
+          gchar *end;
+
+          stored[num_fields] = strtol (p, &end, 10);
+
+          if (end == p)
+            break;
+
+          p = end;
+        }
 
       g_free (def_str);
 
-      if (num_fields == 9)
+      /* Only the first 9 of a partial list are taken */
+      if (num_fields > 9 && num_fields < NUM_SAVE3_VALUES)
+        num_fields = 9;
+
+      if (num_fields >= 9)
         {
-          memcpy (&pngvals, &tmpvals, sizeof (tmpvals));
-          return;
+          /* Fields which are not stored keep their built-in defaults */
+          save_vals_get (values);
+
+          values[0] = stored[0];
+          values[1] = stored[8];
+          memcpy (values + 2, stored + 1, 7 * sizeof (gint));
+          memcpy (values + 9, stored + 9, (num_fields - 9) * sizeof (gint));
+
+          if (! save_vals_set (values, num_fields))
+            memcpy (&pngvals, &defaults, sizeof (defaults));
         }
     }
-
-  memcpy (&pngvals, &defaults, sizeof (defaults));
 }
 
 static void
 save_defaults (void)
 {
   GimpParasite *parasite;
-  gchar        *def_str;
-
-  def_str = g_strdup_printf ("%d %d %d %d %d %d %d %d %d",
-                             pngvals.interlaced,
-                             pngvals.bkgd,
-                             pngvals.gama,
-                             pngvals.offs,
-                             pngvals.phys,
-                             pngvals.time,
-                             pngvals.comment,
-                             pngvals.save_transp_pixels,
-                             pngvals.compression_level);
+  GString      *def_str = g_string_new (NULL);
+  gint          values[NUM_SAVE3_VALUES];
+  gint          i;
+
+  save_vals_get (values);
+
+  g_string_printf (def_str, "%d %d %d %d %d %d %d %d %d",
+                   pngvals.interlaced,
+                   pngvals.bkgd,
+                   pngvals.gama,
+                   pngvals.offs,
+                   pngvals.phys,
+                   pngvals.time,
+                   pngvals.comment,
+                   pngvals.save_transp_pixels,
+                   pngvals.compression_level);
+
+  for (i = 9; i < NUM_SAVE3_VALUES; i++)
+    g_string_append_printf (def_str, " %d", values[i]);
 
   parasite = gimp_parasite_new (PNG_DEFAULTS_PARASITE,
                                 GIMP_PARASITE_PERSISTENT,
-                                strlen (def_str), def_str);
+                                def_str->len, def_str->str);
 
   gimp_parasite_attach (parasite);
 
   gimp_parasite_free (parasite);
-  g_free (def_str);
+  g_string_free (def_str, TRUE);
 }
 
 static void
@@ -2488,11 +7187,21 @@ load_gui_defaults (PngSaveGui *pg)
   SET_ACTIVE (time);
   SET_ACTIVE (comment);
   SET_ACTIVE (save_transp_pixels);
+#if defined(PNG_APNG_SUPPORTED)
+  SET_ACTIVE (as_animation);
+  SET_ACTIVE (first_frame_is_hidden);
+#endif
 
 #undef SET_ACTIVE
 
   gtk_adjustment_set_value (GTK_ADJUSTMENT (pg->compression_level),
                             pngvals.compression_level);
+  gtk_adjustment_set_value (GTK_ADJUSTMENT (pg->compression_budget),
+                            pngvals.compression_budget);
+#if defined(PNG_APNG_SUPPORTED)
+  gtk_adjustment_set_value (GTK_ADJUSTMENT (pg->num_plays),
+                            pngvals.num_plays);
+#endif
 }
 
 #if ((GIMP_MAJOR_VERSION < 2) || (GIMP_MAJOR_VERSION == 2 && GIMP_MINOR_VERSION < 7))